@@ -2,6 +2,7 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
 
 layout(push_constant) uniform pcb
 {
@@ -13,9 +14,9 @@ struct ObjData
    mat4 Model;
 };
 
-layout(std140, set = 0, binding = 0) uniform m_ubo
+layout(std140, set = 0, binding = 0) readonly buffer m_ssbo
 {
-   ObjData data[1024];
+   ObjData data[];
 } OD;
 
 layout(location = 0) in vec3 in_position;
@@ -0,0 +1,217 @@
+#include "vkdf.hpp"
+
+// ----------------------------------------------------------------------------
+// Occlusion culling microbenchmark. Scatters random walls (as occluders) and
+// small boxes around a camera that turns around once, renders the walls
+// into a VkdfOcclusion buffer every frame and tests all boxes against it.
+// Compares the time it takes to render the occluders without a thread pool
+// and with thread pools of increasing size, how many boxes per second we
+// can test, and checks that every run hides the same boxes.
+//
+// Usage: occlusion [max_threads] [occluders] [boxes] [frames]
+// ----------------------------------------------------------------------------
+
+static const uint32_t DEFAULT_MAX_THREADS = 8;
+static const uint32_t DEFAULT_OCCLUDERS = 1000;
+static const uint32_t DEFAULT_BOXES = 10000;
+static const uint32_t DEFAULT_FRAMES = 360;
+
+static const uint32_t BUFFER_WIDTH = 256;
+static const uint32_t BUFFER_HEIGHT = 128;
+static const uint32_t MAX_TRIANGLES = 4096;
+
+// Objects are placed in a square of this half size around the camera,
+// leaving some room around it empty
+static const float WORLD_SIZE = 200.0f;
+static const float EMPTY_RADIUS = 8.0f;
+
+static glm::vec3
+rand_position(float y)
+{
+   glm::vec3 pos;
+   do {
+      pos = glm::vec3(rand_float(-WORLD_SIZE, WORLD_SIZE), y,
+                      rand_float(-WORLD_SIZE, WORLD_SIZE));
+   } while (pos.x * pos.x + pos.z * pos.z < EMPTY_RADIUS * EMPTY_RADIUS);
+   return pos;
+}
+
+static double
+get_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// ----------------------------------------------------------------------------
+// Test world
+// ----------------------------------------------------------------------------
+
+typedef struct {
+   VkdfModel *model;
+   std::vector<glm::mat4> walls;
+   std::vector<VkdfBox> boxes;
+   VkdfCamera *camera;
+} World;
+
+static void
+world_init(World *world, uint32_t num_occluders, uint32_t num_boxes)
+{
+   // The occluders only need CPU side geometry, so we don't need a context
+   VkdfMesh *mesh = vkdf_cube_mesh_new(NULL);
+   world->model = vkdf_model_new();
+   vkdf_model_add_mesh(world->model, mesh);
+   vkdf_model_compute_box(world->model);
+
+   for (uint32_t i = 0; i < num_occluders; i++) {
+      float h = rand_float(2.0f, 4.0f);
+      glm::mat4 t = glm::translate(glm::mat4(1.0f), rand_position(h));
+      t = glm::rotate(t, glm::radians(rand_float(0.0f, 180.0f)),
+                      glm::vec3(0.0f, 1.0f, 0.0f));
+      t = glm::scale(t, glm::vec3(rand_float(2.0f, 8.0f), h, 0.5f));
+      world->walls.push_back(t);
+   }
+
+   for (uint32_t i = 0; i < num_boxes; i++) {
+      VkdfBox box;
+      box.w = rand_float(0.5f, 1.5f);
+      box.h = rand_float(0.5f, 1.5f);
+      box.d = rand_float(0.5f, 1.5f);
+      box.center = rand_position(box.h);
+      world->boxes.push_back(box);
+   }
+
+   world->camera = vkdf_camera_new(0.0f, 2.0f, 0.0f,
+                                   0.0f, 0.0f, 0.0f,
+                                   45.0f, 0.1f, 500.0f,
+                                   (float) BUFFER_WIDTH / BUFFER_HEIGHT);
+}
+
+static void
+world_free(World *world)
+{
+   vkdf_camera_free(world->camera);
+   vkdf_model_free(NULL, world->model);
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark
+// ----------------------------------------------------------------------------
+
+typedef struct {
+   double render_time;
+   double test_time;
+   uint64_t triangles;
+   uint64_t hidden;
+} BenchResult;
+
+static void
+bench_occlusion(World *world,
+                VkdfThreadPool *pool,
+                uint32_t frames,
+                uint32_t *hidden_per_frame,
+                BenchResult *result)
+{
+   VkdfOcclusion *occ =
+      vkdf_occlusion_new(pool, BUFFER_WIDTH, BUFFER_HEIGHT, MAX_TRIANGLES);
+   for (uint32_t i = 0; i < world->walls.size(); i++)
+      vkdf_occlusion_add_occluder(occ, world->model, world->walls[i]);
+
+   memset(result, 0, sizeof(BenchResult));
+   VkdfCamera *cam = world->camera;
+   for (uint32_t f = 0; f < frames; f++) {
+      vkdf_camera_set_rotation(cam, 0.0f, 360.0f * f / frames, 0.0f);
+      glm::mat4 view_proj = (*vkdf_camera_get_projection_ptr(cam)) *
+                            vkdf_camera_get_view_matrix(cam);
+      glm::vec3 cam_pos = vkdf_camera_get_position(cam);
+      const VkdfBox *frustum_box = vkdf_camera_get_frustum_box(cam);
+      const VkdfPlane *frustum_planes = vkdf_camera_get_frustum_planes(cam);
+
+      double start = get_time();
+      vkdf_occlusion_render(occ, view_proj, cam_pos,
+                            frustum_box, frustum_planes);
+      result->render_time += get_time() - start;
+      result->triangles += occ->stats.triangles;
+
+      uint32_t hidden = 0;
+      start = get_time();
+      for (uint32_t i = 0; i < world->boxes.size(); i++) {
+         if (!vkdf_occlusion_box_is_visible(occ, &world->boxes[i]))
+            hidden++;
+      }
+      result->test_time += get_time() - start;
+      result->hidden += hidden;
+
+      // The first run records how many boxes are hidden in each frame and
+      // the others must match it
+      if (pool == NULL)
+         hidden_per_frame[f] = hidden;
+      else if (hidden != hidden_per_frame[f])
+         vkdf_fatal("occlusion: frame %u hides %u boxes, expected %u",
+                    f, hidden, hidden_per_frame[f]);
+   }
+
+   vkdf_occlusion_free(occ);
+}
+
+static void
+print_result(const char *threads, const BenchResult *r,
+             const BenchResult *serial, uint32_t frames, uint32_t num_boxes)
+{
+   printf("%8s %16.3f %8.2fx %16.0f\n",
+          threads,
+          1000.0 * r->render_time / frames,
+          serial->render_time / r->render_time,
+          ((double) num_boxes * frames) / r->test_time);
+}
+
+int
+main(int argc, char **argv)
+{
+   uint32_t max_threads =
+      argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_MAX_THREADS;
+   uint32_t num_occluders =
+      argc > 2 ? (uint32_t) atoi(argv[2]) : DEFAULT_OCCLUDERS;
+   uint32_t num_boxes =
+      argc > 3 ? (uint32_t) atoi(argv[3]) : DEFAULT_BOXES;
+   uint32_t frames =
+      argc > 4 ? (uint32_t) atoi(argv[4]) : DEFAULT_FRAMES;
+
+   if (frames == 0)
+      vkdf_fatal("occlusion: need at least one frame");
+
+   srandom(1);
+   World world;
+   world_init(&world, num_occluders, num_boxes);
+
+   uint32_t *hidden_per_frame = g_new(uint32_t, frames);
+
+   BenchResult serial;
+   bench_occlusion(&world, NULL, frames, hidden_per_frame, &serial);
+
+   printf("%u occluders, %u boxes, %u frames, %ux%u buffer\n",
+          num_occluders, num_boxes, frames, BUFFER_WIDTH, BUFFER_HEIGHT);
+   printf("%.0f triangles rendered and %.1f%% of the boxes hidden per frame\n",
+          (double) serial.triangles / frames,
+          100.0 * serial.hidden / ((double) num_boxes * frames));
+   printf("%8s %16s %9s %16s\n", "threads", "render ms/frame", "speedup",
+          "box tests/s");
+
+   print_result("none", &serial, &serial, frames, num_boxes);
+   for (uint32_t n = 1; n <= max_threads; n *= 2) {
+      VkdfThreadPool *pool = vkdf_thread_pool_new(n);
+      BenchResult result;
+      bench_occlusion(&world, pool, frames, hidden_per_frame, &result);
+      vkdf_thread_pool_free(pool);
+
+      char threads[16];
+      snprintf(threads, sizeof(threads), "%u", n);
+      print_result(threads, &result, &serial, frames, num_boxes);
+   }
+
+   g_free(hidden_per_frame);
+   world_free(&world);
+
+   return 0;
+}
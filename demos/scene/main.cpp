@@ -25,6 +25,7 @@ typedef struct {
 
    struct {
       VkDescriptorPool static_ubo_pool;
+      VkDescriptorPool static_ssbo_pool;
    } descriptor_pool;
 
    struct {
@@ -122,7 +123,7 @@ record_update_resources_command(VkdfContext *ctx,
 static void
 record_scene_commands(VkdfContext *ctx,
                       VkCommandBuffer cmd_buf,
-                      GHashTable *sets, bool is_dynamic,
+                      VkdfSceneSets *sets, bool is_dynamic,
                       bool is_depth_prepass, void *data)
 {
    SceneResources *res = (SceneResources *) data;
@@ -160,8 +161,8 @@ record_scene_commands(VkdfContext *ctx,
    VkdfModel *model = res->cube_model;
 
    VkdfSceneSetInfo *cube_info =
-      (VkdfSceneSetInfo *) g_hash_table_lookup(sets, "cube");
-   assert(cube_info->count > 0);
+      vkdf_scene_sets_get(sets, vkdf_scene_get_set_handle(res->scene, "cube"));
+   assert(cube_info && cube_info->count > 0);
 
    for (uint32_t i = 0; i < model->meshes.size(); i++) {
       VkdfMesh *mesh = model->meshes[i];
@@ -285,10 +286,10 @@ init_obj_pipeline(SceneResources *res, bool init_cache)
                                                false);
 
       res->pipelines.obj.descr.obj_layout =
-         vkdf_create_ubo_descriptor_set_layout(res->ctx, 0, 2,
-                                               VK_SHADER_STAGE_VERTEX_BIT |
-                                                  VK_SHADER_STAGE_FRAGMENT_BIT,
-                                               false);
+         vkdf_create_ssbo_descriptor_set_layout(res->ctx, 0, 2,
+                                                VK_SHADER_STAGE_VERTEX_BIT |
+                                                   VK_SHADER_STAGE_FRAGMENT_BIT,
+                                                false);
 
       VkDescriptorSetLayout layouts[] = {
          res->pipelines.obj.descr.camera_view_layout,
@@ -323,26 +324,23 @@ init_obj_pipeline(SceneResources *res, bool init_cache)
 
       res->pipelines.obj.descr.obj_set =
          create_descriptor_set(res->ctx,
-                               res->descriptor_pool.static_ubo_pool,
+                               res->descriptor_pool.static_ssbo_pool,
                                res->pipelines.obj.descr.obj_layout);
 
-      VkdfBuffer *obj_ubo = vkdf_scene_get_object_ubo(res->scene);
-      VkDeviceSize obj_ubo_size = vkdf_scene_get_object_ubo_size(res->scene);
-      ubo_offset = 0;
-      ubo_size = obj_ubo_size;
+      VkdfBuffer *obj_buf = vkdf_scene_get_object_buffer(res->scene);
+      VkDeviceSize buf_offset = 0;
+      VkDeviceSize buf_size = vkdf_scene_get_object_buffer_size(res->scene);
       vkdf_descriptor_set_buffer_update(res->ctx,
                                         res->pipelines.obj.descr.obj_set,
-                                        obj_ubo->buf,
-                                        0, 1, &ubo_offset, &ubo_size, false, true);
+                                        obj_buf->buf,
+                                        0, 1, &buf_offset, &buf_size, false, false);
 
-      VkdfBuffer *material_ubo = vkdf_scene_get_material_ubo(res->scene);
-      VkDeviceSize material_ubo_size = vkdf_scene_get_material_ubo_size(res->scene);
-      ubo_offset = 0;
-      ubo_size = material_ubo_size;
+      VkdfBuffer *material_buf = vkdf_scene_get_material_buffer(res->scene);
+      buf_size = vkdf_scene_get_material_buffer_size(res->scene);
       vkdf_descriptor_set_buffer_update(res->ctx,
                                         res->pipelines.obj.descr.obj_set,
-                                        material_ubo->buf,
-                                        1, 1, &ubo_offset, &ubo_size, false, true);
+                                        material_buf->buf,
+                                        1, 1, &buf_offset, &buf_size, false, false);
    }
 
    if (init_cache) {
@@ -482,6 +480,9 @@ init_descriptor_pools(SceneResources *res)
    res->descriptor_pool.static_ubo_pool =
       vkdf_create_descriptor_pool(res->ctx,
                                   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8);
+   res->descriptor_pool.static_ssbo_pool =
+      vkdf_create_descriptor_pool(res->ctx,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2);
 }
 
 static void
@@ -515,7 +516,7 @@ destroy_pipelines(SceneResources *res)
    vkDestroyPipelineLayout(res->ctx->device, res->pipelines.obj.layout, NULL);
 
    vkFreeDescriptorSets(res->ctx->device,
-                        res->descriptor_pool.static_ubo_pool,
+                        res->descriptor_pool.static_ssbo_pool,
                         1, &res->pipelines.obj.descr.obj_set);
    vkDestroyDescriptorSetLayout(res->ctx->device,
                                 res->pipelines.obj.descr.obj_layout, NULL);
@@ -528,6 +529,8 @@ destroy_pipelines(SceneResources *res)
 
    vkDestroyDescriptorPool(res->ctx->device,
                            res->descriptor_pool.static_ubo_pool, NULL);
+   vkDestroyDescriptorPool(res->ctx->device,
+                           res->descriptor_pool.static_ssbo_pool, NULL);
 }
 
 static void
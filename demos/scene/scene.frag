@@ -2,6 +2,7 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
 
 struct Material {
    vec4 diffuse;
@@ -15,9 +16,9 @@ struct Material {
    uint pad0, pad1, pad2;
 };
 
-layout(std140, set = 1, binding = 1) uniform ubo_obj_inst_data {
-     Material materials[6];
-} OID;
+layout(std140, set = 1, binding = 1) readonly buffer material_ssbo {
+   Material materials[];
+} Mat;
 
 layout(location = 0) flat in uint in_mat_idx;
 
@@ -25,6 +26,6 @@ layout(location = 0) out vec4 out_color;
 
 void main()
 {
-   Material mat = OID.materials[in_mat_idx];
+   Material mat = Mat.materials[in_mat_idx];
    out_color = mat.diffuse;
 }
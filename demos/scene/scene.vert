@@ -2,6 +2,7 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
 
 layout(push_constant) uniform pcb {
    mat4 Projection;
@@ -14,10 +15,12 @@ layout(std140, set = 0, binding = 0) uniform ubo_camera {
 struct ObjData {
    mat4 Model;
    uint mat_idx;
+   uint model_idx;
+   uint receives_shadows;
 };
 
-layout(std140, set = 1, binding = 0) uniform ubo_obj_inst_data {
-   ObjData data[1000000];
+layout(std140, set = 1, binding = 0) readonly buffer ssbo_obj_data {
+   ObjData data[];
 } OID;
 
 layout(location = 0) in vec3 in_position;
@@ -30,6 +30,7 @@ typedef struct {
 
    struct {
       VkDescriptorPool static_ubo_pool;
+      VkDescriptorPool dynamic_ssbo_pool;
       VkDescriptorPool sampler_pool;
    } descriptor_pool;
 
@@ -104,6 +105,14 @@ typedef struct {
    VkdfModel *tree_model;
 
    VkdfMesh *tile_mesh;
+
+   // Scene set handles, so we don't compare set ids when recording commands
+   struct {
+      uint32_t cube;
+      uint32_t dyn_cube;
+      uint32_t tree;
+      uint32_t floor;
+   } sets;
 } SceneResources;
 
 typedef struct {
@@ -202,7 +211,7 @@ record_instanced_draw(VkCommandBuffer cmd_buf,
 
 static void
 record_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
-                      GHashTable *sets, bool is_dynamic,
+                      VkdfSceneSets *sets, bool is_dynamic,
                       bool is_deth_prepass, void *data)
 {
    SceneResources *res = (SceneResources *) data;
@@ -226,24 +235,30 @@ record_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
       res->pipelines.descr.shadow_map_sampler_set
    };
 
+   // Object and material data for dynamic objects
+   uint32_t dynamic_offsets[2] = { 0, 0 };
+   if (is_dynamic) {
+      dynamic_offsets[0] =
+         vkdf_scene_get_dynamic_object_buffer_offset(res->scene);
+      dynamic_offsets[1] =
+         vkdf_scene_get_dynamic_material_buffer_offset(res->scene);
+   }
+
    vkCmdBindDescriptorSets(cmd_buf,
                            VK_PIPELINE_BIND_POINT_GRAPHICS,
                            res->pipelines.layout.common,
                            0,                        // First decriptor set
                            4,                        // Descriptor set count
                            descriptor_sets,          // Descriptor sets
-                           0,                        // Dynamic offset count
-                           NULL);                    // Dynamic offsets
-
-   char *set_id;
-   VkdfSceneSetInfo *set_info;
-   GHashTableIter iter;
-   g_hash_table_iter_init(&iter, sets);
-   while (g_hash_table_iter_next(&iter, (void **)&set_id, (void **)&set_info)) {
-      if (!set_info || set_info->count == 0)
+                           2,                        // Dynamic offset count
+                           dynamic_offsets);         // Dynamic offsets
+
+   for (uint32_t set = 0; set < sets->count; set++) {
+      VkdfSceneSetInfo *set_info = &sets->info[set];
+      if (set_info->count == 0)
          continue;
 
-      if (!strcmp(set_id, "cube") || !strcmp(set_id, "dyn-cube")) {
+      if (set == res->sets.cube || set == res->sets.dyn_cube) {
          VkPipeline *pipeline = is_dynamic ?
                                    &res->pipelines.obj.dynamic_pipeline :
                                    &res->pipelines.obj.static_pipeline;
@@ -255,7 +270,7 @@ record_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
          continue;
       }
 
-      if (!strcmp(set_id, "tree")) {
+      if (set == res->sets.tree) {
          record_instanced_draw(cmd_buf,
                                res->pipelines.obj.static_pipeline,
                                res->tree_model,
@@ -263,7 +278,7 @@ record_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
          continue;
       }
 
-      if (!strcmp(set_id, "floor")) {
+      if (set == res->sets.floor) {
          record_instanced_draw(cmd_buf,
                                res->pipelines.floor.pipeline,
                                res->floor_model,
@@ -354,6 +369,50 @@ scene_update(void *data)
    update_lights(res);
 }
 
+static void
+update_obj_descriptors(SceneResources *res)
+{
+   VkDeviceSize buf_offset = 0;
+   VkDeviceSize buf_size;
+
+   // Static objects
+   VkdfBuffer *obj_buf = vkdf_scene_get_object_buffer(res->scene);
+   buf_size = vkdf_scene_get_object_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.obj_set,
+                                     obj_buf->buf,
+                                     0, 1, &buf_offset, &buf_size, true, false);
+
+   VkdfBuffer *material_buf = vkdf_scene_get_material_buffer(res->scene);
+   buf_size = vkdf_scene_get_material_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.obj_set,
+                                     material_buf->buf,
+                                     1, 1, &buf_offset, &buf_size, true, false);
+
+   // Dynamic objects
+   obj_buf = vkdf_scene_get_dynamic_object_buffer(res->scene);
+   buf_size = vkdf_scene_get_dynamic_object_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.dyn_obj_set,
+                                     obj_buf->buf,
+                                     0, 1, &buf_offset, &buf_size, true, false);
+
+   material_buf = vkdf_scene_get_dynamic_material_buffer(res->scene);
+   buf_size = vkdf_scene_get_dynamic_material_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.dyn_obj_set,
+                                     material_buf->buf,
+                                     1, 1, &buf_offset, &buf_size, true, false);
+}
+
+static void
+scene_buffers_changed(VkdfContext *ctx, void *data)
+{
+   // All our command buffers that bind these are recorded by the scene
+   update_obj_descriptors((SceneResources *) data);
+}
+
 static void
 init_scene(SceneResources *res)
 {
@@ -381,7 +440,12 @@ init_scene(SceneResources *res)
                                   record_scene_commands,
                                   res);
 
+   vkdf_scene_set_buffers_changed_callback(res->scene, scene_buffers_changed);
+
    vkdf_scene_enable_postprocessing(res->scene, postprocess_draw, NULL);
+
+   // Skip the tiles and dynamic objects hidden behind the large cubes
+   vkdf_scene_enable_occlusion_culling(res->scene, 128, 64, 256);
 }
 
 static void
@@ -404,11 +468,13 @@ init_pipeline_descriptors(SceneResources *res)
                                             VK_SHADER_STAGE_VERTEX_BIT,
                                             false);
 
+   // Object data is bound with dynamic offsets so we can select the
+   // current frame's dynamic object data
    res->pipelines.descr.obj_layout =
-      vkdf_create_ubo_descriptor_set_layout(res->ctx, 0, 2,
-                                            VK_SHADER_STAGE_VERTEX_BIT |
-                                               VK_SHADER_STAGE_FRAGMENT_BIT,
-                                            false);
+      vkdf_create_ssbo_descriptor_set_layout(res->ctx, 0, 2,
+                                             VK_SHADER_STAGE_VERTEX_BIT |
+                                                VK_SHADER_STAGE_FRAGMENT_BIT,
+                                             true);
 
    res->pipelines.descr.light_layout =
       vkdf_create_ubo_descriptor_set_layout(res->ctx, 0, 2,
@@ -457,50 +523,16 @@ init_pipeline_descriptors(SceneResources *res)
    // Static objects descriptor
    res->pipelines.descr.obj_set =
       create_descriptor_set(res->ctx,
-                            res->descriptor_pool.static_ubo_pool,
+                            res->descriptor_pool.dynamic_ssbo_pool,
                             res->pipelines.descr.obj_layout);
 
-   VkdfBuffer *obj_ubo = vkdf_scene_get_object_ubo(res->scene);
-   VkDeviceSize obj_ubo_size = vkdf_scene_get_object_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = obj_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.obj_set,
-                                     obj_ubo->buf,
-                                     0, 1, &ubo_offset, &ubo_size, false, true);
-
-   VkdfBuffer *material_ubo = vkdf_scene_get_material_ubo(res->scene);
-   VkDeviceSize material_ubo_size = vkdf_scene_get_material_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = material_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.obj_set,
-                                     material_ubo->buf,
-                                     1, 1, &ubo_offset, &ubo_size, false, true);
-
    // Dynamic objects descriptor
    res->pipelines.descr.dyn_obj_set =
       create_descriptor_set(res->ctx,
-                            res->descriptor_pool.static_ubo_pool,
+                            res->descriptor_pool.dynamic_ssbo_pool,
                             res->pipelines.descr.obj_layout);
 
-   obj_ubo = vkdf_scene_get_dynamic_object_ubo(res->scene);
-   obj_ubo_size = vkdf_scene_get_dynamic_object_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = obj_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.dyn_obj_set,
-                                     obj_ubo->buf,
-                                     0, 1, &ubo_offset, &ubo_size, false, true);
-
-   material_ubo = vkdf_scene_get_dynamic_material_ubo(res->scene);
-   material_ubo_size = vkdf_scene_get_dynamic_material_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = material_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.dyn_obj_set,
-                                     material_ubo->buf,
-                                     1, 1, &ubo_offset, &ubo_size, false, true);
+   update_obj_descriptors(res);
 
    // Lihgts descriptor
    res->pipelines.descr.light_set =
@@ -763,6 +795,7 @@ init_objects(SceneResources *res)
    vkdf_object_set_lighting_behavior(obj, true, true);
    vkdf_object_set_material_idx_base(obj, 0);
    vkdf_scene_add_object(res->scene, "cube", obj);
+   vkdf_scene_add_occluder(res->scene, obj);
 
    pos = glm::vec3(0.0f, 1.0f, -12.0f);
    obj = vkdf_object_new_from_model(pos, res->cube_model);
@@ -785,6 +818,7 @@ init_objects(SceneResources *res)
    vkdf_object_set_lighting_behavior(obj, true, true);
    vkdf_object_set_material_idx_base(obj, 3);
    vkdf_scene_add_object(res->scene, "cube", obj);
+   vkdf_scene_add_occluder(res->scene, obj);
 
    // Dynamic cube
    pos = glm::vec3(0.0f, 8.0f, 6.0f);
@@ -821,6 +855,11 @@ init_objects(SceneResources *res)
    vkdf_object_set_lighting_behavior(floor, false, true);
    vkdf_scene_add_object(res->scene, "floor", floor);
    vkdf_object_set_material_idx_base(floor, 0);
+
+   res->sets.cube = vkdf_scene_get_set_handle(res->scene, "cube");
+   res->sets.dyn_cube = vkdf_scene_get_set_handle(res->scene, "dyn-cube");
+   res->sets.tree = vkdf_scene_get_set_handle(res->scene, "tree");
+   res->sets.floor = vkdf_scene_get_set_handle(res->scene, "floor");
 }
 
 static void
@@ -878,6 +917,9 @@ init_descriptor_pools(SceneResources *res)
    res->descriptor_pool.static_ubo_pool =
       vkdf_create_descriptor_pool(res->ctx,
                                   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8);
+   res->descriptor_pool.dynamic_ssbo_pool =
+      vkdf_create_descriptor_pool(res->ctx,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 4);
    res->descriptor_pool.sampler_pool =
       vkdf_create_descriptor_pool(res->ctx,
                                   VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 8);
@@ -1171,10 +1213,10 @@ destroy_pipelines(SceneResources *res)
                                 res->pipelines.descr.camera_view_layout, NULL);
 
    vkFreeDescriptorSets(res->ctx->device,
-                        res->descriptor_pool.static_ubo_pool,
+                        res->descriptor_pool.dynamic_ssbo_pool,
                         1, &res->pipelines.descr.obj_set);
    vkFreeDescriptorSets(res->ctx->device,
-                        res->descriptor_pool.static_ubo_pool,
+                        res->descriptor_pool.dynamic_ssbo_pool,
                         1, &res->pipelines.descr.dyn_obj_set);
    vkDestroyDescriptorSetLayout(res->ctx->device,
                                 res->pipelines.descr.obj_layout, NULL);
@@ -1194,6 +1236,8 @@ destroy_pipelines(SceneResources *res)
 
    vkDestroyDescriptorPool(res->ctx->device,
                            res->descriptor_pool.static_ubo_pool, NULL);
+   vkDestroyDescriptorPool(res->ctx->device,
+                           res->descriptor_pool.dynamic_ssbo_pool, NULL);
    vkDestroyDescriptorPool(res->ctx->device,
                            res->descriptor_pool.sampler_pool, NULL);
 
@@ -2,9 +2,8 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
 
-const int MAX_INSTANCES = 16 * 1024;
-const int MAX_MATERIALS_PER_MODEL = 32;
 const int NUM_LIGHTS = 2;
 
 layout(push_constant) uniform pcb {
@@ -23,8 +22,8 @@ struct ObjData {
    uint receives_shadows;
 };
 
-layout(std140, set = 1, binding = 0) uniform ubo_obj_data {
-   ObjData data[MAX_INSTANCES];
+layout(std140, set = 1, binding = 0) readonly buffer ssbo_obj_data {
+   ObjData data[];
 } OID;
 
 struct ShadowMapData {
@@ -61,9 +60,7 @@ void main()
    mat3 Normal = transpose(inverse(mat3(Model)));
    out_normal = normalize(Normal * in_normal);
 
-   out_material_idx =
-      obj_data.model_idx * MAX_MATERIALS_PER_MODEL +
-      obj_data.material_base_idx + in_material_idx;
+   out_material_idx = obj_data.material_base_idx + in_material_idx;
 
    out_world_pos = world_pos;
 
@@ -142,6 +142,7 @@ typedef struct {
 
    struct {
       VkDescriptorPool static_ubo_pool;
+      VkDescriptorPool dynamic_ssbo_pool;
       VkDescriptorPool sampler_pool;
    } descriptor_pool;
 
@@ -229,6 +230,7 @@ typedef struct {
    VkdfMesh *tile_mesh;
    VkdfModel *sponza_model;
    VkdfObject *sponza_obj;
+   uint32_t sponza_set;               // Scene set handle for "sponza"
    bool sponza_mesh_visible[400];
 
    VkSampler sponza_sampler;
@@ -444,7 +446,7 @@ record_instanced_draw(VkCommandBuffer cmd_buf,
 
 static void
 record_forward_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
-                              GHashTable *sets, bool is_dynamic,
+                              VkdfSceneSets *sets, bool is_dynamic,
                               bool is_depth_prepass, void *data)
 {
    assert(!ENABLE_DEFERRED_RENDERING);
@@ -456,6 +458,12 @@ record_forward_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
    glm::mat4 *proj = vkdf_camera_get_projection_ptr(res->scene->camera);
    memcpy(&pcb_data.proj, &(*proj)[0][0], sizeof(pcb_data.proj));
 
+   // Object and material data for the current frame
+   uint32_t dynamic_offsets[2] = {
+      vkdf_scene_get_dynamic_object_buffer_offset(res->scene),
+      vkdf_scene_get_dynamic_material_buffer_offset(res->scene),
+   };
+
    uint32_t descriptor_set_count;
    if (!is_depth_prepass) {
       vkCmdPushConstants(cmd_buf,
@@ -480,8 +488,8 @@ record_forward_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
                               0,                        // First decriptor set
                               descriptor_set_count,     // Descriptor set count
                               descriptor_sets,          // Descriptor sets
-                              0,                        // Dynamic offset count
-                              NULL);                    // Dynamic offsets
+                              2,                        // Dynamic offset count
+                              dynamic_offsets);         // Dynamic offsets
    } else {
       vkCmdPushConstants(cmd_buf,
                          res->pipelines.layout.depth_prepass,
@@ -502,23 +510,20 @@ record_forward_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
                               0,                        // First decriptor set
                               descriptor_set_count,     // Descriptor set count
                               descriptor_sets,          // Descriptor sets
-                              0,                        // Dynamic offset count
-                              NULL);                    // Dynamic offsets
+                              2,                        // Dynamic offset count
+                              dynamic_offsets);         // Dynamic offsets
    }
 
    // Render objects
    VkPipeline pipeline, pipeline_opacity;
    VkPipelineLayout pipeline_layout, pipeline_opacity_layout;
    VkDescriptorSet *tex_set;
-   char *set_id;
-   VkdfSceneSetInfo *set_info;
-   GHashTableIter iter;
-   g_hash_table_iter_init(&iter, sets);
-   while (g_hash_table_iter_next(&iter, (void **)&set_id, (void **)&set_info)) {
-      if (!set_info || set_info->count == 0)
+   for (uint32_t set = 0; set < sets->count; set++) {
+      VkdfSceneSetInfo *set_info = &sets->info[set];
+      if (set_info->count == 0)
          continue;
 
-      if (!strcmp(set_id, "sponza")) {
+      if (set == res->sponza_set) {
          if (!is_depth_prepass) {
             /* If depth-prepass is enabled we have already done opacity
              * testing then so we use the regular pipeline to render everything.
@@ -564,7 +569,7 @@ record_forward_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
 
 static void
 record_gbuffer_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
-                              GHashTable *sets, bool is_dynamic,
+                              VkdfSceneSets *sets, bool is_dynamic,
                               bool is_depth_prepass, void *data)
 {
    assert(ENABLE_DEFERRED_RENDERING);
@@ -576,6 +581,12 @@ record_gbuffer_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
    glm::mat4 *proj = vkdf_camera_get_projection_ptr(res->scene->camera);
    memcpy(&pcb_data.proj, &(*proj)[0][0], sizeof(pcb_data.proj));
 
+   // Object and material data for the current frame
+   uint32_t dynamic_offsets[2] = {
+      vkdf_scene_get_dynamic_object_buffer_offset(res->scene),
+      vkdf_scene_get_dynamic_material_buffer_offset(res->scene),
+   };
+
    uint32_t descriptor_set_count;
    if (!is_depth_prepass) {
       vkCmdPushConstants(cmd_buf,
@@ -600,8 +611,8 @@ record_gbuffer_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
                               0,                      // First decriptor set
                               descriptor_set_count,   // Descriptor set count
                               descriptor_sets,        // Descriptor sets
-                              0,                      // Dynamic offset count
-                              NULL);                  // Dynamic offsets
+                              2,                      // Dynamic offset count
+                              dynamic_offsets);       // Dynamic offsets
    } else {
       vkCmdPushConstants(cmd_buf,
                          res->pipelines.layout.depth_prepass,
@@ -622,23 +633,20 @@ record_gbuffer_scene_commands(VkdfContext *ctx, VkCommandBuffer cmd_buf,
                               0,                      // First decriptor set
                               descriptor_set_count,   // Descriptor set count
                               descriptor_sets,        // Descriptor sets
-                              0,                      // Dynamic offset count
-                              NULL);                  // Dynamic offsets
+                              2,                      // Dynamic offset count
+                              dynamic_offsets);       // Dynamic offsets
    }
 
    // Render objects
    VkPipeline pipeline, pipeline_opacity;
    VkPipelineLayout pipeline_layout, pipeline_opacity_layout;
    VkDescriptorSet *tex_set;
-   char *set_id;
-   VkdfSceneSetInfo *set_info;
-   GHashTableIter iter;
-   g_hash_table_iter_init(&iter, sets);
-   while (g_hash_table_iter_next(&iter, (void **)&set_id, (void **)&set_info)) {
-      if (!set_info || set_info->count == 0)
+   for (uint32_t set = 0; set < sets->count; set++) {
+      VkdfSceneSetInfo *set_info = &sets->info[set];
+      if (set_info->count == 0)
          continue;
 
-      if (!strcmp(set_id, "sponza")) {
+      if (set == res->sponza_set) {
          if (!is_depth_prepass) {
             /* If depth-prepass is enabled we have already done opacity
              * testing then so we use the regular pipeline to render everything.
@@ -771,6 +779,34 @@ scene_update(void *data)
       update_visible_sponza_meshes(res);
 }
 
+static void
+update_obj_descriptors(SceneResources *res)
+{
+   VkDeviceSize buf_offset = 0;
+   VkDeviceSize buf_size;
+
+   VkdfBuffer *obj_buf = vkdf_scene_get_dynamic_object_buffer(res->scene);
+   buf_size = vkdf_scene_get_dynamic_object_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.obj_set,
+                                     obj_buf->buf,
+                                     0, 1, &buf_offset, &buf_size, true, false);
+
+   VkdfBuffer *material_buf = vkdf_scene_get_dynamic_material_buffer(res->scene);
+   buf_size = vkdf_scene_get_dynamic_material_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.descr.obj_set,
+                                     material_buf->buf,
+                                     1, 1, &buf_offset, &buf_size, true, false);
+}
+
+static void
+scene_buffers_changed(VkdfContext *ctx, void *data)
+{
+   // All our command buffers that bind these are recorded by the scene
+   update_obj_descriptors((SceneResources *) data);
+}
+
 static void
 init_scene(SceneResources *res)
 {
@@ -808,6 +844,8 @@ init_scene(SceneResources *res)
                                      record_forward_scene_commands,
                                   res);
 
+   vkdf_scene_set_buffers_changed_callback(res->scene, scene_buffers_changed);
+
    if (SHOW_DEBUG_TILE) {
       vkdf_scene_enable_postprocessing(res->scene, postprocess_draw, NULL);
    }
@@ -1091,11 +1129,13 @@ init_pipeline_descriptors(SceneResources *res,
                                             VK_SHADER_STAGE_VERTEX_BIT,
                                             false);
 
+   // Object data is bound with dynamic offsets that select the current
+   // frame's copy of the scene's dynamic object data
    res->pipelines.descr.obj_layout =
-      vkdf_create_ubo_descriptor_set_layout(res->ctx, 0, 2,
-                                            VK_SHADER_STAGE_VERTEX_BIT |
-                                               VK_SHADER_STAGE_FRAGMENT_BIT,
-                                            false);
+      vkdf_create_ssbo_descriptor_set_layout(res->ctx, 0, 2,
+                                             VK_SHADER_STAGE_VERTEX_BIT |
+                                                VK_SHADER_STAGE_FRAGMENT_BIT,
+                                             true);
 
    res->pipelines.descr.obj_tex_layout =
       vkdf_create_sampler_descriptor_set_layout(res->ctx,
@@ -1203,27 +1243,10 @@ init_pipeline_descriptors(SceneResources *res,
    /* Object data */
    res->pipelines.descr.obj_set =
       create_descriptor_set(res->ctx,
-                            res->descriptor_pool.static_ubo_pool,
+                            res->descriptor_pool.dynamic_ssbo_pool,
                             res->pipelines.descr.obj_layout);
 
-   VkdfBuffer *obj_ubo = vkdf_scene_get_dynamic_object_ubo(res->scene);
-   VkDeviceSize obj_ubo_size = vkdf_scene_get_dynamic_object_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = obj_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.obj_set,
-                                     obj_ubo->buf,
-                                     0, 1, &ubo_offset, &ubo_size, false, true);
-
-   VkdfBuffer *material_ubo = vkdf_scene_get_dynamic_material_ubo(res->scene);
-   VkDeviceSize material_ubo_size =
-      vkdf_scene_get_dynamic_material_ubo_size(res->scene);
-   ubo_offset = 0;
-   ubo_size = material_ubo_size;
-   vkdf_descriptor_set_buffer_update(res->ctx,
-                                     res->pipelines.descr.obj_set,
-                                     material_ubo->buf,
-                                     1, 1, &ubo_offset, &ubo_size, false, true);
+   update_obj_descriptors(res);
 
    /* Light and shadow map descriptions */
    res->pipelines.descr.light_set =
@@ -1780,6 +1803,7 @@ init_objects(SceneResources *res)
    vkdf_scene_add_object(res->scene, "sponza", obj);
 
    res->sponza_obj = obj;
+   res->sponza_set = vkdf_scene_get_set_handle(res->scene, "sponza");
 }
 
 static void
@@ -1789,6 +1813,10 @@ init_descriptor_pools(SceneResources *res)
       vkdf_create_descriptor_pool(res->ctx,
                                   VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8);
 
+   res->descriptor_pool.dynamic_ssbo_pool =
+      vkdf_create_descriptor_pool(res->ctx,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 2);
+
    res->descriptor_pool.sampler_pool =
       vkdf_create_descriptor_pool(res->ctx,
                                   VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
@@ -2106,7 +2134,7 @@ destroy_pipelines(SceneResources *res)
 
    /* Object data */
    vkFreeDescriptorSets(res->ctx->device,
-                        res->descriptor_pool.static_ubo_pool,
+                        res->descriptor_pool.dynamic_ssbo_pool,
                         1, &res->pipelines.descr.obj_set);
    vkDestroyDescriptorSetLayout(res->ctx->device,
                                 res->pipelines.descr.obj_layout, NULL);
@@ -2167,6 +2195,8 @@ destroy_pipelines(SceneResources *res)
    /* Descriptor pools */
    vkDestroyDescriptorPool(res->ctx->device,
                            res->descriptor_pool.static_ubo_pool, NULL);
+   vkDestroyDescriptorPool(res->ctx->device,
+                           res->descriptor_pool.dynamic_ssbo_pool, NULL);
    vkDestroyDescriptorPool(res->ctx->device,
                            res->descriptor_pool.sampler_pool, NULL);
 }
@@ -2,8 +2,7 @@
 
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
-
-const int MAX_INSTANCES = 16;
+#extension GL_ARB_shader_storage_buffer_object : enable
 
 layout(push_constant) uniform pcb
 {
@@ -21,9 +20,9 @@ struct ObjData {
    uint receives_shadows;
 };
 
-layout(std140, set = 1, binding = 0) uniform m_ubo
+layout(std140, set = 1, binding = 0) readonly buffer m_ssbo
 {
-   ObjData data[MAX_INSTANCES];
+   ObjData data[];
 } OD;
 
 layout(location = 0) in vec3 in_position;
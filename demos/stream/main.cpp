@@ -0,0 +1,587 @@
+#include "vkdf.hpp"
+
+const float WIN_WIDTH  = 1920.0f;
+const float WIN_HEIGHT = 1080.0f;
+
+const uint32_t NUM_OBJECTS = 200000;
+
+// Streaming parameters
+const VkDeviceSize STREAM_BUDGET = 64 * 1024 * 1024;
+const float LOAD_DIST = 150.0f;
+const float UNLOAD_DIST = 200.0f;
+
+const uint32_t NUM_MODELS = 2;
+
+static const char *model_set_ids[NUM_MODELS] = {
+   "cube",
+   "pyramid",
+};
+
+static const char *model_paths[NUM_MODELS] = {
+   "./cube.obj",
+   "./pyramid.obj",
+};
+
+// ----------------------------------------------------------------------------
+// Renders a large scene of static objects that are streamed in and out as
+// the camera moves around. Only the tiles near the camera have their objects
+// (and models) loaded.
+// ----------------------------------------------------------------------------
+
+struct PCBData {
+   uint8_t proj[sizeof(glm::mat4)];
+};
+
+typedef struct {
+   VkdfContext *ctx;
+
+   VkdfScene *scene;
+   VkdfStream *stream;
+   VkCommandPool cmd_pool;
+
+   VkdfCamera *camera;
+
+   uint32_t model_handles[NUM_MODELS];
+   VkDeviceSize resident_size;
+
+   struct {
+      VkDescriptorPool static_ubo_pool;
+      VkDescriptorPool static_ssbo_pool;
+   } descriptor_pool;
+
+   struct {
+      struct {
+         VkPipeline pipeline;
+         VkPipelineCache cache;
+         VkPipelineLayout layout;
+         struct {
+            VkDescriptorSetLayout camera_view_layout;
+            VkDescriptorSet camera_view_set;
+            VkDescriptorSetLayout obj_layout;
+            VkDescriptorSet obj_set;
+         } descr;
+      } obj;
+   } pipelines;
+
+   struct {
+      struct {
+         VkdfBuffer buf;
+         VkDeviceSize size;
+      } camera_view;
+   } ubos;
+
+   struct {
+      struct {
+         VkShaderModule vs;
+         VkShaderModule fs;
+      } obj;
+   } shaders;
+} SceneResources;
+
+static inline VkdfBuffer
+create_ubo(VkdfContext *ctx, uint32_t size, uint32_t usage, uint32_t mem_props)
+{
+   usage |= VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+   VkdfBuffer buf = vkdf_create_buffer(ctx, 0, size, usage, mem_props);
+   return buf;
+}
+
+static VkDescriptorSet
+create_descriptor_set(VkdfContext *ctx,
+                      VkDescriptorPool pool,
+                      VkDescriptorSetLayout layout)
+{
+   VkDescriptorSet set;
+   VkDescriptorSetAllocateInfo alloc_info[1];
+   alloc_info[0].sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+   alloc_info[0].pNext = NULL;
+   alloc_info[0].descriptorPool = pool;
+   alloc_info[0].descriptorSetCount = 1;
+   alloc_info[0].pSetLayouts = &layout;
+   VK_CHECK(vkAllocateDescriptorSets(ctx->device, alloc_info, &set));
+
+   return set;
+}
+
+static void
+init_ubos(SceneResources *res)
+{
+   // Camera view
+   res->ubos.camera_view.size = sizeof(glm::mat4);
+   res->ubos.camera_view.buf = create_ubo(res->ctx,
+                                          res->ubos.camera_view.size,
+                                          VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+static bool
+record_update_resources_command(VkdfContext *ctx,
+                                VkCommandBuffer cmd_buf,
+                                void *data)
+{
+   SceneResources *res = (SceneResources *) data;
+
+   VkdfCamera *camera = vkdf_scene_get_camera(res->scene);
+   if (!vkdf_camera_is_dirty(camera))
+      return false;
+
+   glm::mat4 view = vkdf_camera_get_view_matrix(res->camera);
+   vkCmdUpdateBuffer(cmd_buf,
+                     res->ubos.camera_view.buf.buf,
+                     0, sizeof(glm::mat4),
+                     &view[0][0]);
+
+   return true;
+}
+
+static void
+record_scene_commands(VkdfContext *ctx,
+                      VkCommandBuffer cmd_buf,
+                      VkdfSceneSets *sets, bool is_dynamic,
+                      bool is_depth_prepass, void *data)
+{
+   SceneResources *res = (SceneResources *) data;
+
+   // Pipeline
+   vkCmdBindPipeline(cmd_buf,
+                     VK_PIPELINE_BIND_POINT_GRAPHICS,
+                     res->pipelines.obj.pipeline);
+
+   // Push constants
+   struct PCBData pcb_data;
+   glm::mat4 *proj = vkdf_camera_get_projection_ptr(res->scene->camera);
+   memcpy(&pcb_data.proj, &(*proj)[0][0], sizeof(pcb_data.proj));
+
+   vkCmdPushConstants(cmd_buf,
+                      res->pipelines.obj.layout,
+                      VK_SHADER_STAGE_VERTEX_BIT,
+                      0, sizeof(pcb_data), &pcb_data);
+
+   // Descriptors
+   VkDescriptorSet descriptor_sets[] = {
+      res->pipelines.obj.descr.camera_view_set,
+      res->pipelines.obj.descr.obj_set,
+   };
+
+   vkCmdBindDescriptorSets(cmd_buf,
+                           VK_PIPELINE_BIND_POINT_GRAPHICS,
+                           res->pipelines.obj.layout,
+                           0,                        // First decriptor set
+                           2,                        // Descriptor set count
+                           descriptor_sets,          // Descriptor sets
+                           0,                        // Dynamic offset count
+                           NULL);                    // Dynamic offsets
+
+   for (uint32_t m = 0; m < NUM_MODELS; m++) {
+      uint32_t set_handle =
+         vkdf_scene_get_set_handle(res->scene, model_set_ids[m]);
+      VkdfSceneSetInfo *info = vkdf_scene_sets_get(sets, set_handle);
+      if (!info || info->count == 0)
+         continue;
+
+      // Objects are only in the scene while their model is resident
+      VkdfModel *model =
+         vkdf_stream_get_model(res->stream, res->model_handles[m]);
+      assert(model);
+
+      for (uint32_t i = 0; i < model->meshes.size(); i++) {
+         VkdfMesh *mesh = model->meshes[i];
+
+         // Vertex buffers
+         const VkDeviceSize offsets[1] = { 0 };
+         vkCmdBindVertexBuffers(cmd_buf,
+                                0,                         // Start Binding
+                                1,                         // Binding Count
+                                &mesh->vertex_buf.buf,     // Buffers
+                                offsets);                  // Offsets
+
+         // Draw
+         vkdf_mesh_draw(mesh, cmd_buf, info->count, info->start_index);
+      }
+   }
+}
+
+static void
+update_camera(SceneResources *res)
+{
+   const float mov_speed = 0.5f;
+   const float rot_speed = 1.0f;
+
+   VkdfCamera *cam = vkdf_scene_get_camera(res->scene);
+   GLFWwindow *window = res->ctx->window;
+
+   float base_speed = 1.0f;
+
+   // Rotation
+   if (glfwGetKey(window, GLFW_KEY_LEFT) != GLFW_RELEASE)
+      vkdf_camera_rotate(cam, 0.0f, base_speed * rot_speed, 0.0f);
+   else if (glfwGetKey(window, GLFW_KEY_RIGHT) != GLFW_RELEASE)
+      vkdf_camera_rotate(cam, 0.0f, -base_speed * rot_speed, 0.0f);
+
+   // Stepping, we stay at the same height
+   if (glfwGetKey(window, GLFW_KEY_UP) != GLFW_RELEASE) {
+      float step_speed = base_speed * mov_speed;
+      vkdf_camera_step(cam, step_speed, 1, 0, 1);
+   } else if (glfwGetKey(window, GLFW_KEY_DOWN) != GLFW_RELEASE) {
+      float step_speed = -base_speed * mov_speed;
+      vkdf_camera_step(cam, step_speed, 1, 0, 1);
+   }
+}
+
+static void
+scene_update(void *data)
+{
+   SceneResources *res = (SceneResources *) data;
+   update_camera(res);
+
+   vkdf_stream_update(res->stream);
+
+   VkDeviceSize resident_size = vkdf_stream_get_resident_size(res->stream);
+   if (resident_size != res->resident_size) {
+      vkdf_info("Stream: %u objects in the scene, %.1f KB of models "
+                "resident\n",
+                vkdf_scene_get_static_object_count(res->scene),
+                resident_size / 1024.0f);
+      res->resident_size = resident_size;
+   }
+}
+
+static void
+update_obj_descriptors(SceneResources *res)
+{
+   VkDeviceSize buf_offset = 0;
+   VkDeviceSize buf_size;
+
+   VkdfBuffer *obj_buf = vkdf_scene_get_object_buffer(res->scene);
+   buf_size = vkdf_scene_get_object_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.obj.descr.obj_set,
+                                     obj_buf->buf,
+                                     0, 1, &buf_offset, &buf_size,
+                                     false, false);
+
+   VkdfBuffer *material_buf = vkdf_scene_get_material_buffer(res->scene);
+   buf_size = vkdf_scene_get_material_buffer_size(res->scene);
+   vkdf_descriptor_set_buffer_update(res->ctx,
+                                     res->pipelines.obj.descr.obj_set,
+                                     material_buf->buf,
+                                     1, 1, &buf_offset, &buf_size,
+                                     false, false);
+}
+
+static void
+scene_buffers_changed(VkdfContext *ctx, void *data)
+{
+   // Streamed objects and materials may not fit in the scene buffers, all
+   // our command buffers that bind them are recorded by the scene
+   update_obj_descriptors((SceneResources *) data);
+}
+
+static void
+stream_model_loaded(VkdfContext *ctx,
+                    const char *set_id,
+                    VkdfModel *model,
+                    void *data)
+{
+   // Our pipeline expects the vertex layout of models loaded from our
+   // files (see init_obj_pipeline())
+   for (uint32_t i = 0; i < model->meshes.size(); i++) {
+      assert(vkdf_mesh_get_vertex_data_stride(model->meshes[i]) ==
+             2 * sizeof(glm::vec3) + sizeof(uint32_t));
+   }
+}
+
+static void
+init_scene(SceneResources *res)
+{
+   VkdfContext *ctx = res->ctx;
+
+   res->camera = vkdf_camera_new(0.0f, 5.0f, 0.0f,
+                                 0.0f, 180.0f, 0.0f,
+                                 45.0f, 0.1f, LOAD_DIST, WIN_WIDTH / WIN_HEIGHT);
+
+   glm::vec3 scene_origin = glm::vec3(-1000.0f, -10.0f, -1000.0f);
+   glm::vec3 scene_size = glm::vec3(2000.0f, 40.0f, 2000.0f);
+   glm::vec3 tile_size = glm::vec3(50.0f, 40.0f, 50.0f);
+   uint32_t cache_size = 32;
+   res->scene = vkdf_scene_new(ctx,
+                               WIN_WIDTH, WIN_HEIGHT,
+                               res->camera,
+                               scene_origin, scene_size, tile_size, 2,
+                               cache_size, 4);
+
+   vkdf_scene_set_scene_callbacks(res->scene,
+                                  scene_update,
+                                  record_update_resources_command,
+                                  record_scene_commands,
+                                  res);
+
+   vkdf_scene_set_buffers_changed_callback(res->scene, scene_buffers_changed);
+
+   VkClearValue color_clear;
+   vkdf_color_clear_set(&color_clear, glm::vec4(0.2f, 0.4f, 0.8f, 1.0f));
+
+   VkClearValue depth_clear;
+   vkdf_depth_stencil_clear_set(&depth_clear, 1.0f, 0);
+
+   vkdf_scene_set_clear_values(res->scene, &color_clear, &depth_clear);
+
+   // All the objects are streamed in later, so we prepare an empty scene
+   vkdf_scene_prepare(res->scene);
+}
+
+static void
+init_stream(SceneResources *res)
+{
+   res->cmd_pool = vkdf_create_gfx_command_pool(res->ctx, 0);
+
+   res->stream = vkdf_stream_new(res->ctx, res->scene, res->cmd_pool,
+                                 STREAM_BUDGET, LOAD_DIST, UNLOAD_DIST);
+
+   vkdf_stream_set_callbacks(res->stream, stream_model_loaded, NULL, res);
+
+   for (uint32_t m = 0; m < NUM_MODELS; m++) {
+      res->model_handles[m] =
+         vkdf_stream_add_model(res->stream, model_set_ids[m], model_paths[m],
+                               false, false);
+   }
+
+   // Objects on the ground, all over the scene area
+   glm::vec3 origin = res->scene->scene_area.origin;
+   for (uint32_t i = 0; i < NUM_OBJECTS; i++) {
+      VkdfStreamObject obj;
+      obj.model = res->model_handles[random() % NUM_MODELS];
+      obj.pos.x = origin.x + random() % ((uint32_t) res->scene->scene_area.w);
+      obj.pos.y = 0.0f;
+      obj.pos.z = origin.z + random() % ((uint32_t) res->scene->scene_area.d);
+      obj.rot = glm::vec3(0.0f, (float) (random() % 360), 0.0f);
+      obj.scale = glm::vec3(1.0f + (random() % 100) / 50.0f);
+      obj.material_idx_base = 0;
+      obj.casts_shadows = false;
+      obj.receives_shadows = false;
+      vkdf_stream_add_object(res->stream, &obj);
+   }
+}
+
+static void
+init_obj_pipeline(SceneResources *res, bool init_cache)
+{
+   if (!res->pipelines.obj.layout) {
+      VkPushConstantRange pcb_range;
+      pcb_range.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+      pcb_range.offset = 0;
+      pcb_range.size = sizeof(PCBData);
+
+      VkPushConstantRange pcb_ranges[] = {
+         pcb_range,
+      };
+
+      res->pipelines.obj.descr.camera_view_layout =
+         vkdf_create_ubo_descriptor_set_layout(res->ctx, 0, 1,
+                                               VK_SHADER_STAGE_VERTEX_BIT,
+                                               false);
+
+      res->pipelines.obj.descr.obj_layout =
+         vkdf_create_ssbo_descriptor_set_layout(res->ctx, 0, 2,
+                                                VK_SHADER_STAGE_VERTEX_BIT |
+                                                   VK_SHADER_STAGE_FRAGMENT_BIT,
+                                                false);
+
+      VkDescriptorSetLayout layouts[] = {
+         res->pipelines.obj.descr.camera_view_layout,
+         res->pipelines.obj.descr.obj_layout,
+      };
+
+      VkPipelineLayoutCreateInfo pipeline_layout_info;
+      pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+      pipeline_layout_info.pNext = NULL;
+      pipeline_layout_info.pushConstantRangeCount = 1;
+      pipeline_layout_info.pPushConstantRanges = pcb_ranges;
+      pipeline_layout_info.setLayoutCount = 2;
+      pipeline_layout_info.pSetLayouts = layouts;
+      pipeline_layout_info.flags = 0;
+
+      VK_CHECK(vkCreatePipelineLayout(res->ctx->device,
+                                      &pipeline_layout_info,
+                                      NULL,
+                                      &res->pipelines.obj.layout));
+
+      res->pipelines.obj.descr.camera_view_set =
+         create_descriptor_set(res->ctx,
+                               res->descriptor_pool.static_ubo_pool,
+                               res->pipelines.obj.descr.camera_view_layout);
+
+      VkDeviceSize ubo_offset = 0;
+      VkDeviceSize ubo_size = res->ubos.camera_view.size;
+      vkdf_descriptor_set_buffer_update(res->ctx,
+                                        res->pipelines.obj.descr.camera_view_set,
+                                        res->ubos.camera_view.buf.buf,
+                                        0, 1, &ubo_offset, &ubo_size, false, true);
+
+      res->pipelines.obj.descr.obj_set =
+         create_descriptor_set(res->ctx,
+                               res->descriptor_pool.static_ssbo_pool,
+                               res->pipelines.obj.descr.obj_layout);
+
+      update_obj_descriptors(res);
+   }
+
+   if (init_cache) {
+      VkPipelineCacheCreateInfo info;
+      info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+      info.pNext = NULL;
+      info.initialDataSize = 0;
+      info.pInitialData = NULL;
+      info.flags = 0;
+      VK_CHECK(vkCreatePipelineCache(res->ctx->device, &info, NULL,
+                                     &res->pipelines.obj.cache));
+   }
+
+   VkVertexInputBindingDescription vi_bindings[1];
+   VkVertexInputAttributeDescription vi_attribs[3];
+
+   // Vertex attribute binding 0: position, normal, material. Our models are
+   // not loaded yet, but this is the layout of meshes loaded from files
+   // without texture coordinates.
+   uint32_t stride = 2 * sizeof(glm::vec3) + sizeof(uint32_t);
+   vkdf_vertex_binding_set(&vi_bindings[0],
+                           0, VK_VERTEX_INPUT_RATE_VERTEX, stride);
+
+   /* binding 0, location 0: position
+    * binding 0, location 1: normal
+    * binding 0, location 2: material
+    */
+   vkdf_vertex_attrib_set(&vi_attribs[0], 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0);
+   vkdf_vertex_attrib_set(&vi_attribs[1], 0, 1, VK_FORMAT_R32G32B32_SFLOAT, 12);
+   vkdf_vertex_attrib_set(&vi_attribs[2], 0, 2, VK_FORMAT_R32_UINT, 24);
+
+   VkRenderPass renderpass = vkdf_scene_get_static_render_pass(res->scene);
+
+   res->pipelines.obj.pipeline =
+      vkdf_create_gfx_pipeline(res->ctx,
+                               &res->pipelines.obj.cache,
+                               1,
+                               vi_bindings,
+                               3,
+                               vi_attribs,
+                               true,
+                               VK_COMPARE_OP_LESS,
+                               renderpass,
+                               res->pipelines.obj.layout,
+                               VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+                               VK_CULL_MODE_BACK_BIT,
+                               1,
+                               res->shaders.obj.vs,
+                               res->shaders.obj.fs);
+}
+
+static void
+init_shaders(SceneResources *res)
+{
+   res->shaders.obj.vs = vkdf_create_shader_module(res->ctx, "stream.vert.spv");
+   res->shaders.obj.fs = vkdf_create_shader_module(res->ctx, "stream.frag.spv");
+}
+
+static inline void
+init_pipelines(SceneResources *res)
+{
+   init_obj_pipeline(res, true);
+}
+
+static void
+init_descriptor_pools(SceneResources *res)
+{
+   res->descriptor_pool.static_ubo_pool =
+      vkdf_create_descriptor_pool(res->ctx,
+                                  VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8);
+   res->descriptor_pool.static_ssbo_pool =
+      vkdf_create_descriptor_pool(res->ctx,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2);
+}
+
+static void
+init_resources(VkdfContext *ctx, SceneResources *res)
+{
+   memset(res, 0, sizeof(SceneResources));
+
+   res->ctx = ctx;
+
+   init_scene(res);
+   init_stream(res);
+   init_ubos(res);
+   init_shaders(res);
+   init_descriptor_pools(res);
+   init_pipelines(res);
+}
+
+static void
+destroy_pipelines(SceneResources *res)
+{
+   vkDestroyPipelineCache(res->ctx->device, res->pipelines.obj.cache, NULL);
+   vkDestroyPipeline(res->ctx->device, res->pipelines.obj.pipeline, NULL);
+
+   vkDestroyPipelineLayout(res->ctx->device, res->pipelines.obj.layout, NULL);
+
+   vkFreeDescriptorSets(res->ctx->device,
+                        res->descriptor_pool.static_ssbo_pool,
+                        1, &res->pipelines.obj.descr.obj_set);
+   vkDestroyDescriptorSetLayout(res->ctx->device,
+                                res->pipelines.obj.descr.obj_layout, NULL);
+
+   vkFreeDescriptorSets(res->ctx->device,
+                        res->descriptor_pool.static_ubo_pool,
+                        1, &res->pipelines.obj.descr.camera_view_set);
+   vkDestroyDescriptorSetLayout(res->ctx->device,
+                                res->pipelines.obj.descr.camera_view_layout, NULL);
+
+   vkDestroyDescriptorPool(res->ctx->device,
+                           res->descriptor_pool.static_ubo_pool, NULL);
+   vkDestroyDescriptorPool(res->ctx->device,
+                           res->descriptor_pool.static_ssbo_pool, NULL);
+}
+
+static void
+destroy_shader_modules(SceneResources *res)
+{
+  vkDestroyShaderModule(res->ctx->device, res->shaders.obj.vs, NULL);
+  vkDestroyShaderModule(res->ctx->device, res->shaders.obj.fs, NULL);
+}
+
+static void
+destroy_ubos(SceneResources *res)
+{
+   vkDestroyBuffer(res->ctx->device, res->ubos.camera_view.buf.buf, NULL);
+   vkFreeMemory(res->ctx->device, res->ubos.camera_view.buf.mem, NULL);
+}
+
+void
+cleanup_resources(SceneResources *res)
+{
+   // The stream frees its models and objects, and it must go before the
+   // scene
+   vkdf_stream_free(res->stream);
+   vkdf_scene_free(res->scene);
+   vkDestroyCommandPool(res->ctx->device, res->cmd_pool, NULL);
+   destroy_shader_modules(res);
+   destroy_pipelines(res);
+   destroy_ubos(res);
+
+   vkdf_camera_free(res->camera);
+}
+
+int
+main()
+{
+   VkdfContext ctx;
+   SceneResources resources;
+
+   vkdf_init(&ctx, WIN_WIDTH, WIN_HEIGHT, false, false, false);
+   init_resources(&ctx, &resources);
+
+   vkdf_scene_event_loop_run(resources.scene);
+
+   cleanup_resources(&resources);
+   vkdf_cleanup(&ctx);
+
+   return 0;
+}
@@ -0,0 +1,36 @@
+#version 400
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
+
+struct Material {
+   vec4 diffuse;
+   vec4 ambient;
+   vec4 specular;
+   float shininess;
+   uint diffuse_tex_count;
+   uint normal_tex_count;
+   uint specular_tex_count;
+   uint opacity_tex_count;
+   uint pad0, pad1, pad2;
+};
+
+layout(std140, set = 1, binding = 1) readonly buffer material_ssbo {
+   Material materials[];
+} Mat;
+
+layout(location = 0) in vec3 in_normal;
+layout(location = 1) flat in uint in_material_idx;
+
+layout(location = 0) out vec4 out_color;
+
+void main()
+{
+   Material mat = Mat.materials[in_material_idx];
+
+   // Fixed directional light, so the shape of the models is visible
+   vec3 light_dir = normalize(vec3(0.5, 1.0, 0.25));
+   float diffuse = max(dot(normalize(in_normal), light_dir), 0.0);
+   out_color = vec4(mat.diffuse.rgb * (0.25 + 0.75 * diffuse), 1.0);
+}
@@ -0,0 +1,45 @@
+#version 400
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
+
+layout(push_constant) uniform pcb {
+   mat4 Projection;
+} PCB;
+
+layout(std140, set = 0, binding = 0) uniform ubo_camera {
+   mat4 View;
+} CD;
+
+struct ObjData {
+   mat4 Model;
+   uint material_base_idx;
+   uint model_idx;
+   uint receives_shadows;
+};
+
+layout(std140, set = 1, binding = 0) readonly buffer ssbo_obj_data {
+   ObjData data[];
+} OID;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec3 in_normal;
+layout(location = 2) in uint in_material_idx;
+
+layout(location = 0) out vec3 out_normal;
+layout(location = 1) flat out uint out_material_idx;
+
+void main()
+{
+   ObjData obj_data = OID.data[gl_InstanceIndex];
+
+   vec4 pos = vec4(in_position.x, in_position.y, in_position.z, 1.0);
+   mat4 Model = obj_data.Model;
+   vec4 world_pos = Model * pos;
+   vec4 camera_space_pos = CD.View * world_pos;
+   gl_Position = PCB.Projection * camera_space_pos;
+
+   out_normal = normalize(mat3(Model) * in_normal);
+   out_material_idx = obj_data.material_base_idx + in_material_idx;
+}
@@ -0,0 +1,158 @@
+#include "vkdf.hpp"
+
+// ----------------------------------------------------------------------------
+// Coroutine task microbenchmark. Runs a chain of steps where every step hops
+// to a job in the thread pool, written as a VkdfTask coroutine and as jobs
+// that add the next step to their group by hand, checks that both compute
+// the same result and compares how many steps per second they can run.
+//
+// This needs C++20, so it is only built if the compiler supports coroutines.
+//
+// Usage: tasks [max_threads] [steps] [runs]
+// ----------------------------------------------------------------------------
+
+#if !defined(__cpp_impl_coroutine)
+#error "The tasks demo needs a compiler with C++20 coroutine support"
+#endif
+
+static const uint32_t DEFAULT_MAX_THREADS = 8;
+static const uint32_t DEFAULT_STEPS = 100000;
+static const uint32_t DEFAULT_RUNS = 10;
+
+static inline uint32_t
+step_func(uint32_t x)
+{
+   return x * 1664525u + 1013904223u;
+}
+
+static double
+get_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// ----------------------------------------------------------------------------
+// Task chain
+// ----------------------------------------------------------------------------
+
+static VkdfTask<uint32_t>
+task_step(uint32_t x)
+{
+   co_await vkdf_task_schedule();
+   co_return step_func(x);
+}
+
+static VkdfTask<uint32_t>
+task_chain(uint32_t steps, uint32_t seed)
+{
+   uint32_t x = seed;
+   for (uint32_t i = 0; i < steps; i++)
+      x = co_await task_step(x);
+   co_return x;
+}
+
+// ----------------------------------------------------------------------------
+// Job chain
+// ----------------------------------------------------------------------------
+
+typedef struct {
+   VkdfThreadPool *pool;
+   VkdfThreadJobGroup *group;
+   uint32_t left;
+   uint32_t x;
+} JobChain;
+
+static void
+job_chain_step(uint32_t thread_id, void *arg)
+{
+   JobChain *chain = (JobChain *) arg;
+   chain->x = step_func(chain->x);
+   if (--chain->left > 0) {
+      vkdf_thread_pool_add_group_job(chain->pool, chain->group,
+                                     job_chain_step, chain);
+   }
+}
+
+static uint32_t
+job_chain(VkdfThreadPool *pool, uint32_t steps, uint32_t seed)
+{
+   VkdfThreadJobGroup group;
+   vkdf_thread_job_group_init(&group, NULL, NULL);
+
+   JobChain chain;
+   chain.pool = pool;
+   chain.group = &group;
+   chain.left = steps;
+   chain.x = seed;
+
+   vkdf_thread_pool_add_group_job(pool, &group, job_chain_step, &chain);
+   vkdf_thread_pool_wait_group(pool, &group);
+
+   return chain.x;
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark
+// ----------------------------------------------------------------------------
+
+static uint32_t
+serial_chain(uint32_t steps, uint32_t seed)
+{
+   uint32_t x = seed;
+   for (uint32_t i = 0; i < steps; i++)
+      x = step_func(x);
+   return x;
+}
+
+static double
+bench_tasks(VkdfThreadPool *pool, uint32_t steps, uint32_t runs)
+{
+   double start = get_time();
+   for (uint32_t r = 0; r < runs; r++) {
+      uint32_t x = vkdf_task_run(pool, task_chain(steps, r));
+      if (x != serial_chain(steps, r))
+         vkdf_fatal("tasks: wrong result for task chain %u", r);
+   }
+   return (steps * runs) / (get_time() - start);
+}
+
+static double
+bench_jobs(VkdfThreadPool *pool, uint32_t steps, uint32_t runs)
+{
+   double start = get_time();
+   for (uint32_t r = 0; r < runs; r++) {
+      uint32_t x = job_chain(pool, steps, r);
+      if (x != serial_chain(steps, r))
+         vkdf_fatal("tasks: wrong result for job chain %u", r);
+   }
+   return (steps * runs) / (get_time() - start);
+}
+
+int
+main(int argc, char **argv)
+{
+   uint32_t max_threads =
+      argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_MAX_THREADS;
+   uint32_t steps =
+      argc > 2 ? (uint32_t) atoi(argv[2]) : DEFAULT_STEPS;
+   uint32_t runs =
+      argc > 3 ? (uint32_t) atoi(argv[3]) : DEFAULT_RUNS;
+
+   printf("%u steps per chain, %u runs\n", steps, runs);
+   printf("%8s %16s %16s %8s\n", "threads", "job steps/s", "task steps/s",
+          "ratio");
+
+   for (uint32_t n = 1; n <= max_threads; n *= 2) {
+      VkdfThreadPool *pool = vkdf_thread_pool_new(n);
+      double job_rate = bench_jobs(pool, steps, runs);
+      double task_rate = bench_tasks(pool, steps, runs);
+      vkdf_thread_pool_free(pool);
+
+      printf("%8u %16.0f %16.0f %7.2fx\n",
+             n, job_rate, task_rate, task_rate / job_rate);
+   }
+
+   return 0;
+}
@@ -0,0 +1,238 @@
+#include "vkdf.hpp"
+
+// ----------------------------------------------------------------------------
+// Thread pool microbenchmark. Measures how many small jobs per second we can
+// push through VkdfThreadPool and compares that against a simple mutex
+// protected job list that allocates each job on the heap and pops jobs from
+// its head, which is how the thread pool used to queue jobs.
+//
+// vkdf_thread_pool_wait() runs queued jobs in the waiting thread, so the
+// reference list does that too and both run jobs on N+1 threads.
+//
+// Usage: threadpool [max_threads] [jobs_per_frame] [frames]
+// ----------------------------------------------------------------------------
+
+static const uint32_t DEFAULT_MAX_THREADS = 8;
+static const uint32_t DEFAULT_JOBS_PER_FRAME = 1024;
+static const uint32_t DEFAULT_FRAMES = 2000;
+
+// Amount of fake work done by each job, so that we mostly measure the cost
+// of queuing and dispatching jobs.
+static const uint32_t JOB_WORK = 64;
+
+static gint job_count = 0;
+
+static void
+job_func(uint32_t thread_id, void *arg)
+{
+   volatile uint32_t x = (uint32_t) (uintptr_t) arg;
+   for (uint32_t i = 0; i < JOB_WORK; i++)
+      x = x * 1664525u + 1013904223u;
+   g_atomic_int_inc(&job_count);
+}
+
+static double
+get_time()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// ----------------------------------------------------------------------------
+// Reference job list
+// ----------------------------------------------------------------------------
+
+typedef struct {
+   pthread_mutex_t mutex;
+   pthread_cond_t has_jobs;
+   pthread_cond_t all_idle;
+   GList *jobs;
+   uint32_t num_pending;
+   bool active;
+   pthread_t *threads;
+   uint32_t num_threads;
+} ListPool;
+
+typedef struct {
+   ListPool *pool;
+   uint32_t id;
+} ListThread;
+
+static void *
+list_pool_thread_run(void *data)
+{
+   ListThread *thread = (ListThread *) data;
+   ListPool *pool = thread->pool;
+
+   pthread_mutex_lock(&pool->mutex);
+   while (true) {
+      while (pool->active && pool->jobs == NULL)
+         pthread_cond_wait(&pool->has_jobs, &pool->mutex);
+
+      if (!pool->active)
+         break;
+
+      VkdfThreadJob *job = (VkdfThreadJob *) pool->jobs->data;
+      pool->jobs = g_list_delete_link(pool->jobs, pool->jobs);
+      pthread_mutex_unlock(&pool->mutex);
+
+      job->function(thread->id, job->arg);
+      g_free(job);
+
+      pthread_mutex_lock(&pool->mutex);
+      if (--pool->num_pending == 0)
+         pthread_cond_broadcast(&pool->all_idle);
+   }
+   pthread_mutex_unlock(&pool->mutex);
+
+   g_free(thread);
+   return NULL;
+}
+
+static ListPool *
+list_pool_new(uint32_t num_threads)
+{
+   ListPool *pool = g_new0(ListPool, 1);
+   pthread_mutex_init(&pool->mutex, NULL);
+   pthread_cond_init(&pool->has_jobs, NULL);
+   pthread_cond_init(&pool->all_idle, NULL);
+   pool->active = true;
+   pool->num_threads = num_threads;
+   pool->threads = g_new(pthread_t, num_threads);
+   for (uint32_t i = 0; i < num_threads; i++) {
+      ListThread *thread = g_new(ListThread, 1);
+      thread->pool = pool;
+      thread->id = i;
+      pthread_create(&pool->threads[i], NULL, list_pool_thread_run, thread);
+   }
+   return pool;
+}
+
+static void
+list_pool_add_job(ListPool *pool, VkdfThreadJobFunction func, void *arg)
+{
+   VkdfThreadJob *job = g_new(VkdfThreadJob, 1);
+   job->function = func;
+   job->arg = arg;
+
+   pthread_mutex_lock(&pool->mutex);
+   pool->jobs = g_list_prepend(pool->jobs, job);
+   pool->num_pending++;
+   pthread_cond_signal(&pool->has_jobs);
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+list_pool_wait(ListPool *pool)
+{
+   // Run queued jobs while we wait, as the thread pool does
+   pthread_mutex_lock(&pool->mutex);
+   while (pool->num_pending > 0) {
+      if (pool->jobs == NULL) {
+         pthread_cond_wait(&pool->all_idle, &pool->mutex);
+         continue;
+      }
+
+      VkdfThreadJob *job = (VkdfThreadJob *) pool->jobs->data;
+      pool->jobs = g_list_delete_link(pool->jobs, pool->jobs);
+      pthread_mutex_unlock(&pool->mutex);
+
+      job->function(pool->num_threads, job->arg);
+      g_free(job);
+
+      pthread_mutex_lock(&pool->mutex);
+      pool->num_pending--;
+   }
+   pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+list_pool_free(ListPool *pool)
+{
+   pthread_mutex_lock(&pool->mutex);
+   pool->active = false;
+   pthread_cond_broadcast(&pool->has_jobs);
+   pthread_mutex_unlock(&pool->mutex);
+
+   for (uint32_t i = 0; i < pool->num_threads; i++)
+      pthread_join(pool->threads[i], NULL);
+
+   pthread_mutex_destroy(&pool->mutex);
+   pthread_cond_destroy(&pool->has_jobs);
+   pthread_cond_destroy(&pool->all_idle);
+   g_free(pool->threads);
+   g_free(pool);
+}
+
+// ----------------------------------------------------------------------------
+// Benchmark
+// ----------------------------------------------------------------------------
+
+static double
+bench_list_pool(uint32_t num_threads, uint32_t jobs_per_frame, uint32_t frames)
+{
+   ListPool *pool = list_pool_new(num_threads);
+   job_count = 0;
+
+   double start = get_time();
+   for (uint32_t f = 0; f < frames; f++) {
+      for (uint32_t j = 0; j < jobs_per_frame; j++)
+         list_pool_add_job(pool, job_func, (void *) (uintptr_t) j);
+      list_pool_wait(pool);
+   }
+   double elapsed = get_time() - start;
+
+   if (job_count != (gint) (jobs_per_frame * frames))
+      vkdf_fatal("threadpool: job list ran %d jobs, expected %u",
+                 job_count, jobs_per_frame * frames);
+   list_pool_free(pool);
+
+   return (jobs_per_frame * frames) / elapsed;
+}
+
+static double
+bench_vkdf_pool(uint32_t num_threads, uint32_t jobs_per_frame, uint32_t frames)
+{
+   VkdfThreadPool *pool = vkdf_thread_pool_new(num_threads);
+   job_count = 0;
+
+   double start = get_time();
+   for (uint32_t f = 0; f < frames; f++) {
+      for (uint32_t j = 0; j < jobs_per_frame; j++)
+         vkdf_thread_pool_add_job(pool, job_func, (void *) (uintptr_t) j);
+      vkdf_thread_pool_wait(pool);
+   }
+   double elapsed = get_time() - start;
+
+   if (job_count != (gint) (jobs_per_frame * frames))
+      vkdf_fatal("threadpool: thread pool ran %d jobs, expected %u",
+                 job_count, jobs_per_frame * frames);
+   vkdf_thread_pool_free(pool);
+
+   return (jobs_per_frame * frames) / elapsed;
+}
+
+int
+main(int argc, char **argv)
+{
+   uint32_t max_threads =
+      argc > 1 ? (uint32_t) atoi(argv[1]) : DEFAULT_MAX_THREADS;
+   uint32_t jobs_per_frame =
+      argc > 2 ? (uint32_t) atoi(argv[2]) : DEFAULT_JOBS_PER_FRAME;
+   uint32_t frames =
+      argc > 3 ? (uint32_t) atoi(argv[3]) : DEFAULT_FRAMES;
+
+   printf("%u jobs per frame, %u frames\n", jobs_per_frame, frames);
+   printf("%8s %16s %16s %8s\n", "threads", "list jobs/s", "vkdf jobs/s",
+          "speedup");
+
+   for (uint32_t n = 1; n <= max_threads; n *= 2) {
+      double list_rate = bench_list_pool(n, jobs_per_frame, frames);
+      double vkdf_rate = bench_vkdf_pool(n, jobs_per_frame, frames);
+      printf("%8u %16.0f %16.0f %7.2fx\n",
+             n, list_rate, vkdf_rate, vkdf_rate / list_rate);
+   }
+
+   return 0;
+}
@@ -1,6 +1,10 @@
 #include "vkdf-box.hpp"
 #include "vkdf-util.hpp"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 glm::vec3
 vkdf_box_get_vertex(const VkdfBox *box, uint32_t index)
 {
@@ -121,29 +125,58 @@ vkdf_box_transform(VkdfBox *box, glm::mat4 *transform)
    box->d = (maxZ - minZ) / 2.0f;
 }
 
-static uint32_t
-box_is_in_frustum(const VkdfBox *box, const VkdfPlane *fplanes)
+/* We use the p/n-vertex formulation of the box-plane test: for each plane,
+ * the box vertex furthest along the plane normal (p-vertex) is at distance
+ * dist + r from the plane and the nearest one (n-vertex) at dist - r, where
+ * dist is the distance from the box center and r is the projection of the
+ * box extents on the plane normal. If the p-vertex is behind the plane the
+ * box is outside, otherwise if the n-vertex is behind the plane the box
+ * intersects it.
+ *
+ * Only the planes in plane_mask are tested. If out_mask is not NULL, it
+ * receives the subset of those planes that the box intersects.
+ */
+static inline uint32_t
+box_is_in_frustum(float cx, float cy, float cz,
+                  float ex, float ey, float ez,
+                  const VkdfBox *fbox,
+                  const VkdfPlane *fplanes,
+                  uint32_t plane_mask,
+                  uint32_t *out_mask)
 {
-   uint32_t result = INSIDE;
-   uint32_t in, out;
+   if (out_mask)
+      *out_mask = 0;
 
+   if (fbox) {
+      if (fabsf(cx - fbox->center.x) > ex + fbox->w ||
+          fabsf(cy - fbox->center.y) > ey + fbox->h ||
+          fabsf(cz - fbox->center.z) > ez + fbox->d)
+         return OUTSIDE;
+   }
+
+   if (!fplanes)
+      return INSIDE;
+
+   uint32_t result = INSIDE;
+   uint32_t isect_mask = 0;
    for (uint32_t pl = 0; pl < 6; pl++) {
-      out = in = 0;
-      for (uint32_t bvi = 0; bvi < 8 && (in == 0 || out == 0); bvi++) {
-         glm::vec3 p = vkdf_box_get_vertex(box, bvi);
-         float dist = vkdf_plane_distance_from_point(&fplanes[pl], p);
-         if (dist < 0)
-            out++;
-         else
-            in++;
-      }
+      if (!(plane_mask & (1 << pl)))
+         continue;
 
-      if (in == 0)
+      const VkdfPlane *p = &fplanes[pl];
+      float dist = p->a * cx + p->b * cy + p->c * cz + p->d;
+      float r = fabsf(p->a) * ex + fabsf(p->b) * ey + fabsf(p->c) * ez;
+      if (dist + r < 0.0f) {
          return OUTSIDE;
-      else if (out > 0)
+      } else if (dist - r < 0.0f) {
          result = INTERSECT;
+         isect_mask |= 1 << pl;
+      }
    }
 
+   if (out_mask)
+      *out_mask = isect_mask;
+
    return result;
 }
 
@@ -152,13 +185,290 @@ vkdf_box_is_in_frustum(const VkdfBox *box,
                        const VkdfBox *frustum_box,
                        const VkdfPlane *frustum_planes)
 {
-   if (frustum_box && !vkdf_box_collision(box, frustum_box))
-      return OUTSIDE;
+   return box_is_in_frustum(box->center.x, box->center.y, box->center.z,
+                            box->w, box->h, box->d,
+                            frustum_box, frustum_planes,
+                            VKDF_FRUSTUM_PLANE_MASK_ALL, NULL);
+}
+
+uint32_t
+vkdf_box_is_in_frustum_masked(const VkdfBox *box,
+                              const VkdfBox *frustum_box,
+                              const VkdfPlane *frustum_planes,
+                              uint32_t *plane_mask)
+{
+   uint32_t out_mask;
+   uint32_t result =
+      box_is_in_frustum(box->center.x, box->center.y, box->center.z,
+                        box->w, box->h, box->d,
+                        frustum_box, frustum_planes, *plane_mask, &out_mask);
+   if (result != OUTSIDE)
+      *plane_mask = out_mask;
+   return result;
+}
 
-   if (frustum_planes)
-      return box_is_in_frustum(box, frustum_planes);
+#if defined(__SSE2__)
 
-   return INSIDE;
+static inline void
+store_frustum_results(uint32_t *result, uint32_t n,
+                      uint32_t out_bits, uint32_t isect_bits)
+{
+   for (uint32_t k = 0; k < n; k++) {
+      if (out_bits & (1 << k))
+         result[k] = OUTSIDE;
+      else if (isect_bits & (1 << k))
+         result[k] = INTERSECT;
+      else
+         result[k] = INSIDE;
+   }
+}
+
+/* Flags plane p in the plane masks of the boxes with a bit set in
+ * isect_bits
+ */
+static inline void
+add_plane_to_masks(uint32_t *out_masks, uint32_t p, uint32_t isect_bits)
+{
+   while (isect_bits) {
+      uint32_t k = __builtin_ctz(isect_bits);
+      out_masks[k] |= 1 << p;
+      isect_bits &= isect_bits - 1;
+   }
+}
+
+/* Classifies boxes 4 at a time. Returns the number of boxes processed, the
+ * remaining count % 4 boxes are left for the caller.
+ */
+static uint32_t
+box_is_in_frustum_sse(uint32_t count,
+                      const float *cx, const float *cy, const float *cz,
+                      const float *ex, const float *ey, const float *ez,
+                      const VkdfBox *fbox,
+                      const VkdfPlane *fplanes,
+                      uint32_t plane_mask,
+                      uint32_t *result,
+                      uint32_t *out_masks)
+{
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 sign = _mm_set1_ps(-0.0f);
+
+   __m128 fb[6];
+   if (fbox) {
+      fb[0] = _mm_set1_ps(fbox->center.x);
+      fb[1] = _mm_set1_ps(fbox->center.y);
+      fb[2] = _mm_set1_ps(fbox->center.z);
+      fb[3] = _mm_set1_ps(fbox->w);
+      fb[4] = _mm_set1_ps(fbox->h);
+      fb[5] = _mm_set1_ps(fbox->d);
+   }
+
+   __m128 pl[6][7];
+   if (fplanes) {
+      for (uint32_t p = 0; p < 6; p++) {
+         pl[p][0] = _mm_set1_ps(fplanes[p].a);
+         pl[p][1] = _mm_set1_ps(fplanes[p].b);
+         pl[p][2] = _mm_set1_ps(fplanes[p].c);
+         pl[p][3] = _mm_set1_ps(fplanes[p].d);
+         pl[p][4] = _mm_set1_ps(fabsf(fplanes[p].a));
+         pl[p][5] = _mm_set1_ps(fabsf(fplanes[p].b));
+         pl[p][6] = _mm_set1_ps(fabsf(fplanes[p].c));
+      }
+   }
+
+   uint32_t i;
+   for (i = 0; i + 4 <= count; i += 4) {
+      __m128 x = _mm_loadu_ps(cx + i);
+      __m128 y = _mm_loadu_ps(cy + i);
+      __m128 z = _mm_loadu_ps(cz + i);
+      __m128 w = _mm_loadu_ps(ex + i);
+      __m128 h = _mm_loadu_ps(ey + i);
+      __m128 d = _mm_loadu_ps(ez + i);
+
+      __m128 out = zero;
+      __m128 isect = zero;
+
+      if (fbox) {
+         __m128 dx = _mm_andnot_ps(sign, _mm_sub_ps(x, fb[0]));
+         __m128 dy = _mm_andnot_ps(sign, _mm_sub_ps(y, fb[1]));
+         __m128 dz = _mm_andnot_ps(sign, _mm_sub_ps(z, fb[2]));
+         out = _mm_or_ps(out, _mm_cmpgt_ps(dx, _mm_add_ps(w, fb[3])));
+         out = _mm_or_ps(out, _mm_cmpgt_ps(dy, _mm_add_ps(h, fb[4])));
+         out = _mm_or_ps(out, _mm_cmpgt_ps(dz, _mm_add_ps(d, fb[5])));
+      }
+
+      if (out_masks)
+         memset(out_masks + i, 0, 4 * sizeof(uint32_t));
+
+      if (fplanes) {
+         for (uint32_t p = 0; p < 6; p++) {
+            if (!(plane_mask & (1 << p)))
+               continue;
+
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pl[p][0], x),
+                                                _mm_mul_ps(pl[p][1], y)),
+                                     _mm_add_ps(_mm_mul_ps(pl[p][2], z),
+                                                pl[p][3]));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(pl[p][4], w),
+                                             _mm_mul_ps(pl[p][5], h)),
+                                  _mm_mul_ps(pl[p][6], d));
+            __m128 isect_p = _mm_cmplt_ps(_mm_sub_ps(dist, r), zero);
+            out = _mm_or_ps(out, _mm_cmplt_ps(_mm_add_ps(dist, r), zero));
+            isect = _mm_or_ps(isect, isect_p);
+            if (out_masks)
+               add_plane_to_masks(out_masks + i, p, _mm_movemask_ps(isect_p));
+         }
+      }
+
+      store_frustum_results(result + i, 4,
+                            _mm_movemask_ps(out), _mm_movemask_ps(isect));
+   }
+
+   return i;
+}
+
+/* Same as box_is_in_frustum_sse() but 8 boxes at a time. Only used if the
+ * CPU supports AVX.
+ */
+__attribute__((target("avx")))
+static uint32_t
+box_is_in_frustum_avx(uint32_t count,
+                      const float *cx, const float *cy, const float *cz,
+                      const float *ex, const float *ey, const float *ez,
+                      const VkdfBox *fbox,
+                      const VkdfPlane *fplanes,
+                      uint32_t plane_mask,
+                      uint32_t *result,
+                      uint32_t *out_masks)
+{
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 sign = _mm256_set1_ps(-0.0f);
+
+   __m256 fb[6];
+   if (fbox) {
+      fb[0] = _mm256_set1_ps(fbox->center.x);
+      fb[1] = _mm256_set1_ps(fbox->center.y);
+      fb[2] = _mm256_set1_ps(fbox->center.z);
+      fb[3] = _mm256_set1_ps(fbox->w);
+      fb[4] = _mm256_set1_ps(fbox->h);
+      fb[5] = _mm256_set1_ps(fbox->d);
+   }
+
+   __m256 pl[6][7];
+   if (fplanes) {
+      for (uint32_t p = 0; p < 6; p++) {
+         pl[p][0] = _mm256_set1_ps(fplanes[p].a);
+         pl[p][1] = _mm256_set1_ps(fplanes[p].b);
+         pl[p][2] = _mm256_set1_ps(fplanes[p].c);
+         pl[p][3] = _mm256_set1_ps(fplanes[p].d);
+         pl[p][4] = _mm256_set1_ps(fabsf(fplanes[p].a));
+         pl[p][5] = _mm256_set1_ps(fabsf(fplanes[p].b));
+         pl[p][6] = _mm256_set1_ps(fabsf(fplanes[p].c));
+      }
+   }
+
+   uint32_t i;
+   for (i = 0; i + 8 <= count; i += 8) {
+      __m256 x = _mm256_loadu_ps(cx + i);
+      __m256 y = _mm256_loadu_ps(cy + i);
+      __m256 z = _mm256_loadu_ps(cz + i);
+      __m256 w = _mm256_loadu_ps(ex + i);
+      __m256 h = _mm256_loadu_ps(ey + i);
+      __m256 d = _mm256_loadu_ps(ez + i);
+
+      __m256 out = zero;
+      __m256 isect = zero;
+
+      if (fbox) {
+         __m256 dx = _mm256_andnot_ps(sign, _mm256_sub_ps(x, fb[0]));
+         __m256 dy = _mm256_andnot_ps(sign, _mm256_sub_ps(y, fb[1]));
+         __m256 dz = _mm256_andnot_ps(sign, _mm256_sub_ps(z, fb[2]));
+         out = _mm256_or_ps(out, _mm256_cmp_ps(dx, _mm256_add_ps(w, fb[3]),
+                                               _CMP_GT_OQ));
+         out = _mm256_or_ps(out, _mm256_cmp_ps(dy, _mm256_add_ps(h, fb[4]),
+                                               _CMP_GT_OQ));
+         out = _mm256_or_ps(out, _mm256_cmp_ps(dz, _mm256_add_ps(d, fb[5]),
+                                               _CMP_GT_OQ));
+      }
+
+      if (out_masks)
+         memset(out_masks + i, 0, 8 * sizeof(uint32_t));
+
+      if (fplanes) {
+         for (uint32_t p = 0; p < 6; p++) {
+            if (!(plane_mask & (1 << p)))
+               continue;
+
+            __m256 dist =
+               _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pl[p][0], x),
+                                           _mm256_mul_ps(pl[p][1], y)),
+                             _mm256_add_ps(_mm256_mul_ps(pl[p][2], z),
+                                           pl[p][3]));
+            __m256 r =
+               _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(pl[p][4], w),
+                                           _mm256_mul_ps(pl[p][5], h)),
+                             _mm256_mul_ps(pl[p][6], d));
+            __m256 isect_p = _mm256_cmp_ps(_mm256_sub_ps(dist, r), zero,
+                                           _CMP_LT_OQ);
+            out = _mm256_or_ps(out,
+                               _mm256_cmp_ps(_mm256_add_ps(dist, r), zero,
+                                             _CMP_LT_OQ));
+            isect = _mm256_or_ps(isect, isect_p);
+            if (out_masks) {
+               add_plane_to_masks(out_masks + i, p,
+                                  _mm256_movemask_ps(isect_p));
+            }
+         }
+      }
+
+      store_frustum_results(result + i, 8,
+                            _mm256_movemask_ps(out),
+                            _mm256_movemask_ps(isect));
+   }
+
+   return i;
+}
+
+#endif
+
+void
+vkdf_box_is_in_frustum_soa_masked(uint32_t count,
+                                  const float *cx,
+                                  const float *cy,
+                                  const float *cz,
+                                  const float *ex,
+                                  const float *ey,
+                                  const float *ez,
+                                  const VkdfBox *frustum_box,
+                                  const VkdfPlane *frustum_planes,
+                                  uint32_t plane_mask,
+                                  uint32_t *result,
+                                  uint32_t *plane_masks)
+{
+   uint32_t i = 0;
+
+#if defined(__SSE2__)
+   if (count >= 8 && __builtin_cpu_supports("avx")) {
+      i = box_is_in_frustum_avx(count, cx, cy, cz, ex, ey, ez,
+                                frustum_box, frustum_planes, plane_mask,
+                                result, plane_masks);
+   }
+
+   if (count - i >= 4) {
+      i += box_is_in_frustum_sse(count - i,
+                                 cx + i, cy + i, cz + i,
+                                 ex + i, ey + i, ez + i,
+                                 frustum_box, frustum_planes, plane_mask,
+                                 result + i,
+                                 plane_masks ? plane_masks + i : NULL);
+   }
+#endif
+
+   for (; i < count; i++) {
+      result[i] = box_is_in_frustum(cx[i], cy[i], cz[i],
+                                    ex[i], ey[i], ez[i],
+                                    frustum_box, frustum_planes, plane_mask,
+                                    plane_masks ? &plane_masks[i] : NULL);
+   }
 }
 
 uint32_t
@@ -32,6 +32,127 @@ vkdf_box_is_in_frustum(const VkdfBox *box,
                        const VkdfBox *frustum_box,
                        const VkdfPlane *frustum_planes);
 
+/* Plane masks select frustum planes, bit i standing for frustum_planes[i] */
+#define VKDF_FRUSTUM_PLANE_MASK_ALL 0x3f
+
+/**
+ * Same as vkdf_box_is_in_frustum() but only tests the frustum planes in
+ * *plane_mask. If the box is not OUTSIDE, *plane_mask is updated to the
+ * planes that the box intersects (see vkdf_box_is_in_frustum_soa_masked()).
+ */
+uint32_t
+vkdf_box_is_in_frustum_masked(const VkdfBox *box,
+                              const VkdfBox *frustum_box,
+                              const VkdfPlane *frustum_planes,
+                              uint32_t *plane_mask);
+
+/* Boxes in SoA form, so they can be tested against a frustum in batches */
+#define VKDF_BOX_BATCH_SIZE 64
+
+typedef struct {
+   uint32_t count;
+   float cx[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+   float cy[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+   float cz[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+   float ex[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+   float ey[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+   float ez[VKDF_BOX_BATCH_SIZE] __attribute__((aligned(32)));
+} VkdfBoxBatch;
+
+inline void
+vkdf_box_batch_reset(VkdfBoxBatch *batch)
+{
+   batch->count = 0;
+}
+
+inline bool
+vkdf_box_batch_is_full(const VkdfBoxBatch *batch)
+{
+   return batch->count == VKDF_BOX_BATCH_SIZE;
+}
+
+inline void
+vkdf_box_batch_add(VkdfBoxBatch *batch, const VkdfBox *box)
+{
+   assert(batch->count < VKDF_BOX_BATCH_SIZE);
+   uint32_t i = batch->count++;
+   batch->cx[i] = box->center.x;
+   batch->cy[i] = box->center.y;
+   batch->cz[i] = box->center.z;
+   batch->ex[i] = box->w;
+   batch->ey[i] = box->h;
+   batch->ez[i] = box->d;
+}
+
+/**
+ * Classifies count boxes, given as arrays of centers and half-extents,
+ * against a frustum, only testing the frustum planes in plane_mask. Planes
+ * not in the mask are assumed to have all the boxes on their inner side.
+ * Writes OUTSIDE, INSIDE or INTERSECT for each box to result. If
+ * plane_masks is not NULL, it receives, for each box that is not OUTSIDE,
+ * the planes in plane_mask that the box intersects. These are the only
+ * planes that need to be tested for boxes contained in that box.
+ */
+void
+vkdf_box_is_in_frustum_soa_masked(uint32_t count,
+                                  const float *cx,
+                                  const float *cy,
+                                  const float *cz,
+                                  const float *ex,
+                                  const float *ey,
+                                  const float *ez,
+                                  const VkdfBox *frustum_box,
+                                  const VkdfPlane *frustum_planes,
+                                  uint32_t plane_mask,
+                                  uint32_t *result,
+                                  uint32_t *plane_masks);
+
+/**
+ * Classifies count boxes, given as arrays of centers and half-extents,
+ * against a frustum. Writes OUTSIDE, INSIDE or INTERSECT for each box to
+ * result. Same semantics as vkdf_box_is_in_frustum().
+ */
+inline void
+vkdf_box_is_in_frustum_soa(uint32_t count,
+                           const float *cx, const float *cy, const float *cz,
+                           const float *ex, const float *ey, const float *ez,
+                           const VkdfBox *frustum_box,
+                           const VkdfPlane *frustum_planes,
+                           uint32_t *result)
+{
+   vkdf_box_is_in_frustum_soa_masked(count, cx, cy, cz, ex, ey, ez,
+                                     frustum_box, frustum_planes,
+                                     VKDF_FRUSTUM_PLANE_MASK_ALL,
+                                     result, NULL);
+}
+
+inline void
+vkdf_box_batch_is_in_frustum(const VkdfBoxBatch *batch,
+                             const VkdfBox *frustum_box,
+                             const VkdfPlane *frustum_planes,
+                             uint32_t *result)
+{
+   vkdf_box_is_in_frustum_soa(batch->count,
+                              batch->cx, batch->cy, batch->cz,
+                              batch->ex, batch->ey, batch->ez,
+                              frustum_box, frustum_planes, result);
+}
+
+inline void
+vkdf_box_batch_is_in_frustum_masked(const VkdfBoxBatch *batch,
+                                    const VkdfBox *frustum_box,
+                                    const VkdfPlane *frustum_planes,
+                                    uint32_t plane_mask,
+                                    uint32_t *result,
+                                    uint32_t *plane_masks)
+{
+   vkdf_box_is_in_frustum_soa_masked(batch->count,
+                                     batch->cx, batch->cy, batch->cz,
+                                     batch->ex, batch->ey, batch->ez,
+                                     frustum_box, frustum_planes, plane_mask,
+                                     result, plane_masks);
+}
+
 uint32_t
 vkdf_box_is_in_cone(const VkdfBox *box,
                     glm::vec3 top, glm::vec3 dir, float cutoff);
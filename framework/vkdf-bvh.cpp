@@ -0,0 +1,276 @@
+#include "vkdf-bvh.hpp"
+#include "vkdf-util.hpp"
+
+#include <algorithm>
+
+// Rebuild the tree when refitting makes it this much worse than a fresh build
+#define REBUILD_COST_FACTOR 2.0f
+
+VkdfBvh *
+vkdf_bvh_new()
+{
+   return g_new0(VkdfBvh, 1);
+}
+
+void
+vkdf_bvh_free(VkdfBvh *bvh)
+{
+   g_free(bvh->nodes);
+   g_free(bvh->items);
+   g_free(bvh->boxes);
+   g_free(bvh);
+}
+
+static inline void
+box_from_bounds(VkdfBox *box, const glm::vec3 &min, const glm::vec3 &max)
+{
+   box->center = (min + max) * 0.5f;
+   box->w = (max.x - min.x) * 0.5f;
+   box->h = (max.y - min.y) * 0.5f;
+   box->d = (max.z - min.z) * 0.5f;
+}
+
+static inline void
+box_get_bounds(const VkdfBox *box, glm::vec3 *min, glm::vec3 *max)
+{
+   glm::vec3 extent = glm::vec3(box->w, box->h, box->d);
+   *min = box->center - extent;
+   *max = box->center + extent;
+}
+
+static inline void
+merge_boxes(VkdfBox *box, const VkdfBox *a, const VkdfBox *b)
+{
+   glm::vec3 min_a, max_a, min_b, max_b;
+   box_get_bounds(a, &min_a, &max_a);
+   box_get_bounds(b, &min_b, &max_b);
+   box_from_bounds(box, glm::min(min_a, min_b), glm::max(max_a, max_b));
+}
+
+static inline float
+box_area(const VkdfBox *box)
+{
+   return box->w * box->h + box->h * box->d + box->d * box->w;
+}
+
+static float
+compute_cost(VkdfBvh *bvh)
+{
+   float cost = 0.0f;
+   for (uint32_t i = 0; i < bvh->num_nodes; i++)
+      cost += box_area(&bvh->nodes[i].box);
+   return cost;
+}
+
+/* Builds the subtree for items [first, first + count) and returns its root.
+ * Nodes are split at the median item along the axis with the largest spread
+ * of box centers.
+ */
+static int32_t
+build_node(VkdfBvh *bvh, uint32_t first, uint32_t count)
+{
+   int32_t idx = bvh->num_nodes++;
+   VkdfBvhNode *node = &bvh->nodes[idx];
+   node->first = first;
+   node->count = count;
+   node->left = -1;
+   node->right = -1;
+
+   uint32_t *items = &bvh->items[first];
+
+   glm::vec3 min, max, cmin, cmax;
+   box_get_bounds(&bvh->boxes[items[0]], &min, &max);
+   cmin = cmax = bvh->boxes[items[0]].center;
+   for (uint32_t i = 1; i < count; i++) {
+      const VkdfBox *box = &bvh->boxes[items[i]];
+      glm::vec3 bmin, bmax;
+      box_get_bounds(box, &bmin, &bmax);
+      min = glm::min(min, bmin);
+      max = glm::max(max, bmax);
+      cmin = glm::min(cmin, box->center);
+      cmax = glm::max(cmax, box->center);
+   }
+   box_from_bounds(&node->box, min, max);
+
+   if (count <= VKDF_BVH_LEAF_SIZE)
+      return idx;
+
+   glm::vec3 spread = cmax - cmin;
+   uint32_t axis = 0;
+   if (spread.y > spread[axis])
+      axis = 1;
+   if (spread.z > spread[axis])
+      axis = 2;
+
+   const VkdfBox *boxes = bvh->boxes;
+   uint32_t half = count / 2;
+   std::nth_element(items, items + half, items + count,
+                    [boxes, axis](uint32_t a, uint32_t b) {
+                       return boxes[a].center[axis] < boxes[b].center[axis];
+                    });
+
+   // The node array is allocated for the worst case up front, so node
+   // stays valid while we build the children
+   node->left = build_node(bvh, first, half);
+   node->right = build_node(bvh, first + half, count - half);
+
+   return idx;
+}
+
+/**
+ * Builds the BVH for num_items boxes. The boxes are copied.
+ */
+void
+vkdf_bvh_build(VkdfBvh *bvh, uint32_t num_items, const VkdfBox *boxes)
+{
+   if (num_items != bvh->num_items) {
+      bvh->items = g_renew(uint32_t, bvh->items, num_items);
+      bvh->boxes = g_renew(VkdfBox, bvh->boxes, num_items);
+
+      // A binary tree with at least 1 item per leaf has at most
+      // 2 * num_items - 1 nodes
+      bvh->nodes = g_renew(VkdfBvhNode, bvh->nodes, MAX2(2 * num_items, 1));
+      bvh->num_items = num_items;
+   }
+
+   if (boxes != bvh->boxes)
+      memcpy(bvh->boxes, boxes, num_items * sizeof(VkdfBox));
+
+   for (uint32_t i = 0; i < num_items; i++)
+      bvh->items[i] = i;
+
+   bvh->num_nodes = 0;
+   if (num_items > 0)
+      build_node(bvh, 0, num_items);
+
+   bvh->needs_refit = false;
+   bvh->build_cost = compute_cost(bvh);
+}
+
+/**
+ * Updates node boxes after items have been updated with
+ * vkdf_bvh_update_item(). If the tree has degraded too much it is rebuilt
+ * instead. Returns true if the tree was rebuilt.
+ */
+bool
+vkdf_bvh_refit(VkdfBvh *bvh)
+{
+   if (!bvh->needs_refit)
+      return false;
+
+   bvh->needs_refit = false;
+
+   // Children are stored after their parents, so going through the nodes
+   // backwards refits children before their parents
+   for (int32_t i = bvh->num_nodes - 1; i >= 0; i--) {
+      VkdfBvhNode *node = &bvh->nodes[i];
+      if (node->left >= 0) {
+         merge_boxes(&node->box,
+                     &bvh->nodes[node->left].box,
+                     &bvh->nodes[node->right].box);
+         continue;
+      }
+
+      node->box = bvh->boxes[bvh->items[node->first]];
+      for (uint32_t j = 1; j < node->count; j++) {
+         merge_boxes(&node->box, &node->box,
+                     &bvh->boxes[bvh->items[node->first + j]]);
+      }
+   }
+
+   if (compute_cost(bvh) > REBUILD_COST_FACTOR * bvh->build_cost) {
+      vkdf_bvh_build(bvh, bvh->num_items, bvh->boxes);
+      return true;
+   }
+
+   return false;
+}
+
+/* The frustum box test only rejects boxes that do not overlap it, so an
+ * INSIDE result only covers every item of a node if the node box is also
+ * contained in the frustum box.
+ */
+static inline bool
+box_contains(const VkdfBox *outer, const VkdfBox *box)
+{
+   return fabsf(box->center.x - outer->center.x) + box->w <= outer->w &&
+          fabsf(box->center.y - outer->center.y) + box->h <= outer->h &&
+          fabsf(box->center.z - outer->center.z) + box->d <= outer->d;
+}
+
+static inline uint32_t
+add_node_items(VkdfBvh *bvh, const VkdfBvhNode *node,
+               uint32_t *items, uint32_t count)
+{
+   memcpy(&items[count], &bvh->items[node->first],
+          node->count * sizeof(uint32_t));
+   return count + node->count;
+}
+
+/**
+ * Finds the items that are inside or intersect a frustum. items must have
+ * room for all the items in the BVH. Returns the number of items found.
+ */
+uint32_t
+vkdf_bvh_query_frustum(VkdfBvh *bvh,
+                       const VkdfBox *frustum_box,
+                       const VkdfPlane *frustum_planes,
+                       uint32_t *items)
+{
+   if (bvh->num_nodes == 0)
+      return 0;
+
+   // Nodes pending a visit with the frustum planes their parent intersects
+   struct {
+      int32_t node;
+      uint32_t plane_mask;
+   } stack[64];
+   uint32_t stack_size = 0;
+
+   stack[stack_size].node = 0;
+   stack[stack_size].plane_mask = VKDF_FRUSTUM_PLANE_MASK_ALL;
+   stack_size++;
+
+   uint32_t count = 0;
+   while (stack_size > 0) {
+      stack_size--;
+      const VkdfBvhNode *node = &bvh->nodes[stack[stack_size].node];
+      uint32_t plane_mask = stack[stack_size].plane_mask;
+
+      uint32_t result =
+         vkdf_box_is_in_frustum_masked(&node->box, frustum_box,
+                                       frustum_planes, &plane_mask);
+      if (result == OUTSIDE)
+         continue;
+
+      // If the node is inside, so are all its items
+      if (result == INSIDE &&
+          (!frustum_box || box_contains(frustum_box, &node->box))) {
+         count = add_node_items(bvh, node, items, count);
+         continue;
+      }
+
+      if (node->left < 0) {
+         for (uint32_t i = 0; i < node->count; i++) {
+            uint32_t item = bvh->items[node->first + i];
+            uint32_t item_mask = plane_mask;
+            if (vkdf_box_is_in_frustum_masked(&bvh->boxes[item], frustum_box,
+                                              frustum_planes,
+                                              &item_mask) != OUTSIDE) {
+               items[count++] = item;
+            }
+         }
+         continue;
+      }
+
+      assert(stack_size + 2 <= 64);
+      stack[stack_size].node = node->right;
+      stack[stack_size].plane_mask = plane_mask;
+      stack_size++;
+      stack[stack_size].node = node->left;
+      stack[stack_size].plane_mask = plane_mask;
+      stack_size++;
+   }
+
+   return count;
+}
@@ -0,0 +1,73 @@
+#ifndef __VKDF_BVH_H__
+#define __VKDF_BVH_H__
+
+#include "vkdf-deps.hpp"
+#include "vkdf-box.hpp"
+#include "vkdf-plane.hpp"
+
+/* Maximum number of items in a leaf node */
+#define VKDF_BVH_LEAF_SIZE 4
+
+/* Every node covers a contiguous range of the items array, so a node that is
+ * fully inside a query volume can report all its items without visiting its
+ * children. Children are always stored after their parent.
+ */
+typedef struct {
+   VkdfBox box;
+   int32_t left;                // Child nodes, -1 for leaf nodes
+   int32_t right;
+   uint32_t first;              // First item covered by the node
+   uint32_t count;              // Number of items covered by the node
+} VkdfBvhNode;
+
+/* Bounding volume hierarchy over a set of boxes (items). Items are
+ * identified by their index in the array of boxes the BVH is built from.
+ * When items move, their boxes are updated and the tree is refit, which
+ * keeps the topology and only grows or shrinks node boxes. Once refitting
+ * has degraded the tree too much, it is rebuilt.
+ */
+typedef struct {
+   VkdfBvhNode *nodes;
+   uint32_t num_nodes;
+
+   uint32_t num_items;
+   uint32_t *items;             // Item indices, in node order
+   VkdfBox *boxes;              // Item boxes, indexed by item
+
+   bool needs_refit;
+   float build_cost;            // Sum of node box areas after the last build
+} VkdfBvh;
+
+VkdfBvh *
+vkdf_bvh_new();
+
+void
+vkdf_bvh_free(VkdfBvh *bvh);
+
+void
+vkdf_bvh_build(VkdfBvh *bvh, uint32_t num_items, const VkdfBox *boxes);
+
+inline uint32_t
+vkdf_bvh_get_num_items(VkdfBvh *bvh)
+{
+   return bvh->num_items;
+}
+
+inline void
+vkdf_bvh_update_item(VkdfBvh *bvh, uint32_t item, const VkdfBox *box)
+{
+   assert(item < bvh->num_items);
+   bvh->boxes[item] = *box;
+   bvh->needs_refit = true;
+}
+
+bool
+vkdf_bvh_refit(VkdfBvh *bvh);
+
+uint32_t
+vkdf_bvh_query_frustum(VkdfBvh *bvh,
+                       const VkdfBox *frustum_box,
+                       const VkdfPlane *frustum_planes,
+                       uint32_t *items);
+
+#endif
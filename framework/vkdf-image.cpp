@@ -770,22 +770,32 @@ guess_swizzle_from_format(VkFormat format, VkComponentSwizzle *swz)
    }
 }
 
-bool
-vkdf_load_image_from_file(VkdfContext *ctx,
-                          VkCommandPool pool,
-                          const char *path,
-                          VkdfImage *image,
-                          VkImageUsageFlags usage,
-                          bool is_srgb)
+/**
+ * Loads and decodes an image file. This doesn't use any Vulkan resources, so
+ * it can be called from any thread.
+ */
+SDL_Surface *
+vkdf_load_image_data_from_file(const char *path)
 {
-   memset(image, 0, sizeof(VkdfImage));
-
-   // Load image data from file and put pixel data in a GPU buffer
    SDL_Surface *surf = IMG_Load(path);
-   if (!surf) {
+   if (!surf)
       vkdf_error("image: failed to load '%s'", path);
-      return false;
-   }
+   return surf;
+}
+
+/**
+ * Creates an image with the pixel data from an image surface loaded with
+ * vkdf_load_image_data_from_file() and uploads the data to it.
+ */
+bool
+vkdf_create_image_from_surface(VkdfContext *ctx,
+                               VkCommandPool pool,
+                               SDL_Surface *surf,
+                               VkdfImage *image,
+                               VkImageUsageFlags usage,
+                               bool is_srgb)
+{
+   memset(image, 0, sizeof(VkdfImage));
 
    // Get pixel size and format
    uint32_t bpp = compute_bpp_from_sdl_surface(surf);
@@ -829,6 +839,29 @@ vkdf_load_image_from_file(VkdfContext *ctx,
    return true;
 }
 
+bool
+vkdf_load_image_from_file(VkdfContext *ctx,
+                          VkCommandPool pool,
+                          const char *path,
+                          VkdfImage *image,
+                          VkImageUsageFlags usage,
+                          bool is_srgb)
+{
+   memset(image, 0, sizeof(VkdfImage));
+
+   // Load image data from file and put pixel data in a GPU buffer
+   SDL_Surface *surf = vkdf_load_image_data_from_file(path);
+   if (!surf)
+      return false;
+
+   bool result =
+      vkdf_create_image_from_surface(ctx, pool, surf, image, usage, is_srgb);
+
+   SDL_FreeSurface(surf);
+
+   return result;
+}
+
 void
 vkdf_create_image_from_data(VkdfContext *ctx,
                             VkCommandPool pool,
@@ -24,6 +24,17 @@ vkdf_create_image(VkdfContext *ctx,
                   VkImageAspectFlags aspect_flags,
                   VkImageViewType image_view_type);
 
+SDL_Surface *
+vkdf_load_image_data_from_file(const char *path);
+
+bool
+vkdf_create_image_from_surface(VkdfContext *ctx,
+                               VkCommandPool pool,
+                               SDL_Surface *surf,
+                               VkdfImage *image,
+                               VkImageUsageFlags usage,
+                               bool is_srgb);
+
 bool
 vkdf_load_image_from_file(VkdfContext *ctx,
                           VkCommandPool pool,
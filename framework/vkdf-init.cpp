@@ -1,6 +1,9 @@
 #include "vkdf-init.hpp"
 #include "vkdf-init-priv.hpp"
 #include "vkdf-semaphore.hpp"
+#include "vkdf-util.hpp"
+
+#include <unistd.h>
 
 static VkResult
 CreateDebugReportCallbackEXT(VkInstance instance,
@@ -735,6 +738,32 @@ set_fps_target_from_env(VkdfContext *ctx)
    ctx->fps_target_from_env = true;
 }
 
+static void
+init_thread_pool(VkdfContext *ctx)
+{
+   // Threads that wait on the pool run jobs too, so leave one CPU for the
+   // main thread
+   long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   uint32_t num_threads = (uint32_t) MAX2(num_cpus - 1, 1);
+
+   char *env_str = getenv("VKDF_NUM_THREADS");
+   if (env_str) {
+      char *last;
+      long value = strtol(env_str, &last, 10);
+      if (*last != '\0' || value <= 0) {
+         vkdf_error("Can't set number of threads from environment variable "
+                    "with value '%s'\n", env_str);
+      } else {
+         vkdf_info("Setting number of threads from environment variable "
+                   "to %ld.\n", value);
+         num_threads = (uint32_t) value;
+      }
+   }
+
+   ctx->thread_pool = vkdf_thread_pool_new(num_threads);
+   vkdf_thread_pool_set_name(ctx->thread_pool, "vkdf");
+}
+
 void
 vkdf_init(VkdfContext *ctx,
           uint32_t width,
@@ -762,6 +791,8 @@ vkdf_init(VkdfContext *ctx,
    IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG | IMG_INIT_TIF);
 
    set_fps_target_from_env(ctx);
+
+   init_thread_pool(ctx);
 }
 
 static void
@@ -781,6 +812,9 @@ destroy_device(VkdfContext *ctx)
 void
 vkdf_cleanup(VkdfContext *ctx)
 {
+   vkdf_thread_pool_wait(ctx->thread_pool);
+   vkdf_thread_pool_free(ctx->thread_pool);
+
    destroy_swap_chain(ctx);
    destroy_device(ctx);
    vkDestroySurfaceKHR(ctx->inst, ctx->surface, NULL);
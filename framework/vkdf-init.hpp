@@ -3,6 +3,7 @@
 
 #include "vkdf-deps.hpp"
 #include "vkdf-error.hpp"
+#include "vkdf-thread-pool.hpp"
 
 typedef struct {
    VkImage image;
@@ -75,6 +76,9 @@ struct _VkdfContext {
    float fps_target;
    double frame_time_budget;
    bool fps_target_from_env;
+
+   // Job system shared by scenes, asset loaders and applications
+   VkdfThreadPool *thread_pool;
 };
 
 typedef struct _VkdfContext VkdfContext;
@@ -101,6 +105,12 @@ vkdf_set_framerate_target(VkdfContext *ctx, float target)
    }
 }
 
+inline VkdfThreadPool *
+vkdf_get_thread_pool(VkdfContext *ctx)
+{
+   return ctx->thread_pool;
+}
+
 void
 vkdf_cleanup(VkdfContext *ctx);
 
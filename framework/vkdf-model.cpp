@@ -506,55 +506,175 @@ vkdf_model_compute_box(VkdfModel *model)
    model->box.d = (max.z - min.z) / 2.0f;
 }
 
-void
-vkdf_model_load_textures(VkdfContext *ctx,
-                         VkCommandPool pool,
-                         VkdfModel *model,
-                         bool color_is_srgb)
+struct TextureLoadData {
+   const char *path;
+   VkdfImage *image;
+   uint32_t *tex_count;
+   bool is_srgb;
+   SDL_Surface *surf;
+};
+
+static void
+add_texture_load(std::vector<struct TextureLoadData> &loads,
+                 uint32_t *tex_count,
+                 const char *path,
+                 VkdfImage *image,
+                 bool is_srgb)
+{
+   if (*tex_count == 0)
+      return;
+
+   assert(path);
+
+   struct TextureLoadData data;
+   data.path = path;
+   data.image = image;
+   data.tex_count = tex_count;
+   data.is_srgb = is_srgb;
+   data.surf = NULL;
+   loads.push_back(data);
+}
+
+struct _VkdfModelTextureData {
+   std::vector<struct TextureLoadData> loads;
+};
+
+static VkdfModelTextureData *
+collect_texture_loads(VkdfModel *model, bool color_is_srgb)
 {
+   VkdfModelTextureData *data = g_new0(VkdfModelTextureData, 1);
+   data->loads = std::vector<struct TextureLoadData>();
+
+   std::vector<struct TextureLoadData> &loads = data->loads;
    for (uint32_t i = 0; i < model->materials.size(); i++) {
       VkdfMaterial *mat = &model->materials[i];
       VkdfTexMaterial *tex = &model->tex_materials[i];
 
-      if (mat->diffuse_tex_count > 0) {
-         assert(tex->diffuse_path);
-         if (!vkdf_load_image_from_file(ctx, pool,
-                                        tex->diffuse_path, &tex->diffuse,
-                                        VK_IMAGE_USAGE_SAMPLED_BIT,
-                                        color_is_srgb)) {
-            mat->diffuse_tex_count = 0;
-         }
-      }
+      add_texture_load(loads, &mat->diffuse_tex_count,
+                       tex->diffuse_path, &tex->diffuse, color_is_srgb);
+      add_texture_load(loads, &mat->specular_tex_count,
+                       tex->specular_path, &tex->specular, color_is_srgb);
+      add_texture_load(loads, &mat->normal_tex_count,
+                       tex->normal_path, &tex->normal, false);
+      add_texture_load(loads, &mat->opacity_tex_count,
+                       tex->opacity_path, &tex->opacity, false);
+   }
 
-      if (mat->specular_tex_count > 0) {
-         assert(tex->specular_path);
-         if (!vkdf_load_image_from_file(ctx, pool,
-                                        tex->specular_path, &tex->specular,
-                                        VK_IMAGE_USAGE_SAMPLED_BIT,
-                                        color_is_srgb)) {
-            mat->specular_tex_count = 0;
-         }
-      }
+   return data;
+}
 
-      if (mat->normal_tex_count > 0) {
-         assert(tex->normal_path);
-         if (!vkdf_load_image_from_file(ctx, pool,
-                                        tex->normal_path, &tex->normal,
-                                        VK_IMAGE_USAGE_SAMPLED_BIT,
-                                        false)) {
-            mat->normal_tex_count = 0;
-         }
-      }
+static void
+thread_load_texture_data(uint32_t thread_id, void *arg)
+{
+   struct TextureLoadData *data = (struct TextureLoadData *) arg;
+   data->surf = vkdf_load_image_data_from_file(data->path);
+}
 
-      if (mat->opacity_tex_count > 0) {
-         assert(tex->opacity_path);
-         if (!vkdf_load_image_from_file(ctx, pool,
-                                        tex->opacity_path, &tex->opacity,
-                                        VK_IMAGE_USAGE_SAMPLED_BIT,
-                                        false)) {
-            mat->opacity_tex_count = 0;
-         }
+/**
+ * Decodes the texture files for the materials in a model. This doesn't
+ * involve Vulkan, so it can be called from any thread. The images are
+ * created later with vkdf_model_create_textures().
+ */
+VkdfModelTextureData *
+vkdf_model_load_texture_data(VkdfModel *model, bool color_is_srgb)
+{
+   VkdfModelTextureData *data = collect_texture_loads(model, color_is_srgb);
+   for (uint32_t i = 0; i < data->loads.size(); i++)
+      thread_load_texture_data(0, &data->loads[i]);
+   return data;
+}
+
+/**
+ * Same as vkdf_model_load_texture_data(), but decodes each texture file in
+ * its own job in 'group', so long loads don't keep a thread busy for the
+ * whole time. The data is ready once the group completes. Jobs running in
+ * the group can call this too.
+ */
+VkdfModelTextureData *
+vkdf_model_load_texture_data_in_group(VkdfThreadPool *pool,
+                                      VkdfThreadJobGroup *group,
+                                      VkdfModel *model,
+                                      bool color_is_srgb)
+{
+   VkdfModelTextureData *data = collect_texture_loads(model, color_is_srgb);
+   for (uint32_t i = 0; i < data->loads.size(); i++) {
+      vkdf_thread_pool_add_group_job(pool, group, thread_load_texture_data,
+                                     &data->loads[i]);
+   }
+   return data;
+}
+
+/**
+ * Returns an estimate of the GPU memory needed for the textures in 'data',
+ * including mipmaps.
+ */
+VkDeviceSize
+vkdf_model_get_texture_data_size(VkdfModelTextureData *data)
+{
+   VkDeviceSize size = 0;
+   for (uint32_t i = 0; i < data->loads.size(); i++) {
+      SDL_Surface *surf = data->loads[i].surf;
+      if (surf)
+         size += (VkDeviceSize) surf->pitch * surf->h * 4 / 3;
+   }
+   return size;
+}
+
+void
+vkdf_model_free_texture_data(VkdfModelTextureData *data)
+{
+   for (uint32_t i = 0; i < data->loads.size(); i++) {
+      if (data->loads[i].surf)
+         SDL_FreeSurface(data->loads[i].surf);
+   }
+
+   data->loads.clear();
+   std::vector<struct TextureLoadData>(data->loads).swap(data->loads);
+   g_free(data);
+}
+
+/**
+ * Creates the texture images of a model from data decoded with
+ * vkdf_model_load_texture_data() and frees the data.
+ */
+void
+vkdf_model_create_textures(VkdfContext *ctx,
+                           VkCommandPool pool,
+                           VkdfModel *model,
+                           VkdfModelTextureData *data)
+{
+   // Image creation and upload use the command pool, which we can't share
+   // across threads
+   for (uint32_t i = 0; i < data->loads.size(); i++) {
+      struct TextureLoadData *load = &data->loads[i];
+      if (!load->surf ||
+          !vkdf_create_image_from_surface(ctx, pool, load->surf, load->image,
+                                          VK_IMAGE_USAGE_SAMPLED_BIT,
+                                          load->is_srgb)) {
+         *load->tex_count = 0;
       }
    }
+
+   vkdf_model_free_texture_data(data);
 }
 
+void
+vkdf_model_load_textures(VkdfContext *ctx,
+                         VkCommandPool pool,
+                         VkdfModel *model,
+                         bool color_is_srgb)
+{
+   // Decoding image files is CPU intensive and doesn't involve Vulkan, so we
+   // do that in the thread pool. Loading runs as background work so it
+   // doesn't get in the way of frame work if this is called while rendering.
+   VkdfThreadJobGroup group;
+   vkdf_thread_job_group_init(&group, NULL, NULL);
+   vkdf_thread_job_group_set_priority(&group,
+                                      VKDF_THREAD_JOB_PRIORITY_BACKGROUND);
+   VkdfModelTextureData *data =
+      vkdf_model_load_texture_data_in_group(vkdf_get_thread_pool(ctx), &group,
+                                            model, color_is_srgb);
+   vkdf_thread_pool_wait_group(vkdf_get_thread_pool(ctx), &group);
+
+   vkdf_model_create_textures(ctx, pool, model, data);
+}
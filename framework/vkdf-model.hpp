@@ -89,4 +89,28 @@ vkdf_model_load_textures(VkdfContext *ctx,
                          VkdfModel *model,
                          bool color_is_srgb);
 
+/* Texture data decoded from files, ready to create images from */
+typedef struct _VkdfModelTextureData VkdfModelTextureData;
+
+VkdfModelTextureData *
+vkdf_model_load_texture_data(VkdfModel *model, bool color_is_srgb);
+
+VkdfModelTextureData *
+vkdf_model_load_texture_data_in_group(VkdfThreadPool *pool,
+                                      VkdfThreadJobGroup *group,
+                                      VkdfModel *model,
+                                      bool color_is_srgb);
+
+VkDeviceSize
+vkdf_model_get_texture_data_size(VkdfModelTextureData *data);
+
+void
+vkdf_model_free_texture_data(VkdfModelTextureData *data);
+
+void
+vkdf_model_create_textures(VkdfContext *ctx,
+                           VkCommandPool pool,
+                           VkdfModel *model,
+                           VkdfModelTextureData *data);
+
 #endif
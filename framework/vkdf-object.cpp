@@ -189,11 +189,23 @@ vkdf_object_get_visible_meshes(VkdfObject *obj,
 
    const VkdfBox *mesh_boxes = vkdf_object_get_mesh_boxes(obj);
    const VkdfModel *model = obj->model;
-   for (uint32_t i = 0; i < model->meshes.size(); i++) {
-      VkdfBox *box = (VkdfBox *) &mesh_boxes[i];
-      visible[i] =
-         vkdf_box_is_in_frustum(box, frustum_box, frustum_planes) != OUTSIDE;
-      any_visible |= visible[i];
+   const uint32_t num_meshes = model->meshes.size();
+
+   VkdfBoxBatch batch;
+   uint32_t visibility[VKDF_BOX_BATCH_SIZE];
+   for (uint32_t first = 0; first < num_meshes; first += VKDF_BOX_BATCH_SIZE) {
+      uint32_t count = MIN2(num_meshes - first, VKDF_BOX_BATCH_SIZE);
+
+      vkdf_box_batch_reset(&batch);
+      for (uint32_t i = 0; i < count; i++)
+         vkdf_box_batch_add(&batch, &mesh_boxes[first + i]);
+      vkdf_box_batch_is_in_frustum(&batch, frustum_box, frustum_planes,
+                                   visibility);
+
+      for (uint32_t i = 0; i < count; i++) {
+         visible[first + i] = visibility[i] != OUTSIDE;
+         any_visible |= visible[first + i];
+      }
    }
 
    return any_visible;
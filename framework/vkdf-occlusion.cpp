@@ -0,0 +1,620 @@
+#include "vkdf-occlusion.hpp"
+#include "vkdf-util.hpp"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Boxes are tested as if they were this much closer to the camera, so
+// objects are not culled by their own occluder geometry due to rounding
+#define DEPTH_BIAS 1e-4f
+
+static uint32_t
+count_triangles(VkdfModel *model)
+{
+   uint32_t count = 0;
+   for (uint32_t i = 0; i < model->meshes.size(); i++) {
+      VkdfMesh *mesh = model->meshes[i];
+      if (mesh->primitive != VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+         continue;
+      if (mesh->indices.size() > 0)
+         count += mesh->indices.size() / 3;
+      else
+         count += mesh->vertices.size() / 3;
+   }
+   return count;
+}
+
+VkdfOcclusion *
+vkdf_occlusion_new(VkdfThreadPool *pool,
+                   uint32_t width,
+                   uint32_t height,
+                   uint32_t max_triangles)
+{
+   assert(width > 0 && width % VKDF_OCCLUSION_BLOCK_SIZE == 0);
+   assert(height > 0 && height % VKDF_OCCLUSION_BLOCK_SIZE == 0);
+
+   VkdfOcclusion *occ = g_new0(VkdfOcclusion, 1);
+
+   occ->pool = pool;
+   occ->width = width;
+   occ->height = height;
+   occ->blocks_w = width / VKDF_OCCLUSION_BLOCK_SIZE;
+   occ->blocks_h = height / VKDF_OCCLUSION_BLOCK_SIZE;
+   occ->depth = g_new0(float, width * height);
+   occ->block_depth = g_new0(float, occ->blocks_w * occ->blocks_h);
+
+   occ->max_triangles = max_triangles;
+   occ->tris = g_new(VkdfOcclusionTriangle, 2 * max_triangles);
+
+   occ->empty = true;
+
+   return occ;
+}
+
+void
+vkdf_occlusion_free(VkdfOcclusion *occ)
+{
+   g_list_free_full(occ->occluders, g_free);
+   g_free(occ->clip);
+   g_free(occ->tris);
+   g_free(occ->block_depth);
+   g_free(occ->depth);
+   g_free(occ);
+}
+
+/**
+ * Adds a model to render as an occluder with the given model transform.
+ * The model's box must be up to date and the model must outlive the
+ * occluder. Only triangle list meshes are rendered.
+ */
+VkdfOccluder *
+vkdf_occlusion_add_occluder(VkdfOcclusion *occ,
+                            VkdfModel *model,
+                            const glm::mat4 &transform)
+{
+   VkdfOccluder *occluder = g_new0(VkdfOccluder, 1);
+   occluder->model = model;
+   occluder->num_tris = count_triangles(model);
+   occluder->transform = transform;
+   occluder->box = model->box;
+   vkdf_box_transform(&occluder->box, &occluder->transform);
+
+   occ->occluders = g_list_prepend(occ->occluders, occluder);
+   occ->occluders_changed = true;
+
+   return occluder;
+}
+
+void
+vkdf_occlusion_remove_occluder(VkdfOcclusion *occ, VkdfOccluder *occluder)
+{
+   occ->occluders = g_list_remove(occ->occluders, occluder);
+   occ->occluders_changed = true;
+   g_free(occluder);
+}
+
+void
+vkdf_occlusion_set_occluder_transform(VkdfOcclusion *occ,
+                                      VkdfOccluder *occluder,
+                                      const glm::mat4 &transform)
+{
+   if (!memcmp(&occluder->transform, &transform, sizeof(glm::mat4)))
+      return;
+
+   occluder->transform = transform;
+   occluder->box = occluder->model->box;
+   vkdf_box_transform(&occluder->box, &occluder->transform);
+   occ->occluders_changed = true;
+}
+
+static inline void
+cull_triangle(VkdfOcclusionTriangle *t)
+{
+   t->min_y = INT32_MAX;
+   t->max_y = -1;
+}
+
+/**
+ * Sets up a triangle with all its vertices in front of the near plane.
+ */
+static void
+setup_triangle(const VkdfOcclusion *occ,
+               const glm::vec4 &c0, const glm::vec4 &c1, const glm::vec4 &c2,
+               VkdfOcclusionTriangle *t)
+{
+   const glm::vec4 *c[3] = { &c0, &c1, &c2 };
+
+   float x[3], y[3], z[3];
+   for (uint32_t i = 0; i < 3; i++) {
+      float iw = 1.0f / c[i]->w;
+      x[i] = (c[i]->x * iw * 0.5f + 0.5f) * occ->width;
+      y[i] = (c[i]->y * iw * 0.5f + 0.5f) * occ->height;
+      z[i] = iw;
+   }
+
+   // We render both sides of the triangles, so make them all
+   // counter-clockwise
+   float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+   if (!(fabsf(area) > 1e-6f)) {
+      cull_triangle(t);
+      return;
+   }
+
+   if (area < 0.0f) {
+      std::swap(x[1], x[2]);
+      std::swap(y[1], y[2]);
+      std::swap(z[1], z[2]);
+      area = -area;
+   }
+
+   // Pixels are sampled at their centers. Clamp before converting to
+   // integers, since the vertices can be far outside the screen.
+   float min_x = ceilf(MIN2(x[0], MIN2(x[1], x[2])) - 0.5f);
+   float max_x = floorf(MAX2(x[0], MAX2(x[1], x[2])) - 0.5f);
+   float min_y = ceilf(MIN2(y[0], MIN2(y[1], y[2])) - 0.5f);
+   float max_y = floorf(MAX2(y[0], MAX2(y[1], y[2])) - 0.5f);
+   min_x = MAX2(min_x, 0.0f);
+   max_x = MIN2(max_x, (float) (occ->width - 1));
+   min_y = MAX2(min_y, 0.0f);
+   max_y = MIN2(max_y, (float) (occ->height - 1));
+   if (min_x > max_x || min_y > max_y) {
+      cull_triangle(t);
+      return;
+   }
+
+   t->min_x = (int32_t) min_x;
+   t->max_x = (int32_t) max_x;
+   t->min_y = (int32_t) min_y;
+   t->max_y = (int32_t) max_y;
+
+   // Edge i is opposite to vertex i, so its edge function divided by the
+   // area is the barycentric coordinate of vertex i
+   for (uint32_t i = 0; i < 3; i++) {
+      uint32_t i0 = (i + 1) % 3;
+      uint32_t i1 = (i + 2) % 3;
+      t->a[i] = y[i0] - y[i1];
+      t->b[i] = x[i1] - x[i0];
+      t->c[i] = -(t->a[i] * x[i0] + t->b[i] * y[i0]);
+   }
+
+   float inv_area = 1.0f / area;
+   t->za = (t->a[0] * z[0] + t->a[1] * z[1] + t->a[2] * z[2]) * inv_area;
+   t->zb = (t->b[0] * z[0] + t->b[1] * z[1] + t->b[2] * z[2]) * inv_area;
+   t->zc = (t->c[0] * z[0] + t->c[1] * z[1] + t->c[2] * z[2]) * inv_area;
+}
+
+/**
+ * Clips a triangle against the near plane. Returns the number of vertices
+ * of the resulting polygon (at most 4).
+ */
+static uint32_t
+clip_triangle_near(const glm::vec4 *in, glm::vec4 *out)
+{
+   uint32_t n = 0;
+   for (uint32_t i = 0; i < 3; i++) {
+      const glm::vec4 &a = in[i];
+      const glm::vec4 &b = in[(i + 1) % 3];
+      bool a_in = a.w >= VKDF_OCCLUSION_NEAR;
+      bool b_in = b.w >= VKDF_OCCLUSION_NEAR;
+      if (a_in)
+         out[n++] = a;
+      if (a_in != b_in) {
+         float t = (VKDF_OCCLUSION_NEAR - a.w) / (b.w - a.w);
+         out[n++] = a + t * (b - a);
+      }
+   }
+   return n;
+}
+
+/**
+ * Sets up the (up to two) triangles that result from clipping a triangle
+ * against the near plane.
+ */
+static void
+setup_clipped_triangle(const VkdfOcclusion *occ,
+                       const glm::vec4 &c0,
+                       const glm::vec4 &c1,
+                       const glm::vec4 &c2,
+                       VkdfOcclusionTriangle *t)
+{
+   if (c0.w >= VKDF_OCCLUSION_NEAR &&
+       c1.w >= VKDF_OCCLUSION_NEAR &&
+       c2.w >= VKDF_OCCLUSION_NEAR) {
+      setup_triangle(occ, c0, c1, c2, &t[0]);
+      cull_triangle(&t[1]);
+      return;
+   }
+
+   glm::vec4 in[3] = { c0, c1, c2 };
+   glm::vec4 poly[4];
+   uint32_t n = clip_triangle_near(in, poly);
+
+   if (n >= 3)
+      setup_triangle(occ, poly[0], poly[1], poly[2], &t[0]);
+   else
+      cull_triangle(&t[0]);
+
+   if (n == 4)
+      setup_triangle(occ, poly[0], poly[2], poly[3], &t[1]);
+   else
+      cull_triangle(&t[1]);
+}
+
+struct _OccluderRef {
+   VkdfOccluder *occluder;
+   float priority;
+   uint32_t first_tri;
+};
+
+static bool
+compare_occluder_priority(const struct _OccluderRef &a,
+                          const struct _OccluderRef &b)
+{
+   return a.priority > b.priority;
+}
+
+static glm::vec4 *
+get_clip_vertices(VkdfOcclusion *occ, uint32_t thread_id, uint32_t count)
+{
+   if (occ->pool) {
+      return (glm::vec4 *)
+         vkdf_thread_pool_get_scratch(occ->pool, thread_id,
+                                      count * sizeof(glm::vec4));
+   }
+
+   if (occ->clip_size < count) {
+      occ->clip_size = MAX2(count, 2 * occ->clip_size);
+      occ->clip = g_renew(glm::vec4, occ->clip, occ->clip_size);
+   }
+   return occ->clip;
+}
+
+struct OccluderSetupData {
+   VkdfOcclusion *occ;
+   const struct _OccluderRef *refs;
+};
+
+/**
+ * Transforms the triangles of occluders [begin, end) to screen space and
+ * sets them up for rasterization. Each occluder writes to its own range of
+ * the triangle array.
+ */
+static void
+setup_occluders(uint32_t thread_id, uint32_t begin, uint32_t end, void *arg)
+{
+   struct OccluderSetupData *data = (struct OccluderSetupData *) arg;
+   VkdfOcclusion *occ = data->occ;
+
+   for (uint32_t i = begin; i < end; i++) {
+      VkdfOccluder *occluder = data->refs[i].occluder;
+      VkdfOcclusionTriangle *t = occ->tris + data->refs[i].first_tri;
+
+      glm::mat4 mvp = occ->view_proj * occluder->transform;
+
+      VkdfModel *model = occluder->model;
+      for (uint32_t m = 0; m < model->meshes.size(); m++) {
+         VkdfMesh *mesh = model->meshes[m];
+         if (mesh->primitive != VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST)
+            continue;
+
+         uint32_t num_verts = mesh->vertices.size();
+         glm::vec4 *clip = get_clip_vertices(occ, thread_id, num_verts);
+         for (uint32_t v = 0; v < num_verts; v++)
+            clip[v] = mvp * glm::vec4(mesh->vertices[v], 1.0f);
+
+         if (mesh->indices.size() > 0) {
+            const uint32_t *idx = &mesh->indices[0];
+            uint32_t num_tris = mesh->indices.size() / 3;
+            for (uint32_t j = 0; j < num_tris; j++, idx += 3, t += 2)
+               setup_clipped_triangle(occ, clip[idx[0]], clip[idx[1]],
+                                      clip[idx[2]], t);
+         } else {
+            uint32_t num_tris = num_verts / 3;
+            for (uint32_t j = 0; j < num_tris; j++, t += 2)
+               setup_clipped_triangle(occ, clip[3 * j], clip[3 * j + 1],
+                                      clip[3 * j + 2], t);
+         }
+      }
+   }
+}
+
+#if defined(__SSE2__)
+
+static void
+rasterize_triangle(VkdfOcclusion *occ,
+                   const VkdfOcclusionTriangle *t,
+                   int32_t y0, int32_t y1)
+{
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 offset = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+   const __m128 a0 = _mm_set1_ps(t->a[0]);
+   const __m128 a1 = _mm_set1_ps(t->a[1]);
+   const __m128 a2 = _mm_set1_ps(t->a[2]);
+   const __m128 za = _mm_set1_ps(t->za);
+
+   // Pixels go in groups of 4 aligned to 4 pixels. Rows have a multiple of
+   // 4 pixels, so groups never cross the end of a row.
+   const int32_t x0 = t->min_x & ~3;
+
+   for (int32_t y = y0; y <= y1; y++) {
+      float py = y + 0.5f;
+      __m128 r0 = _mm_set1_ps(t->b[0] * py + t->c[0]);
+      __m128 r1 = _mm_set1_ps(t->b[1] * py + t->c[1]);
+      __m128 r2 = _mm_set1_ps(t->b[2] * py + t->c[2]);
+      __m128 rz = _mm_set1_ps(t->zb * py + t->zc);
+
+      float *row = occ->depth + y * occ->width;
+      for (int32_t x = x0; x <= t->max_x; x += 4) {
+         __m128 px = _mm_add_ps(_mm_set1_ps((float) x), offset);
+         __m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), r0);
+         __m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), r1);
+         __m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), r2);
+         __m128 inside =
+            _mm_and_ps(_mm_cmpge_ps(e0, zero),
+                       _mm_and_ps(_mm_cmpge_ps(e1, zero),
+                                  _mm_cmpge_ps(e2, zero)));
+         if (!_mm_movemask_ps(inside))
+            continue;
+
+         __m128 z = _mm_add_ps(_mm_mul_ps(za, px), rz);
+         __m128 d = _mm_loadu_ps(row + x);
+         d = _mm_or_ps(_mm_and_ps(inside, _mm_max_ps(d, z)),
+                       _mm_andnot_ps(inside, d));
+         _mm_storeu_ps(row + x, d);
+      }
+   }
+}
+
+static float
+block_min_depth(const float *p, uint32_t stride)
+{
+   __m128 m = _mm_loadu_ps(p);
+   for (uint32_t y = 0; y < VKDF_OCCLUSION_BLOCK_SIZE; y++, p += stride) {
+      for (uint32_t x = 0; x < VKDF_OCCLUSION_BLOCK_SIZE; x += 4)
+         m = _mm_min_ps(m, _mm_loadu_ps(p + x));
+   }
+   m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+   m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+   return _mm_cvtss_f32(m);
+}
+
+#else
+
+static void
+rasterize_triangle(VkdfOcclusion *occ,
+                   const VkdfOcclusionTriangle *t,
+                   int32_t y0, int32_t y1)
+{
+   for (int32_t y = y0; y <= y1; y++) {
+      float py = y + 0.5f;
+      float *row = occ->depth + y * occ->width;
+      for (int32_t x = t->min_x; x <= t->max_x; x++) {
+         float px = x + 0.5f;
+         if (t->a[0] * px + t->b[0] * py + t->c[0] < 0.0f ||
+             t->a[1] * px + t->b[1] * py + t->c[1] < 0.0f ||
+             t->a[2] * px + t->b[2] * py + t->c[2] < 0.0f) {
+            continue;
+         }
+
+         float z = t->za * px + t->zb * py + t->zc;
+         row[x] = MAX2(row[x], z);
+      }
+   }
+}
+
+static float
+block_min_depth(const float *p, uint32_t stride)
+{
+   float m = p[0];
+   for (uint32_t y = 0; y < VKDF_OCCLUSION_BLOCK_SIZE; y++, p += stride) {
+      for (uint32_t x = 0; x < VKDF_OCCLUSION_BLOCK_SIZE; x++)
+         m = MIN2(m, p[x]);
+   }
+   return m;
+}
+
+#endif
+
+/**
+ * Clears and renders block rows [begin, end) of the depth buffer, then
+ * updates their block depths. Each job only touches its own rows.
+ */
+static void
+rasterize_block_rows(uint32_t thread_id, uint32_t begin, uint32_t end,
+                     void *arg)
+{
+   VkdfOcclusion *occ = (VkdfOcclusion *) arg;
+
+   const int32_t y0 = begin * VKDF_OCCLUSION_BLOCK_SIZE;
+   const int32_t y1 = end * VKDF_OCCLUSION_BLOCK_SIZE - 1;
+
+   memset(occ->depth + y0 * occ->width, 0,
+          (y1 - y0 + 1) * occ->width * sizeof(float));
+
+   for (uint32_t i = 0; i < occ->num_tris; i++) {
+      const VkdfOcclusionTriangle *t = &occ->tris[i];
+      if (t->max_y < y0 || t->min_y > y1)
+         continue;
+      rasterize_triangle(occ, t, MAX2(t->min_y, y0), MIN2(t->max_y, y1));
+   }
+
+   for (uint32_t by = begin; by < end; by++) {
+      const float *row =
+         occ->depth + by * VKDF_OCCLUSION_BLOCK_SIZE * occ->width;
+      for (uint32_t bx = 0; bx < occ->blocks_w; bx++) {
+         occ->block_depth[by * occ->blocks_w + bx] =
+            block_min_depth(row + bx * VKDF_OCCLUSION_BLOCK_SIZE,
+                            occ->width);
+      }
+   }
+}
+
+/**
+ * Renders the occluders visible in the frustum with the given view and
+ * projection transform. The frustum can be NULL to skip frustum culling of
+ * the occluders. Occluders are picked by how large they look from cam_pos
+ * until the triangle budget is used up.
+ */
+void
+vkdf_occlusion_render(VkdfOcclusion *occ,
+                      const glm::mat4 &view_proj,
+                      const glm::vec3 &cam_pos,
+                      const VkdfBox *frustum_box,
+                      const VkdfPlane *frustum_planes)
+{
+   occ->view_proj = view_proj;
+   occ->occluders_changed = false;
+
+   // Pick the occluders that take the largest part of the view
+   std::vector<struct _OccluderRef> refs;
+   GList *iter = occ->occluders;
+   while (iter) {
+      VkdfOccluder *occluder = (VkdfOccluder *) iter->data;
+      iter = g_list_next(iter);
+
+      if (occluder->num_tris == 0 || occluder->num_tris > occ->max_triangles)
+         continue;
+
+      if (frustum_planes &&
+          vkdf_box_is_in_frustum(&occluder->box, frustum_box,
+                                 frustum_planes) == OUTSIDE) {
+         continue;
+      }
+
+      const VkdfBox *box = &occluder->box;
+      glm::vec3 dir = box->center - cam_pos;
+      float radius2 = box->w * box->w + box->h * box->h + box->d * box->d;
+      float dist2 = MAX2(glm::dot(dir, dir), 1e-4f);
+
+      struct _OccluderRef ref;
+      ref.occluder = occluder;
+      ref.priority = radius2 / dist2;
+      ref.first_tri = 0;
+      refs.push_back(ref);
+   }
+
+   std::sort(refs.begin(), refs.end(), compare_occluder_priority);
+
+   uint32_t num_src_tris = 0;
+   uint32_t num_refs = 0;
+   for (uint32_t i = 0; i < refs.size(); i++) {
+      uint32_t count = refs[i].occluder->num_tris;
+      if (num_src_tris + count > occ->max_triangles)
+         continue;
+
+      refs[num_refs] = refs[i];
+      refs[num_refs].first_tri = 2 * num_src_tris;
+      num_refs++;
+      num_src_tris += count;
+   }
+
+   occ->stats.occluders = num_refs;
+   occ->stats.triangles = num_src_tris;
+
+   occ->num_tris = 2 * num_src_tris;
+   occ->empty = num_refs == 0;
+   if (occ->empty)
+      return;
+
+   struct OccluderSetupData setup_data;
+   setup_data.occ = occ;
+   setup_data.refs = &refs[0];
+   vkdf_thread_pool_parallel_for(occ->pool, 0, num_refs, 1,
+                                 setup_occluders, &setup_data);
+
+   vkdf_thread_pool_parallel_for(occ->pool, 0, occ->blocks_h, 1,
+                                 rasterize_block_rows, occ);
+}
+
+static bool
+pixels_are_visible(const VkdfOcclusion *occ,
+                   int32_t x0, int32_t x1, int32_t y0, int32_t y1,
+                   float z)
+{
+#if defined(__SSE2__)
+   const __m128 bz = _mm_set1_ps(z);
+#endif
+
+   for (int32_t y = y0; y <= y1; y++) {
+      const float *row = occ->depth + y * occ->width;
+      int32_t x = x0;
+#if defined(__SSE2__)
+      for (; x + 3 <= x1; x += 4) {
+         if (_mm_movemask_ps(_mm_cmpge_ps(bz, _mm_loadu_ps(row + x))))
+            return true;
+      }
+#endif
+      for (; x <= x1; x++) {
+         if (z >= row[x])
+            return true;
+      }
+   }
+
+   return false;
+}
+
+/**
+ * Returns false if the box is fully hidden behind the occluders rendered in
+ * the last call to vkdf_occlusion_render(). Boxes that cross the near plane
+ * or fall outside the screen are always visible.
+ */
+bool
+vkdf_occlusion_box_is_visible(const VkdfOcclusion *occ, const VkdfBox *box)
+{
+   if (occ->empty)
+      return true;
+
+   // Find the screen rectangle covered by the box and its nearest point
+   float min_x = G_MAXFLOAT, max_x = -G_MAXFLOAT;
+   float min_y = G_MAXFLOAT, max_y = -G_MAXFLOAT;
+   float max_z = 0.0f;
+   for (uint32_t i = 0; i < 8; i++) {
+      glm::vec4 c =
+         occ->view_proj * glm::vec4(vkdf_box_get_vertex(box, i), 1.0f);
+      if (c.w < VKDF_OCCLUSION_NEAR)
+         return true;
+
+      float iw = 1.0f / c.w;
+      float x = (c.x * iw * 0.5f + 0.5f) * occ->width;
+      float y = (c.y * iw * 0.5f + 0.5f) * occ->height;
+      min_x = MIN2(min_x, x);
+      max_x = MAX2(max_x, x);
+      min_y = MIN2(min_y, y);
+      max_y = MAX2(max_y, y);
+      max_z = MAX2(max_z, iw);
+   }
+
+   if (max_x < 0.0f || max_y < 0.0f ||
+       min_x >= occ->width || min_y >= occ->height) {
+      return true;
+   }
+
+   // The box is hidden if its nearest point is behind the occluders in
+   // every pixel it overlaps
+   const int32_t x0 = (int32_t) MAX2(floorf(min_x), 0.0f);
+   const int32_t x1 = (int32_t) MIN2(floorf(max_x), (float) (occ->width - 1));
+   const int32_t y0 = (int32_t) MAX2(floorf(min_y), 0.0f);
+   const int32_t y1 = (int32_t) MIN2(floorf(max_y), (float) (occ->height - 1));
+   max_z *= 1.0f + DEPTH_BIAS;
+
+   const int32_t bs = VKDF_OCCLUSION_BLOCK_SIZE;
+   for (int32_t by = y0 / bs; by <= y1 / bs; by++) {
+      for (int32_t bx = x0 / bs; bx <= x1 / bs; bx++) {
+         // Skip blocks where all the occluders are closer than the box
+         if (max_z < occ->block_depth[by * occ->blocks_w + bx])
+            continue;
+
+         if (pixels_are_visible(occ,
+                                MAX2(x0, bx * bs), MIN2(x1, bx * bs + bs - 1),
+                                MAX2(y0, by * bs), MIN2(y1, by * bs + bs - 1),
+                                max_z)) {
+            return true;
+         }
+      }
+   }
+
+   return false;
+}
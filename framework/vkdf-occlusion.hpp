@@ -0,0 +1,116 @@
+#ifndef __VKDF_OCCLUSION_H__
+#define __VKDF_OCCLUSION_H__
+
+#include "vkdf-deps.hpp"
+#include "vkdf-box.hpp"
+#include "vkdf-plane.hpp"
+#include "vkdf-model.hpp"
+#include "vkdf-thread-pool.hpp"
+
+/* Depth values are tested in blocks of this many pixels per side first */
+#define VKDF_OCCLUSION_BLOCK_SIZE 8
+
+/* Geometry closer to the camera than this (in view space) is clipped */
+#define VKDF_OCCLUSION_NEAR 0.01f
+
+typedef struct {
+   VkdfModel *model;
+   glm::mat4 transform;
+   VkdfBox box;                 // World-space box
+   uint32_t num_tris;           // Triangles in the model
+} VkdfOccluder;
+
+/* A triangle set up for rasterization. Edge functions and depth are planes
+ * over the screen (e = a * x + b * y + c), pixels are inside when all three
+ * edge functions are >= 0.
+ */
+typedef struct {
+   float a[3], b[3], c[3];
+   float za, zb, zc;
+   int32_t min_x, max_x;        // Pixel bounds, min_y > max_y if culled
+   int32_t min_y, max_y;
+} VkdfOcclusionTriangle;
+
+/* Low resolution depth buffer for CPU occlusion culling. Every frame the
+ * application's occluder models are rasterized into it and then bounding
+ * boxes can be tested against it to find out if they are hidden behind
+ * them.
+ *
+ * Only the occluders that look largest from the camera are rendered, up to
+ * 'max_triangles' triangles in total, so the cost of rendering stays
+ * bounded. Occluders should be simple models that are fully contained in
+ * the geometry they stand for (like the inner walls of a building).
+ *
+ * The buffer stores 1/w of the nearest occluder for each pixel, or 0 if there
+ * is none, so larger values are closer to the camera. Rendering runs in the
+ * thread pool, with each job handling a band of pixel rows. Box tests are
+ * read-only and can run in any thread once rendering is done.
+ */
+typedef struct {
+   VkdfThreadPool *pool;
+
+   uint32_t width;
+   uint32_t height;
+   uint32_t blocks_w;
+   uint32_t blocks_h;
+   float *depth;                // width x height, 1/w of the nearest occluder
+   float *block_depth;          // Farthest depth value in each block
+
+   uint32_t max_triangles;
+   GList *occluders;
+   bool occluders_changed;      // Added, removed or moved since last render
+
+   glm::mat4 view_proj;
+   bool empty;                  // Nothing was rendered in the last frame
+
+   VkdfOcclusionTriangle *tris; // Two per source triangle, for near clipping
+   uint32_t num_tris;
+
+   glm::vec4 *clip;             // Vertex scratch memory without thread pool
+   uint32_t clip_size;
+
+   struct {
+      uint32_t occluders;       // Occluders rendered in the last frame
+      uint32_t triangles;       // Source triangles rendered in the last frame
+   } stats;
+} VkdfOcclusion;
+
+VkdfOcclusion *
+vkdf_occlusion_new(VkdfThreadPool *pool,
+                   uint32_t width,
+                   uint32_t height,
+                   uint32_t max_triangles);
+
+void
+vkdf_occlusion_free(VkdfOcclusion *occ);
+
+VkdfOccluder *
+vkdf_occlusion_add_occluder(VkdfOcclusion *occ,
+                            VkdfModel *model,
+                            const glm::mat4 &transform);
+
+void
+vkdf_occlusion_remove_occluder(VkdfOcclusion *occ, VkdfOccluder *occluder);
+
+void
+vkdf_occlusion_set_occluder_transform(VkdfOcclusion *occ,
+                                      VkdfOccluder *occluder,
+                                      const glm::mat4 &transform);
+
+inline bool
+vkdf_occlusion_is_dirty(VkdfOcclusion *occ)
+{
+   return occ->occluders_changed;
+}
+
+void
+vkdf_occlusion_render(VkdfOcclusion *occ,
+                      const glm::mat4 &view_proj,
+                      const glm::vec3 &cam_pos,
+                      const VkdfBox *frustum_box,
+                      const VkdfPlane *frustum_planes);
+
+bool
+vkdf_occlusion_box_is_visible(const VkdfOcclusion *occ, const VkdfBox *box);
+
+#endif
@@ -36,6 +36,9 @@
 #define SSR_BLEND_VS_SHADER_PATH JOIN(VKDF_DATA_DIR, "spirv/ssr-blend.vert.spv")
 #define SSR_BLEND_FS_SHADER_PATH JOIN(VKDF_DATA_DIR, "spirv/ssr-blend.frag.spv")
 
+// No frustum plane rejected the tile in the last culling pass
+#define NO_PLANE 0xff
+
 /**
  * Input texture bindings for deferred SSAO base pass
  */
@@ -45,10 +48,8 @@ enum {
    SSAO_NOISE_TEX_BINDING    = 2,
 };
 
-static const uint32_t MAX_MATERIALS_PER_MODEL =   32;
-static const uint32_t MAX_DYNAMIC_OBJECTS     = 1024;
-static const uint32_t MAX_DYNAMIC_MODELS      =  128;
-static const uint32_t MAX_DYNAMIC_MATERIALS   =  MAX_DYNAMIC_MODELS * MAX_MATERIALS_PER_MODEL;
+// Minimum number of dynamic objects processed by each parallel job
+static const uint32_t DYNAMIC_OBJECT_GRAIN = 64;
 
 struct FreeCmdBufInfo {
    uint32_t num_commands;
@@ -59,6 +60,15 @@ struct FreeCmdBufInfo {
 static void inline
 new_inactive_cmd_buf(VkdfScene *s, uint32_t thread_id, VkCommandBuffer cmd_buf);
 
+static void
+range_allocator_free(VkdfSceneRangeAllocator *a);
+
+static void
+create_shadow_map_pipeline_for_mesh(VkdfScene *s, VkdfMesh *mesh);
+
+static void
+invalidate_top_level_tile_cmd_bufs(VkdfScene *s, VkdfSceneTile *t);
+
 static inline uint32_t
 tile_index_from_tile_coords(VkdfScene *s, float tx, float ty, float tz)
 {
@@ -87,41 +97,106 @@ subtile_index_from_position(VkdfScene *s, VkdfSceneTile *t, glm::vec3 pos)
    return (y << 2) + (z << 1) + x;
 }
 
-static void
-init_subtiles(VkdfScene *s, VkdfSceneTile *t)
+/* Position of a subtile in the subtiles array of its tile */
+static inline uint32_t
+subtile_slot(VkdfSceneTile *t, uint32_t subtile_idx)
 {
-   uint32_t level = t->level + 1;
-   if (level >= s->num_tile_levels)
-      return;
+   return __builtin_popcount(t->subtile_mask & ((1u << subtile_idx) - 1));
+}
 
-   t->subtiles = g_new0(VkdfSceneTile, 8);
+/* Returns the subtile with a Morton index, or NULL if it has no objects */
+static inline VkdfSceneTile *
+get_subtile(VkdfSceneTile *t, uint32_t subtile_idx)
+{
+   if (!(t->subtile_mask & (1u << subtile_idx)))
+      return NULL;
+   return &t->subtiles[subtile_slot(t, subtile_idx)];
+}
 
-   struct _dim subtile_size = s->tile_size[level];
+static inline void
+store_subtile_box(VkdfSceneTile *t, uint32_t slot)
+{
+   const VkdfBox *box = &t->subtiles[slot].box;
+   VkdfSceneSubtileBoxes *boxes = t->subtile_boxes;
+   boxes->cx[slot] = box->center.x;
+   boxes->cy[slot] = box->center.y;
+   boxes->cz[slot] = box->center.z;
+   boxes->ex[slot] = box->w;
+   boxes->ey[slot] = box->h;
+   boxes->ez[slot] = box->d;
+}
 
-   for (uint32_t sty = 0; sty < 2; sty++)
-   for (uint32_t stz = 0; stz < 2; stz++)
-   for (uint32_t stx = 0; stx < 2; stx++) {
-      uint32_t sti = (sty << 2) + (stz << 1) + stx;
-      VkdfSceneTile *st = &t->subtiles[sti];
-      st->parent = t->index;
-      st->index = sti;
-      st->level = level;
+/* Subtiles are only created when an object is added to them (see
+ * add_static_object()), so memory usage grows with the number of objects
+ * rather than with the size of the scene. The subtiles of a tile are stored
+ * in a flat array in Morton order (see subtile_index_from_position()), with
+ * their boxes in SoA form next to them. Adding a subtile moves its siblings,
+ * so if the scene is prepared we first invalidate the secondaries of the
+ * top-level tile, since they are tracked by tile pointer.
+ */
+static VkdfSceneTile *
+add_subtile(VkdfScene *s,
+            VkdfSceneTile *top_tile,
+            VkdfSceneTile *t,
+            uint32_t subtile_idx)
+{
+   uint32_t level = t->level + 1;
+   assert(level < s->num_tile_levels);
+   assert(!(t->subtile_mask & (1u << subtile_idx)));
 
-      st->offset = glm::vec3(t->offset.x + stx * subtile_size.w,
-                             t->offset.y + sty * subtile_size.h,
-                             t->offset.z + stz * subtile_size.d);
+   if (s->static_edit.prepared && t->num_subtiles > 0) {
+      invalidate_top_level_tile_cmd_bufs(s, top_tile);
+      // Shadow maps keep lists of visible tiles too
+      s->static_edit.shadow_casters_changed = true;
+   }
 
-      st->box.center = st->offset + glm::vec3(subtile_size.w / 2.0f,
-                                              subtile_size.h / 2.0f,
-                                              subtile_size.d / 2.0f);
-      st->box.w = 0.0f;
-      st->box.h = 0.0f;
-      st->box.d = 0.0f;
+   uint32_t slot = subtile_slot(t, subtile_idx);
+   uint32_t count = t->num_subtiles + 1;
 
-      st->sets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   VkdfSceneTile *subtiles = g_new0(VkdfSceneTile, count);
+   if (t->num_subtiles > 0) {
+      for (uint32_t i = 0; i < t->num_subtiles; i++)
+         subtiles[i < slot ? i : i + 1] = t->subtiles[i];
+      g_free(t->subtiles);
+   } else {
+      t->subtile_boxes = g_new0(VkdfSceneSubtileBoxes, 1);
+   }
+   t->subtiles = subtiles;
+   t->subtile_mask |= 1u << subtile_idx;
+   t->num_subtiles = count;
 
-      init_subtiles(s, st);
+   for (uint32_t i = 0; i < count; i++) {
+      if (i != slot)
+         g_ptr_array_index(s->tiles_by_id, subtiles[i].id) = &subtiles[i];
    }
+
+   struct _dim subtile_size = s->tile_size[level];
+   uint32_t stx = subtile_idx & 1;
+   uint32_t stz = (subtile_idx >> 1) & 1;
+   uint32_t sty = subtile_idx >> 2;
+
+   VkdfSceneTile *st = &subtiles[slot];
+   st->parent = t->index;
+   st->index = subtile_idx;
+   st->level = level;
+   st->id = s->tiles_by_id->len;
+   g_ptr_array_add(s->tiles_by_id, st);
+
+   st->offset = glm::vec3(t->offset.x + stx * subtile_size.w,
+                          t->offset.y + sty * subtile_size.h,
+                          t->offset.z + stz * subtile_size.d);
+
+   st->box.center = st->offset + glm::vec3(subtile_size.w / 2.0f,
+                                           subtile_size.h / 2.0f,
+                                           subtile_size.d / 2.0f);
+   st->box.w = 0.0f;
+   st->box.h = 0.0f;
+   st->box.d = 0.0f;
+
+   for (uint32_t i = 0; i < count; i++)
+      store_subtile_box(t, i);
+
+   return st;
 }
 
 static void
@@ -253,6 +328,57 @@ vkdf_scene_enable_deferred_rendering(VkdfScene *s,
    }
 }
 
+/**
+ * Enables CPU occlusion culling for the camera. Occluders are rendered to a
+ * width x height depth buffer (both multiples of VKDF_OCCLUSION_BLOCK_SIZE)
+ * whenever the camera or the occluders move, using at most 'max_triangles'
+ * triangles, and tiles and dynamic objects hidden behind them are not
+ * rendered. Shadow maps are not affected.
+ */
+void
+vkdf_scene_enable_occlusion_culling(VkdfScene *s,
+                                    uint32_t width,
+                                    uint32_t height,
+                                    uint32_t max_triangles)
+{
+   assert(!s->occlusion.buf);
+   s->occlusion.buf =
+      vkdf_occlusion_new(s->thread.pool, width, height, max_triangles);
+   s->occlusion.occluders = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+/**
+ * Uses the model of a scene object as an occluder for occlusion culling.
+ * Occluders should be cheap models of large objects, like walls. Dynamic
+ * objects are tracked as they move.
+ */
+void
+vkdf_scene_add_occluder(VkdfScene *s, VkdfObject *obj)
+{
+   assert(s->occlusion.buf);
+   assert(!g_hash_table_lookup(s->occlusion.occluders, obj));
+
+   VkdfOccluder *occluder =
+      vkdf_occlusion_add_occluder(s->occlusion.buf, obj->model,
+                                  vkdf_object_get_model_matrix(obj));
+   g_hash_table_insert(s->occlusion.occluders, obj, occluder);
+}
+
+void
+vkdf_scene_remove_occluder(VkdfScene *s, VkdfObject *obj)
+{
+   if (!s->occlusion.buf)
+      return;
+
+   VkdfOccluder *occluder =
+      (VkdfOccluder *) g_hash_table_lookup(s->occlusion.occluders, obj);
+   if (!occluder)
+      return;
+
+   vkdf_occlusion_remove_occluder(s->occlusion.buf, occluder);
+   g_hash_table_remove(s->occlusion.occluders, obj);
+}
+
 void
 vkdf_scene_enable_ssao(VkdfScene *s,
                        float downsampling,
@@ -350,6 +476,8 @@ vkdf_scene_new(VkdfContext *ctx,
    s->num_tiles.total = s->num_tiles.w * s->num_tiles.h * s->num_tiles.d;
    s->tiles = g_new0(VkdfSceneTile, s->num_tiles.total);
 
+   s->tiles_by_id = g_ptr_array_sized_new(s->num_tiles.total);
+
    for (uint32_t ty = 0; ty < s->num_tiles.h; ty++)
    for (uint32_t tz = 0; tz < s->num_tiles.d; tz++)
    for (uint32_t tx = 0; tx < s->num_tiles.w; tx++) {
@@ -371,52 +499,78 @@ vkdf_scene_new(VkdfContext *ctx,
       t->box.w = 0.0f;
       t->box.h = 0.0f;
       t->box.d = 0.0f;
+   }
 
-      t->sets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-
-      init_subtiles(s, t);
+   // Top-level tiles take the first ids, subtiles get the next ids as they
+   // are created
+   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
+      s->tiles[i].id = i;
+      g_ptr_array_add(s->tiles_by_id, &s->tiles[i]);
    }
 
    assert(num_threads <= s->num_tiles.total);
 
+   // Tiles are split in slices that run as jobs in the shared thread pool.
+   // We use more slices than threads so the pool can balance the load when
+   // the visible tiles are not evenly spread across slices. Each slice owns
+   // its command pool, command buffer lists and cache, and only one job
+   // works on a slice at a time, so secondaries recorded for a tile always
+   // come from the same pool.
+   uint32_t num_slices = 1;
+   if (num_threads > 1) {
+      s->thread.pool = vkdf_get_thread_pool(ctx);
+      num_slices = MIN2(num_threads * SCENE_SLICES_PER_THREAD,
+                        s->num_tiles.total);
+   }
+
    s->thread.num_threads = num_threads;
+   s->thread.num_slices = num_slices;
    s->thread.work_size =
-      (uint32_t) truncf((float) s->num_tiles.total / num_threads);
-   if (num_threads > 1)
-      s->thread.pool = vkdf_thread_pool_new(num_threads);
-
-   s->cache = (struct _cache *) malloc(sizeof(struct _cache) * num_threads);
-   for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
-      s->cache[thread_idx].max_size = cache_size;
-      s->cache[thread_idx].size = 0;
-      s->cache[thread_idx].cached = NULL;
-   }
-
-   s->cmd_buf.pool = g_new(VkCommandPool, num_threads);
-   s->cmd_buf.active = g_new(GList *, num_threads);
-   s->cmd_buf.free = g_new(GList *, num_threads);
-   for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
-      s->cmd_buf.pool[thread_idx] =
+      (uint32_t) truncf((float) s->num_tiles.total / num_slices);
+
+   // The cache size is per thread, spread it across the thread's slices
+   uint32_t slice_cache_size = 0;
+   if (cache_size > 0) {
+      slice_cache_size =
+         MAX2((cache_size * num_threads + num_slices - 1) / num_slices, 1);
+   }
+
+   s->cache = (struct _cache *) malloc(sizeof(struct _cache) * num_slices);
+   for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+      s->cache[slice_idx].max_size = slice_cache_size;
+      s->cache[slice_idx].size = 0;
+      s->cache[slice_idx].cached = NULL;
+   }
+
+   s->cmd_buf.pool = g_new(VkCommandPool, num_slices);
+   s->cmd_buf.active = g_new(GList *, num_slices);
+   s->cmd_buf.free = g_new(GList *, num_slices);
+   for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+      s->cmd_buf.pool[slice_idx] =
          vkdf_create_gfx_command_pool(s->ctx,
                                       VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
-      s->cmd_buf.active[thread_idx] = NULL;
-      s->cmd_buf.free[thread_idx] = NULL;
+      s->cmd_buf.active[slice_idx] = NULL;
+      s->cmd_buf.free[slice_idx] = NULL;
    }
    s->cmd_buf.cur_idx = SCENE_CMD_BUF_LIST_SIZE - 1;
 
-   s->thread.tile_data = g_new0(struct TileThreadData, num_threads);
-   for (uint32_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
-      s->thread.tile_data[thread_idx].id = thread_idx;
-      s->thread.tile_data[thread_idx].s = s;
-      s->thread.tile_data[thread_idx].first_idx =
-         thread_idx * s->thread.work_size;
-      s->thread.tile_data[thread_idx].last_idx =
-         (thread_idx < num_threads - 1) ?
-            s->thread.tile_data[thread_idx].first_idx +
+   s->thread.tile_data = g_new0(struct TileThreadData, num_slices);
+   for (uint32_t slice_idx = 0; slice_idx < num_slices; slice_idx++) {
+      s->thread.tile_data[slice_idx].id = slice_idx;
+      s->thread.tile_data[slice_idx].s = s;
+      s->thread.tile_data[slice_idx].first_idx =
+         slice_idx * s->thread.work_size;
+      s->thread.tile_data[slice_idx].last_idx =
+         (slice_idx < num_slices - 1) ?
+            s->thread.tile_data[slice_idx].first_idx +
                s->thread.work_size - 1 :
             s->num_tiles.total - 1;
+      s->thread.tile_data[slice_idx].min_word = UINT32_MAX;
+      s->thread.tile_data[slice_idx].max_word = 0;
    }
 
+   s->culling.skip_unchanged = true;
+
    s->sync.update_resources_sem = vkdf_create_semaphore(s->ctx);
    s->sync.depth_draw_sem = vkdf_create_semaphore(s->ctx);
    s->sync.depth_draw_static_sem = vkdf_create_semaphore(s->ctx);
@@ -429,11 +583,12 @@ vkdf_scene_new(VkdfContext *ctx,
 
    s->ubo.static_pool =
       vkdf_create_descriptor_pool(s->ctx, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 8);
+   s->ssbo.dynamic_pool =
+      vkdf_create_descriptor_pool(s->ctx,
+                                  VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 2);
 
-   s->dynamic.sets =
-      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
-   s->dynamic.visible =
-      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   s->set_ids = g_ptr_array_new();
+   s->set_handles = g_hash_table_new(g_str_hash, g_str_equal);
 
    s->sampler.pool =
       vkdf_create_descriptor_pool(s->ctx,
@@ -447,28 +602,31 @@ vkdf_scene_new(VkdfContext *ctx,
    return s;
 }
 
+/* Makes room for count sets, new set infos are empty */
 static void
-free_scene_set(VkdfSceneSetInfo *info, bool full_destroy)
+resize_scene_sets(VkdfSceneSets *sets, uint32_t count)
 {
-   if (full_destroy)
-      g_list_free_full(info->objs, (GDestroyNotify) vkdf_object_free);
-   else
-      g_list_free(info->objs);
-   g_free(info);
-}
+   if (sets->count >= count)
+      return;
 
-static void
-destroy_set_full(gpointer key, gpointer value, gpointer data)
-{
-   VkdfSceneSetInfo *info = (VkdfSceneSetInfo *) value;
-   free_scene_set(info, true);
+   sets->info = g_renew(VkdfSceneSetInfo, sets->info, count);
+   memset(&sets->info[sets->count], 0,
+          (count - sets->count) * sizeof(VkdfSceneSetInfo));
+   sets->count = count;
 }
 
 static void
-destroy_set(gpointer key, gpointer value, gpointer data)
+free_scene_sets(VkdfSceneSets *sets, bool full_destroy)
 {
-   VkdfSceneSetInfo *info = (VkdfSceneSetInfo *) value;
-   free_scene_set(info, false);
+   for (uint32_t i = 0; i < sets->count; i++) {
+      if (full_destroy)
+         g_list_free_full(sets->info[i].objs, (GDestroyNotify) vkdf_object_free);
+      else
+         g_list_free(sets->info[i].objs);
+   }
+   g_free(sets->info);
+   sets->info = NULL;
+   sets->count = 0;
 }
 
 static void
@@ -495,26 +653,57 @@ destroy_light(VkdfScene *s, VkdfSceneLight *slight)
 static void
 free_tile(VkdfSceneTile *t)
 {
-   g_hash_table_foreach(t->sets,
-                        t->subtiles ? destroy_set : destroy_set_full, NULL);
-   g_hash_table_destroy(t->sets);
-   t->sets = NULL;
+   free_scene_sets(&t->sets, t->subtiles == NULL);
 
    if (t->subtiles)
    {
-      for (uint32_t i = 0; i < 8; i++)
+      for (uint32_t i = 0; i < t->num_subtiles; i++)
          free_tile(&t->subtiles[i]);
       g_free(t->subtiles);
+      g_free(t->subtile_boxes);
       t->subtiles = NULL;
+      t->subtile_boxes = NULL;
+      t->subtile_mask = 0;
+      t->num_subtiles = 0;
    }
 }
 
+static void
+free_occupied_tiles(VkdfScene *s)
+{
+   g_free(s->occupied_tiles.index);
+   g_free(s->occupied_tiles.cx);
+   g_free(s->occupied_tiles.cy);
+   g_free(s->occupied_tiles.cz);
+   g_free(s->occupied_tiles.ex);
+   g_free(s->occupied_tiles.ey);
+   g_free(s->occupied_tiles.ez);
+   g_free(s->occupied_tiles.last_result);
+   g_free(s->occupied_tiles.last_plane);
+   g_free(s->occupied_tiles.expiry);
+   memset(&s->occupied_tiles, 0, sizeof(s->occupied_tiles));
+}
+
 static void
 free_dynamic_objects(VkdfScene *s)
 {
-   g_hash_table_foreach(s->dynamic.sets, destroy_set_full, NULL);
-   g_hash_table_destroy(s->dynamic.sets);
-   s->dynamic.sets = NULL;
+   free_scene_sets(&s->dynamic.sets, true);
+   free_scene_sets(&s->dynamic.visible, false);
+
+   if (s->dynamic.bvh.bvh)
+      vkdf_bvh_free(s->dynamic.bvh.bvh);
+   g_free(s->dynamic.bvh.objs);
+   g_free(s->dynamic.bvh.set_handles);
+   g_free(s->dynamic.bvh.query_items);
+   g_free(s->dynamic.bvh.query_visible);
+   g_free(s->dynamic.bvh.sorted_items);
+   g_free(s->dynamic.bvh.last_visible);
+   memset(&s->dynamic.bvh, 0, sizeof(s->dynamic.bvh));
+
+   g_free(s->dynamic.set_data.start);
+   g_free(s->dynamic.set_data.model_index);
+   g_free(s->dynamic.set_data.material_base);
+   memset(&s->dynamic.set_data, 0, sizeof(s->dynamic.set_data));
 }
 
 static void
@@ -721,6 +910,68 @@ destroy_fxaa_resources(VkdfScene *s)
    vkdf_destroy_image(s->ctx, &s->fxaa.output);
 }
 
+/**
+ * Creates a persistently mapped ring of storage buffer slots with
+ * 'num_ranges' ranges of 'capacity' instances each. Slots and ranges are
+ * aligned so their offsets can be used as dynamic offsets.
+ */
+static void
+create_buffer_ring(VkdfScene *s,
+                   VkdfSceneBufferRing *ring,
+                   VkDeviceSize inst_size,
+                   uint32_t capacity,
+                   uint32_t num_ranges)
+{
+   VkDeviceSize ssbo_offset_alignment =
+      s->ctx->phy_device_props.limits.minStorageBufferOffsetAlignment;
+
+   ring->inst_size = inst_size;
+   ring->capacity = capacity;
+   ring->size = inst_size * capacity;
+   ring->range_stride = ALIGN(ring->size, ssbo_offset_alignment);
+   ring->slot_stride = ring->range_stride * num_ranges;
+   ring->slot = 0;
+
+   ring->buf =
+      vkdf_create_buffer(s->ctx, 0,
+                         ring->slot_stride * SCENE_BUFFER_RING_SIZE,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+   vkdf_memory_map(s->ctx, ring->buf.mem, 0, VK_WHOLE_SIZE,
+                   (void **) &ring->ptr);
+}
+
+static void
+destroy_buffer_ring(VkdfScene *s, VkdfSceneBufferRing *ring)
+{
+   if (!ring->buf.buf)
+      return;
+
+   vkdf_memory_unmap(s->ctx, ring->buf.mem, ring->buf.mem_props,
+                     0, VK_WHOLE_SIZE);
+   vkdf_destroy_buffer(s->ctx, &ring->buf);
+   memset(ring, 0, sizeof(VkdfSceneBufferRing));
+}
+
+/**
+ * Moves the ring to its next slot and returns a pointer to it. The slot
+ * contents are undefined, so callers must rewrite all the data they need.
+ */
+static inline uint8_t *
+buffer_ring_next_slot(VkdfSceneBufferRing *ring)
+{
+   ring->slot = (ring->slot + 1) % SCENE_BUFFER_RING_SIZE;
+   return ring->ptr + ring->slot * ring->slot_stride;
+}
+
+static inline uint32_t
+buffer_ring_get_offset(VkdfSceneBufferRing *ring)
+{
+   return ring->slot * ring->slot_stride;
+}
+
 void
 vkdf_scene_free(VkdfScene *s)
 {
@@ -735,11 +986,6 @@ vkdf_scene_free(VkdfScene *s)
       s->sync.present_fence_active = false;
    }
 
-   if (s->thread.pool) {
-      vkdf_thread_pool_wait(s->thread.pool);
-      vkdf_thread_pool_free(s->thread.pool);
-   }
-
    vkdf_destroy_image(s->ctx, &s->rt.depth);
    vkdf_destroy_image(s->ctx, &s->rt.color);
    for (uint32_t i = 0; i < s->rt.gbuffer_size; i++)
@@ -767,11 +1013,17 @@ vkdf_scene_free(VkdfScene *s)
                            s->rp.dpp_dynamic_geom.framebuffer, NULL);
    }
 
-   for (uint32_t i = 0; i < s->thread.num_threads; i++)
-      g_list_free(s->thread.tile_data[i].visible);
+   for (uint32_t i = 0; i < s->thread.num_slices; i++) {
+      g_free(s->thread.tile_data[i].visible);
+      g_free(s->thread.tile_data[i].cur_visible);
+   }
    g_free(s->thread.tile_data);
 
-   g_list_free_full(s->set_ids, g_free);
+   g_hash_table_destroy(s->set_handles);
+   s->set_handles = NULL;
+   for (uint32_t i = 0; i < s->set_ids->len; i++)
+      g_free(g_ptr_array_index(s->set_ids, i));
+   g_ptr_array_free(s->set_ids, TRUE);
    s->set_ids = NULL;
 
    g_list_free(s->models);
@@ -780,11 +1032,19 @@ vkdf_scene_free(VkdfScene *s)
    for (uint32_t i = 0; i < s->num_tiles.total; i++)
       free_tile(&s->tiles[i]);
    g_free(s->tiles);
+   g_ptr_array_free(s->tiles_by_id, TRUE);
+   free_occupied_tiles(s);
+   g_list_free(s->static_edit.tiles);
+   g_free(s->static_edit.tile_ranges);
+   range_allocator_free(&s->ssbo.obj.alloc);
+   range_allocator_free(&s->ssbo.shadow_map.alloc);
 
    free_dynamic_objects(s);
-   g_free(s->dynamic.ubo.obj.host_buf);
-   g_free(s->dynamic.ubo.material.host_buf);
-   g_free(s->dynamic.ubo.shadow_map.host_buf);
+
+   if (s->occlusion.buf) {
+      vkdf_occlusion_free(s->occlusion.buf);
+      g_hash_table_destroy(s->occlusion.occluders);
+   }
 
    for (uint32_t i = 0; i < s->lights.size(); i++)
       destroy_light(s, s->lights[i]);
@@ -801,7 +1061,7 @@ vkdf_scene_free(VkdfScene *s)
    vkDestroySemaphore(s->ctx->device, s->sync.postprocess_sem, NULL);
    vkDestroyFence(s->ctx->device, s->sync.present_fence, NULL);
 
-   for (uint32_t i = 0; i < s->thread.num_threads; i++) {
+   for (uint32_t i = 0; i < s->thread.num_slices; i++) {
       g_list_free(s->cache[i].cached);
       g_list_free(s->cmd_buf.active[i]);
       g_list_free(s->cmd_buf.free[i]);
@@ -851,28 +1111,27 @@ vkdf_scene_free(VkdfScene *s)
    // FIXME: have a list of buffers in the scene so that here we can just go
    // through the list and destory all of them without having to add another
    // deleter every time we start using a new buffer.
-   if (s->ubo.obj.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->ubo.obj.buf);
+   if (s->ssbo.obj.buf.buf)
+      vkdf_destroy_buffer(s->ctx, &s->ssbo.obj.buf);
 
-   if (s->dynamic.ubo.obj.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->dynamic.ubo.obj.buf);
+   destroy_buffer_ring(s, &s->dynamic.ssbo.obj);
 
-   if (s->ubo.material.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->ubo.material.buf);
+   if (s->ssbo.material.buf.buf)
+      vkdf_destroy_buffer(s->ctx, &s->ssbo.material.buf);
+   g_free(s->ssbo.material.set_base);
 
-   if (s->dynamic.ubo.material.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->dynamic.ubo.material.buf);
+   destroy_buffer_ring(s, &s->dynamic.ssbo.material);
 
    if (s->ubo.light.buf.buf)
       vkdf_destroy_buffer(s->ctx, &s->ubo.light.buf);
 
-   if (s->ubo.shadow_map.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->ubo.shadow_map.buf);
+   if (s->ssbo.shadow_map.buf.buf)
+      vkdf_destroy_buffer(s->ctx, &s->ssbo.shadow_map.buf);
 
-   if (s->dynamic.ubo.shadow_map.buf.buf)
-      vkdf_destroy_buffer(s->ctx, &s->dynamic.ubo.shadow_map.buf);
+   destroy_buffer_ring(s, &s->dynamic.ssbo.shadow_map);
 
    vkDestroyDescriptorPool(s->ctx->device, s->ubo.static_pool, NULL);
+   vkDestroyDescriptorPool(s->ctx->device, s->ssbo.dynamic_pool, NULL);
    vkDestroyDescriptorPool(s->ctx->device, s->sampler.pool, NULL);
 
    g_free(s);
@@ -916,32 +1175,56 @@ update_tile_box_to_fit_box(VkdfSceneTile *t,
                              min_bounds.z + t->box.d);
 }
 
-static inline bool
-set_id_is_registered(VkdfScene *s, const char *id)
+/* Returns the handle for a set id, registering the set id if this is the
+ * first time we see it
+ */
+static uint32_t
+intern_set_id(VkdfScene *s, const char *set_id, VkdfModel *model)
 {
-   GList *iter = s->set_ids;
-   while (iter) {
-      if (!strcmp((const char *) iter->data, id))
-         return true;
-      iter = g_list_next(iter);
-   }
-   return false;
+   uint32_t handle = vkdf_scene_get_set_handle(s, set_id);
+   if (handle != VKDF_SCENE_INVALID_SET_HANDLE)
+      return handle;
+
+   handle = s->set_ids->len;
+   char *id = g_strdup(set_id);
+   g_ptr_array_add(s->set_ids, id);
+   g_hash_table_insert(s->set_handles, id, GUINT_TO_POINTER(handle + 1));
+   s->models = g_list_append(s->models, model);
+
+   return handle;
 }
 
-static void
-add_static_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
+/**
+ * Returns the index of the top-level tile that contains a position
+ */
+uint32_t
+vkdf_scene_get_tile_index(VkdfScene *s, glm::vec3 pos)
+{
+   glm::vec3 tile_coord = tile_coord_from_position(s, pos);
+
+   return tile_index_from_tile_coords(s,
+                                      (uint32_t) tile_coord.x,
+                                      (uint32_t) tile_coord.y,
+                                      (uint32_t) tile_coord.z);
+}
+
+static inline VkdfSceneTile *
+find_top_level_tile(VkdfScene *s, VkdfObject *obj)
+{
+   return &s->tiles[vkdf_scene_get_tile_index(s, obj->pos)];
+}
+
+/* Adds a static object to the leaf tile it belongs to. Returns the
+ * top-level tile that contains it.
+ */
+static VkdfSceneTile *
+add_static_object(VkdfScene *s, uint32_t set_handle, VkdfObject *obj)
 {
    bool is_shadow_caster = vkdf_object_casts_shadows(obj);
 
    // Find tile this object belongs to
-   glm::vec3 tile_coord = tile_coord_from_position(s, obj->pos);
-
-   uint32_t ti =
-      tile_index_from_tile_coords(s,
-                                  (uint32_t) tile_coord.x,
-                                  (uint32_t) tile_coord.y,
-                                  (uint32_t) tile_coord.z);
-   VkdfSceneTile *tile = &s->tiles[ti];
+   VkdfSceneTile *top_tile = find_top_level_tile(s, obj);
+   VkdfSceneTile *tile = top_tile;
 
    tile->obj_count++;
    if (is_shadow_caster)
@@ -955,10 +1238,12 @@ add_static_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
 
    update_tile_box_to_fit_box(tile, min_box, max_box);
 
-   // Add the objects to subtiles of its tile
-   while (tile->subtiles) {
+   // Add the objects to subtiles of its tile, creating them as needed
+   while (tile->level + 1 < s->num_tile_levels) {
       uint32_t subtile_idx = subtile_index_from_position(s, tile, obj->pos);
-      VkdfSceneTile *subtile = &tile->subtiles[subtile_idx];
+      VkdfSceneTile *subtile = get_subtile(tile, subtile_idx);
+      if (!subtile)
+         subtile = add_subtile(s, top_tile, tile, subtile_idx);
 
       subtile->obj_count++;
       if (is_shadow_caster)
@@ -966,6 +1251,7 @@ add_static_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
       subtile->dirty = true;
 
       update_tile_box_to_fit_box(subtile, min_box, max_box);
+      store_subtile_box(tile, subtile - tile->subtiles);
 
       tile = subtile;
    }
@@ -973,12 +1259,8 @@ add_static_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
    // Only actually put the object in the bottom-most tile of the hierarchy
    // When the user calls vkdf_scene_prepare() we will create the lists
    // for non-leaf tiles in the hierarchy.
-   VkdfSceneSetInfo *info =
-      (VkdfSceneSetInfo *) g_hash_table_lookup(tile->sets, set_id);
-   if (!info) {
-      info = g_new0(VkdfSceneSetInfo, 1);
-      g_hash_table_replace(tile->sets, g_strdup(set_id), info);
-   }
+   resize_scene_sets(&tile->sets, set_handle + 1);
+   VkdfSceneSetInfo *info = &tile->sets.info[set_handle];
    info->objs = g_list_prepend(info->objs, obj);
    info->count++;
    if (is_shadow_caster)
@@ -987,26 +1269,170 @@ add_static_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
    s->static_obj_count++;
    if (is_shadow_caster)
       s->static_shadow_caster_count++;
+
+   return top_tile;
 }
 
+/* Recomputes the box of a tile and its subtiles from the objects in its
+ * leaf tiles. Boxes only grow when objects are added, so we need this when
+ * objects are removed.
+ */
+static void
+refit_tile_box(VkdfSceneTile *t)
+{
+   if (t->obj_count == 0) {
+      t->box.w = 0.0f;
+      t->box.h = 0.0f;
+      t->box.d = 0.0f;
+      return;
+   }
+
+   glm::vec3 min_bounds = glm::vec3(G_MAXFLOAT);
+   glm::vec3 max_bounds = glm::vec3(-G_MAXFLOAT);
+
+   if (t->subtiles) {
+      for (uint32_t i = 0; i < t->num_subtiles; i++) {
+         VkdfSceneTile *st = &t->subtiles[i];
+         refit_tile_box(st);
+         store_subtile_box(t, i);
+         if (st->obj_count == 0)
+            continue;
+
+         glm::vec3 extent = glm::vec3(st->box.w, st->box.h, st->box.d);
+         min_bounds = glm::min(min_bounds, st->box.center - extent);
+         max_bounds = glm::max(max_bounds, st->box.center + extent);
+      }
+   } else {
+      for (uint32_t set = 0; set < t->sets.count; set++) {
+         GList *iter = t->sets.info[set].objs;
+         while (iter) {
+            VkdfBox *box = vkdf_object_get_box((VkdfObject *) iter->data);
+            glm::vec3 extent = glm::vec3(box->w, box->h, box->d);
+            min_bounds = glm::min(min_bounds, box->center - extent);
+            max_bounds = glm::max(max_bounds, box->center + extent);
+            iter = g_list_next(iter);
+         }
+      }
+   }
+
+   t->box.w = (max_bounds.x - min_bounds.x) / 2.0f;
+   t->box.h = (max_bounds.y - min_bounds.y) / 2.0f;
+   t->box.d = (max_bounds.z - min_bounds.z) / 2.0f;
+   t->box.center = glm::vec3(min_bounds.x + t->box.w,
+                             min_bounds.y + t->box.h,
+                             min_bounds.z + t->box.d);
+}
+
+/* Removes a static object from the leaf tile it belongs to. Returns the
+ * top-level tile that contained it, or NULL if the object is not in the
+ * scene with that set.
+ */
+static VkdfSceneTile *
+remove_static_object(VkdfScene *s, uint32_t set_handle, VkdfObject *obj)
+{
+   bool is_shadow_caster = vkdf_object_casts_shadows(obj);
+
+   VkdfSceneTile *top_tile = find_top_level_tile(s, obj);
+
+   // Find the leaf tile with the object first, so we don't touch any counts
+   // if it is not in the scene
+   VkdfSceneTile *leaf = top_tile;
+   while (leaf && leaf->subtiles) {
+      uint32_t subtile_idx = subtile_index_from_position(s, leaf, obj->pos);
+      leaf = get_subtile(leaf, subtile_idx);
+   }
+
+   if (!leaf)
+      return NULL;
+
+   VkdfSceneSetInfo *info = vkdf_scene_sets_get(&leaf->sets, set_handle);
+   if (!info)
+      return NULL;
+
+   GList *link = g_list_find(info->objs, obj);
+   if (!link)
+      return NULL;
+
+   info->objs = g_list_delete_link(info->objs, link);
+   info->count--;
+   if (is_shadow_caster)
+      info->shadow_caster_count--;
+
+   VkdfSceneTile *tile = top_tile;
+   while (true) {
+      assert(tile->obj_count > 0);
+      tile->obj_count--;
+      if (is_shadow_caster)
+         tile->shadow_caster_count--;
+      tile->dirty = true;
+
+      if (!tile->subtiles)
+         break;
+
+      uint32_t subtile_idx = subtile_index_from_position(s, tile, obj->pos);
+      tile = get_subtile(tile, subtile_idx);
+   }
+
+   refit_tile_box(top_tile);
+
+   s->static_obj_count--;
+   if (is_shadow_caster)
+      s->static_shadow_caster_count--;
+
+   return top_tile;
+}
+
+/* Queues a top-level tile for update in the next frame after static objects
+ * in it have been added or removed.
+ */
 static void
-add_dynamic_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
+queue_static_tile_update(VkdfScene *s, VkdfSceneTile *t, bool shadow_caster)
 {
-   // FIXME: for dynamic objects a hashtable might not be the best choice...
-   VkdfSceneSetInfo *info =
-      (VkdfSceneSetInfo *) g_hash_table_lookup(s->dynamic.sets, set_id);
-   if (!info) {
-      info = g_new0(VkdfSceneSetInfo, 1);
-      g_hash_table_replace(s->dynamic.sets, g_strdup(set_id), info);
+   if (!g_list_find(s->static_edit.tiles, t))
+      s->static_edit.tiles = g_list_prepend(s->static_edit.tiles, t);
+
+   if (shadow_caster)
+      s->static_edit.shadow_casters_changed = true;
+}
 
+static void
+add_dynamic_object(VkdfScene *s, uint32_t set_handle, VkdfObject *obj)
+{
+   resize_scene_sets(&s->dynamic.sets, set_handle + 1);
+   VkdfSceneSetInfo *info = &s->dynamic.sets.info[set_handle];
+   if (info->count == 0) {
       // If this is the first time we added this type of dynamic object
-      // we will need to update the dynamic materials UBO
+      // we will need to update the dynamic material buffer
       s->dynamic.materials_dirty = true;
+      s->dynamic.material_count += obj->model->materials.size();
    }
    info->objs = g_list_prepend(info->objs, obj);
    info->count++;
    if (vkdf_object_casts_shadows(obj))
       info->shadow_caster_count++;
+
+   // Dynamic objects are also BVH items, the BVH is built on the next update
+   if (s->dynamic.bvh.count == s->dynamic.bvh.size) {
+      uint32_t size = MAX2(2 * s->dynamic.bvh.size, 64);
+      s->dynamic.bvh.objs =
+         g_renew(VkdfObject *, s->dynamic.bvh.objs, size);
+      s->dynamic.bvh.set_handles =
+         g_renew(uint32_t, s->dynamic.bvh.set_handles, size);
+      s->dynamic.bvh.query_items =
+         g_renew(uint32_t, s->dynamic.bvh.query_items, size);
+      s->dynamic.bvh.query_visible =
+         g_renew(uint8_t, s->dynamic.bvh.query_visible, size);
+      s->dynamic.bvh.sorted_items =
+         g_renew(uint32_t, s->dynamic.bvh.sorted_items, size);
+      s->dynamic.bvh.last_visible =
+         g_renew(uint32_t, s->dynamic.bvh.last_visible, size);
+      s->dynamic.bvh.size = size;
+   }
+
+   uint32_t item = s->dynamic.bvh.count++;
+   s->dynamic.bvh.objs[item] = obj;
+   s->dynamic.bvh.set_handles[item] = set_handle;
+   s->dynamic.bvh.needs_build = true;
 }
 
 void
@@ -1014,18 +1440,117 @@ vkdf_scene_add_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
 {
    assert(obj->model);
 
-   if (!set_id_is_registered(s, set_id)) {
-      s->set_ids = g_list_prepend(s->set_ids, g_strdup(set_id));
-      s->models = g_list_prepend(s->models, obj->model);
-   }
+   uint32_t set_handle = intern_set_id(s, set_id, obj->model);
 
-   if (!vkdf_object_is_dynamic(obj))
-      add_static_object(s, set_id, obj);
-   else
-      add_dynamic_object(s, set_id, obj);
+   if (!vkdf_object_is_dynamic(obj)) {
+      VkdfSceneTile *t = add_static_object(s, set_handle, obj);
+      if (s->static_edit.prepared)
+         queue_static_tile_update(s, t, vkdf_object_casts_shadows(obj));
+   } else {
+      add_dynamic_object(s, set_handle, obj);
+   }
 
    s->obj_count++;
-   s->dirty = true;
+   if (!s->static_edit.prepared)
+      s->dirty = true;
+}
+
+/**
+ * Removes a static object from the scene. The object is not freed,
+ * ownership goes back to the caller.
+ *
+ * If the scene has been prepared already, the tile that contained the
+ * object is updated in the next frame.
+ *
+ * Dynamic objects cannot be removed: the scene keeps them in the dynamic
+ * BVH and in per-frame visibility state, so they are rejected with an
+ * error and stay in the scene.
+ */
+void
+vkdf_scene_remove_object(VkdfScene *s, const char *set_id, VkdfObject *obj)
+{
+   if (vkdf_object_is_dynamic(obj)) {
+      vkdf_error("scene: cannot remove object from set '%s', removing "
+                 "dynamic objects is not supported.", set_id);
+      return;
+   }
+
+   uint32_t set_handle = vkdf_scene_get_set_handle(s, set_id);
+   if (set_handle == VKDF_SCENE_INVALID_SET_HANDLE) {
+      vkdf_error("scene: cannot remove object, set '%s' does not exist.",
+                 set_id);
+      return;
+   }
+
+   VkdfSceneTile *t = remove_static_object(s, set_handle, obj);
+   if (!t) {
+      vkdf_error("scene: cannot remove object, it is not in set '%s'.",
+                 set_id);
+      return;
+   }
+
+   vkdf_scene_remove_occluder(s, obj);
+   if (s->static_edit.prepared)
+      queue_static_tile_update(s, t, vkdf_object_casts_shadows(obj));
+
+   s->obj_count--;
+   if (!s->static_edit.prepared)
+      s->dirty = true;
+}
+
+/**
+ * Replaces the model of an object set. Applications that free models and
+ * load them again while the scene is alive (like VkdfStream) must call this
+ * so the scene doesn't keep a pointer to a freed model: with NULL when the
+ * model is freed and with the new model when it is loaded again. The set
+ * must not have any objects while its model is NULL, and the new model
+ * must have the same materials as the original one, since they are in the
+ * material buffer already.
+ */
+void
+vkdf_scene_set_model(VkdfScene *s, const char *set_id, VkdfModel *model)
+{
+   uint32_t set_handle = vkdf_scene_get_set_handle(s, set_id);
+   if (set_handle == VKDF_SCENE_INVALID_SET_HANDLE) {
+      vkdf_error("scene: cannot set model, set '%s' does not exist.",
+                 set_id);
+      return;
+   }
+
+   GList *link = g_list_nth(s->models, set_handle);
+   link->data = model;
+
+   // Shadow map pipelines only depend on the vertex layout of the meshes,
+   // but a different model may need new ones
+   if (model && s->shadows.pipeline.pipelines) {
+      for (uint32_t i = 0; i < model->meshes.size(); i++)
+         create_shadow_map_pipeline_for_mesh(s, model->meshes[i]);
+   }
+}
+
+/**
+ * Static object buffers are created when the scene is prepared, with some
+ * room for objects added later, and replaced with larger ones when they
+ * fill up. Applications that know they will add many static objects can
+ * use this to make room for 'count' static objects at once. If the scene
+ * is prepared already the buffers grow in the next frame. Reserving less
+ * room than a previous call has no effect.
+ */
+void
+vkdf_scene_reserve_static_objects(VkdfScene *s, uint32_t count)
+{
+   s->static_edit.reserved_objs = MAX2(s->static_edit.reserved_objs, count);
+}
+
+/**
+ * Like vkdf_scene_reserve_static_objects(), for the materials of the
+ * models of new object sets.
+ */
+void
+vkdf_scene_reserve_static_materials(VkdfScene *s, uint32_t count)
+{
+   s->static_edit.reserved_materials =
+      MAX2(s->static_edit.reserved_materials, count);
 }
 
 static inline VkdfImage
@@ -1278,7 +1803,7 @@ static inline GList *
 sort_active_tiles_by_distance(VkdfScene *s)
 {
    GList *list = NULL;
-   for (uint32_t i = 0; i < s->thread.num_threads; i++) {
+   for (uint32_t i = 0; i < s->thread.num_slices; i++) {
       GList *iter = s->cmd_buf.active[i];
       while (iter) {
          list = g_list_prepend(list, iter->data);
@@ -1424,7 +1949,7 @@ check_fences(VkdfScene *s)
 static void
 free_inactive_command_buffers(VkdfScene *s)
 {
-   for (uint32_t i = 0; i < s->thread.num_threads; i++) {
+   for (uint32_t i = 0; i < s->thread.num_slices; i++) {
       GList *iter = s->cmd_buf.free[i];
       while (iter) {
          struct FreeCmdBufInfo *info = (struct FreeCmdBufInfo *) iter->data;
@@ -1453,7 +1978,7 @@ add_to_cache(struct TileThreadData *data, VkdfSceneTile *t)
 {
    VkdfScene *s = data->s;
    uint32_t job_id = data->id;
-   assert(job_id < s->thread.num_threads);
+   assert(job_id < s->thread.num_slices);
 
    s->cache[job_id].cached = g_list_prepend(s->cache[job_id].cached, t);
    s->cache[job_id].size++;
@@ -1464,7 +1989,7 @@ remove_from_cache(struct TileThreadData *data, VkdfSceneTile *t)
 {
    VkdfScene *s = data->s;
    uint32_t job_id = data->id;
-   assert(job_id < s->thread.num_threads);
+   assert(job_id < s->thread.num_slices);
 
    assert(s->cache[job_id].size > 0);
    s->cache[job_id].cached = g_list_remove(s->cache[job_id].cached, t);
@@ -1498,7 +2023,7 @@ new_active_tile(struct TileThreadData *data, VkdfSceneTile *t)
 {
    VkdfScene *s = data->s;
    uint32_t job_id = data->id;
-   assert(job_id < s->thread.num_threads);
+   assert(job_id < s->thread.num_slices);
 
    assert(t->obj_count > 0);
 
@@ -1548,7 +2073,7 @@ new_active_tile(struct TileThreadData *data, VkdfSceneTile *t)
 
    record_viewport_and_scissor_commands(cmd_buf[0], s->rt.width, s->rt.height);
 
-   s->callbacks.record_commands(s->ctx, cmd_buf[0], t->sets, false, false,
+   s->callbacks.record_commands(s->ctx, cmd_buf[0], &t->sets, false, false,
                                 s->callbacks.data);
 
    vkdf_command_buffer_end(cmd_buf[0]);
@@ -1566,7 +2091,7 @@ new_active_tile(struct TileThreadData *data, VkdfSceneTile *t)
                                            s->rt.width, s->rt.height);
 
       s->callbacks.record_commands(s->ctx, cmd_buf[1],
-                                   t->sets, false, true, s->callbacks.data);
+                                   &t->sets, false, true, s->callbacks.data);
 
       vkdf_command_buffer_end(cmd_buf[1]);
 
@@ -1583,7 +2108,7 @@ new_inactive_tile(struct TileThreadData *data, VkdfSceneTile *t)
 {
    VkdfScene *s = data->s;
    uint32_t job_id = data->id;
-   assert(job_id < s->thread.num_threads);
+   assert(job_id < s->thread.num_slices);
 
    s->cmd_buf.active[job_id] =
       g_list_remove(s->cmd_buf.active[job_id], t);
@@ -1669,7 +2194,7 @@ record_client_resource_updates(VkdfScene *s)
 }
 
 static void
-build_object_lists(VkdfScene *s, VkdfSceneTile *t, const char *set_id)
+build_object_lists(VkdfScene *s, VkdfSceneTile *t, uint32_t set_handle)
 {
    // Leaf tiles is where we put objects when we add objects to the scene,
    // so their lists are already in place
@@ -1682,15 +2207,13 @@ build_object_lists(VkdfScene *s, VkdfSceneTile *t, const char *set_id)
 
    // Call this recursively for each subtile, for each object key
    // available to build per-key lists for each (sub)tile
-   VkdfSceneSetInfo *tile_set_info =
-     (VkdfSceneSetInfo *) g_hash_table_lookup(t->sets, set_id);
+   VkdfSceneSetInfo *tile_set_info = &t->sets.info[set_handle];
 
-   for (int32_t i = 0; i < 8; i++) {
+   for (uint32_t i = 0; i < t->num_subtiles; i++) {
       VkdfSceneTile *st = &t->subtiles[i];
       if (st->obj_count > 0) {
-         build_object_lists(s, st, set_id);
-         VkdfSceneSetInfo *subtile_set_info =
-            (VkdfSceneSetInfo *) g_hash_table_lookup(st->sets, set_id);
+         build_object_lists(s, st, set_handle);
+         VkdfSceneSetInfo *subtile_set_info = &st->sets.info[set_handle];
          GList *st_objs = subtile_set_info->objs;
          while (st_objs) {
             VkdfObject *obj = (VkdfObject *) st_objs->data;
@@ -1709,14 +2232,20 @@ build_object_lists(VkdfScene *s, VkdfSceneTile *t, const char *set_id)
 static void
 compute_tile_start_indices(VkdfScene *s,
                            VkdfSceneTile *t,
-                           const char *set_id,
+                           uint32_t set_handle,
                            uint32_t start_index,
                            uint32_t shadow_caster_start_index,
                            uint32_t *next_start_index,
                            uint32_t *next_shadow_caster_start_index)
 {
-   VkdfSceneSetInfo *tile_set_info =
-      (VkdfSceneSetInfo *) g_hash_table_lookup(t->sets, set_id);
+   // Empty tiles don't have set infos
+   if (t->obj_count == 0) {
+      *next_start_index = start_index;
+      *next_shadow_caster_start_index = shadow_caster_start_index;
+      return;
+   }
+
+   VkdfSceneSetInfo *tile_set_info = &t->sets.info[set_handle];
    tile_set_info->start_index = start_index;
    tile_set_info->shadow_caster_start_index = shadow_caster_start_index;
 
@@ -1728,16 +2257,18 @@ compute_tile_start_indices(VkdfScene *s,
       return;
    }
 
-   for (uint32_t i = 0; i < 8; i++) {
+   for (uint32_t i = 0; i < t->num_subtiles; i++) {
       VkdfSceneTile *st = &t->subtiles[i];
-      VkdfSceneSetInfo *subtile_set_info =
-         (VkdfSceneSetInfo *) g_hash_table_lookup(st->sets, set_id);
+      if (st->obj_count == 0)
+         continue;
+
+      VkdfSceneSetInfo *subtile_set_info = &st->sets.info[set_handle];
 
       subtile_set_info->start_index = start_index;
       subtile_set_info->shadow_caster_start_index = shadow_caster_start_index;
 
       uint32_t unused;
-      compute_tile_start_indices(s, st, set_id,
+      compute_tile_start_indices(s, st, set_handle,
                                  subtile_set_info->start_index,
                                  subtile_set_info->shadow_caster_start_index,
                                  &unused, &unused);
@@ -1751,455 +2282,1124 @@ compute_tile_start_indices(VkdfScene *s,
 }
 
 static void
-ensure_set_infos(VkdfSceneTile *t, GList *set_ids)
+ensure_set_infos(VkdfSceneTile *t, uint32_t num_sets)
 {
-   GList *iter = set_ids;
-   while (iter) {
-      const char *id = (const char *) iter->data;
-      VkdfSceneSetInfo *info =
-         (VkdfSceneSetInfo *) g_hash_table_lookup(t->sets, id);
-      if (!info) {
-         info = g_new0(VkdfSceneSetInfo, 1);
-         g_hash_table_replace(t->sets, g_strdup(id), info);
-      }
+   if (t->obj_count == 0)
+      return;
 
-      if (t->subtiles) {
-         for (uint32_t i = 0; i < 8; i++)
-            ensure_set_infos(&t->subtiles[i], set_ids);
-      }
+   resize_scene_sets(&t->sets, num_sets);
 
-      iter = g_list_next(iter);
-   }
+   for (uint32_t i = 0; i < t->num_subtiles; i++)
+      ensure_set_infos(&t->subtiles[i], num_sets);
 }
 
-static inline uint32_t
-tile_is_visible(VkdfSceneTile *t,
-                const VkdfBox *visible_box,
-                const VkdfPlane *fp)
+/* Visible tiles found by collect_visible_tiles(). If bits is not NULL,
+ * visible tiles are flagged in a bitset indexed by tile id, and
+ * [min_word, max_word] tracks the words that have bits set. Otherwise
+ * they are added to list. If occlusion is not NULL, tiles hidden behind
+ * its occluders are left out.
+ */
+struct _VisibleTiles {
+   GList *list;
+   uint64_t *bits;
+   uint32_t min_word;
+   uint32_t max_word;
+   const VkdfOcclusion *occlusion;
+};
+
+static inline bool
+tile_is_occluded(struct _VisibleTiles *visible, VkdfSceneTile *t)
 {
-   if (t->obj_count == 0)
-      return OUTSIDE;
-   return vkdf_box_is_in_frustum(&t->box, visible_box, fp);
+   return visible->occlusion &&
+          !vkdf_occlusion_box_is_visible(visible->occlusion, &t->box);
 }
 
-static inline uint32_t
-subtile_is_visible(VkdfSceneTile *t, const VkdfPlane *fp)
+static inline void
+add_visible_tile(struct _VisibleTiles *visible, VkdfSceneTile *t)
 {
-   if (t->obj_count == 0)
-      return OUTSIDE;
-
-   // We only check subtiles if the parent tile is inside the camera's box,
-   // so no need to check if a subtile is inside it
-   return vkdf_box_is_in_frustum(&t->box, NULL, fp);
+   if (visible->bits) {
+      uint32_t w = t->id / 64;
+      visible->bits[w] |= ((uint64_t) 1) << (t->id % 64);
+      visible->min_word = MIN2(visible->min_word, w);
+      visible->max_word = MAX2(visible->max_word, w);
+   } else {
+      visible->list = g_list_prepend(visible->list, t);
+   }
 }
 
-static GList *
+/* Finds the visible subtiles of a tile that intersects the frustum.
+ * plane_mask has the frustum planes the tile intersects: subtiles are
+ * contained in the tile, so they are on the inner side of all the other
+ * planes and only need to be tested against these.
+ */
+static void
 find_visible_subtiles(VkdfSceneTile *t,
                       const VkdfPlane *fplanes,
-                      GList *visible)
+                      uint32_t plane_mask,
+                      struct _VisibleTiles *visible)
 {
-   // If the tile can't be subdivided, then take the entire tile as visible
-   if (!t->subtiles)
-      return g_list_prepend(visible, t);
+   // If the tile can't be subdivided, or it is not crossed by any of the
+   // frustum planes, then take the entire tile as visible
+   if (!t->subtiles || plane_mask == 0) {
+      add_visible_tile(visible, t);
+      return;
+   }
 
-   // Otherwise, check visibility for each subtile
+   // Otherwise, check visibility for each subtile. We only check subtiles if
+   // the parent tile is inside the camera's box, so no need to check if a
+   // subtile is inside it.
+   const uint32_t count = t->num_subtiles;
+   const VkdfSceneSubtileBoxes *boxes = t->subtile_boxes;
    uint32_t subtile_visibility[8];
-   bool all_subtiles_visible = true;
+   uint32_t subtile_plane_mask[8];
+   vkdf_box_is_in_frustum_soa_masked(count,
+                                     boxes->cx, boxes->cy, boxes->cz,
+                                     boxes->ex, boxes->ey, boxes->ez,
+                                     NULL, fplanes, plane_mask,
+                                     subtile_visibility, subtile_plane_mask);
 
-   for (uint32_t j = 0; j < 8; j++) {
+   bool all_subtiles_visible = true;
+   for (uint32_t j = 0; j < count; j++) {
       VkdfSceneTile *st = &t->subtiles[j];
-      subtile_visibility[j] = subtile_is_visible(st, fplanes);
+      if (st->obj_count == 0) {
+         subtile_visibility[j] = OUTSIDE;
+         continue;
+      }
 
       // Only take individualsubtiles if there are invisible subtiles that have
       // objects in them
-      if (subtile_visibility[j] == OUTSIDE && st->obj_count > 0)
+      if (subtile_visibility[j] == OUTSIDE)
          all_subtiles_visible = false;
    }
 
    // If all subtiles are visible, then the parent tile is fully visible,
    // just add the parent tile
-   if (all_subtiles_visible)
-      return g_list_prepend(visible, t);
+   if (all_subtiles_visible) {
+      add_visible_tile(visible, t);
+      return;
+   }
 
    // Otherwise, add only the visible subtiles
-   for (uint32_t j = 0; j < 8; j++) {
-      if (subtile_visibility[j] == INSIDE) {
-         visible = g_list_prepend(visible, &t->subtiles[j]);
-      } else if (subtile_visibility[j] == INTERSECT) {
-         visible = find_visible_subtiles(&t->subtiles[j], fplanes, visible);
+   for (uint32_t j = 0; j < count; j++) {
+      if (subtile_visibility[j] == OUTSIDE ||
+          tile_is_occluded(visible, &t->subtiles[j])) {
+         continue;
       }
+
+      if (subtile_visibility[j] == INSIDE)
+         add_visible_tile(visible, &t->subtiles[j]);
+      else if (subtile_visibility[j] == INTERSECT)
+         find_visible_subtiles(&t->subtiles[j], fplanes,
+                               subtile_plane_mask[j], visible);
+   }
+}
+
+/* Index of the first occupied tile with index >= tile_idx */
+static uint32_t
+find_occupied_tile(VkdfScene *s, uint32_t tile_idx)
+{
+   uint32_t begin = 0;
+   uint32_t end = s->occupied_tiles.count;
+   while (begin < end) {
+      uint32_t mid = (begin + end) / 2;
+      if (s->occupied_tiles.index[mid] < tile_idx)
+         begin = mid + 1;
+      else
+         end = mid;
    }
+   return begin;
+}
 
-   return visible;
+static inline void
+occupied_tile_plane_distance(VkdfScene *s, uint32_t i, const VkdfPlane *p,
+                             float *dist, float *r)
+{
+   *dist = p->a * s->occupied_tiles.cx[i] +
+           p->b * s->occupied_tiles.cy[i] +
+           p->c * s->occupied_tiles.cz[i] + p->d;
+   *r = fabsf(p->a) * s->occupied_tiles.ex[i] +
+        fabsf(p->b) * s->occupied_tiles.ey[i] +
+        fabsf(p->c) * s->occupied_tiles.ez[i];
 }
 
-static GList *
-find_visible_tiles(VkdfScene *s,
-                   uint32_t first_tile_idx,
-                   uint32_t last_tile_idx,
-                   const VkdfBox *visible_box,
-                   const VkdfPlane *fplanes)
+/* Tries to classify occupied tile i against the camera frustum using the
+ * results from previous frames. Returns false if the tile needs a full
+ * frustum test.
+ */
+static inline bool
+classify_tile_from_cache(VkdfScene *s, uint32_t i,
+                         const VkdfPlane *fplanes,
+                         uint32_t *result)
 {
-   GList *visible = NULL;
-   for (uint32_t i = first_tile_idx; i <= last_tile_idx; i++) {
-      VkdfSceneTile *t = &s->tiles[i];
-      uint32_t visibility = tile_is_visible(t, visible_box, fplanes);
-      if (visibility == INSIDE) {
-         visible = g_list_prepend(visible, t);
-      } else if (visibility == INTERSECT) {
-         visible = find_visible_subtiles(t, fplanes, visible);
-      }
+   // The last result can't have changed if the frustum planes haven't moved
+   // more than the distance from the tile to the closest plane
+   if (s->occupied_tiles.expiry[i] > s->culling.drift) {
+      *result = s->occupied_tiles.last_result[i];
+      return true;
    }
-   return visible;
+
+   // Otherwise, the plane that rejected the tile last time is likely to
+   // reject it again
+   uint32_t pl = s->occupied_tiles.last_plane[i];
+   if (pl == NO_PLANE)
+      return false;
+
+   float dist, r;
+   occupied_tile_plane_distance(s, i, &fplanes[pl], &dist, &r);
+   if (dist + r >= 0.0f)
+      return false;
+
+   s->occupied_tiles.last_result[i] = OUTSIDE;
+   if (s->culling.skip_unchanged)
+      s->occupied_tiles.expiry[i] = s->culling.drift - (dist + r);
+
+   *result = OUTSIDE;
+   return true;
 }
 
+/* Caches the result of a full frustum test for occupied tile i */
 static void
-create_static_object_ubo(VkdfScene *s)
+cache_tile_result(VkdfScene *s, uint32_t i,
+                  const VkdfPlane *fplanes,
+                  uint32_t result)
 {
-   // Per-instance data: model matrix, base material index, model index,
-   // receives shadows
-   uint32_t num_objects = vkdf_scene_get_static_object_count(s);
-   if (num_objects == 0)
-      return;
-
-   s->ubo.obj.inst_size = ALIGN(sizeof(glm::mat4) + 3 * sizeof(uint32_t), 16);
-   s->ubo.obj.size = s->ubo.obj.inst_size * num_objects;
-   s->ubo.obj.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->ubo.obj.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+   s->occupied_tiles.last_result[i] = result;
+   s->occupied_tiles.last_plane[i] = NO_PLANE;
+   s->occupied_tiles.expiry[i] = -1.0;
 
-   uint8_t *mem;
-   vkdf_memory_map(s->ctx, s->ubo.obj.buf.mem,
-                   0, VK_WHOLE_SIZE, (void **) &mem);
+   // Tiles that intersect the frustum are always tested
+   if (result == INTERSECT)
+      return;
 
-   // NOTE: this assumes that each set-id model has a different set of
-   // materials. In theory, we could have different set-ids share models
-   // though and in that case we would be replicating model data here,
-   // but this makes things easier.
-   uint32_t model_index = 0;
-   GList *set_id_iter = s->set_ids;
-   while (set_id_iter) {
-      for (uint32_t i = 0; i < s->num_tiles.total; i++) {
-         VkdfSceneTile *t = &s->tiles[i];
-         if (t->obj_count == 0)
-             continue;
-
-         const char *set_id = (const char *) set_id_iter->data;
-         VkdfSceneSetInfo *info =
-            (VkdfSceneSetInfo *) g_hash_table_lookup(t->sets, set_id);
-         if (info && info->count > 0) {
-            VkDeviceSize offset = info->start_index * s->ubo.obj.inst_size;
-            GList *iter = info->objs;
-            while (iter) {
-               VkdfObject *obj = (VkdfObject *) iter->data;
-
-               // Model matrix
-               glm::mat4 model = vkdf_object_get_model_matrix(obj);
-               float *model_data = glm::value_ptr(model);
-               memcpy(mem + offset, model_data, sizeof(glm::mat4));
-               offset += sizeof(glm::mat4);
-
-               // Base material index
-               memcpy(mem + offset, &obj->material_idx_base, sizeof(uint32_t));
-               offset += sizeof(uint32_t);
-
-               // Model index
-               memcpy(mem + offset, &model_index, sizeof(uint32_t));
-               offset += sizeof(uint32_t);
-
-               // Receives shadows
-               uint32_t receives_shadows = (uint32_t) obj->receives_shadows;
-               memcpy(mem + offset, &receives_shadows, sizeof(uint32_t));
-               offset += sizeof(uint32_t);
-
-               offset = ALIGN(offset, 16);
-
-               iter = g_list_next(iter);
-            }
+   // For tiles outside the frustum, find the plane that rejects them. For
+   // tiles inside, find how far they are from the closest plane.
+   bool has_slack = false;
+   float slack = 0.0f;
+   for (uint32_t pl = 0; pl < 6; pl++) {
+      float dist, r;
+      occupied_tile_plane_distance(s, i, &fplanes[pl], &dist, &r);
+      if (result == OUTSIDE) {
+         if (dist + r < 0.0f) {
+            s->occupied_tiles.last_plane[i] = pl;
+            slack = -(dist + r);
+            has_slack = true;
+            break;
          }
+      } else if (!has_slack || dist - r < slack) {
+         slack = dist - r;
+         has_slack = true;
       }
-      set_id_iter = g_list_next(set_id_iter);
-      model_index++;
    }
 
-   vkdf_memory_unmap(s->ctx, s->ubo.obj.buf.mem, s->ubo.obj.buf.mem_props,
-                     0, VK_WHOLE_SIZE);
+   // Tiles rejected only by the frustum box are not cached
+   if (s->culling.skip_unchanged && has_slack)
+      s->occupied_tiles.expiry[i] = s->culling.drift + slack;
 }
 
-static void
-create_dynamic_object_ubo(VkdfScene *s)
+static inline void
+add_classified_tile(struct _VisibleTiles *visible,
+                    VkdfSceneTile *t,
+                    const VkdfPlane *fplanes,
+                    uint32_t result,
+                    uint32_t plane_mask)
 {
-   // Per-instance data: model matrix, base material index,
-   // model index, receives shadows
-   s->dynamic.ubo.obj.inst_size =
-      ALIGN(sizeof(glm::mat4) + 3 * sizeof(uint32_t), 16);
+   if (result == OUTSIDE || tile_is_occluded(visible, t))
+      return;
 
-   s->dynamic.ubo.obj.host_buf =
-      g_new(uint8_t, MAX_DYNAMIC_OBJECTS * s->dynamic.ubo.obj.inst_size);
+   if (result == INSIDE)
+      add_visible_tile(visible, t);
+   else
+      find_visible_subtiles(t, fplanes, plane_mask, visible);
+}
 
-   s->dynamic.ubo.obj.size = s->dynamic.ubo.obj.inst_size * MAX_DYNAMIC_OBJECTS;
+/* Updates the bound on how much the camera frustum planes have moved since
+ * we started caching culling results. For any point p in the scene, the
+ * distance to a plane can't change by more than the change in the plane
+ * coefficients weighted by the largest coordinates in the scene.
+ */
+static void
+update_culling_drift(VkdfScene *s, const VkdfPlane *fplanes)
+{
+   if (s->culling.has_planes) {
+      const float *m = s->occupied_tiles.max_abs;
+      float max_delta = 0.0f;
+      for (uint32_t pl = 0; pl < 6; pl++) {
+         const VkdfPlane *p0 = &s->culling.planes[pl];
+         const VkdfPlane *p1 = &fplanes[pl];
+         float delta = fabsf(p1->a - p0->a) * m[0] +
+                       fabsf(p1->b - p0->b) * m[1] +
+                       fabsf(p1->c - p0->c) * m[2] +
+                       fabsf(p1->d - p0->d);
+         max_delta = MAX2(max_delta, delta);
+      }
+      s->culling.drift += max_delta;
+   }
 
-   s->dynamic.ubo.obj.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->dynamic.ubo.obj.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+   memcpy(s->culling.planes, fplanes, sizeof(s->culling.planes));
+   s->culling.has_planes = true;
 }
 
-struct _shadow_map_ubo_data {
-   glm::mat4 light_viewproj;
-   uint32_t shadow_map_size;
-   uint32_t pcf_kernel_size;
-   uint32_t padding[2]; // Keep this struct 16-byte aligned
+/* Occupied tiles waiting for a full frustum test */
+struct _TileBatch {
+   VkdfBoxBatch boxes;
+   uint32_t idx[VKDF_BOX_BATCH_SIZE];  // Indices into occupied_tiles
 };
 
 static void
-create_light_ubo(VkdfScene *s)
+flush_tile_batch(VkdfScene *s,
+                 struct _TileBatch *batch,
+                 const VkdfBox *visible_box,
+                 const VkdfPlane *fplanes,
+                 bool coherent,
+                 struct _VisibleTiles *visible)
 {
-   uint32_t num_lights = s->lights.size();
-   if (num_lights == 0)
-      return;
+   uint32_t visibility[VKDF_BOX_BATCH_SIZE];
+   uint32_t plane_mask[VKDF_BOX_BATCH_SIZE];
+   vkdf_box_batch_is_in_frustum_masked(&batch->boxes, visible_box, fplanes,
+                                       VKDF_FRUSTUM_PLANE_MASK_ALL,
+                                       visibility, plane_mask);
+
+   for (uint32_t j = 0; j < batch->boxes.count; j++) {
+      uint32_t i = batch->idx[j];
+      VkdfSceneTile *t = &s->tiles[s->occupied_tiles.index[i]];
+      if (coherent)
+         cache_tile_result(s, i, fplanes, visibility[j]);
+      add_classified_tile(visible, t, fplanes, visibility[j], plane_mask[j]);
+   }
 
-   const uint32_t light_data_size = ALIGN(sizeof(VkdfLight), 16);
+   vkdf_box_batch_reset(&batch->boxes);
+}
 
-   const uint32_t shadow_map_data_size =
-      ALIGN(sizeof(struct _shadow_map_ubo_data) , 16);
+/* Classifies the occupied tiles in [first, last). Tiles that can't be
+ * classified from cached results are batched for a full frustum test.
+ */
+static void
+classify_occupied_tiles(VkdfScene *s,
+                        uint32_t first,
+                        uint32_t last,
+                        const VkdfBox *visible_box,
+                        const VkdfPlane *fplanes,
+                        bool coherent,
+                        struct _TileBatch *batch,
+                        struct _VisibleTiles *visible)
+{
+   for (uint32_t i = first; i < last; i++) {
+      VkdfSceneTile *t = &s->tiles[s->occupied_tiles.index[i]];
 
-   /* Since our shadow map data comes after the light data, make sure it
-    * starts at a valid offset.
-    */
-   VkDeviceSize ubo_offset_alignment =
-      s->ctx->phy_device_props.limits.minUniformBufferOffsetAlignment;
+      uint32_t result;
+      if (coherent && classify_tile_from_cache(s, i, fplanes, &result)) {
+         add_classified_tile(visible, t, fplanes, result,
+                             VKDF_FRUSTUM_PLANE_MASK_ALL);
+         continue;
+      }
 
-   s->ubo.light.light_data_size = num_lights * light_data_size;
-   s->ubo.light.shadow_map_data_offset =
-      ALIGN(s->ubo.light.light_data_size, ubo_offset_alignment);
-   s->ubo.light.shadow_map_data_size = num_lights * shadow_map_data_size;
-   s->ubo.light.size = s->ubo.light.shadow_map_data_offset +
-                       s->ubo.light.shadow_map_data_size;
-   s->ubo.light.buf = vkdf_create_buffer(s->ctx, 0,
-                                         s->ubo.light.size,
-                                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+      batch->idx[batch->boxes.count] = i;
+      vkdf_box_batch_add(&batch->boxes, &t->box);
+      if (vkdf_box_batch_is_full(&batch->boxes))
+         flush_tile_batch(s, batch, visible_box, fplanes, coherent, visible);
+   }
 }
 
-/**
- * Creates a UBO with the model matrices for each object that can cast
- * shadows (the ones we need to render to the shadow map).
- *
- * The function also computes the counts of shadow caster objects per tile and
- * in each set as well as the starting index of each set in the UBO so we can
- * draw correct instance counts when we render each set to the the shadow map.
+/* Computes the range of top-level tile coordinates of the tiles that can
+ * overlap a box. Tile boxes are fit to the objects in them, so they can
+ * stick out of their grid cells by up to occupied_tiles.overhang. Returns
+ * false if no tile can overlap the box.
+ */
+static bool
+tile_range_for_box(VkdfScene *s, const VkdfBox *box,
+                   uint32_t *min, uint32_t *max)
+{
+   const float center[3] = { box->center.x, box->center.y, box->center.z };
+   const float extent[3] = { box->w, box->h, box->d };
+   const float origin[3] = { s->scene_area.origin.x,
+                             s->scene_area.origin.y,
+                             s->scene_area.origin.z };
+   const float size[3] = { s->tile_size[0].w,
+                           s->tile_size[0].h,
+                           s->tile_size[0].d };
+   const uint32_t num[3] = { s->num_tiles.w,
+                             s->num_tiles.h,
+                             s->num_tiles.d };
+
+   for (uint32_t a = 0; a < 3; a++) {
+      float margin = extent[a] + s->occupied_tiles.overhang[a];
+      float lo = floorf((center[a] - margin - origin[a]) / size[a]);
+      float hi = floorf((center[a] + margin - origin[a]) / size[a]);
+      if (hi < 0.0f || lo >= (float) num[a])
+         return false;
+
+      min[a] = lo < 0.0f ? 0 : (uint32_t) lo;
+      max[a] = hi >= (float) num[a] ? num[a] - 1 : (uint32_t) hi;
+   }
+
+   return true;
+}
+
+/* Finds the visible tiles in the range of top-level tile indices. If
+ * coherent is true the frustum is the camera's and we can reuse the culling
+ * results from previous frames.
  */
 static void
-create_static_shadow_map_ubo(VkdfScene *s)
+collect_visible_tiles(VkdfScene *s,
+                      uint32_t first_tile_idx,
+                      uint32_t last_tile_idx,
+                      const VkdfBox *visible_box,
+                      const VkdfPlane *fplanes,
+                      bool coherent,
+                      struct _VisibleTiles *visible)
 {
-   if (s->static_shadow_caster_count == 0)
-      return;
+   coherent = coherent && fplanes;
 
-   // Build per-instance data for each shadow caster object
-   s->ubo.shadow_map.inst_size = ALIGN(sizeof(glm::mat4), 16);
-   s->ubo.shadow_map.size =
-      s->ubo.shadow_map.inst_size * s->static_shadow_caster_count;
-   s->ubo.shadow_map.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->ubo.shadow_map.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+   // Only tiles in the grid cells overlapped by the visible box can be
+   // visible, so we don't need to look at any other tiles
+   uint32_t min[3], max[3];
+   if (visible_box) {
+      if (!tile_range_for_box(s, visible_box, min, max))
+         return;
+   } else {
+      min[0] = min[1] = min[2] = 0;
+      max[0] = s->num_tiles.w - 1;
+      max[1] = s->num_tiles.h - 1;
+      max[2] = s->num_tiles.d - 1;
+   }
 
-   uint8_t *mem;
-   vkdf_memory_map(s->ctx, s->ubo.shadow_map.buf.mem,
-                   0, VK_WHOLE_SIZE, (void **) &mem);
+   struct _TileBatch batch;
+   vkdf_box_batch_reset(&batch.boxes);
+
+   // Each (y, z) row of the range is a contiguous range of tile indices.
+   // Only non-empty tiles are tested, we find them with a binary search on
+   // the occupied tiles, merging consecutive rows into a single search.
+   bool has_run = false;
+   uint32_t run_first = 0, run_last = 0;
+   for (uint32_t ty = min[1]; ty <= max[1]; ty++) {
+      for (uint32_t tz = min[2]; tz <= max[2]; tz++) {
+         uint32_t row_first = tile_index_from_tile_coords(s, min[0], ty, tz);
+         uint32_t row_last = tile_index_from_tile_coords(s, max[0], ty, tz);
+         if (row_last < first_tile_idx || row_first > last_tile_idx)
+            continue;
 
-   VkDeviceSize offset = 0;
-   GList *set_id_iter = s->set_ids;
-   while (set_id_iter) {
-      for (uint32_t i = 0; i < s->num_tiles.total; i++) {
-         VkdfSceneTile *t = &s->tiles[i];
-         if (t->shadow_caster_count == 0)
-             continue;
-
-         const char *set_id = (const char *) set_id_iter->data;
-         VkdfSceneSetInfo *info =
-            (VkdfSceneSetInfo *) g_hash_table_lookup(t->sets, set_id);
-         if (info && info->shadow_caster_count > 0) {
-            GList *iter = info->objs;
-            while (iter) {
-               VkdfObject *obj = (VkdfObject *) iter->data;
-               if (vkdf_object_casts_shadows(obj)) {
-                  // Model matrix
-                  glm::mat4 model = vkdf_object_get_model_matrix(obj);
-                  float *model_data = glm::value_ptr(model);
-                  memcpy(mem + offset, model_data, sizeof(glm::mat4));
-                  offset += sizeof(glm::mat4);
-
-                  offset = ALIGN(offset, 16);
-               }
-               iter = g_list_next(iter);
-            }
+         row_first = MAX2(row_first, first_tile_idx);
+         row_last = MIN2(row_last, last_tile_idx);
+
+         if (has_run && row_first == run_last + 1) {
+            run_last = row_last;
+            continue;
          }
+
+         if (has_run) {
+            classify_occupied_tiles(s,
+                                    find_occupied_tile(s, run_first),
+                                    find_occupied_tile(s, run_last + 1),
+                                    visible_box, fplanes, coherent,
+                                    &batch, visible);
+         }
+
+         has_run = true;
+         run_first = row_first;
+         run_last = row_last;
       }
-      set_id_iter = g_list_next(set_id_iter);
    }
 
-   vkdf_memory_unmap(s->ctx, s->ubo.shadow_map.buf.mem,
-                     s->ubo.shadow_map.buf.mem_props, 0, VK_WHOLE_SIZE);
+   if (has_run) {
+      classify_occupied_tiles(s,
+                              find_occupied_tile(s, run_first),
+                              find_occupied_tile(s, run_last + 1),
+                              visible_box, fplanes, coherent,
+                              &batch, visible);
+   }
+
+   if (batch.boxes.count > 0)
+      flush_tile_batch(s, &batch, visible_box, fplanes, coherent, visible);
 }
 
-static void
-create_dynamic_shadow_map_ubo(VkdfScene *s)
+static GList *
+find_visible_tiles(VkdfScene *s,
+                   uint32_t first_tile_idx,
+                   uint32_t last_tile_idx,
+                   const VkdfBox *visible_box,
+                   const VkdfPlane *fplanes)
 {
-   s->dynamic.ubo.shadow_map.inst_size = ALIGN(sizeof(glm::mat4), 16);
+   struct _VisibleTiles visible;
+   visible.list = NULL;
+   visible.bits = NULL;
+   visible.min_word = UINT32_MAX;
+   visible.max_word = 0;
+   visible.occlusion = NULL;
 
-   VkDeviceSize buf_size =
-      s->dynamic.ubo.shadow_map.inst_size * MAX_DYNAMIC_OBJECTS *
-         s->lights.size();
+   collect_visible_tiles(s, first_tile_idx, last_tile_idx,
+                         visible_box, fplanes, false, &visible);
 
-   s->dynamic.ubo.shadow_map.host_buf = g_new(uint8_t, buf_size);
-   s->dynamic.ubo.shadow_map.size = buf_size;
+   return visible.list;
+}
 
-   s->dynamic.ubo.shadow_map.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->dynamic.ubo.shadow_map.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+/* Static buffers have room for objects added after the scene is prepared.
+ * If that is not enough they are replaced with larger ones.
+ */
+static inline uint32_t
+static_buffer_capacity(VkdfScene *s, uint32_t count)
+{
+   count = MAX2(count, s->static_edit.reserved_objs);
+   return count + MAX2(count / 4, 64);
+}
+
+static inline uint32_t
+static_material_capacity(VkdfScene *s, uint32_t count)
+{
+   count = MAX2(count, s->static_edit.reserved_materials);
+   return count + MAX2(count / 4, 64);
 }
 
 static void
-create_static_material_ubo(VkdfScene *s)
+range_allocator_free(VkdfSceneRangeAllocator *a)
 {
-   // NOTE: this doesn't consider the case where we have repeated models,
-   // which could happen if different set-ids share the same model. It is
-   // fine though, since we don't handle the case of shared models when
-   // we set up the static object ubo either.
-   uint32_t num_models = g_list_length(s->models);
-   s->ubo.material.size = num_models * MAX_MATERIALS_PER_MODEL *
-                          ALIGN(sizeof(VkdfMaterial), 16);
-   s->ubo.material.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->ubo.material.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+   g_list_free_full(a->free, g_free);
+   a->free = NULL;
+   for (uint32_t i = 0; i < SCENE_BUFFER_RING_SIZE; i++) {
+      g_list_free_full(a->pending[i], g_free);
+      a->pending[i] = NULL;
+   }
+}
 
-   uint8_t *mem;
-   VkDeviceSize material_size = sizeof(VkdfMaterial);
-   vkdf_memory_map(s->ctx, s->ubo.material.buf.mem,
-                   0, VK_WHOLE_SIZE, (void **) &mem);
+/**
+ * Makes slots [used, capacity) the only free slots.
+ */
+static void
+range_allocator_reset(VkdfSceneRangeAllocator *a,
+                      uint32_t used,
+                      uint32_t capacity)
+{
+   range_allocator_free(a);
+   if (used < capacity) {
+      VkdfSceneRange *r = g_new(VkdfSceneRange, 1);
+      r->start = used;
+      r->count = capacity - used;
+      a->free = g_list_prepend(a->free, r);
+   }
+}
 
-   uint32_t model_idx = 0;
-   GList *model_iter = s->models;
-   while (model_iter) {
-      VkdfModel *model = (VkdfModel *) model_iter->data;
-      VkDeviceSize offset =
-         model_idx * MAX_MATERIALS_PER_MODEL * ALIGN(sizeof(VkdfMaterial), 16);
-      uint32_t num_materials = model->materials.size();
-      assert(num_materials <= MAX_MATERIALS_PER_MODEL);
-      for (uint32_t mat_idx = 0; mat_idx < num_materials; mat_idx++) {
-         VkdfMaterial *m = &model->materials[mat_idx];
-         memcpy(mem + offset, m, material_size);
-         offset += ALIGN(material_size, 16);
+/**
+ * Finds 'count' contiguous free slots, first fit. Returns false if there
+ * is no free range large enough.
+ */
+static bool
+range_allocator_alloc(VkdfSceneRangeAllocator *a,
+                      uint32_t count,
+                      uint32_t *start)
+{
+   if (count == 0) {
+      *start = 0;
+      return true;
+   }
+
+   GList *iter = a->free;
+   while (iter) {
+      VkdfSceneRange *r = (VkdfSceneRange *) iter->data;
+      if (r->count >= count) {
+         *start = r->start;
+         r->start += count;
+         r->count -= count;
+         if (r->count == 0) {
+            g_free(r);
+            a->free = g_list_delete_link(a->free, iter);
+         }
+         return true;
       }
-      model_iter = g_list_next(model_iter);
-      model_idx++;
+      iter = g_list_next(iter);
    }
 
-   vkdf_memory_unmap(s->ctx, s->ubo.material.buf.mem,
-                     s->ubo.material.buf.mem_props, 0, VK_WHOLE_SIZE);
+   return false;
 }
 
+/**
+ * Frees slots that frames in flight may still be using. They can be
+ * allocated again after SCENE_BUFFER_RING_SIZE frames.
+ */
 static void
-create_dynamic_material_ubo(VkdfScene *s)
+range_allocator_release(VkdfSceneRangeAllocator *a,
+                        uint32_t start,
+                        uint32_t count)
 {
-   s->dynamic.ubo.material.inst_size = ALIGN(sizeof(VkdfMaterial), 16);
-
-   VkDeviceSize buf_size =
-      MAX_DYNAMIC_MATERIALS * s->dynamic.ubo.material.inst_size;
+   if (count == 0)
+      return;
 
-   s->dynamic.ubo.material.host_buf = g_new(uint8_t, buf_size);
-   s->dynamic.ubo.material.size = buf_size;
+   VkdfSceneRange *r = g_new(VkdfSceneRange, 1);
+   r->start = start;
+   r->count = count;
+   a->pending[a->frame] = g_list_prepend(a->pending[a->frame], r);
+}
 
-   s->dynamic.ubo.material.buf =
-      vkdf_create_buffer(s->ctx, 0,
-                         s->dynamic.ubo.material.size,
-                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+static gint
+compare_ranges(gconstpointer a, gconstpointer b)
+{
+   const VkdfSceneRange *ra = (const VkdfSceneRange *) a;
+   const VkdfSceneRange *rb = (const VkdfSceneRange *) b;
+   return ra->start < rb->start ? -1 : (ra->start > rb->start ? 1 : 0);
 }
 
 /**
- * - Builds object lists for non-leaf (sub)tiles (making sure object
- *   order is correct)
- * - Computes (sub)tile starting indices
- * - Creates static UBO data for scene objects (model matrix, materials, etc)
+ * Starts a new frame. The slots released SCENE_BUFFER_RING_SIZE frames ago
+ * are not in use any more, so they become free.
  */
 static void
-prepare_scene_objects(VkdfScene *s)
+range_allocator_next_frame(VkdfSceneRangeAllocator *a)
 {
-   if (!s->dirty)
-      return;
-
-   s->set_ids = g_list_reverse(s->set_ids);
-   s->models = g_list_reverse(s->models);
+   a->frame = (a->frame + 1) % SCENE_BUFFER_RING_SIZE;
 
-   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
-      VkdfSceneTile *t = &s->tiles[i];
-      ensure_set_infos(t, s->set_ids);
+   GList *released = a->pending[a->frame];
+   a->pending[a->frame] = NULL;
+   if (!released)
+      return;
 
-      GList *iter = s->set_ids;
-      while (iter) {
-         const char *set_id = (const char *) iter->data;
-         build_object_lists(s, t, set_id);
+   GList *iter = released;
+   while (iter) {
+      a->free = g_list_insert_sorted(a->free, iter->data, compare_ranges);
+      iter = g_list_next(iter);
+   }
+   g_list_free(released);
+
+   // Merge adjacent ranges
+   iter = a->free;
+   while (iter && iter->next) {
+      VkdfSceneRange *r = (VkdfSceneRange *) iter->data;
+      VkdfSceneRange *next = (VkdfSceneRange *) iter->next->data;
+      if (r->start + r->count == next->start) {
+         r->count += next->count;
+         g_free(next);
+         a->free = g_list_delete_link(a->free, iter->next);
+      } else {
          iter = g_list_next(iter);
       }
    }
+}
 
-   uint32_t start_index = 0;
-   uint32_t shadow_caster_start_index = 0;
-   GList *iter = s->set_ids;
+/**
+ * Writes the per-instance data for the objects of a tile set at the start
+ * index of the set.
+ */
+static void
+write_static_object_data(VkdfScene *s, uint8_t *mem,
+                         uint32_t set, VkdfSceneSetInfo *info)
+{
+   // Models are packed back to back in the material buffer, so objects
+   // store the index of their first material in it
+   uint32_t material_base = s->ssbo.material.set_base[set];
+
+   // NOTE: this assumes that each set-id model has a different set of
+   // materials. In theory, we could have different set-ids share models
+   // though and in that case we would be replicating model data here,
+   // but this makes things easier.
+   uint32_t model_index = set;
+
+   VkDeviceSize offset = info->start_index * s->ssbo.obj.inst_size;
+   GList *iter = info->objs;
    while (iter) {
-      const char *set_id = (const char *) iter->data;
-      for (uint32_t i = 0; i < s->num_tiles.total; i++) {
-         VkdfSceneTile *t = &s->tiles[i];
-         uint32_t next_start_index, next_shadow_caster_start_index;
-         compute_tile_start_indices(s, t, set_id,
-                                    start_index,
-                                    shadow_caster_start_index,
-                                    &next_start_index,
-                                    &next_shadow_caster_start_index);
-         start_index = next_start_index;
-         shadow_caster_start_index = next_shadow_caster_start_index;
-      }
-      iter = g_list_next(iter);
-   }
+      VkdfObject *obj = (VkdfObject *) iter->data;
 
-   create_static_object_ubo(s);
-   create_static_material_ubo(s);
+      // Model matrix
+      glm::mat4 model = vkdf_object_get_model_matrix(obj);
+      float *model_data = glm::value_ptr(model);
+      memcpy(mem + offset, model_data, sizeof(glm::mat4));
+      offset += sizeof(glm::mat4);
 
-   create_dynamic_object_ubo(s);
-   create_dynamic_material_ubo(s);
+      // Base material index
+      uint32_t material_idx = material_base + obj->material_idx_base;
+      memcpy(mem + offset, &material_idx, sizeof(uint32_t));
+      offset += sizeof(uint32_t);
 
-   create_light_ubo(s);
-   if (s->has_shadow_caster_lights) {
-      create_static_shadow_map_ubo(s);
-      create_dynamic_shadow_map_ubo(s);
+      // Model index
+      memcpy(mem + offset, &model_index, sizeof(uint32_t));
+      offset += sizeof(uint32_t);
+
+      // Receives shadows
+      uint32_t receives_shadows = (uint32_t) obj->receives_shadows;
+      memcpy(mem + offset, &receives_shadows, sizeof(uint32_t));
+      offset += sizeof(uint32_t);
+
+      offset = ALIGN(offset, 16);
+
+      iter = g_list_next(iter);
    }
+}
 
-   s->dirty = false;
+/**
+ * Writes the model matrices for the shadow casters of a tile set at the
+ * shadow caster start index of the set.
+ */
+static void
+write_static_shadow_caster_data(VkdfScene *s, uint8_t *mem,
+                                VkdfSceneSetInfo *info)
+{
+   VkDeviceSize offset =
+      info->shadow_caster_start_index * s->ssbo.shadow_map.inst_size;
+   GList *iter = info->objs;
+   while (iter) {
+      VkdfObject *obj = (VkdfObject *) iter->data;
+      if (vkdf_object_casts_shadows(obj)) {
+         // Model matrix
+         glm::mat4 model = vkdf_object_get_model_matrix(obj);
+         float *model_data = glm::value_ptr(model);
+         memcpy(mem + offset, model_data, sizeof(glm::mat4));
+         offset += sizeof(glm::mat4);
+
+         offset = ALIGN(offset, 16);
+      }
+      iter = g_list_next(iter);
+   }
 }
 
-static VkRenderPass
-create_depth_renderpass(VkdfScene *s,
-                        VkAttachmentLoadOp load_op,
-                        bool needs_sampling)
+/**
+ * Writes the object and shadow caster data for a top-level tile. shadow_mem
+ * is NULL if the scene doesn't have a shadow map buffer.
+ */
+static void
+write_static_tile_data(VkdfScene *s, VkdfSceneTile *t,
+                       uint8_t *obj_mem, uint8_t *shadow_mem)
 {
-   VkAttachmentDescription attachments[2];
+   if (t->obj_count == 0)
+      return;
 
-   // Single depth attachment
+   for (uint32_t set = 0; set < t->sets.count; set++) {
+      VkdfSceneSetInfo *info = &t->sets.info[set];
+      if (info->count > 0)
+         write_static_object_data(s, obj_mem, set, info);
+      if (shadow_mem && info->shadow_caster_count > 0)
+         write_static_shadow_caster_data(s, shadow_mem, info);
+   }
+}
+
+static inline void
+map_static_object_buffers(VkdfScene *s, uint8_t **obj_mem, uint8_t **shadow_mem)
+{
+   vkdf_memory_map(s->ctx, s->ssbo.obj.buf.mem,
+                   0, VK_WHOLE_SIZE, (void **) obj_mem);
+
+   *shadow_mem = NULL;
+   if (s->ssbo.shadow_map.buf.buf) {
+      vkdf_memory_map(s->ctx, s->ssbo.shadow_map.buf.mem,
+                      0, VK_WHOLE_SIZE, (void **) shadow_mem);
+   }
+}
+
+static inline void
+unmap_static_object_buffers(VkdfScene *s)
+{
+   vkdf_memory_unmap(s->ctx, s->ssbo.obj.buf.mem, s->ssbo.obj.buf.mem_props,
+                     0, VK_WHOLE_SIZE);
+
+   if (s->ssbo.shadow_map.buf.buf) {
+      vkdf_memory_unmap(s->ctx, s->ssbo.shadow_map.buf.mem,
+                        s->ssbo.shadow_map.buf.mem_props, 0, VK_WHOLE_SIZE);
+   }
+}
+
+/**
+ * Writes the data for all the static objects in the scene.
+ */
+static void
+write_static_objects(VkdfScene *s)
+{
+   uint8_t *obj_mem, *shadow_mem;
+   map_static_object_buffers(s, &obj_mem, &shadow_mem);
+
+   for (uint32_t i = 0; i < s->num_tiles.total; i++)
+      write_static_tile_data(s, &s->tiles[i], obj_mem, shadow_mem);
+
+   unmap_static_object_buffers(s);
+}
+
+static void
+create_static_object_ssbo(VkdfScene *s)
+{
+   // Per-instance data: model matrix, base material index, model index,
+   // receives shadows
+   s->ssbo.obj.capacity =
+      static_buffer_capacity(s, vkdf_scene_get_static_object_count(s));
+
+   s->ssbo.obj.inst_size = ALIGN(sizeof(glm::mat4) + 3 * sizeof(uint32_t), 16);
+   s->ssbo.obj.size = s->ssbo.obj.inst_size * s->ssbo.obj.capacity;
+   s->ssbo.obj.buf =
+      vkdf_create_buffer(s->ctx, 0,
+                         s->ssbo.obj.size,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+/* Dynamic buffers have room for objects and materials added after the
+ * scene is prepared. If that is not enough they are replaced with larger
+ * ones.
+ */
+static inline uint32_t
+dynamic_buffer_capacity(uint32_t count)
+{
+   return count + MAX2(count / 4, 64);
+}
+
+static void
+create_dynamic_object_ssbo(VkdfScene *s)
+{
+   // Per-instance data: model matrix, base material index,
+   // model index, receives shadows. At most all dynamic objects are visible.
+   VkDeviceSize inst_size =
+      ALIGN(sizeof(glm::mat4) + 3 * sizeof(uint32_t), 16);
+
+   create_buffer_ring(s, &s->dynamic.ssbo.obj, inst_size,
+                      dynamic_buffer_capacity(s->dynamic.bvh.count), 1);
+}
+
+struct _shadow_map_ubo_data {
+   glm::mat4 light_viewproj;
+   uint32_t shadow_map_size;
+   uint32_t pcf_kernel_size;
+   uint32_t padding[2]; // Keep this struct 16-byte aligned
+};
+
+static void
+create_light_ubo(VkdfScene *s)
+{
+   uint32_t num_lights = s->lights.size();
+   if (num_lights == 0)
+      return;
+
+   const uint32_t light_data_size = ALIGN(sizeof(VkdfLight), 16);
+
+   const uint32_t shadow_map_data_size =
+      ALIGN(sizeof(struct _shadow_map_ubo_data) , 16);
+
+   /* Since our shadow map data comes after the light data, make sure it
+    * starts at a valid offset.
+    */
+   VkDeviceSize ubo_offset_alignment =
+      s->ctx->phy_device_props.limits.minUniformBufferOffsetAlignment;
+
+   s->ubo.light.light_data_size = num_lights * light_data_size;
+   s->ubo.light.shadow_map_data_offset =
+      ALIGN(s->ubo.light.light_data_size, ubo_offset_alignment);
+   s->ubo.light.shadow_map_data_size = num_lights * shadow_map_data_size;
+   s->ubo.light.size = s->ubo.light.shadow_map_data_offset +
+                       s->ubo.light.shadow_map_data_size;
+   s->ubo.light.buf = vkdf_create_buffer(s->ctx, 0,
+                                         s->ubo.light.size,
+                                         VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                         VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+/**
+ * Creates a buffer with the model matrices for each object that can cast
+ * shadows (the ones we need to render to the shadow map).
+ *
+ * The shadow caster start index of each set, computed with the object start
+ * indices, tells where its data goes so we can draw correct instance counts
+ * when we render each set to the the shadow map.
+ */
+static void
+create_static_shadow_map_ssbo(VkdfScene *s)
+{
+   s->ssbo.shadow_map.capacity =
+      static_buffer_capacity(s, s->static_shadow_caster_count);
+
+   s->ssbo.shadow_map.inst_size = ALIGN(sizeof(glm::mat4), 16);
+   s->ssbo.shadow_map.size =
+      s->ssbo.shadow_map.inst_size * s->ssbo.shadow_map.capacity;
+   s->ssbo.shadow_map.buf =
+      vkdf_create_buffer(s->ctx, 0,
+                         s->ssbo.shadow_map.size,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+static void
+create_dynamic_shadow_map_ssbo(VkdfScene *s)
+{
+   // Each light gets its own range so we can select it with a dynamic
+   // offset, the descriptor only covers the data for one light
+   VkDeviceSize inst_size = ALIGN(sizeof(glm::mat4), 16);
+   create_buffer_ring(s, &s->dynamic.ssbo.shadow_map, inst_size,
+                      dynamic_buffer_capacity(s->dynamic.bvh.count),
+                      s->lights.size());
+}
+
+/**
+ * Returns the number of materials of the sets that are not in the static
+ * material buffer yet.
+ */
+static uint32_t
+count_new_set_materials(VkdfScene *s)
+{
+   uint32_t count = 0;
+   GList *model_iter = g_list_nth(s->models, s->ssbo.material.num_set_bases);
+   while (model_iter) {
+      VkdfModel *model = (VkdfModel *) model_iter->data;
+      count += model->materials.size();
+      model_iter = g_list_next(model_iter);
+   }
+   return count;
+}
+
+/**
+ * Writes the materials of the sets that don't have them in the material
+ * buffer yet. Returns false, without writing anything, if they don't fit.
+ */
+static bool
+write_static_materials(VkdfScene *s)
+{
+   const uint32_t num_sets = s->set_ids->len;
+   if (s->ssbo.material.num_set_bases == num_sets)
+      return true;
+
+   uint32_t count = s->ssbo.material.count + count_new_set_materials(s);
+   if (count > s->ssbo.material.capacity)
+      return false;
+
+   s->ssbo.material.set_base =
+      g_renew(uint32_t, s->ssbo.material.set_base, num_sets);
+
+   uint8_t *mem;
+   VkDeviceSize material_size = sizeof(VkdfMaterial);
+   vkdf_memory_map(s->ctx, s->ssbo.material.buf.mem,
+                   0, VK_WHOLE_SIZE, (void **) &mem);
+
+   VkDeviceSize offset =
+      s->ssbo.material.count * ALIGN(material_size, 16);
+
+   uint32_t set = s->ssbo.material.num_set_bases;
+   GList *model_iter = g_list_nth(s->models, set);
+   for (; set < num_sets; set++) {
+      VkdfModel *model = (VkdfModel *) model_iter->data;
+      s->ssbo.material.set_base[set] = s->ssbo.material.count;
+      for (uint32_t mat_idx = 0; mat_idx < model->materials.size(); mat_idx++) {
+         VkdfMaterial *m = &model->materials[mat_idx];
+         memcpy(mem + offset, m, material_size);
+         offset += ALIGN(material_size, 16);
+      }
+      s->ssbo.material.count += model->materials.size();
+
+      model_iter = g_list_next(model_iter);
+   }
+   s->ssbo.material.num_set_bases = num_sets;
+
+   vkdf_memory_unmap(s->ctx, s->ssbo.material.buf.mem,
+                     s->ssbo.material.buf.mem_props, 0, VK_WHOLE_SIZE);
+
+   return true;
+}
+
+static void
+create_static_material_buffer(VkdfScene *s, uint32_t num_materials)
+{
+   // Leave room for the materials of sets added later
+   s->ssbo.material.capacity = static_material_capacity(s, num_materials);
+   s->ssbo.material.size =
+      s->ssbo.material.capacity * ALIGN(sizeof(VkdfMaterial), 16);
+   s->ssbo.material.buf =
+      vkdf_create_buffer(s->ctx, 0,
+                         s->ssbo.material.size,
+                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+}
+
+static void
+create_static_material_ssbo(VkdfScene *s)
+{
+   // NOTE: this doesn't consider the case where we have repeated models,
+   // which could happen if different set-ids share the same model. It is
+   // fine though, since we don't handle the case of shared models when
+   // we set up the static object buffer either.
+   //
+   // Models are packed back to back in the order of s->models, and
+   // s->ssbo.material.set_base has the index of the first material of
+   // each set.
+   s->ssbo.material.count = 0;
+   s->ssbo.material.num_set_bases = 0;
+   create_static_material_buffer(s, count_new_set_materials(s));
+
+   // This always fits, we made room for the materials of all the models
+   write_static_materials(s);
+}
+
+static void
+create_dynamic_material_ssbo(VkdfScene *s)
+{
+   // Room for the materials of every set with dynamic objects
+   VkDeviceSize inst_size = ALIGN(sizeof(VkdfMaterial), 16);
+   create_buffer_ring(s, &s->dynamic.ssbo.material, inst_size,
+                      dynamic_buffer_capacity(s->dynamic.material_count), 1);
+}
+
+static void
+build_occupied_tiles(VkdfScene *s)
+{
+   free_occupied_tiles(s);
+
+   uint32_t count = 0;
+   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
+      if (s->tiles[i].obj_count > 0)
+         count++;
+   }
+
+   s->occupied_tiles.count = count;
+   s->occupied_tiles.index = g_new(uint32_t, count);
+   s->occupied_tiles.cx = g_new(float, count);
+   s->occupied_tiles.cy = g_new(float, count);
+   s->occupied_tiles.cz = g_new(float, count);
+   s->occupied_tiles.ex = g_new(float, count);
+   s->occupied_tiles.ey = g_new(float, count);
+   s->occupied_tiles.ez = g_new(float, count);
+   s->occupied_tiles.last_result = g_new0(uint8_t, count);
+   s->occupied_tiles.last_plane = g_new(uint8_t, count);
+   memset(s->occupied_tiles.last_plane, NO_PLANE, count);
+
+   // No cached result is valid until the tile has been tested once
+   s->occupied_tiles.expiry = g_new(double, count);
+   for (uint32_t i = 0; i < count; i++)
+      s->occupied_tiles.expiry[i] = -1.0;
+
+   float *max_abs = s->occupied_tiles.max_abs;
+   float *overhang = s->occupied_tiles.overhang;
+   uint32_t n = 0;
+   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
+      VkdfSceneTile *t = &s->tiles[i];
+      if (t->obj_count == 0)
+         continue;
+
+      s->occupied_tiles.index[n] = i;
+      s->occupied_tiles.cx[n] = t->box.center.x;
+      s->occupied_tiles.cy[n] = t->box.center.y;
+      s->occupied_tiles.cz[n] = t->box.center.z;
+      s->occupied_tiles.ex[n] = t->box.w;
+      s->occupied_tiles.ey[n] = t->box.h;
+      s->occupied_tiles.ez[n] = t->box.d;
+      max_abs[0] = MAX2(max_abs[0], fabsf(t->box.center.x) + t->box.w);
+      max_abs[1] = MAX2(max_abs[1], fabsf(t->box.center.y) + t->box.h);
+      max_abs[2] = MAX2(max_abs[2], fabsf(t->box.center.z) + t->box.d);
+
+      // How far the tile box sticks out of its grid cell
+      glm::vec3 cell_max = t->offset + glm::vec3(s->tile_size[0].w,
+                                                 s->tile_size[0].h,
+                                                 s->tile_size[0].d);
+      overhang[0] = MAX2(overhang[0], t->offset.x - (t->box.center.x - t->box.w));
+      overhang[0] = MAX2(overhang[0], (t->box.center.x + t->box.w) - cell_max.x);
+      overhang[1] = MAX2(overhang[1], t->offset.y - (t->box.center.y - t->box.h));
+      overhang[1] = MAX2(overhang[1], (t->box.center.y + t->box.h) - cell_max.y);
+      overhang[2] = MAX2(overhang[2], t->offset.z - (t->box.center.z - t->box.d));
+      overhang[2] = MAX2(overhang[2], (t->box.center.z + t->box.d) - cell_max.z);
+      n++;
+   }
+}
+
+/**
+ * Lays out the objects of a top-level tile in the object and shadow map
+ * buffers from the start of its ranges. Sets go one after the other and,
+ * within a set, subtiles are in index order.
+ */
+static void
+compute_tile_ranges_start_indices(VkdfScene *s, VkdfSceneTile *t)
+{
+   const VkdfSceneTileRanges *r = &s->static_edit.tile_ranges[t->index];
+   uint32_t start_index = r->obj.start;
+   uint32_t shadow_caster_start_index = r->shadow_map.start;
+   for (uint32_t set = 0; set < t->sets.count; set++) {
+      compute_tile_start_indices(s, t, set,
+                                 start_index,
+                                 shadow_caster_start_index,
+                                 &start_index,
+                                 &shadow_caster_start_index);
+   }
+}
+
+/**
+ * Lays out all the static objects in the object and shadow map buffers.
+ * Each top-level tile gets a range of slots in each buffer, in tile index
+ * order, so it can be moved to new slots when it changes. The rest of the
+ * buffers is free.
+ */
+static void
+compute_static_start_indices(VkdfScene *s)
+{
+   if (!s->static_edit.tile_ranges)
+      s->static_edit.tile_ranges =
+         g_new0(VkdfSceneTileRanges, s->num_tiles.total);
+
+   uint32_t start_index = 0;
+   uint32_t shadow_caster_start_index = 0;
+   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
+      VkdfSceneTile *t = &s->tiles[i];
+      VkdfSceneTileRanges *r = &s->static_edit.tile_ranges[i];
+      r->obj.start = start_index;
+      r->obj.count = t->obj_count;
+      r->shadow_map.start = shadow_caster_start_index;
+      r->shadow_map.count = t->shadow_caster_count;
+
+      compute_tile_ranges_start_indices(s, t);
+
+      start_index += t->obj_count;
+      shadow_caster_start_index += t->shadow_caster_count;
+   }
+
+   range_allocator_reset(&s->ssbo.obj.alloc,
+                         start_index, s->ssbo.obj.capacity);
+   range_allocator_reset(&s->ssbo.shadow_map.alloc,
+                         shadow_caster_start_index,
+                         s->ssbo.shadow_map.capacity);
+}
+
+/**
+ * - Builds object lists for non-leaf (sub)tiles (making sure object
+ *   order is correct)
+ * - Computes (sub)tile starting indices
+ * - Creates static buffer data for scene objects (model matrix, materials, etc)
+ */
+static void
+prepare_scene_objects(VkdfScene *s)
+{
+   // Scenes may start empty and get all their objects after they are
+   // prepared (like with VkdfStream), so we need the buffers anyway
+   if (s->static_edit.prepared)
+      return;
+
+   const uint32_t num_sets = s->set_ids->len;
+
+   for (uint32_t i = 0; i < s->num_tiles.total; i++) {
+      VkdfSceneTile *t = &s->tiles[i];
+      ensure_set_infos(t, num_sets);
+
+      for (uint32_t set = 0; set < num_sets; set++)
+         build_object_lists(s, t, set);
+   }
+
+   resize_scene_sets(&s->dynamic.sets, num_sets);
+   resize_scene_sets(&s->dynamic.visible, num_sets);
+
+   build_occupied_tiles(s);
+
+   // Objects store material indices, so materials go first
+   create_static_material_ssbo(s);
+   create_static_object_ssbo(s);
+
+   create_dynamic_object_ssbo(s);
+   create_dynamic_material_ssbo(s);
+
+   create_light_ubo(s);
+   if (s->has_shadow_caster_lights) {
+      create_static_shadow_map_ssbo(s);
+      create_dynamic_shadow_map_ssbo(s);
+   }
+
+   compute_static_start_indices(s);
+   write_static_objects(s);
+
+   s->dirty = false;
+   s->static_edit.prepared = true;
+}
+
+static VkRenderPass
+create_depth_renderpass(VkdfScene *s,
+                        VkAttachmentLoadOp load_op,
+                        bool needs_sampling)
+{
+   VkAttachmentDescription attachments[2];
+
+   // Single depth attachment
    attachments[0].format = VK_FORMAT_D32_SFLOAT;
    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
    attachments[0].loadOp = load_op;
@@ -2456,37 +3656,37 @@ static void
 create_shadow_map_pipelines(VkdfScene *s)
 {
    // Set layout with a single binding for the model matrices of
-   // scene objects
+   // scene objects. The binding is dynamic so we can select the data for
+   // each light in the dynamic object buffer ring.
    s->shadows.pipeline.models_set_layout =
-      vkdf_create_ubo_descriptor_set_layout(s->ctx, 0, 1,
-                                            VK_SHADER_STAGE_VERTEX_BIT, false);
+      vkdf_create_ssbo_descriptor_set_layout(s->ctx, 0, 1,
+                                             VK_SHADER_STAGE_VERTEX_BIT, true);
 
-   if (s->static_shadow_caster_count > 0) {
-      s->shadows.pipeline.models_set =
-         create_descriptor_set(s->ctx, s->ubo.static_pool,
-                               s->shadows.pipeline.models_set_layout);
+   // Static shadow casters can be added after the scene is prepared, so
+   // we always need this one
+   s->shadows.pipeline.models_set =
+      create_descriptor_set(s->ctx, s->ssbo.dynamic_pool,
+                            s->shadows.pipeline.models_set_layout);
 
-      VkDeviceSize ubo_offset = 0;
-      VkDeviceSize ubo_size = s->ubo.shadow_map.size;
-      vkdf_descriptor_set_buffer_update(s->ctx,
-                                        s->shadows.pipeline.models_set,
-                                        s->ubo.shadow_map.buf.buf,
-                                        0, 1, &ubo_offset, &ubo_size,
-                                        false, true);
-   }
+   VkDeviceSize buf_offset = 0;
+   VkDeviceSize buf_size = s->ssbo.shadow_map.size;
+   vkdf_descriptor_set_buffer_update(s->ctx,
+                                     s->shadows.pipeline.models_set,
+                                     s->ssbo.shadow_map.buf.buf,
+                                     0, 1, &buf_offset, &buf_size,
+                                     true, false);
 
    s->shadows.pipeline.dyn_models_set =
-      create_descriptor_set(s->ctx, s->ubo.static_pool,
+      create_descriptor_set(s->ctx, s->ssbo.dynamic_pool,
                             s->shadows.pipeline.models_set_layout);
 
-
-   VkDeviceSize ubo_offset = 0;
-   VkDeviceSize ubo_size = s->dynamic.ubo.shadow_map.size;
+   buf_offset = 0;
+   buf_size = s->dynamic.ssbo.shadow_map.size;
    vkdf_descriptor_set_buffer_update(s->ctx,
                                      s->shadows.pipeline.dyn_models_set,
-                                     s->dynamic.ubo.shadow_map.buf.buf,
-                                     0, 1, &ubo_offset, &ubo_size,
-                                     false, true);
+                                     s->dynamic.ssbo.shadow_map.buf.buf,
+                                     0, 1, &buf_offset, &buf_size,
+                                     true, false);
 
    // Pipeline layout: 2 push constant ranges and 1 set layout
    VkPushConstantRange pcb_ranges[1];
@@ -2525,11 +3725,17 @@ create_shadow_map_pipelines(VkdfScene *s)
    GList *iter = s->models;
    while(iter) {
       VkdfModel *model = (VkdfModel *) iter->data;
+      iter = g_list_next(iter);
+
+      // Models that are not loaded get their pipelines when they are
+      // loaded again (see vkdf_scene_set_model())
+      if (!model)
+         continue;
+
       for (uint32_t mesh_idx = 0; mesh_idx < model->meshes.size(); mesh_idx++) {
          VkdfMesh *mesh = model->meshes[mesh_idx];
          create_shadow_map_pipeline_for_mesh(s, mesh);
       }
-      iter = g_list_next(iter);
    }
 }
 
@@ -2648,19 +3854,15 @@ compute_visible_tiles_for_light(VkdfScene *s, VkdfSceneLight *sl)
 static inline void
 start_recording_shadow_map_commands(VkdfScene *s)
 {
-   /* Ensure that dirty light / hadow map descriptions have been updated as
-    * well as dirty dynamic objects
+   /* Ensure that dirty light / hadow map descriptions have been updated.
+    * Dynamic object data is written by the host, which is visible to the
+    * device once we submit.
     */
-   VkBufferMemoryBarrier barriers[2] = {
+   VkBufferMemoryBarrier barriers[1] = {
       vkdf_create_buffer_barrier(VK_ACCESS_TRANSFER_WRITE_BIT,
                                  VK_ACCESS_SHADER_READ_BIT,
                                  s->ubo.light.buf.buf,
                                  0, VK_WHOLE_SIZE),
-
-      vkdf_create_buffer_barrier(VK_ACCESS_TRANSFER_WRITE_BIT,
-                                 VK_ACCESS_SHADER_READ_BIT,
-                                 s->dynamic.ubo.shadow_map.buf.buf,
-                                 0, VK_WHOLE_SIZE),
    };
 
    vkCmdPipelineBarrier(s->cmd_buf.update_resources,
@@ -2668,7 +3870,7 @@ start_recording_shadow_map_commands(VkdfScene *s)
                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
                         0,
                         0, NULL,
-                        2, barriers,
+                        1, barriers,
                         0, NULL);
 }
 
@@ -2681,7 +3883,8 @@ stop_recording_shadow_map_commands(VkdfScene *s)
 static void
 record_shadow_map_commands(VkdfScene *s,
                            VkdfSceneLight *sl,
-                           GHashTable *dyn_sets)
+                           VkdfSceneSets *dyn_sets,
+                           uint32_t dyn_ssbo_offset)
 {
    assert(sl->shadow.shadow_map.image);
 
@@ -2729,15 +3932,16 @@ record_shadow_map_commands(VkdfScene *s,
 
    // Render static objects
    if (s->static_shadow_caster_count > 0) {
-      // Descriptor sets (UBO with object model matrices)
+      // Descriptor sets (buffer with object model matrices)
+      const uint32_t static_ssbo_offset = 0;
       vkCmdBindDescriptorSets(s->cmd_buf.update_resources,
                               VK_PIPELINE_BIND_POINT_GRAPHICS,
                               s->shadows.pipeline.layout,
                               0,                               // First decriptor set
                               1,                               // Descriptor set count
                               &s->shadows.pipeline.models_set, // Descriptor sets
-                              0,                               // Dynamic offset count
-                              NULL);                           // Dynamic offsets
+                              1,                               // Dynamic offset count
+                              &static_ssbo_offset);            // Dynamic offsets
 
       // For each tile visible from this light source...
       GList *tile_iter = sl->shadow.visible;
@@ -2746,11 +3950,8 @@ record_shadow_map_commands(VkdfScene *s,
          assert(tile);
 
          // For each object type in this tile...
-         GList *set_iter = s->set_ids;
-         while (set_iter) {
-            const char *set_id = (const char *) set_iter->data;
-            VkdfSceneSetInfo *set_info =
-               (VkdfSceneSetInfo *) g_hash_table_lookup(tile->sets, set_id);
+         for (uint32_t set = 0; set < tile->sets.count; set++) {
+            VkdfSceneSetInfo *set_info = &tile->sets.info[set];
 
             // If there are shadow caster objects of this type...
             if (set_info->shadow_caster_count > 0) {
@@ -2802,7 +4003,6 @@ record_shadow_map_commands(VkdfScene *s,
                                  set_info->shadow_caster_start_index);
                }
             }
-            set_iter = g_list_next(set_iter);
          }
          tile_iter = g_list_next(tile_iter);
       }
@@ -2815,15 +4015,12 @@ record_shadow_map_commands(VkdfScene *s,
                            0,                                   // First decriptor set
                            1,                                   // Descriptor set count
                            &s->shadows.pipeline.dyn_models_set, // Descriptor sets
-                           0,                                   // Dynamic offset count
-                           NULL);                               // Dynamic offsets
-
-   char *set_id;
-   VkdfSceneSetInfo *set_info;
-   GHashTableIter set_iter;
-   g_hash_table_iter_init(&set_iter, dyn_sets);
-   while (g_hash_table_iter_next(&set_iter, (void **)&set_id, (void **)&set_info)) {
-      if (!set_info || set_info->shadow_caster_count == 0)
+                           1,                                   // Dynamic offset count
+                           &dyn_ssbo_offset);                   // Dynamic offsets
+
+   for (uint32_t set = 0; set < dyn_sets->count; set++) {
+      VkdfSceneSetInfo *set_info = &dyn_sets->info[set];
+      if (set_info->shadow_caster_count == 0)
          continue;
 
       // Grab the model (it is shared across all objects in the same type)
@@ -2964,8 +4161,45 @@ record_dirty_shadow_map_resource_updates(VkdfScene *s)
    s->cmd_buf.have_resource_updates = true;
 }
 
-static GHashTable *
+/**
+ * Groups the dynamic objects returned by a BVH query by set. On return, the
+ * items for set handle 'set' are sorted_items[set_start[set]] to
+ * sorted_items[set_start[set + 1] - 1]. set_start must have room for the
+ * number of dynamic sets plus one.
+ */
+static void
+sort_dynamic_items_by_set(VkdfScene *s,
+                          uint32_t count,
+                          const uint32_t *items,
+                          uint32_t *set_start,
+                          uint32_t *sorted_items)
+{
+   const uint32_t num_sets = s->dynamic.sets.count;
+   const uint32_t *set_handles = s->dynamic.bvh.set_handles;
+
+   memset(set_start, 0, (num_sets + 1) * sizeof(uint32_t));
+   for (uint32_t i = 0; i < count; i++)
+      set_start[set_handles[items[i]]]++;
+
+   uint32_t start = 0;
+   for (uint32_t set = 0; set < num_sets; set++) {
+      uint32_t set_count = set_start[set];
+      set_start[set] = start;
+      start += set_count;
+   }
+
+   // Scattering advances every set_start to the start of the next set, so
+   // shift them back afterwards
+   for (uint32_t i = 0; i < count; i++)
+      sorted_items[set_start[set_handles[items[i]]]++] = items[i];
+
+   memmove(&set_start[1], &set_start[0], num_sets * sizeof(uint32_t));
+   set_start[0] = 0;
+}
+
+static VkdfSceneSets *
 find_dynamic_objects_for_light(VkdfScene *s,
+                               uint32_t thread_id,
                                VkdfSceneLight *sl,
                                bool *has_dirty_objects)
 {
@@ -2973,14 +4207,11 @@ find_dynamic_objects_for_light(VkdfScene *s,
    // shadow map. If no dynamic object invalidates it we can skip its update.
    *has_dirty_objects = false;
 
-   GHashTable *dyn_sets =
-      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+   VkdfSceneSets *dyn_sets = g_new0(VkdfSceneSets, 1);
+   resize_scene_sets(dyn_sets, s->dynamic.sets.count);
 
-   // Go through the list of dynamic objects and check if any of them is
-   // inside in any of the visible tiles for this light
-   GHashTableIter iter;
-   char *id;
-   VkdfSceneSetInfo *info;
+   // Query the BVH of dynamic objects for objects that are visible to this
+   // light
 
    // Notice that in order to test if a dynamic objects is visible to a light
    // we can't rely on the know list of vible tiles for the light. This is
@@ -2989,7 +4220,7 @@ find_dynamic_objects_for_light(VkdfScene *s,
    // that the object is inside a tile that is visible to the light but that is
    // not in its list of visible tiles because it doesn't have any static
    // objects or it doesn't have any visible to the light. Therefore,
-   // we need to test for visibility by doing frustum testing for each object.
+   // we need to frustum test the objects themselves.
 
    // FIXME: Support point lights
    assert(vkdf_light_get_type(sl->light) != VKDF_LIGHT_POINT);
@@ -2998,73 +4229,93 @@ find_dynamic_objects_for_light(VkdfScene *s,
    const VkdfBox *light_box = vkdf_frustum_get_box(f);
    const VkdfPlane *light_planes = vkdf_frustum_get_planes(f);
 
-   uint32_t start_index = 0;
-   g_hash_table_iter_init(&iter, s->dynamic.sets);
-   while (g_hash_table_iter_next(&iter, (void **)&id, (void **)&info)) {
-      if (!info || info->count == 0)
+   if (s->dynamic.bvh.count == 0)
+      return dyn_sets;
+
+   // This runs concurrently for multiple lights, so we can't use the scene's
+   // query arrays. Use the scratch memory of the thread instead.
+   size_t scratch_count =
+      2 * s->dynamic.bvh.count + s->dynamic.sets.count + 1;
+   uint32_t *items;
+   if (s->thread.pool) {
+      items = (uint32_t *)
+         vkdf_thread_pool_get_scratch(s->thread.pool, thread_id,
+                                      scratch_count * sizeof(uint32_t));
+   } else {
+      items = g_new(uint32_t, scratch_count);
+   }
+   uint32_t *sorted_items = items + s->dynamic.bvh.count;
+   uint32_t *set_start = sorted_items + s->dynamic.bvh.count;
+
+   uint32_t num_items =
+      vkdf_bvh_query_frustum(s->dynamic.bvh.bvh, light_box, light_planes,
+                             items);
+   sort_dynamic_items_by_set(s, num_items, items, set_start, sorted_items);
+
+   uint32_t start_index = 0;
+   for (uint32_t set = 0; set < s->dynamic.sets.count; set++) {
+      VkdfSceneSetInfo *info = &s->dynamic.sets.info[set];
+      if (info->count == 0)
          continue;
 
-      VkdfSceneSetInfo *dyn_info = g_new0(VkdfSceneSetInfo, 1);
-      g_hash_table_replace(dyn_sets, g_strdup(id), dyn_info);
+      VkdfSceneSetInfo *dyn_info = &dyn_sets->info[set];
       dyn_info->shadow_caster_start_index = start_index;
 
-      GList *obj_iter = info->objs;
-      while (obj_iter) {
-         VkdfObject *obj = (VkdfObject *) obj_iter->data;
-         if (vkdf_object_casts_shadows(obj)) {
-            VkdfBox *obj_box = vkdf_object_get_box(obj);
-            if (vkdf_box_is_in_frustum(obj_box, light_box, light_planes) != OUTSIDE) {
-               dyn_info->objs = g_list_prepend(dyn_info->objs, obj);
-               dyn_info->shadow_caster_count++;
-               start_index++;
-
-               if (vkdf_object_is_dirty(obj))
-                  *has_dirty_objects = true;
-            }
-         }
-         obj_iter = g_list_next(obj_iter);
+      for (uint32_t i = set_start[set]; i < set_start[set + 1]; i++) {
+         VkdfObject *obj = s->dynamic.bvh.objs[sorted_items[i]];
+         if (!vkdf_object_casts_shadows(obj))
+            continue;
+
+         dyn_info->objs = g_list_prepend(dyn_info->objs, obj);
+         dyn_info->shadow_caster_count++;
+         start_index++;
+
+         if (vkdf_object_is_dirty(obj))
+            *has_dirty_objects = true;
       }
    }
 
+   if (!s->thread.pool)
+      g_free(items);
+
    return dyn_sets;
 }
 
 static void
 record_dynamic_shadow_map_resource_updates_helper(VkdfScene *s,
                                                   const _DirtyShadowMapInfo *ds,
-                                                  VkDeviceSize *offset)
+                                                  uint8_t *mem)
 {
-   // Fill host buffer with data
-   //
    // We store visible objects to each light contiguously so we can use
    // instanced rendering. Because the same object can be seen by multiple
    // lights, we may have to replicate object data for each light.
-   uint8_t *mem = (uint8_t *) s->dynamic.ubo.shadow_map.host_buf;
-
+   VkDeviceSize offset = 0;
    uint32_t count = 0;
 
-   char *id;
-   VkdfSceneSetInfo *info;
-   GHashTableIter set_iter;
-   g_hash_table_iter_init(&set_iter, ds->dyn_sets);
-   while (g_hash_table_iter_next(&set_iter, (void **)&id, (void **)&info)) {
-      if (!info || info->shadow_caster_count == 0)
+   for (uint32_t set = 0; set < ds->dyn_sets->count; set++) {
+      VkdfSceneSetInfo *info = &ds->dyn_sets->info[set];
+      if (info->shadow_caster_count == 0)
          continue;
 
       // Sanity check
       assert(count == info->shadow_caster_start_index);
 
+      if (count + info->shadow_caster_count >
+          s->dynamic.ssbo.shadow_map.capacity) {
+         vkdf_fatal("Scene: out of space for dynamic shadow casters");
+      }
+
       GList *obj_iter = info->objs;
       while (obj_iter) {
          VkdfObject *obj = (VkdfObject *) obj_iter->data;
 
          // Model matrix
          glm::mat4 model = vkdf_object_get_model_matrix(obj);
-         memcpy(mem + (*offset),
+         memcpy(mem + offset,
                 &model[0][0], sizeof(glm::mat4));
-         *offset += sizeof(glm::mat4);
+         offset += sizeof(glm::mat4);
 
-         *offset = ALIGN(*offset, 16);
+         offset = ALIGN(offset, 16);
 
          count++;
          obj_iter = g_list_next(obj_iter);
@@ -3072,26 +4323,30 @@ record_dynamic_shadow_map_resource_updates_helper(VkdfScene *s,
    }
 }
 
+/**
+ * Writes the dynamic shadow casters for each dirty shadow map to the next
+ * slot of the dynamic shadow map buffer ring. Each light gets its own range of
+ * the slot, and the dynamic offset to it is stored in its dirty shadow map
+ * info.
+ */
 static void
 record_dynamic_shadow_map_resource_updates(VkdfScene *s,
-                                           const std::vector<struct LightThreadData>& data)
+                                           std::vector<struct LightThreadData>& data,
+                                           uint32_t data_count)
 {
-   VkDeviceSize offset = 0;
-   for (int i = 0; i < data.size(); i++) {
+   VkdfSceneBufferRing *ring = &s->dynamic.ssbo.shadow_map;
+   uint8_t *mem = buffer_ring_next_slot(ring);
+   uint32_t offset = buffer_ring_get_offset(ring);
+
+   for (uint32_t i = 0; i < data_count; i++) {
       if (!data[i].has_dirty_shadow_map)
          continue;
-      const struct _DirtyShadowMapInfo *ds = &data[i].shadow_map_info;
-      record_dynamic_shadow_map_resource_updates_helper(s, ds, &offset);
-   }
+      struct _DirtyShadowMapInfo *ds = &data[i].shadow_map_info;
+      record_dynamic_shadow_map_resource_updates_helper(s, ds, mem);
+      ds->dyn_ssbo_offset = offset;
 
-   // If offset > 0 then we have at least one dynamic object that needs
-   // to be updated
-   if (offset > 0) {
-      assert(offset < 64 * 1024);
-      uint8_t *mem = (uint8_t *) s->dynamic.ubo.shadow_map.host_buf;
-      vkCmdUpdateBuffer(s->cmd_buf.update_resources,
-                        s->dynamic.ubo.shadow_map.buf.buf,
-                        0, offset, mem);
+      mem += ring->range_stride;
+      offset += ring->range_stride;
    }
 }
 
@@ -3127,13 +4382,16 @@ thread_shadow_map_update(uint32_t thread_id, void *arg)
    // shadow map frames, since otherwise we get self-shadowing on dynamic
    // objects
    bool has_dirty_objects;
-   GHashTable *dyn_sets =
-      find_dynamic_objects_for_light(s, sl, &has_dirty_objects);
+   VkdfSceneSets *dyn_sets =
+      find_dynamic_objects_for_light(s, thread_id, sl, &has_dirty_objects);
    data->has_dirty_shadow_map = data->has_dirty_shadow_map || has_dirty_objects;
 
    if (data->has_dirty_shadow_map) {
       data->shadow_map_info.sl = sl;
       data->shadow_map_info.dyn_sets = dyn_sets;
+   } else {
+      free_scene_sets(dyn_sets, false);
+      g_free(dyn_sets);
    }
 }
 
@@ -3156,27 +4414,28 @@ directional_light_has_dirty_shadow_map(VkdfScene *s, VkdfSceneLight *sl)
    return false;
 }
 
-static void
-update_dirty_lights(VkdfScene *s)
+/**
+ * Goes through the list of lights and checks if they are dirty. Shadow map
+ * checks for shadow caster lights are added as jobs to 'group', one per
+ * light. Returns the number of jobs added.
+ */
+static uint32_t
+start_dirty_light_checks(VkdfScene *s,
+                         std::vector<struct LightThreadData> &data,
+                         VkdfThreadJobGroup *group)
 {
    s->lights_dirty = false;
    s->shadow_maps_dirty = false;
 
    uint32_t num_lights = s->lights.size();
    if (num_lights == 0)
-      return;
-
-   // Go through the list of lights and check if they are dirty and if they
-   // require new shadow maps. If they require new shadow maps, record
-   // the command buffers for them. We thread the shadow map checks per light.
+      return 0;
 
    // If all lights are shadow casters then we can have as much that many
    // dirty shadow maps
-   std::vector<struct LightThreadData> data;
    data.resize(num_lights);
    uint32_t data_count = 0;
 
-   bool has_thread_jobs = false;
    for (uint32_t i = 0; i < num_lights; i++) {
       VkdfSceneLight *sl = s->lights[i];
       VkdfLight *l = sl->light;
@@ -3202,22 +4461,28 @@ update_dirty_lights(VkdfScene *s)
       data[data_count].id = i;
       data[data_count].s = s;
       data[data_count].sl = sl;
-
-      if (s->thread.pool) {
-         has_thread_jobs = true;
-         vkdf_thread_pool_add_job(s->thread.pool,
-                                  thread_shadow_map_update,
-                                  &data[data_count]);
-      } else {
-         thread_shadow_map_update(0, &data[data_count]);
-      }
-
+      vkdf_thread_pool_add_group_job(s->thread.pool, group,
+                                     thread_shadow_map_update,
+                                     &data[data_count]);
       data_count++;
    }
 
-   // Wait for all threads to finish
-   if (has_thread_jobs)
-      vkdf_thread_pool_wait(s->thread.pool);
+   return data_count;
+}
+
+/**
+ * Records the resource updates and shadow map commands required by dirty
+ * lights. The shadow map checks started by start_dirty_light_checks() must
+ * have completed.
+ */
+static void
+update_dirty_lights(VkdfScene *s,
+                    std::vector<struct LightThreadData> &data,
+                    uint32_t data_count)
+{
+   uint32_t num_lights = s->lights.size();
+   if (num_lights == 0)
+      return;
 
    // Check if we have at least one shadow map that we need to update.
    uint32_t first_dirty_shadow_map = 0;
@@ -3240,7 +4505,7 @@ update_dirty_lights(VkdfScene *s)
 
    if (s->shadow_maps_dirty) {
       record_dirty_shadow_map_resource_updates(s);
-      record_dynamic_shadow_map_resource_updates(s, data);
+      record_dynamic_shadow_map_resource_updates(s, data, data_count);
 
       /* Record shadow map commands */
       start_recording_shadow_map_commands(s);
@@ -3248,10 +4513,11 @@ update_dirty_lights(VkdfScene *s)
          if (!data[i].has_dirty_shadow_map)
             continue;
          struct _DirtyShadowMapInfo *ds = &data[i].shadow_map_info;
-         record_shadow_map_commands(s, ds->sl, ds->dyn_sets);
+         record_shadow_map_commands(s, ds->sl, ds->dyn_sets,
+                                    ds->dyn_ssbo_offset);
 
-         g_hash_table_foreach(ds->dyn_sets, destroy_set, NULL);
-         g_hash_table_destroy(ds->dyn_sets);
+         free_scene_sets(ds->dyn_sets, false);
+         g_free(ds->dyn_sets);
       }
       stop_recording_shadow_map_commands(s);
    }
@@ -5283,353 +6549,1080 @@ prepare_scene_gbuffer_merge_command_buffer(VkdfScene *s)
       clear_values = NULL;
    }
 
-   VkRenderPassBeginInfo rp_begin =
-      vkdf_renderpass_begin_new(s->rp.gbuffer_merge.renderpass,
-                                s->rp.gbuffer_merge.framebuffer,
-                                0, 0, s->rt.width, s->rt.height,
-                                num_clear_values, clear_values);
+   VkRenderPassBeginInfo rp_begin =
+      vkdf_renderpass_begin_new(s->rp.gbuffer_merge.renderpass,
+                                s->rp.gbuffer_merge.framebuffer,
+                                0, 0, s->rt.width, s->rt.height,
+                                num_clear_values, clear_values);
+
+   vkCmdBeginRenderPass(cmd_buf,
+                        &rp_begin,
+                        VK_SUBPASS_CONTENTS_INLINE);
+
+   record_viewport_and_scissor_commands(cmd_buf, s->rt.width, s->rt.height);
+
+   s->callbacks.gbuffer_merge(s->ctx, cmd_buf, s->callbacks.data);
+
+   vkCmdEndRenderPass(cmd_buf);
+
+   vkdf_command_buffer_end(cmd_buf);
+
+   s->cmd_buf.gbuffer_merge = cmd_buf;
+}
+
+/**
+ * Processess scene contents and sets things up for optimal rendering
+ */
+void
+vkdf_scene_prepare(VkdfScene *s)
+{
+   prepare_render_target(s);
+   prepare_scene_objects(s);
+   prepare_scene_lights(s);
+   prepare_scene_render_passes(s);
+}
+
+static void
+record_dynamic_objects_command_buffer(VkdfScene *s,
+                                      VkCommandBuffer cmd_buf,
+                                      VkRenderPassBeginInfo *rp_begin)
+{
+   // We keep submitting these for as long as the visible dynamic objects
+   // don't change
+   vkdf_command_buffer_begin(cmd_buf,
+                             VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+
+   vkCmdBeginRenderPass(cmd_buf, rp_begin, VK_SUBPASS_CONTENTS_INLINE);
+
+   record_viewport_and_scissor_commands(cmd_buf, s->rt.width, s->rt.height);
+
+   const bool is_depth_prepass =
+      rp_begin->renderPass == s->rp.dpp_dynamic_geom.renderpass;
+   s->callbacks.record_commands(s->ctx, cmd_buf, &s->dynamic.visible,
+                                true, is_depth_prepass, s->callbacks.data);
+
+   vkCmdEndRenderPass(cmd_buf);
+
+   vkdf_command_buffer_end(cmd_buf);
+}
+
+struct DynamicObjectPackData {
+   VkdfScene *s;
+   uint8_t *obj_mem;                   // Buffer ring slot to write to
+   const uint32_t *items;              // Visible items, by buffer slot
+   const uint32_t *set_model_index;    // Model index, by set handle
+   const uint32_t *set_material_base;  // First material index, by set handle
+};
+
+/**
+ * Writes the buffer data for visible dynamic objects [begin, end) to the host
+ * buffer. Runs in parallel, each object is only touched by one thread.
+ */
+static void
+pack_dynamic_objects(uint32_t thread_id,
+                     uint32_t begin, uint32_t end,
+                     void *arg)
+{
+   struct DynamicObjectPackData *data = (struct DynamicObjectPackData *) arg;
+   VkdfScene *s = data->s;
+
+   const VkDeviceSize inst_size = s->dynamic.ssbo.obj.inst_size;
+   uint8_t *obj_mem = data->obj_mem;
+
+   for (uint32_t i = begin; i < end; i++) {
+      uint32_t item = data->items[i];
+      VkdfObject *obj = s->dynamic.bvh.objs[item];
+      VkDeviceSize obj_offset = i * inst_size;
+
+      glm::mat4 model_matrix = vkdf_object_get_model_matrix(obj);
+
+      // Model matrix
+      memcpy(obj_mem + obj_offset,
+             &model_matrix[0][0], sizeof(glm::mat4));
+      obj_offset += sizeof(glm::mat4);
+
+      // Base material index
+      uint32_t set = s->dynamic.bvh.set_handles[item];
+      uint32_t material_idx =
+         data->set_material_base[set] + obj->material_idx_base;
+      memcpy(obj_mem + obj_offset,
+             &material_idx, sizeof(uint32_t));
+      obj_offset += sizeof(uint32_t);
+
+      // Model index
+      uint32_t model_index = data->set_model_index[set];
+      memcpy(obj_mem + obj_offset,
+             &model_index, sizeof(uint32_t));
+      obj_offset += sizeof(uint32_t);
+
+      // Receives shadows
+      uint32_t receives_shadows = (uint32_t) obj->receives_shadows;
+      memcpy(obj_mem + obj_offset,
+             &receives_shadows, sizeof(uint32_t));
+
+      // This object is no longer dirty. Notice that we skip processing
+      // updates for dirty objects that are not visible.
+      vkdf_object_set_dirty(obj, false);
+   }
+}
+
+static bool
+has_dirty_dynamic_objects(VkdfScene *s, uint32_t count, const uint32_t *items)
+{
+   if (s->dynamic.bvh.num_dirty == 0)
+      return false;
+
+   for (uint32_t i = 0; i < count; i++) {
+      if (vkdf_object_is_dirty(s->dynamic.bvh.objs[items[i]]))
+         return true;
+   }
+
+   return false;
+}
+
+struct DynamicObjectOcclusionData {
+   VkdfScene *s;
+   const uint32_t *items;
+   uint8_t *visible;
+};
+
+static void
+test_dynamic_object_occlusion(uint32_t thread_id,
+                              uint32_t begin, uint32_t end,
+                              void *arg)
+{
+   struct DynamicObjectOcclusionData *data =
+      (struct DynamicObjectOcclusionData *) arg;
+   const VkdfBvh *bvh = data->s->dynamic.bvh.bvh;
+   const VkdfOcclusion *occ = data->s->occlusion.buf;
+   for (uint32_t i = begin; i < end; i++) {
+      data->visible[i] =
+         vkdf_occlusion_box_is_visible(occ, &bvh->boxes[data->items[i]]);
+   }
+}
+
+/**
+ * Removes the dynamic objects hidden behind occluders from the list of
+ * items in the camera frustum (s->dynamic.bvh.query_items). Returns the
+ * number of items left.
+ */
+static uint32_t
+remove_occluded_dynamic_objects(VkdfScene *s, uint32_t count, uint32_t *items)
+{
+   struct DynamicObjectOcclusionData data;
+   data.s = s;
+   data.items = items;
+   data.visible = s->dynamic.bvh.query_visible;
+   vkdf_thread_pool_parallel_for(s->thread.pool, 0, count,
+                                 DYNAMIC_OBJECT_GRAIN,
+                                 test_dynamic_object_occlusion, &data);
+
+   uint32_t num_visible = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      if (data.visible[i])
+         items[num_visible++] = items[i];
+   }
+
+   return num_visible;
+}
+
+/**
+ * Makes sure the per-set scratch arrays used to update dynamic objects have
+ * room for all the dynamic object sets.
+ */
+static void
+resize_dynamic_set_data(VkdfScene *s, uint32_t count)
+{
+   if (s->dynamic.set_data.size >= count)
+      return;
+
+   s->dynamic.set_data.start =
+      g_renew(uint32_t, s->dynamic.set_data.start, count + 1);
+   s->dynamic.set_data.model_index =
+      g_renew(uint32_t, s->dynamic.set_data.model_index, count);
+   s->dynamic.set_data.material_base =
+      g_renew(uint32_t, s->dynamic.set_data.material_base, count);
+   s->dynamic.set_data.size = count;
+}
+
+static void
+update_dirty_objects(VkdfScene *s)
+{
+   // Only need to do anything if we have dynamic objects
+   if (s->obj_count == s->static_obj_count)
+      return;
+
+   // If neither the camera, the occluders nor any object box changed, the
+   // visible objects are the same as in the previous frame and we only need
+   // to do something if any of them is dirty
+   uint32_t *items;
+   uint32_t num_visible;
+   bool same_visible;
+   if (!vkdf_camera_is_dirty(s->camera) && !s->dynamic.bvh.changed &&
+       !s->occlusion.changed) {
+      items = s->dynamic.bvh.last_visible;
+      num_visible = s->dynamic.bvh.num_last_visible;
+      same_visible = true;
+      if (!s->dynamic.materials_dirty &&
+          !has_dirty_dynamic_objects(s, num_visible, items)) {
+         return;
+      }
+   } else {
+      const VkdfBox *cam_box = vkdf_camera_get_frustum_box(s->camera);
+      const VkdfPlane *cam_planes =
+         vkdf_camera_get_frustum_planes(s->camera);
+      items = s->dynamic.bvh.query_items;
+      num_visible = vkdf_bvh_query_frustum(s->dynamic.bvh.bvh,
+                                           cam_box, cam_planes, items);
+      if (s->occlusion.buf)
+         num_visible = remove_occluded_dynamic_objects(s, num_visible, items);
+      same_visible = false;
+   }
+
+   // Group the visible objects by set
+   resize_dynamic_set_data(s, s->dynamic.sets.count);
+   uint32_t *sorted_items = s->dynamic.bvh.sorted_items;
+   uint32_t *set_start = s->dynamic.set_data.start;
+   sort_dynamic_items_by_set(s, num_visible, items, set_start, sorted_items);
+
+   // If the camera moved but we still see the same objects and none of them
+   // changed we can keep last frame's object data and command buffers
+   if (!same_visible &&
+       num_visible == s->dynamic.bvh.num_last_visible &&
+       !memcmp(sorted_items, s->dynamic.bvh.last_visible,
+               num_visible * sizeof(uint32_t)) &&
+       !s->dynamic.materials_dirty &&
+       !has_dirty_dynamic_objects(s, num_visible, sorted_items)) {
+      return;
+   }
+
+   // Keep track of the number of visible dynamic objects in the scene so we
+   // can compute start indices for each visible set in the buffer with the
+   // dynamic object data
+   s->dynamic.visible_obj_count = 0;
+   s->dynamic.visible_shadow_caster_count = 0;
+
+   // Go through all dynamic object sets and update visible sets and their
+   // material data. New data goes to the next slot of each buffer ring, since
+   // the GPU may still be using the current one.
+   uint8_t *mat_mem = NULL;
+   if (s->dynamic.materials_dirty)
+      mat_mem = buffer_ring_next_slot(&s->dynamic.ssbo.material);
+
+   resize_scene_sets(&s->dynamic.visible, s->dynamic.sets.count);
+
+   uint32_t *set_model_index = s->dynamic.set_data.model_index;
+   uint32_t *set_material_base = s->dynamic.set_data.material_base;
+
+   uint32_t model_index = 0;
+   uint32_t material_base = 0;
+   for (uint32_t set = 0; set < s->dynamic.sets.count; set++) {
+      VkdfSceneSetInfo *info = &s->dynamic.sets.info[set];
+      if (info->count == 0)
+         continue;
+
+      VkdfModel *model = ((VkdfObject *) info->objs->data)->model;
+      uint32_t num_materials = model->materials.size();
+
+      set_model_index[set] = model_index;
+      set_material_base[set] = material_base;
+
+      // Reset visible information for this set
+      VkdfSceneSetInfo *vis_info = &s->dynamic.visible.info[set];
+      g_list_free(vis_info->objs);
+      memset(vis_info, 0, sizeof(VkdfSceneSetInfo));
+
+      // Update visible objects for this set. Objects are sorted by set, so
+      // their positions in the sorted list are also their buffer slots.
+      vis_info->start_index = set_start[set];
+      vis_info->shadow_caster_start_index =
+         s->dynamic.visible_shadow_caster_count;
+
+      for (uint32_t i = set_start[set]; i < set_start[set + 1]; i++) {
+         VkdfObject *obj = s->dynamic.bvh.objs[sorted_items[i]];
+         vis_info->objs = g_list_prepend(vis_info->objs, obj);
+         if (vkdf_object_casts_shadows(obj))
+            vis_info->shadow_caster_count++;
+      }
+      vis_info->count = set_start[set + 1] - set_start[set];
+
+      s->dynamic.visible_obj_count += vis_info->count;
+      s->dynamic.visible_shadow_caster_count += vis_info->shadow_caster_count;
+
+      // Update material data for this dynamic object set. We only need to
+      // upload material data for dynamic objects once unless we have added
+      // new set-ids or the materials have been updated (we don't really
+      // support that for now)
+      //
+      // FIXME: support dirty materials for existing set-ids
+      if (s->dynamic.materials_dirty) {
+         if (material_base + num_materials >
+             s->dynamic.ssbo.material.capacity) {
+            vkdf_fatal("Scene: out of space for dynamic materials");
+         }
+
+         uint32_t material_size = s->dynamic.ssbo.material.inst_size;
+         VkDeviceSize mat_offset = material_base * material_size;
+         for (uint32_t mat_idx = 0; mat_idx < num_materials; mat_idx++) {
+            VkdfMaterial *m = &model->materials[mat_idx];
+            memcpy(mat_mem + mat_offset, m, sizeof(VkdfMaterial));
+            mat_offset += material_size;
+         }
+      }
+
+      model_index++;
+      material_base += num_materials;
+   }
+
+   // Pack the object data for the buffer upload
+   //
+   // FIXME: Maybe we want to wrap objects into sceneobjects so we can keep
+   // track of whether they are visible to the camera and the lights and their
+   // slots in the UBOs. Then here and in other similar updates, if the object
+   // is known to already be in the UBO and in the same slot as we would put
+   // it now, we can skip the memcpy's with the purpose of having the update
+   // command start at an offset > 0.
+   struct DynamicObjectPackData pack_data;
+   pack_data.s = s;
+   pack_data.obj_mem = buffer_ring_next_slot(&s->dynamic.ssbo.obj);
+   pack_data.items = sorted_items;
+   pack_data.set_model_index = set_model_index;
+   pack_data.set_material_base = set_material_base;
+   if (num_visible > s->dynamic.ssbo.obj.capacity)
+      vkdf_fatal("Scene: out of space for dynamic objects");
+   vkdf_thread_pool_parallel_for(s->thread.pool, 0, num_visible,
+                                 DYNAMIC_OBJECT_GRAIN,
+                                 pack_dynamic_objects, &pack_data);
+
+
+   // Remember what we have seen so we can tell if it changes in the next
+   // frame
+   s->dynamic.bvh.sorted_items = s->dynamic.bvh.last_visible;
+   s->dynamic.bvh.last_visible = sorted_items;
+   s->dynamic.bvh.num_last_visible = num_visible;
+
+   // We have processed all new materials by now
+   s->dynamic.materials_dirty = false;
+
+   // Record dynamic object rendering command buffer
+   if (s->cmd_buf.dynamic)
+      new_inactive_cmd_buf(s, 0, s->cmd_buf.dynamic);
+   if (s->cmd_buf.dpp_dynamic)
+      new_inactive_cmd_buf(s, 0, s->cmd_buf.dpp_dynamic);
+
+   if (s->dynamic.visible_obj_count > 0) {
+      VkCommandBuffer cmd_buf[2];
+      vkdf_create_command_buffer(s->ctx,
+                                 s->cmd_buf.pool[0],
+                                 VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+                                 s->rp.do_depth_prepass ? 2 : 1, cmd_buf);
+
+      VkRenderPassBeginInfo rp_begin =
+         vkdf_renderpass_begin_new(s->rp.dynamic_geom.renderpass,
+                                   s->rp.dynamic_geom.framebuffer,
+                                   0, 0, s->rt.width, s->rt.height,
+                                   0, NULL);
+
+      record_dynamic_objects_command_buffer(s, cmd_buf[0], &rp_begin);
+
+      s->cmd_buf.dynamic = cmd_buf[0];
+
+      if (s->rp.do_depth_prepass) {
+         rp_begin =
+            vkdf_renderpass_begin_new(s->rp.dpp_dynamic_geom.renderpass,
+                                      s->rp.dpp_dynamic_geom.framebuffer,
+                                      0, 0, s->rt.width, s->rt.height,
+                                      0, NULL);
+
+         record_dynamic_objects_command_buffer(s, cmd_buf[1], &rp_begin);
+
+         s->cmd_buf.dpp_dynamic = cmd_buf[1];
+      }
+   } else {
+      s->cmd_buf.dynamic = 0;
+      s->cmd_buf.dpp_dynamic = 0;
+   }
+}
+
+static void
+thread_update_cmd_bufs(uint32_t thread_id, void *arg)
+{
+   struct TileThreadData *data = (struct TileThreadData *) arg;
+
+   VkdfScene *s = data->s;
+
+   const VkdfBox *visible_box = data->visible_box;
+   const VkdfPlane *fplanes = data->fplanes;
+
+   uint32_t first_idx = data->first_idx;
+   uint32_t last_idx = data->last_idx;
+
+   // Make sure the visibility bitsets can hold all the tiles in the scene.
+   // Both bitsets are all zeros outside of the words tracked for them.
+   uint32_t num_words = (s->tiles_by_id->len + 63) / 64;
+   if (data->num_words < num_words) {
+      data->visible = g_renew(uint64_t, data->visible, num_words);
+      data->cur_visible = g_renew(uint64_t, data->cur_visible, num_words);
+      memset(data->visible + data->num_words, 0,
+             (num_words - data->num_words) * sizeof(uint64_t));
+      memset(data->cur_visible + data->num_words, 0,
+             (num_words - data->num_words) * sizeof(uint64_t));
+      data->num_words = num_words;
+   }
+
+   // Find visible tiles
+   struct _VisibleTiles cur_visible;
+   cur_visible.list = NULL;
+   cur_visible.bits = data->cur_visible;
+   cur_visible.min_word = UINT32_MAX;
+   cur_visible.max_word = 0;
+   cur_visible.occlusion = s->occlusion.buf;
+   collect_visible_tiles(s, first_idx, last_idx, visible_box, fplanes, true,
+                         &cur_visible);
+
+   // Only the words with bits set in either bitset can have changes. Since
+   // a slice only covers a few tiles, this is usually a small fraction of
+   // the bitsets.
+   uint32_t min_word = MIN2(data->min_word, cur_visible.min_word);
+   uint32_t max_word = MAX2(data->max_word, cur_visible.max_word);
+
+   // Identify new invisible tiles
+   data->cmd_buf_changes = false;
+   for (uint32_t w = min_word; w <= max_word && w < data->num_words; w++) {
+      uint64_t bits = data->visible[w] & ~data->cur_visible[w];
+      while (bits) {
+         uint32_t id = w * 64 + __builtin_ctzll(bits);
+         VkdfSceneTile *t =
+            (VkdfSceneTile *) g_ptr_array_index(s->tiles_by_id, id);
+         new_inactive_tile(data, t);
+         data->cmd_buf_changes = true;
+         bits &= bits - 1;
+      }
+   }
+
+   // Identify new visible tiles
+   for (uint32_t w = min_word; w <= max_word && w < data->num_words; w++) {
+      uint64_t bits = data->cur_visible[w] & ~data->visible[w];
+      while (bits) {
+         uint32_t id = w * 64 + __builtin_ctzll(bits);
+         VkdfSceneTile *t =
+            (VkdfSceneTile *) g_ptr_array_index(s->tiles_by_id, id);
+         if (t->obj_count > 0) {
+            new_active_tile(data, t);
+            data->cmd_buf_changes = true;
+         }
+         bits &= bits - 1;
+      }
+   }
+
+   // Keep the new set of visible tiles and clear the old one so it can be
+   // used as scratch next time
+   if (data->min_word <= data->max_word) {
+      memset(data->visible + data->min_word, 0,
+             (data->max_word - data->min_word + 1) * sizeof(uint64_t));
+   }
+
+   uint64_t *tmp = data->visible;
+   data->visible = data->cur_visible;
+   data->cur_visible = tmp;
+   data->min_word = cur_visible.min_word;
+   data->max_word = cur_visible.max_word;
+}
+
+static void
+start_update_cmd_bufs(VkdfScene *s, VkdfThreadJobGroup *group)
+{
+   const VkdfBox *cam_box = vkdf_camera_get_frustum_box(s->camera);
+   const VkdfPlane *cam_planes = vkdf_camera_get_frustum_planes(s->camera);
+
+   update_culling_drift(s, cam_planes);
+
+   for (uint32_t slice_idx = 0;
+        slice_idx < s->thread.num_slices;
+        slice_idx++) {
+      s->thread.tile_data[slice_idx].visible_box = cam_box;
+      s->thread.tile_data[slice_idx].fplanes = cam_planes;
+      s->thread.tile_data[slice_idx].cmd_buf_changes = false;
+   }
+
+   for (uint32_t slice_idx = 0;
+        slice_idx < s->thread.num_slices;
+        slice_idx++) {
+      vkdf_thread_pool_add_group_job(s->thread.pool, group,
+                                     thread_update_cmd_bufs,
+                                     &s->thread.tile_data[slice_idx]);
+   }
+}
+
+static bool
+finish_update_cmd_bufs(VkdfScene *s)
+{
+   bool cmd_buf_changes = s->thread.tile_data[0].cmd_buf_changes;
+   for (uint32_t slice_idx = 1;
+        cmd_buf_changes == false && slice_idx < s->thread.num_slices;
+        slice_idx++) {
+      cmd_buf_changes = cmd_buf_changes ||
+                        s->thread.tile_data[slice_idx].cmd_buf_changes;
+   }
+
+   return cmd_buf_changes;
+}
+
+static void
+compute_dirty_object_boxes(uint32_t thread_id,
+                           uint32_t begin, uint32_t end,
+                           void *arg)
+{
+   VkdfObject **objs = (VkdfObject **) arg;
+   for (uint32_t i = begin; i < end; i++) {
+      if (vkdf_object_is_dirty(objs[i]))
+         vkdf_object_get_box(objs[i]);
+   }
+}
+
+/**
+ * Brings the BVH of dynamic objects up to date with the objects' current
+ * boxes. This needs to happen before we query it for the camera or lights.
+ */
+static void
+update_dynamic_bvh(VkdfScene *s)
+{
+   s->dynamic.bvh.changed = false;
+   s->dynamic.bvh.num_dirty = 0;
+
+   const uint32_t count = s->dynamic.bvh.count;
+   if (count == 0)
+      return;
+
+   VkdfObject **objs = s->dynamic.bvh.objs;
+   VkdfBvh *bvh = s->dynamic.bvh.bvh;
+
+   if (s->dynamic.bvh.needs_build) {
+      VkdfBox *boxes = g_new(VkdfBox, count);
+      for (uint32_t i = 0; i < count; i++)
+         boxes[i] = *vkdf_object_get_box(objs[i]);
+
+      if (!bvh)
+         bvh = s->dynamic.bvh.bvh = vkdf_bvh_new();
+      vkdf_bvh_build(bvh, count, boxes);
+      g_free(boxes);
+
+      s->dynamic.bvh.needs_build = false;
+      s->dynamic.bvh.changed = true;
+      s->dynamic.bvh.num_dirty = count;
+      return;
+   }
+
+   // Computing the boxes of moving objects is the expensive part, so do that
+   // in parallel first
+   vkdf_thread_pool_parallel_for(s->thread.pool, 0, count,
+                                 DYNAMIC_OBJECT_GRAIN,
+                                 compute_dirty_object_boxes, objs);
+
+   // Objects stay dirty until they are visible to the camera, so only
+   // update items whose box actually changed since the last frame
+   for (uint32_t i = 0; i < count; i++) {
+      if (!vkdf_object_is_dirty(objs[i]))
+         continue;
+
+      s->dynamic.bvh.num_dirty++;
+
+      const VkdfBox *box = vkdf_object_get_box(objs[i]);
+      if (memcmp(box, &bvh->boxes[i], sizeof(VkdfBox))) {
+         vkdf_bvh_update_item(bvh, i, box);
+         s->dynamic.bvh.changed = true;
+      }
+   }
+
+   vkdf_bvh_refit(bvh);
+}
+
+/* Releases the secondaries of a tile and its subtiles and makes them look
+ * invisible, so they are recorded again the next time they are visible.
+ * The command buffers are freed once the GPU is done with them.
+ */
+static void
+invalidate_tile_cmd_bufs(struct TileThreadData *data, VkdfSceneTile *t)
+{
+   VkdfScene *s = data->s;
+   uint32_t job_id = data->id;
+
+   uint32_t w = t->id / 64;
+   if (w < data->num_words)
+      data->visible[w] &= ~(((uint64_t) 1) << (t->id % 64));
+
+   s->cmd_buf.active[job_id] = g_list_remove(s->cmd_buf.active[job_id], t);
+
+   if (s->cache[job_id].size > 0 && g_list_find(s->cache[job_id].cached, t))
+      remove_from_cache(data, t);
+
+   // Secondaries that expired from the cache are queued for freeing
+   // already, and the queue must not point to the tile since subtiles
+   // can move (see add_subtile())
+   GList *iter = s->cmd_buf.free[job_id];
+   while (iter) {
+      struct FreeCmdBufInfo *info = (struct FreeCmdBufInfo *) iter->data;
+      if (info->tile == t) {
+         if (t->cmd_buf == info->cmd_buf[0]) {
+            t->cmd_buf = 0;
+            t->depth_cmd_buf = 0;
+         }
+         info->tile = NULL;
+      }
+      iter = g_list_next(iter);
+   }
+
+   if (t->cmd_buf) {
+      struct FreeCmdBufInfo *info = g_new(struct FreeCmdBufInfo, 1);
+      info->cmd_buf[0] = t->cmd_buf;
+      if (s->rp.do_depth_prepass) {
+         info->num_commands = 2;
+         info->cmd_buf[1] = t->depth_cmd_buf;
+      } else {
+         info->num_commands = 1;
+      }
+      info->tile = NULL;
+      s->cmd_buf.free[job_id] = g_list_prepend(s->cmd_buf.free[job_id], info);
 
-   vkCmdBeginRenderPass(cmd_buf,
-                        &rp_begin,
-                        VK_SUBPASS_CONTENTS_INLINE);
+      t->cmd_buf = 0;
+      t->depth_cmd_buf = 0;
+   }
 
-   record_viewport_and_scissor_commands(cmd_buf, s->rt.width, s->rt.height);
+   t->dirty = true;
 
-   s->callbacks.gbuffer_merge(s->ctx, cmd_buf, s->callbacks.data);
+   for (uint32_t i = 0; i < t->num_subtiles; i++)
+      invalidate_tile_cmd_bufs(data, &t->subtiles[i]);
+}
 
-   vkCmdEndRenderPass(cmd_buf);
+static void
+invalidate_top_level_tile_cmd_bufs(VkdfScene *s, VkdfSceneTile *t)
+{
+   for (uint32_t i = 0; i < s->thread.num_slices; i++) {
+      struct TileThreadData *data = &s->thread.tile_data[i];
+      if (t->index >= data->first_idx && t->index <= data->last_idx) {
+         invalidate_tile_cmd_bufs(data, t);
+         return;
+      }
+   }
+   assert(!"Tile is not in any slice");
+}
 
-   vkdf_command_buffer_end(cmd_buf);
+/* Object lists of non-leaf tiles are built from the lists of their
+ * subtiles, so they need to be reset before we build them again.
+ */
+static void
+reset_object_lists(VkdfSceneTile *t)
+{
+   if (!t->subtiles)
+      return;
 
-   s->cmd_buf.gbuffer_merge = cmd_buf;
+   for (uint32_t set = 0; set < t->sets.count; set++) {
+      VkdfSceneSetInfo *info = &t->sets.info[set];
+      g_list_free(info->objs);
+      info->objs = NULL;
+      info->count = 0;
+      info->shadow_caster_count = 0;
+   }
+
+   for (uint32_t i = 0; i < t->num_subtiles; i++)
+      reset_object_lists(&t->subtiles[i]);
 }
 
 /**
- * Processess scene contents and sets things up for optimal rendering
+ * Makes all shadow maps render again in the next frame, even for lights
+ * that skip shadow map frames.
  */
-void
-vkdf_scene_prepare(VkdfScene *s)
+static void
+invalidate_shadow_maps(VkdfScene *s)
 {
-   prepare_render_target(s);
-   prepare_scene_objects(s);
-   prepare_scene_lights(s);
-   prepare_scene_render_passes(s);
+   for (uint32_t i = 0; i < s->lights.size(); i++) {
+      VkdfSceneLight *sl = s->lights[i];
+      if (!vkdf_light_casts_shadows(sl->light))
+         continue;
+      vkdf_light_set_dirty_shadows(sl->light, true);
+      sl->shadow.frame_counter = -1;
+   }
 }
 
+/**
+ * The application binds the object and material buffers in its own
+ * descriptor sets, so we can only replace them if it can update them.
+ */
 static void
-record_dynamic_objects_command_buffer(VkdfScene *s,
-                                      VkCommandBuffer cmd_buf,
-                                      VkRenderPassBeginInfo *rp_begin)
+check_buffers_can_grow(VkdfScene *s, const char *what)
 {
-   vkdf_command_buffer_begin(cmd_buf,
-                             VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-
-   vkCmdBeginRenderPass(cmd_buf, rp_begin, VK_SUBPASS_CONTENTS_INLINE);
+   if (!s->callbacks.buffers_changed) {
+      vkdf_fatal("Scene: out of space for %s, use "
+                 "vkdf_scene_set_buffers_changed_callback() so the scene "
+                 "can grow its buffers", what);
+   }
+}
 
-   record_viewport_and_scissor_commands(cmd_buf, s->rt.width, s->rt.height);
+/**
+ * Lets the application update its descriptors after we replaced buffers it
+ * binds, with the GPU idle, and makes sure that everything that was
+ * recorded with them is recorded again.
+ */
+static void
+finish_buffer_replacement(VkdfScene *s)
+{
+   s->callbacks.buffers_changed(s->ctx, s->callbacks.data);
 
-   const bool is_depth_prepass =
-      rp_begin->renderPass == s->rp.dpp_dynamic_geom.renderpass;
-   s->callbacks.record_commands(s->ctx, cmd_buf, s->dynamic.visible,
-                                true, is_depth_prepass, s->callbacks.data);
+   // Writing the dynamic materials again also writes the dynamic object
+   // data and records the dynamic object command buffers
+   s->dynamic.materials_dirty = true;
 
-   vkCmdEndRenderPass(cmd_buf);
+   for (uint32_t i = 0; i < s->num_tiles.total; i++)
+      invalidate_top_level_tile_cmd_bufs(s, &s->tiles[i]);
 
-   vkdf_command_buffer_end(cmd_buf);
+   invalidate_shadow_maps(s);
 }
 
+/**
+ * Replaces the static material buffer with one that has room for the
+ * materials of the new object sets. The materials we have already are
+ * copied from the old buffer, since the models of their sets may not be
+ * loaded any more (see vkdf_scene_set_model()), so material indices don't
+ * change.
+ */
 static void
-update_dirty_objects(VkdfScene *s)
+grow_static_material_buffer(VkdfScene *s)
 {
-   // Only need to do anything if we have dynamic objects
-   if (s->obj_count == s->static_obj_count)
-      return;
+   check_buffers_can_grow(s, "static materials");
+
+   vkDeviceWaitIdle(s->ctx->device);
+
+   VkdfBuffer old_buf = s->ssbo.material.buf;
+   create_static_material_buffer(s, s->ssbo.material.count +
+                                    count_new_set_materials(s));
+
+   VkDeviceSize used =
+      s->ssbo.material.count * ALIGN(sizeof(VkdfMaterial), 16);
+   if (used > 0) {
+      uint8_t *old_mem, *mem;
+      vkdf_memory_map(s->ctx, old_buf.mem, 0, used, (void **) &old_mem);
+      vkdf_memory_map(s->ctx, s->ssbo.material.buf.mem,
+                      0, used, (void **) &mem);
+      memcpy(mem, old_mem, used);
+      vkdf_memory_unmap(s->ctx, s->ssbo.material.buf.mem,
+                        s->ssbo.material.buf.mem_props, 0, used);
+      vkdf_memory_unmap(s->ctx, old_buf.mem, old_buf.mem_props, 0, used);
+   }
+   vkdf_destroy_buffer(s->ctx, &old_buf);
 
-   const VkdfBox *cam_box = vkdf_camera_get_frustum_box(s->camera);
-   const VkdfPlane *cam_planes = vkdf_camera_get_frustum_planes(s->camera);
+   // This always fits, we made room for the materials of the new sets
+   write_static_materials(s);
 
-   // Keep track of the number of visible dynamic objects in the scene so we
-   // can compute start indices for each visible set in the UBO with the
-   // dynamic object data
-   s->dynamic.visible_obj_count = 0;
-   s->dynamic.visible_shadow_caster_count = 0;
+   finish_buffer_replacement(s);
+}
 
-   // Go through all dynamic objects in the scene and update visible sets
-   // and their material data
-   uint8_t *obj_mem = (uint8_t *) s->dynamic.ubo.obj.host_buf;
-   uint8_t *mat_mem = (uint8_t *) s->dynamic.ubo.material.host_buf;
-   VkDeviceSize obj_offset = 0;
-   VkDeviceSize mat_offset;
+/**
+ * Sets up the material data and shadow map pipelines for the object sets
+ * added since the last frame. Returns true if the material buffer had to
+ * be replaced.
+ */
+static bool
+prepare_new_sets(VkdfScene *s)
+{
+   const uint32_t num_sets = s->set_ids->len;
+   const uint32_t first_new_set = s->ssbo.material.num_set_bases;
+
+   // Applications can reserve room for more materials at any time
+   bool grown = false;
+   if (s->static_edit.reserved_materials > s->ssbo.material.capacity ||
+       !write_static_materials(s)) {
+      grow_static_material_buffer(s);
+      grown = true;
+   }
 
-   uint32_t model_index = 0;
-   char *id;
-   VkdfSceneSetInfo *info;
-   GHashTableIter set_iter;
-   g_hash_table_iter_init(&set_iter, s->dynamic.sets);
-   while (g_hash_table_iter_next(&set_iter, (void **)&id, (void **)&info)) {
-      if (!info || info->count == 0)
-         continue;
+   if (first_new_set == num_sets)
+      return grown;
 
-      // Reset visible information for this set
-      VkdfSceneSetInfo *vis_info =
-         (VkdfSceneSetInfo *) g_hash_table_lookup(s->dynamic.visible, id);
-      if (!vis_info) {
-         vis_info = g_new0(VkdfSceneSetInfo, 1);
-         g_hash_table_replace(s->dynamic.visible, g_strdup(id), vis_info);
-      } else if (vis_info->objs) {
-         g_list_free(vis_info->objs);
-         memset(vis_info, 0, sizeof(VkdfSceneSetInfo));
-      }
+   resize_scene_sets(&s->dynamic.sets, num_sets);
+   resize_scene_sets(&s->dynamic.visible, num_sets);
 
-      // Update visible objects for this set
-      vis_info->start_index = s->dynamic.visible_obj_count;
-      vis_info->shadow_caster_start_index =
-         s->dynamic.visible_shadow_caster_count;
+   if (s->shadows.pipeline.pipelines) {
+      GList *model_iter = g_list_nth(s->models, first_new_set);
+      while (model_iter) {
+         VkdfModel *model = (VkdfModel *) model_iter->data;
+         for (uint32_t i = 0; model && i < model->meshes.size(); i++)
+            create_shadow_map_pipeline_for_mesh(s, model->meshes[i]);
+         model_iter = g_list_next(model_iter);
+      }
+   }
 
-      GList *obj_iter = info->objs;
-      while (obj_iter) {
-         VkdfObject *obj = (VkdfObject *) obj_iter->data;
+   return grown;
+}
 
-         // FIXME: Maybe we want to wrap objects into sceneobjects so we
-         // can keep track of whether they are visible to the camera and the
-         // lights and their slots in the UBOs. Then here and in other
-         // similar updates, if the object is known to already be in the UBO
-         // and in the same slot as we would put it now, we can skip
-         // the memcpy's with the purpose of having the update command
-         // start at an offset > 0.
-         //
-         // FIXME: The above would enable another optimization: we could
-         // skip the frustum testing if we know that the object is not dirty
-         // (or maybe more procisely, it has not moved) and the
-         // camera is not dirty and the object was visible in the previous
-         // frame.
-         VkdfBox *obj_box = vkdf_object_get_box(obj);
-         if (vkdf_box_is_in_frustum(obj_box, cam_box, cam_planes) != OUTSIDE) {
-            // Update host buffer for UBO upload
-            glm::mat4 model_matrix = vkdf_object_get_model_matrix(obj);
-
-            // Model matrix
-            memcpy(obj_mem + obj_offset,
-                   &model_matrix[0][0], sizeof(glm::mat4));
-            obj_offset += sizeof(glm::mat4);
-
-            // Base material index
-            memcpy(obj_mem + obj_offset,
-                   &obj->material_idx_base, sizeof(uint32_t));
-            obj_offset += sizeof(uint32_t);
-
-            // Model index
-            memcpy(obj_mem + obj_offset,
-                   &model_index, sizeof(uint32_t));
-            obj_offset += sizeof(uint32_t);
-
-            // Receives shadows
-            uint32_t receives_shadows = (uint32_t) obj->receives_shadows;
-            memcpy(obj_mem + obj_offset,
-                   &receives_shadows, sizeof(uint32_t));
-            obj_offset += sizeof(uint32_t);
-
-            obj_offset = ALIGN(obj_offset, 16);
-
-            // Add the object to the viisble list and update visibility counters
-            vis_info->objs = g_list_prepend(vis_info->objs, obj);
-            vis_info->count++;
-            if (vkdf_object_casts_shadows) {
-               vis_info->shadow_caster_count++;
-               s->dynamic.visible_shadow_caster_count++;
-            }
-            s->dynamic.visible_obj_count++;
+/**
+ * Replaces the dynamic object buffers that are too small for the dynamic
+ * objects in the scene with larger ones. Frames in flight may still use
+ * the old buffers, so this waits for the GPU to be idle, and all the
+ * command buffers that bind them are recorded again. Returns true if any
+ * buffer was replaced.
+ */
+static bool
+grow_dynamic_object_buffers(VkdfScene *s)
+{
+   const uint32_t num_objs = s->dynamic.bvh.count;
+   bool grow_objs = num_objs > s->dynamic.ssbo.obj.capacity;
+   bool grow_materials =
+      s->dynamic.material_count > s->dynamic.ssbo.material.capacity;
+   bool grow_shadow_map = s->dynamic.ssbo.shadow_map.buf.buf &&
+                          num_objs > s->dynamic.ssbo.shadow_map.capacity;
+
+   if (!grow_objs && !grow_materials && !grow_shadow_map)
+      return false;
 
-            // This object is no longer dirty. Notice that we skip processing
-            // updates for dirty objects that are not visible.
-            vkdf_object_set_dirty(obj, false);
-         }
+   check_buffers_can_grow(s, "dynamic objects");
 
-         obj_iter = g_list_next(obj_iter);
-      }
+   vkDeviceWaitIdle(s->ctx->device);
 
-      // Update material data for this dynamic object set. We only need to
-      // upload material data for dynamic objects once unless we have added
-      // new set-ids or the materials have been updated (we don't really
-      // support that for now)
-      //
-      // FIXME: support dirty materials for existing set-ids
-      if (s->dynamic.materials_dirty) {
-         VkdfModel *model = ((VkdfObject *) info->objs->data)->model;
-         uint32_t material_size = ALIGN(sizeof(VkdfMaterial), 16);
-         mat_offset = model_index * MAX_MATERIALS_PER_MODEL * material_size;
-         uint32_t num_materials = model->materials.size();
-         assert(num_materials <= MAX_MATERIALS_PER_MODEL);
-         for (uint32_t mat_idx = 0; mat_idx < num_materials; mat_idx++) {
-            VkdfMaterial *m = &model->materials[mat_idx];
-            memcpy(mat_mem + mat_offset, m, material_size);
-            mat_offset += material_size;
-         }
-      }
+   if (grow_objs) {
+      destroy_buffer_ring(s, &s->dynamic.ssbo.obj);
+      create_dynamic_object_ssbo(s);
+   }
 
-      model_index++;
+   if (grow_materials) {
+      destroy_buffer_ring(s, &s->dynamic.ssbo.material);
+      create_dynamic_material_ssbo(s);
    }
 
-   // Record dynamic resource update command buffer for dynamic objects and
-   // materials
-   //
-   // FIXME: Maybe we can skip this if we have an efficient way to know that
-   // it has not changed from the previous frame ahead. For now,
-   // we update every frame.
-   if (s->dynamic.visible_obj_count > 0) {
-      s->cmd_buf.have_resource_updates = true;
-
-      /* We can only use VkCmdUpdateBuffer for small updates, but that should
-       * be okay assuming that we won't have too many dynamic objects in a
-       * scene (as in many hundreds of them).
-       *
-       * FIXME: vkCmdUpdateBuffer is not the most efficient thing to do, but
-       * it has the advantage that the update won't happen until the command
-       * buffer executes and we ensure it won't until it is dafe to update
-       * the UBO. If we want to implement an alternative we will need to use
-       * a ring a UBOs and command buffers so that we do buffer updates against
-       * buffers that are not being accessed by commands in execution.
-       */
-      assert(obj_offset < 64 * 1024);
-      vkCmdUpdateBuffer(s->cmd_buf.update_resources,
-                        s->dynamic.ubo.obj.buf.buf,
-                        0, obj_offset,
-                        s->dynamic.ubo.obj.host_buf);
+   if (grow_shadow_map) {
+      destroy_buffer_ring(s, &s->dynamic.ssbo.shadow_map);
+      create_dynamic_shadow_map_ssbo(s);
 
-      if (s->dynamic.materials_dirty) {
-         assert(mat_offset < 64 * 1024);
-         vkCmdUpdateBuffer(s->cmd_buf.update_resources,
-                           s->dynamic.ubo.material.buf.buf,
-                           0, mat_offset,
-                           s->dynamic.ubo.material.host_buf);
-      }
+      VkDeviceSize buf_offset = 0;
+      VkDeviceSize buf_size = s->dynamic.ssbo.shadow_map.size;
+      vkdf_descriptor_set_buffer_update(s->ctx,
+                                        s->shadows.pipeline.dyn_models_set,
+                                        s->dynamic.ssbo.shadow_map.buf.buf,
+                                        0, 1, &buf_offset, &buf_size,
+                                        true, false);
    }
 
-   // We have processed all new materials by now
-   s->dynamic.materials_dirty = false;
+   finish_buffer_replacement(s);
 
-   // Record dynamic object rendering command buffer
-   if (s->cmd_buf.dynamic)
-      new_inactive_cmd_buf(s, 0, s->cmd_buf.dynamic);
-   if (s->cmd_buf.dpp_dynamic)
-      new_inactive_cmd_buf(s, 0, s->cmd_buf.dpp_dynamic);
+   return true;
+}
 
-   if (s->dynamic.visible_obj_count > 0) {
-      VkCommandBuffer cmd_buf[2];
-      vkdf_create_command_buffer(s->ctx,
-                                 s->cmd_buf.pool[0],
-                                 VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-                                 s->rp.do_depth_prepass ? 2 : 1, cmd_buf);
+/**
+ * Lays out all the static objects again from the start of the static
+ * buffers, replacing them with larger ones if they are close to full. This
+ * is only needed when there is no free range large enough for a tile that
+ * changed, and it needs to wait for the GPU to be idle, since it overwrites
+ * data that frames in flight may be using.
+ */
+static void
+compact_static_objects(VkdfScene *s)
+{
+   bool grow_objs =
+      static_buffer_capacity(s, s->static_obj_count) > s->ssbo.obj.capacity;
+   bool grow_shadow_map =
+      s->ssbo.shadow_map.buf.buf &&
+      static_buffer_capacity(s, s->static_shadow_caster_count) >
+         s->ssbo.shadow_map.capacity;
 
-      VkRenderPassBeginInfo rp_begin =
-         vkdf_renderpass_begin_new(s->rp.dynamic_geom.renderpass,
-                                   s->rp.dynamic_geom.framebuffer,
-                                   0, 0, s->rt.width, s->rt.height,
-                                   0, NULL);
+   if (grow_objs)
+      check_buffers_can_grow(s, "static objects");
 
-      record_dynamic_objects_command_buffer(s, cmd_buf[0], &rp_begin);
+   vkDeviceWaitIdle(s->ctx->device);
 
-      s->cmd_buf.dynamic = cmd_buf[0];
+   if (grow_objs) {
+      vkdf_destroy_buffer(s->ctx, &s->ssbo.obj.buf);
+      create_static_object_ssbo(s);
+   }
 
-      if (s->rp.do_depth_prepass) {
-         rp_begin =
-            vkdf_renderpass_begin_new(s->rp.dpp_dynamic_geom.renderpass,
-                                      s->rp.dpp_dynamic_geom.framebuffer,
-                                      0, 0, s->rt.width, s->rt.height,
-                                      0, NULL);
+   if (grow_shadow_map) {
+      vkdf_destroy_buffer(s->ctx, &s->ssbo.shadow_map.buf);
+      create_static_shadow_map_ssbo(s);
 
-         record_dynamic_objects_command_buffer(s, cmd_buf[1], &rp_begin);
+      VkDeviceSize buf_offset = 0;
+      VkDeviceSize buf_size = s->ssbo.shadow_map.size;
+      vkdf_descriptor_set_buffer_update(s->ctx,
+                                        s->shadows.pipeline.models_set,
+                                        s->ssbo.shadow_map.buf.buf,
+                                        0, 1, &buf_offset, &buf_size,
+                                        true, false);
+   }
 
-         s->cmd_buf.dpp_dynamic = cmd_buf[1];
-      }
+   compute_static_start_indices(s);
+   write_static_objects(s);
+
+   if (grow_objs) {
+      finish_buffer_replacement(s);
    } else {
-      s->cmd_buf.dynamic = 0;
-      s->cmd_buf.dpp_dynamic = 0;
+      for (uint32_t i = 0; i < s->num_tiles.total; i++)
+         invalidate_top_level_tile_cmd_bufs(s, &s->tiles[i]);
    }
+
+   if (s->static_shadow_caster_count > 0)
+      s->static_edit.shadow_casters_changed = true;
 }
 
+/**
+ * Releases the slots of a top-level tile in the static buffers. Frames in
+ * flight may still use them, so they are reused a few frames later.
+ */
 static void
-thread_update_cmd_bufs(uint32_t thread_id, void *arg)
+release_tile_ranges(VkdfScene *s, VkdfSceneTile *t)
 {
-   struct TileThreadData *data = (struct TileThreadData *) arg;
+   const VkdfSceneTileRanges *r = &s->static_edit.tile_ranges[t->index];
+   range_allocator_release(&s->ssbo.obj.alloc, r->obj.start, r->obj.count);
+   if (s->ssbo.shadow_map.buf.buf) {
+      range_allocator_release(&s->ssbo.shadow_map.alloc,
+                              r->shadow_map.start, r->shadow_map.count);
+   }
+}
 
-   VkdfScene *s = data->s;
+/**
+ * Allocates slots in the static buffers for the current objects of a
+ * top-level tile. Returns false if there is no free range large enough.
+ */
+static bool
+alloc_tile_ranges(VkdfScene *s, VkdfSceneTile *t)
+{
+   VkdfSceneTileRanges *r = &s->static_edit.tile_ranges[t->index];
 
-   const VkdfBox *visible_box = data->visible_box;
-   const VkdfPlane *fplanes = data->fplanes;
+   r->obj.count = t->obj_count;
+   if (!range_allocator_alloc(&s->ssbo.obj.alloc,
+                              r->obj.count, &r->obj.start)) {
+      return false;
+   }
 
-   uint32_t first_idx = data->first_idx;
-   uint32_t last_idx = data->last_idx;
+   r->shadow_map.count = t->shadow_caster_count;
+   r->shadow_map.start = 0;
+   if (s->ssbo.shadow_map.buf.buf &&
+       !range_allocator_alloc(&s->ssbo.shadow_map.alloc,
+                              r->shadow_map.count, &r->shadow_map.start)) {
+      return false;
+   }
 
-   // Find visible tiles
-   GList *prev_visible = data->visible;
-   GList *cur_visible =
-      find_visible_tiles(s, first_idx, last_idx, visible_box, fplanes);
+   return true;
+}
 
-   // Identify new invisible tiles
-   data->cmd_buf_changes = false;
-   GList *iter = prev_visible;
+/**
+ * Applies the static object additions and removals made since the last
+ * frame. Only the top-level tiles with changes are updated: their objects
+ * are written to free slots of the static buffers, since frames in flight
+ * may still be using their current data. Returns true if there were any
+ * changes.
+ */
+static bool
+update_static_tiles(VkdfScene *s)
+{
+   range_allocator_next_frame(&s->ssbo.obj.alloc);
+   range_allocator_next_frame(&s->ssbo.shadow_map.alloc);
+
+   // Applications can reserve room for more objects at any time
+   bool grow = s->static_edit.reserved_objs > s->ssbo.obj.capacity;
+
+   if (!s->static_edit.tiles && !grow)
+      return false;
+
+   const uint32_t num_sets = s->set_ids->len;
+
+   // Rebuild the object lists of the tiles with changes
+   GList *iter = s->static_edit.tiles;
    while (iter) {
       VkdfSceneTile *t = (VkdfSceneTile *) iter->data;
-      if (!g_list_find(cur_visible, t)) {
-         new_inactive_tile(data, t);
-         data->cmd_buf_changes = true;
-      }
+      ensure_set_infos(t, num_sets);
+      reset_object_lists(t);
+      for (uint32_t set = 0; set < num_sets; set++)
+         build_object_lists(s, t, set);
+
+      // Shadow caster indices change with the tile's data, so shadow maps
+      // that render the tile need to be recorded again
+      if (t->shadow_caster_count > 0)
+         s->static_edit.shadow_casters_changed = true;
+
       iter = g_list_next(iter);
    }
 
-   // Identify new visible tiles
-   iter = cur_visible;
+   // Move the tiles with changes to new slots
+   iter = s->static_edit.tiles;
    while (iter) {
-      VkdfSceneTile *t = (VkdfSceneTile *) iter->data;
-      if (t->obj_count > 0 && !g_list_find(prev_visible, t)) {
-         new_active_tile(data, t);
-         data->cmd_buf_changes = true;
-      }
+      release_tile_ranges(s, (VkdfSceneTile *) iter->data);
+      iter = g_list_next(iter);
+   }
+
+   bool fits = !grow;
+   iter = s->static_edit.tiles;
+   while (iter && fits) {
+      fits = alloc_tile_ranges(s, (VkdfSceneTile *) iter->data);
       iter = g_list_next(iter);
    }
 
-   // Attach the new list of visible tiles
-   g_list_free(data->visible);
-   data->visible = cur_visible;
+   if (!fits) {
+      compact_static_objects(s);
+   } else {
+      uint8_t *obj_mem, *shadow_mem;
+      map_static_object_buffers(s, &obj_mem, &shadow_mem);
+
+      iter = s->static_edit.tiles;
+      while (iter) {
+         VkdfSceneTile *t = (VkdfSceneTile *) iter->data;
+         compute_tile_ranges_start_indices(s, t);
+         write_static_tile_data(s, t, obj_mem, shadow_mem);
+         invalidate_top_level_tile_cmd_bufs(s, t);
+         iter = g_list_next(iter);
+      }
+
+      unmap_static_object_buffers(s);
+   }
+
+   // Tile boxes may have changed
+   build_occupied_tiles(s);
+
+   if (s->static_edit.shadow_casters_changed)
+      invalidate_shadow_maps(s);
+
+   g_list_free(s->static_edit.tiles);
+   s->static_edit.tiles = NULL;
+   s->static_edit.shadow_casters_changed = false;
+
+   return true;
 }
 
+/**
+ * Renders the occluders again if the camera or any of the occluders moved.
+ * Returns true if it did, since then the visible tiles and dynamic objects
+ * can change even if the camera didn't move.
+ */
 static bool
-update_cmd_bufs(VkdfScene *s)
+update_occlusion(VkdfScene *s)
 {
-   const VkdfBox *cam_box = vkdf_camera_get_frustum_box(s->camera);
-   const VkdfPlane *cam_planes = vkdf_camera_get_frustum_planes(s->camera);
+   s->occlusion.changed = false;
+   if (!s->occlusion.buf)
+      return false;
 
-   for (uint32_t thread_idx = 0;
-        thread_idx < s->thread.num_threads;
-        thread_idx++) {
-      s->thread.tile_data[thread_idx].visible_box = cam_box;
-      s->thread.tile_data[thread_idx].fplanes = cam_planes;
-      s->thread.tile_data[thread_idx].cmd_buf_changes = false;
-   }
+   VkdfOcclusion *occ = s->occlusion.buf;
 
-   if (s->thread.pool) {
-      for (uint32_t thread_idx = 0;
-           thread_idx < s->thread.num_threads;
-           thread_idx++) {
-         vkdf_thread_pool_add_job(s->thread.pool,
-                                  thread_update_cmd_bufs,
-                                  &s->thread.tile_data[thread_idx]);
-      }
-      vkdf_thread_pool_wait(s->thread.pool);
-   } else {
-      thread_update_cmd_bufs(0, &s->thread.tile_data[0]);
-   }
+   GHashTableIter iter;
+   gpointer key, value;
+   g_hash_table_iter_init(&iter, s->occlusion.occluders);
+   while (g_hash_table_iter_next(&iter, &key, &value)) {
+      VkdfObject *obj = (VkdfObject *) key;
+      if (!vkdf_object_is_dynamic(obj))
+         continue;
 
-   bool cmd_buf_changes = s->thread.tile_data[0].cmd_buf_changes;
-   for (uint32_t thread_idx = 1;
-        cmd_buf_changes == false && thread_idx < s->thread.num_threads;
-        thread_idx++) {
-      cmd_buf_changes = cmd_buf_changes ||
-                        s->thread.tile_data[thread_idx].cmd_buf_changes;
+      glm::mat4 transform = vkdf_object_get_model_matrix(obj);
+      vkdf_occlusion_set_occluder_transform(occ, (VkdfOccluder *) value,
+                                            transform);
    }
 
-   return cmd_buf_changes;
+   if (!vkdf_camera_is_dirty(s->camera) && !vkdf_occlusion_is_dirty(occ))
+      return false;
+
+   glm::mat4 view_proj = (*vkdf_camera_get_projection_ptr(s->camera)) *
+                         vkdf_camera_get_view_matrix(s->camera);
+   vkdf_occlusion_render(occ, view_proj,
+                         vkdf_camera_get_position(s->camera),
+                         vkdf_camera_get_frustum_box(s->camera),
+                         vkdf_camera_get_frustum_planes(s->camera));
+
+   s->occlusion.changed = true;
+   return true;
 }
 
 static void
@@ -5654,21 +7647,58 @@ scene_update(VkdfScene *s)
    // Record resource updates from the application
    record_client_resource_updates(s);
 
+   // Dynamic object boxes must be up to date before the light jobs start
+   update_dynamic_bvh(s);
+
+   // Objects may come from new sets. Their materials may not fit in the
+   // material buffer, and replacing it invalidates all the secondaries.
+   bool static_changes = prepare_new_sets(s);
+
+   // Static objects added or removed since the last frame. This invalidates
+   // the secondaries and shadow maps for the tiles involved.
+   static_changes |= update_static_tiles(s);
+
+   // Dynamic objects added since the last frame may not fit in the dynamic
+   // object buffers
+   static_changes |= grow_dynamic_object_buffers(s);
+
+   // Occluders have to be rendered before we test tiles and objects
+   // against them
+   bool occlusion_changes = update_occlusion(s);
+
+   // If the camera didn't change, then our active tiles remain the same and
+   // we don't need to re-record secondaries for them
+   bool update_tiles = vkdf_camera_is_dirty(s->camera) || static_changes ||
+                       occlusion_changes;
+
+   // Shadow map checks for lights and tile visibility updates are
+   // independent, so we run them concurrently and wait for both to finish.
+   // We can't record anything else until then, since the tile jobs record
+   // secondaries from the same command pool we use for resource updates.
+   VkdfThreadJobGroup group;
+   vkdf_thread_job_group_init(&group, NULL, NULL);
+
+   std::vector<struct LightThreadData> light_data;
+   uint32_t light_data_count = start_dirty_light_checks(s, light_data, &group);
+   if (update_tiles)
+      start_update_cmd_bufs(s, &group);
+
+   vkdf_thread_pool_wait_group(s->thread.pool, &group);
+
    // Process scene element changes (this may also record resource updates)
    // We want to update dirty lights first so we can know if any dirty objects
    // are visible to them (since that means their shadow maps are dirty).
-   update_dirty_lights(s);
+   update_dirty_lights(s, light_data, light_data_count);
    update_dirty_objects(s);
 
    // At this point we are done recording resource updates
    stop_recording_resource_updates(s);
 
-   // If the camera didn't change, then our active tiles remain the same and
-   // we don't need to re-record secondaries for them
-   if (vkdf_camera_is_dirty(s->camera)) {
-      bool cmd_buf_changes = update_cmd_bufs(s);
+   if (update_tiles) {
+      bool cmd_buf_changes = finish_update_cmd_bufs(s);
 
-      if (!s->cmd_buf.primary[s->cmd_buf.cur_idx] || cmd_buf_changes) {
+      if (!s->cmd_buf.primary[s->cmd_buf.cur_idx] || cmd_buf_changes ||
+          static_changes) {
          build_primary_cmd_buf(s);
       }
 
@@ -9,6 +9,8 @@
 #include "vkdf-plane.hpp"
 #include "vkdf-object.hpp"
 #include "vkdf-box.hpp"
+#include "vkdf-bvh.hpp"
+#include "vkdf-occlusion.hpp"
 #include "vkdf-buffer.hpp"
 #include "vkdf-camera.hpp"
 #include "vkdf-thread-pool.hpp"
@@ -47,6 +49,55 @@ const VkFormat GBUFFER_FIXED_FORMATS[GBUFFER_LAST_FIXED_IDX] = {
 static const uint32_t SCENE_CMD_BUF_LIST_SIZE = 2;
 static const bool SCENE_FREE_SECONDARIES = false;
 
+// Number of tile slices per thread. Slices are small so threads that run out
+// of work can pick up the slices of busier threads.
+static const uint32_t SCENE_SLICES_PER_THREAD = 8;
+
+// Number of slots in host-written buffer rings. Rendering for frame N-1 has
+// completed by the time we update frame N+1, so two slots are enough.
+static const uint32_t SCENE_BUFFER_RING_SIZE = 2;
+
+/* A host-visible storage buffer with SCENE_BUFFER_RING_SIZE slots that stays
+ * mapped for the lifetime of the scene. New data is written to the next slot while the
+ * GPU may still be reading the current one, and descriptors select the slot
+ * with a dynamic offset.
+ *
+ * Each slot can be split in ranges with room for 'capacity' instances each,
+ * so different users can select their own range with the dynamic offset.
+ */
+typedef struct {
+   VkdfBuffer buf;
+   VkDeviceSize inst_size;
+   uint32_t capacity;          // Instances in each range
+   VkDeviceSize size;          // Size of each range (the descriptor range)
+   VkDeviceSize range_stride;  // Distance between ranges in a slot
+   VkDeviceSize slot_stride;   // Distance between slots
+   uint8_t *ptr;               // Mapping of the whole buffer
+   uint32_t slot;              // Slot with the current data
+} VkdfSceneBufferRing;
+
+/* A range of instance slots in a static object buffer */
+typedef struct {
+   uint32_t start;
+   uint32_t count;
+} VkdfSceneRange;
+
+/* Free slots in a static object buffer. Frames in flight may still read the
+ * slots freed in a frame, so they can only be allocated again after
+ * SCENE_BUFFER_RING_SIZE frames.
+ */
+typedef struct {
+   GList *free;                             // Free ranges, sorted by start
+   GList *pending[SCENE_BUFFER_RING_SIZE];  // Ranges freed in recent frames
+   uint32_t frame;                          // Pending list for this frame
+} VkdfSceneRangeAllocator;
+
+/* Slots used by the objects of a top-level tile in the static buffers */
+typedef struct {
+   VkdfSceneRange obj;
+   VkdfSceneRange shadow_map;
+} VkdfSceneTileRanges;
+
 typedef struct {
    uint32_t shadow_map_size;
    float shadow_map_near;
@@ -117,6 +168,29 @@ typedef struct {
 typedef struct _VkdfSceneTile VkdfSceneTile;
 typedef struct _VkdfScene VkdfScene;
 
+typedef struct {
+   GList *objs;                        // Set list
+   uint32_t start_index;               // The global scene set index of the first object in this set
+   uint32_t count;                     // Number of objects in the set
+   uint32_t shadow_caster_start_index; // The shadow map scene set index of the first shadow caster object in this set
+   uint32_t shadow_caster_count;       // Number of objects in the set that cast shadows
+} VkdfSceneSetInfo;
+
+/* Per-set object information, indexed by set handle. Set handles are dense
+ * integers assigned in the order set ids are first added to the scene
+ * (see vkdf_scene_get_set_handle()).
+ */
+typedef struct {
+   uint32_t count;                     // Number of entries in info
+   VkdfSceneSetInfo *info;
+} VkdfSceneSets;
+
+inline VkdfSceneSetInfo *
+vkdf_scene_sets_get(VkdfSceneSets *sets, uint32_t set_handle)
+{
+   return set_handle < sets->count ? &sets->info[set_handle] : NULL;
+}
+
 struct TileThreadData {
    uint32_t id;
    VkdfScene *s;
@@ -124,13 +198,18 @@ struct TileThreadData {
    uint32_t last_idx;
    const VkdfBox *visible_box;
    const VkdfPlane *fplanes;
-   GList *visible;
+   uint32_t num_words;         // Size of the visibility bitsets
+   uint64_t *visible;          // Visible tiles and subtiles, indexed by id
+   uint64_t *cur_visible;      // Scratch bitset for the new visible tiles
+   uint32_t min_word;          // Range of words with bits set in visible
+   uint32_t max_word;
    bool cmd_buf_changes;
 };
 
 struct _DirtyShadowMapInfo {
    VkdfSceneLight *sl;
-   GHashTable *dyn_sets;
+   VkdfSceneSets *dyn_sets;
+   uint32_t dyn_ssbo_offset;   // Dynamic offset of the light's object data
 };
 
 struct LightThreadData {
@@ -143,27 +222,31 @@ struct LightThreadData {
    struct _DirtyShadowMapInfo shadow_map_info;
 };
 
+/* Boxes of the subtiles of a tile in SoA form, in the same order as the
+ * subtiles, so culling can test them all at once.
+ */
 typedef struct {
-   GList *objs;                        // Set list
-   uint32_t start_index;               // The global scene set index of the first object in this set
-   uint32_t count;                     // Number of objects in the set
-   uint32_t shadow_caster_start_index; // The shadow map scene set index of the first shadow caster object in this set
-   uint32_t shadow_caster_count;       // Number of objects in the set that cast shadows
-} VkdfSceneSetInfo;
+   float cx[8], cy[8], cz[8];
+   float ex[8], ey[8], ez[8];
+} VkdfSceneSubtileBoxes;
 
 struct _VkdfSceneTile {
    int32_t parent;
    uint32_t level;                 // Level of the tile
    uint32_t index;                 // Index of the tile in the level
+   uint32_t id;                    // Unique id of the tile in the scene
    glm::vec3 offset;               // world-space offset of the tile
    bool dirty;                     // Whether new objects have been added
    VkdfBox box;                    // Bounding box of the ojects in the tile
-   GHashTable *sets;               // Objects in the tile
+   VkdfSceneSets sets;             // Objects in the tile
    uint32_t obj_count;             // Number of objects in the tile
    uint32_t shadow_caster_count;   // Number of objects in the tile that can cast shadows
    VkCommandBuffer cmd_buf;        // Secondary command buffer for this tile
    VkCommandBuffer depth_cmd_buf;  // Secondary command buffer for this tile (depth-prepass)
-   VkdfSceneTile *subtiles;        // Subtiles within this tile
+   uint32_t subtile_mask;          // Subtiles in use, by Morton index
+   uint32_t num_subtiles;          // Number of bits set in subtile_mask
+   VkdfSceneTile *subtiles;        // Subtiles in use, in Morton order
+   VkdfSceneSubtileBoxes *subtile_boxes;
 };
 
 /* Screen-Space Reflections configuration. Check SSR fragment shader for
@@ -197,9 +280,10 @@ typedef struct {
 
 typedef void (*VkdfSceneUpdateStateCB)(void *);
 typedef bool (*VkdfSceneUpdateResourcesCB)(VkdfContext *, VkCommandBuffer, void *);
-typedef void (*VkdfSceneCommandsCB)(VkdfContext *, VkCommandBuffer, GHashTable *, bool, bool, void *);
+typedef void (*VkdfSceneCommandsCB)(VkdfContext *, VkCommandBuffer, VkdfSceneSets *, bool, bool, void *);
 typedef void (*VkdfScenePostprocessCB)(VkdfContext *, VkCommandBuffer, void *);
 typedef void (*VkdfSceneGbufferMergeCommandsCB)(VkdfContext *, VkCommandBuffer, void *);
+typedef void (*VkdfSceneBuffersChangedCB)(VkdfContext *, void *);
 
 struct _dim {
    float w;
@@ -219,8 +303,10 @@ struct _VkdfScene {
    // Scene resources
    VkdfCamera *camera;
    std::vector<VkdfSceneLight *> lights;
-   GList *set_ids;
-   GList *models;
+   GPtrArray *set_ids;                  // Set ids, indexed by set handle
+   GHashTable *set_handles;             // Set id -> set handle + 1
+   GList *models;                       // Set models, in set handle order,
+                                        // NULL while not loaded
 
    bool deferred;
 
@@ -513,6 +599,38 @@ struct _VkdfScene {
    } num_tiles;
 
    VkdfSceneTile *tiles;
+   GPtrArray *tiles_by_id;     // Tiles and subtiles, indexed by tile id
+
+   // Non-empty top-level tiles sorted by index, with their boxes in SoA form
+   // so culling can stream through them
+   struct {
+      uint32_t count;
+      uint32_t *index;
+      float *cx, *cy, *cz;
+      float *ex, *ey, *ez;
+      float max_abs[3];        // Largest absolute x/y/z of any tile box
+      float overhang[3];       // Largest x/y/z distance a tile box sticks out of its cell
+
+      // Camera culling results from previous frames
+      uint8_t *last_result;    // Last result (OUTSIDE, INSIDE or INTERSECT)
+      uint8_t *last_plane;     // Last frustum plane that rejected the tile
+      double *expiry;          // Last result is valid while culling.drift < expiry
+   } occupied_tiles;
+
+   // Temporal coherence for camera culling
+   struct {
+      bool skip_unchanged;     // Don't reclassify tiles with a valid last result
+      bool has_planes;
+      VkdfPlane planes[6];     // Camera frustum planes in the last update
+      double drift;            // Bound on the accumulated motion of the planes
+   } culling;
+
+   // CPU occlusion culling for the camera (disabled if buf is NULL)
+   struct {
+      VkdfOcclusion *buf;
+      GHashTable *occluders;   // VkdfOccluder by VkdfObject
+      bool changed;            // Occluders were rendered again in this frame
+   } occlusion;
 
    struct _cache *cache;
 
@@ -525,6 +643,17 @@ struct _VkdfScene {
    uint32_t static_shadow_caster_count; // Number of static objects that are shadow casters
    bool has_shadow_caster_lights;       // If we have any static objects that can cast shadows
 
+   // Static objects added or removed after vkdf_scene_prepare(). Only the
+   // top-level tiles that contain them are updated, in the next frame.
+   struct {
+      bool prepared;                    // Scene objects have been prepared
+      uint32_t reserved_objs;           // Static objects to make room for
+      uint32_t reserved_materials;      // Materials to make room for
+      GList *tiles;                     // Top-level tiles with changes
+      bool shadow_casters_changed;
+      VkdfSceneTileRanges *tile_ranges; // Static buffer slots, by top-level tile
+   } static_edit;
+
    /** 
     * active    : list of secondary command buffers that are active (that is,
     *             they are associated with a currently visible tile).
@@ -575,6 +704,7 @@ struct _VkdfScene {
       VkdfSceneCommandsCB record_commands;            // Records command buffers
       VkdfScenePostprocessCB postprocess;             // Executes post-processing command buffers
       VkdfSceneGbufferMergeCommandsCB gbuffer_merge;  // Records Gbuffer merge command buffer (deferred only)
+      VkdfSceneBuffersChangedCB buffers_changed;      // Updates descriptors for object and material buffers
       void *data;
       VkdfImage *postprocess_output;                  // Pointer to output image produced by the postprocessing chain
    } callbacks;
@@ -582,8 +712,9 @@ struct _VkdfScene {
    struct {
       VkdfThreadPool *pool;
       uint32_t num_threads;
+      uint32_t num_slices;
       uint32_t work_size;
-      struct TileThreadData *tile_data;
+      struct TileThreadData *tile_data;  // One per tile slice
    } thread;
 
    struct {
@@ -604,60 +735,75 @@ struct _VkdfScene {
       VkDescriptorPool static_pool;
       struct {
          VkdfBuffer buf;
-         VkDeviceSize inst_size;
+         VkDeviceSize light_data_size;
+         VkDeviceSize shadow_map_data_offset;
+         VkDeviceSize shadow_map_data_size;
          VkDeviceSize size;
-      } obj;
+      } light;
+   } ubo;
+
+   struct {
+      VkDescriptorPool dynamic_pool;   // For dynamic storage buffer descriptors
       struct {
          VkdfBuffer buf;
+         VkDeviceSize inst_size;
          VkDeviceSize size;
-      } material;
+         uint32_t capacity;            // Object slots in the buffer
+         VkdfSceneRangeAllocator alloc;
+      } obj;
       struct {
          VkdfBuffer buf;
-         VkDeviceSize light_data_size;
-         VkDeviceSize shadow_map_data_offset;
-         VkDeviceSize shadow_map_data_size;
          VkDeviceSize size;
-      } light;
+         uint32_t capacity;            // Material slots in the buffer
+         uint32_t count;               // Materials in the buffer
+         uint32_t num_set_bases;
+         uint32_t *set_base;           // First material, by set handle
+      } material;
       struct {
          VkdfBuffer buf;
          VkDeviceSize inst_size;
          VkDeviceSize size;
+         uint32_t capacity;            // Shadow caster slots in the buffer
+         VkdfSceneRangeAllocator alloc;
       } shadow_map;
-   } ubo;
-
-   struct {
+   } ssbo;
+  struct {
       VkDescriptorPool pool;
    } sampler;
 
    struct {
       uint32_t visible_obj_count;            // Number of dynamic objects that are visible
       uint32_t visible_shadow_caster_count;  // Number of visible dynamic objects that can cast shadows
-      GHashTable *sets;                      // Dynamic objects, these are not tiled
-      GHashTable *visible;                   // Dynamic objects that are visible
+      VkdfSceneSets sets;                    // Dynamic objects, these are not tiled
+      VkdfSceneSets visible;                 // Dynamic objects that are visible
       bool materials_dirty;
+      uint32_t material_count;               // Materials of the sets with dynamic objects
       struct {
-         // UBO for dynamic object updates
-         struct {
-            VkdfBuffer buf;
-            VkDeviceSize inst_size;
-            VkDeviceSize size;
-            void *host_buf;
-         } obj;
-         // UBO for dynamic material updates
-         struct {
-            VkdfBuffer buf;
-            VkDeviceSize inst_size;
-            VkDeviceSize size;
-            void *host_buf;
-         } material;
-         // UBO for dynamic shadow map object updates
-         struct {
-            VkdfBuffer buf;
-            VkDeviceSize inst_size;
-            VkDeviceSize size;
-            void *host_buf;
-         } shadow_map;
-      } ubo;
+         VkdfBvh *bvh;                       // BVH of dynamic object boxes
+         bool needs_build;                   // Objects added since last build
+         bool changed;                       // BVH changed in this frame
+         uint32_t num_dirty;                 // Dirty objects in this frame
+         uint32_t count;                     // Number of dynamic objects
+         uint32_t size;                      // Allocated size of the arrays
+         VkdfObject **objs;                  // Dynamic objects, by BVH item
+         uint32_t *set_handles;              // Object set handles, by BVH item
+         uint32_t *query_items;              // Camera query results
+         uint8_t *query_visible;             // Occlusion results for query_items
+         uint32_t *sorted_items;             // Camera query results by set
+         uint32_t *last_visible;             // Visible items, by set
+         uint32_t num_last_visible;
+      } bvh;
+      struct {
+         uint32_t size;                      // Allocated size, in sets
+         uint32_t *start;                    // First visible sorted item, by set (size + 1)
+         uint32_t *model_index;              // Model index, by set handle
+         uint32_t *material_base;            // First material index, by set handle
+      } set_data;                            // Scratch for update_dirty_objects()
+      struct {
+         VkdfSceneBufferRing obj;         // Dynamic object data
+         VkdfSceneBufferRing material;    // Dynamic material data
+         VkdfSceneBufferRing shadow_map;  // Dynamic shadow caster data, by light
+      } ssbo;
    } dynamic;
 };
 
@@ -685,6 +831,18 @@ vkdf_scene_get_camera(VkdfScene *scene)
 void
 vkdf_scene_add_object(VkdfScene *scene, const char *set_id, VkdfObject *obj);
 
+void
+vkdf_scene_remove_object(VkdfScene *scene, const char *set_id, VkdfObject *obj);
+
+void
+vkdf_scene_set_model(VkdfScene *scene, const char *set_id, VkdfModel *model);
+
+void
+vkdf_scene_reserve_static_objects(VkdfScene *scene, uint32_t count);
+
+void
+vkdf_scene_reserve_static_materials(VkdfScene *scene, uint32_t count);
+
 void
 vkdf_scene_set_clear_values(VkdfScene *scene,
                             VkClearValue *color,
@@ -729,52 +887,83 @@ vkdf_scene_get_depth_render_target(VkdfScene *s)
    return &s->rt.depth;
 }
 
+/**
+ * Object and material data are stored in storage buffers sized for the
+ * objects in the scene when it is prepared, so shaders should declare them
+ * as buffer blocks with unsized arrays. The material index in each object's
+ * data is the index of its first material in the material buffer.
+ *
+ * The buffers can be replaced later if objects are added, see
+ * vkdf_scene_set_buffers_changed_callback().
+ */
 inline VkdfBuffer *
-vkdf_scene_get_object_ubo(VkdfScene *s)
+vkdf_scene_get_object_buffer(VkdfScene *s)
 {
-   return &s->ubo.obj.buf;
+   return &s->ssbo.obj.buf;
 }
 
 inline VkDeviceSize
-vkdf_scene_get_object_ubo_size(VkdfScene *s)
+vkdf_scene_get_object_buffer_size(VkdfScene *s)
 {
-   return s->ubo.obj.size;
+   return s->ssbo.obj.size;
 }
 
 inline VkdfBuffer *
-vkdf_scene_get_dynamic_object_ubo(VkdfScene *s)
+vkdf_scene_get_dynamic_object_buffer(VkdfScene *s)
 {
-   return &s->dynamic.ubo.obj.buf;
+   return &s->dynamic.ssbo.obj.buf;
 }
 
 inline VkDeviceSize
-vkdf_scene_get_dynamic_object_ubo_size(VkdfScene *s)
+vkdf_scene_get_dynamic_object_buffer_size(VkdfScene *s)
 {
-   return s->dynamic.ubo.obj.size;
+   return s->dynamic.ssbo.obj.size;
 }
 
 inline VkdfBuffer *
-vkdf_scene_get_material_ubo(VkdfScene *s)
+vkdf_scene_get_material_buffer(VkdfScene *s)
 {
-   return &s->ubo.material.buf;
+   return &s->ssbo.material.buf;
 }
 
 inline VkDeviceSize
-vkdf_scene_get_material_ubo_size(VkdfScene *s)
+vkdf_scene_get_material_buffer_size(VkdfScene *s)
 {
-   return s->ubo.material.size;
+   return s->ssbo.material.size;
 }
 
 inline VkdfBuffer *
-vkdf_scene_get_dynamic_material_ubo(VkdfScene *s)
+vkdf_scene_get_dynamic_material_buffer(VkdfScene *s)
 {
-   return &s->dynamic.ubo.material.buf;
+   return &s->dynamic.ssbo.material.buf;
 }
 
 inline VkDeviceSize
-vkdf_scene_get_dynamic_material_ubo_size(VkdfScene *s)
+vkdf_scene_get_dynamic_material_buffer_size(VkdfScene *s)
+{
+   return s->dynamic.ssbo.material.size;
+}
+
+/**
+ * Returns the dynamic offset to bind the dynamic object buffer with for the
+ * current frame. The dynamic object buffer must be bound as a
+ * VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC descriptor with a range of
+ * vkdf_scene_get_dynamic_object_buffer_size().
+ */
+inline uint32_t
+vkdf_scene_get_dynamic_object_buffer_offset(VkdfScene *s)
 {
-   return s->dynamic.ubo.material.size;
+   return s->dynamic.ssbo.obj.slot * s->dynamic.ssbo.obj.slot_stride;
+}
+
+/**
+ * Like vkdf_scene_get_dynamic_object_buffer_offset(), for the dynamic
+ * material buffer.
+ */
+inline uint32_t
+vkdf_scene_get_dynamic_material_buffer_offset(VkdfScene *s)
+{
+   return s->dynamic.ssbo.material.slot * s->dynamic.ssbo.material.slot_stride;
 }
 
 inline uint32_t
@@ -844,10 +1033,36 @@ vkdf_scene_get_object_count(VkdfScene *scene)
    return scene->obj_count;
 }
 
+#define VKDF_SCENE_INVALID_SET_HANDLE ((uint32_t) -1)
+
+/**
+ * Returns the handle of a set id or VKDF_SCENE_INVALID_SET_HANDLE if no
+ * objects have been added to the scene with that set id.
+ */
+inline uint32_t
+vkdf_scene_get_set_handle(VkdfScene *s, const char *set_id)
+{
+   return GPOINTER_TO_UINT(g_hash_table_lookup(s->set_handles, set_id)) - 1;
+}
+
+inline const char *
+vkdf_scene_get_set_id(VkdfScene *s, uint32_t set_handle)
+{
+   assert(set_handle < s->set_ids->len);
+   return (const char *) g_ptr_array_index(s->set_ids, set_handle);
+}
+
+inline uint32_t
+vkdf_scene_get_num_sets(VkdfScene *s)
+{
+   return s->set_ids->len;
+}
+
 inline VkdfSceneSetInfo *
 vkdf_scene_get_dynamic_object_set(VkdfScene *s, const char *set_id)
 {
-   return (VkdfSceneSetInfo *) g_hash_table_lookup(s->dynamic.sets, set_id);
+   return vkdf_scene_sets_get(&s->dynamic.sets,
+                              vkdf_scene_get_set_handle(s, set_id));
 }
 
 inline uint32_t
@@ -856,6 +1071,16 @@ vkdf_scene_get_num_tiles(VkdfScene *s)
    return s->num_tiles.total;
 }
 
+inline VkdfSceneTile *
+vkdf_scene_get_tile(VkdfScene *s, uint32_t index)
+{
+   assert(index < s->num_tiles.total);
+   return &s->tiles[index];
+}
+
+uint32_t
+vkdf_scene_get_tile_index(VkdfScene *s, glm::vec3 pos);
+
 void
 vkdf_scene_add_light(VkdfScene *s,
                      VkdfLight *light,
@@ -874,6 +1099,25 @@ vkdf_scene_set_scene_callbacks(VkdfScene *s,
    s->callbacks.data = data;
 }
 
+/**
+ * The scene replaces its object and material buffers with larger ones when
+ * the objects added to it don't fit. When that happens it waits for the
+ * GPU to be idle and calls 'cb', so the application can update the
+ * descriptor sets where it binds them before anything else is recorded.
+ * Command buffers recorded by the scene are recorded again, but
+ * applications must record again any other command buffers that bind
+ * those descriptor sets.
+ *
+ * Scenes without this callback can't grow their buffers, so running out
+ * of space in them is a fatal error.
+ */
+inline void
+vkdf_scene_set_buffers_changed_callback(VkdfScene *s,
+                                        VkdfSceneBuffersChangedCB cb)
+{
+   s->callbacks.buffers_changed = cb;
+}
+
 inline void
 vkdf_scene_enable_postprocessing(VkdfScene *s,
                                  VkdfScenePostprocessCB pp_cb,
@@ -901,6 +1145,29 @@ vkdf_scene_enable_depth_prepass(VkdfScene *s)
    s->rp.do_depth_prepass = true;
 }
 
+/**
+ * If enabled (the default), top-level tiles are not tested against the
+ * camera frustum while the camera has moved too little to change their
+ * previous culling result.
+ */
+inline void
+vkdf_scene_set_temporal_culling(VkdfScene *s, bool enable)
+{
+   s->culling.skip_unchanged = enable;
+}
+
+void
+vkdf_scene_enable_occlusion_culling(VkdfScene *s,
+                                    uint32_t width,
+                                    uint32_t height,
+                                    uint32_t max_triangles);
+
+void
+vkdf_scene_add_occluder(VkdfScene *s, VkdfObject *obj);
+
+void
+vkdf_scene_remove_occluder(VkdfScene *s, VkdfObject *obj);
+
 void
 vkdf_scene_enable_ssao(VkdfScene *s,
                        float downsampling,
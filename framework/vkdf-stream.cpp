@@ -0,0 +1,683 @@
+#include "vkdf-stream.hpp"
+#include "vkdf-util.hpp"
+#include "vkdf-error.hpp"
+
+/* Content that has been unloaded but may still be in use by the GPU */
+struct _PendingFree {
+   uint32_t frames;
+   GPtrArray *objs;
+   VkdfStreamModel *m;
+   VkdfModel *model;
+};
+
+VkdfStream *
+vkdf_stream_new(VkdfContext *ctx,
+                VkdfScene *scene,
+                VkCommandPool pool,
+                VkDeviceSize budget,
+                float load_dist,
+                float unload_dist)
+{
+   assert(unload_dist >= load_dist);
+
+   // Streamed objects and their materials go into the scene's static
+   // buffers, which can only grow if the application can update its
+   // descriptors for them
+   if (!scene->callbacks.buffers_changed) {
+      vkdf_fatal("Stream: the scene needs a buffers changed callback, see "
+                 "vkdf_scene_set_buffers_changed_callback()");
+   }
+
+   VkdfStream *stream = g_new0(VkdfStream, 1);
+
+   stream->ctx = ctx;
+   stream->scene = scene;
+   stream->pool = pool;
+   stream->budget = budget;
+   stream->load_dist = load_dist;
+   stream->unload_dist = unload_dist;
+   stream->upload_budget = VKDF_STREAM_DEFAULT_UPLOAD_BUDGET;
+
+   stream->models = g_ptr_array_new();
+   stream->model_handles = g_hash_table_new(g_str_hash, g_str_equal);
+   stream->tiles = g_new0(VkdfStreamTile *, vkdf_scene_get_num_tiles(scene));
+   stream->used_tiles = g_ptr_array_new();
+
+   return stream;
+}
+
+static void
+free_model_data(VkdfStream *stream, VkdfStreamModel *m)
+{
+   if (m->tex_data) {
+      vkdf_model_free_texture_data(m->tex_data);
+      m->tex_data = NULL;
+   }
+
+   if (m->model) {
+      vkdf_model_free(stream->ctx, m->model);
+      m->model = NULL;
+   }
+}
+
+static void
+free_pending(VkdfStream *stream, struct _PendingFree *pf)
+{
+   if (pf->objs) {
+      for (uint32_t i = 0; i < pf->objs->len; i++)
+         vkdf_object_free((VkdfObject *) g_ptr_array_index(pf->objs, i));
+      g_ptr_array_free(pf->objs, TRUE);
+   }
+
+   if (pf->model) {
+      if (stream->callbacks.model_unloaded) {
+         stream->callbacks.model_unloaded(stream->ctx, pf->m->set_id,
+                                          pf->model, stream->callbacks.data);
+      }
+      vkdf_model_free(stream->ctx, pf->model);
+   }
+
+   g_free(pf);
+}
+
+static void
+add_pending_free(VkdfStream *stream,
+                 GPtrArray *objs,
+                 VkdfStreamModel *m,
+                 VkdfModel *model)
+{
+   struct _PendingFree *pf = g_new0(struct _PendingFree, 1);
+   pf->frames = VKDF_STREAM_FREE_DELAY;
+   pf->objs = objs;
+   pf->m = m;
+   pf->model = model;
+   stream->pending_free = g_list_prepend(stream->pending_free, pf);
+}
+
+static void
+unload_tile(VkdfStream *stream, VkdfStreamTile *t);
+
+void
+vkdf_stream_free(VkdfStream *stream)
+{
+   // Take resident objects out of the scene first
+   for (uint32_t i = 0; i < stream->used_tiles->len; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      unload_tile(stream, t);
+   }
+
+   // Loads in flight write to the models, so wait for them
+   for (uint32_t i = 0; i < stream->models->len; i++) {
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, i);
+      if (m->state == VKDF_STREAM_MODEL_LOADING) {
+         vkdf_thread_pool_wait_group(vkdf_get_thread_pool(stream->ctx),
+                                     &m->load_group);
+      }
+   }
+
+   vkDeviceWaitIdle(stream->ctx->device);
+
+   GList *iter = stream->pending_free;
+   while (iter) {
+      free_pending(stream, (struct _PendingFree *) iter->data);
+      iter = g_list_next(iter);
+   }
+   g_list_free(stream->pending_free);
+
+   for (uint32_t i = 0; i < stream->models->len; i++) {
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, i);
+      free_model_data(stream, m);
+      g_free(m->set_id);
+      g_free(m->path);
+      g_free(m);
+   }
+   g_ptr_array_free(stream->models, TRUE);
+   g_hash_table_destroy(stream->model_handles);
+
+   for (uint32_t i = 0; i < stream->used_tiles->len; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      g_array_free(t->objs, TRUE);
+      g_array_free(t->models, TRUE);
+      g_free(t);
+   }
+   g_ptr_array_free(stream->used_tiles, TRUE);
+   g_free(stream->tiles);
+
+   g_free(stream);
+}
+
+/* Until a model has been loaded once we don't know how much GPU memory it
+ * needs, so we use the size of its file as an estimate.
+ */
+static VkDeviceSize
+estimate_model_size(const char *path)
+{
+   FILE *f = fopen(path, "rb");
+   if (!f)
+      return 0;
+
+   fseek(f, 0, SEEK_END);
+   long size = ftell(f);
+   fclose(f);
+
+   return size > 0 ? (VkDeviceSize) size : 0;
+}
+
+/**
+ * Registers a model file for streaming. All the objects using the model go
+ * into the scene with the given set id. Returns the handle for the model.
+ *
+ * The size of the file is used as an estimate of the GPU memory the model
+ * needs until it has been loaded once. Applications that know better (for
+ * example, because the model has textures) can set their own estimate with
+ * vkdf_stream_set_model_size().
+ */
+uint32_t
+vkdf_stream_add_model(VkdfStream *stream,
+                      const char *set_id,
+                      const char *path,
+                      bool load_textures,
+                      bool color_is_srgb)
+{
+   assert(vkdf_stream_get_model_handle(stream, set_id) ==
+          VKDF_STREAM_INVALID_MODEL);
+
+   VkdfStreamModel *m = g_new0(VkdfStreamModel, 1);
+   m->ctx = stream->ctx;
+   m->set_id = g_strdup(set_id);
+   m->path = g_strdup(path);
+   m->load_textures = load_textures;
+   m->color_is_srgb = color_is_srgb;
+   m->state = VKDF_STREAM_MODEL_UNLOADED;
+   m->size = estimate_model_size(path);
+
+   uint32_t handle = stream->models->len;
+   g_ptr_array_add(stream->models, m);
+   g_hash_table_insert(stream->model_handles, m->set_id,
+                       GUINT_TO_POINTER(handle + 1));
+
+   return handle;
+}
+
+static void
+thread_fill_model_buffers(uint32_t thread_id, void *arg)
+{
+   VkdfStreamModel *m = (VkdfStreamModel *) arg;
+
+   // Vertex and index buffers are host visible, so filling them doesn't
+   // need the queue or a command pool and we can do it in the background
+   vkdf_model_fill_vertex_buffers(m->ctx, m->model, true);
+}
+
+/* Parses the model file and queues the rest of the work as separate jobs in
+ * the model's load group, so no job keeps a thread busy for the whole load
+ * and frame-critical jobs can run in between.
+ */
+static void
+thread_load_model(uint32_t thread_id, void *arg)
+{
+   VkdfStreamModel *m = (VkdfStreamModel *) arg;
+   VkdfThreadPool *pool = vkdf_get_thread_pool(m->ctx);
+
+   m->model = vkdf_model_load(m->path);
+
+   vkdf_thread_pool_add_group_job(pool, &m->load_group,
+                                  thread_fill_model_buffers, m);
+
+   if (m->load_textures) {
+      m->tex_data =
+         vkdf_model_load_texture_data_in_group(pool, &m->load_group,
+                                               m->model, m->color_is_srgb);
+   }
+}
+
+static void
+acquire_model(VkdfStream *stream, VkdfStreamModel *m)
+{
+   m->users++;
+   if (m->state != VKDF_STREAM_MODEL_UNLOADED)
+      return;
+
+   // Parsing model files and decoding textures is the expensive part, so
+   // do that in the background. We only check for completion in updates,
+   // so we never wait on the group.
+   m->state = VKDF_STREAM_MODEL_LOADING;
+   vkdf_thread_job_group_init(&m->load_group, NULL, NULL);
+   vkdf_thread_job_group_set_priority(&m->load_group,
+                                      VKDF_THREAD_JOB_PRIORITY_BACKGROUND);
+   vkdf_thread_pool_add_group_job(vkdf_get_thread_pool(stream->ctx),
+                                  &m->load_group, thread_load_model, m);
+   vkdf_thread_pool_close_group(vkdf_get_thread_pool(stream->ctx),
+                                &m->load_group);
+}
+
+/* Updates the model of the scene set for a model. The scene only has a set
+ * once objects that use the model have been added to it.
+ */
+static void
+update_scene_model(VkdfStream *stream, VkdfStreamModel *m, VkdfModel *model)
+{
+   if (vkdf_scene_get_set_handle(stream->scene, m->set_id) !=
+       VKDF_SCENE_INVALID_SET_HANDLE) {
+      vkdf_scene_set_model(stream->scene, m->set_id, model);
+   }
+}
+
+static void
+release_model(VkdfStream *stream, VkdfStreamModel *m)
+{
+   assert(m->users > 0);
+   if (--m->users > 0)
+      return;
+
+   switch (m->state) {
+   case VKDF_STREAM_MODEL_LOADING:
+      // We can't cancel the load, check_loaded_models() frees it when done
+      break;
+   case VKDF_STREAM_MODEL_LOADED:
+      free_model_data(stream, m);
+      m->state = VKDF_STREAM_MODEL_UNLOADED;
+      break;
+   case VKDF_STREAM_MODEL_RESIDENT:
+      // The scene must not use the model after we free it. Secondaries and
+      // shadow maps recorded for previous frames may still use it though,
+      // so we free it a few frames later.
+      update_scene_model(stream, m, NULL);
+      add_pending_free(stream, NULL, m, m->model);
+      m->model = NULL;
+      stream->resident_size -= m->size;
+      m->state = VKDF_STREAM_MODEL_UNLOADED;
+      break;
+   default:
+      assert(!"Releasing an unloaded model");
+   }
+}
+
+static void
+unload_tile(VkdfStream *stream, VkdfStreamTile *t)
+{
+   if (t->state == VKDF_STREAM_TILE_UNLOADED)
+      return;
+
+   // Tiles that got new objects while resident are loading again, with
+   // their previous objects still in the scene
+   if (t->scene_objs) {
+      for (uint32_t i = 0; i < t->scene_objs->len; i++) {
+         VkdfObject *obj = (VkdfObject *) g_ptr_array_index(t->scene_objs, i);
+         uint32_t handle = g_array_index(t->objs, VkdfStreamObject, i).model;
+         VkdfStreamModel *m =
+            (VkdfStreamModel *) g_ptr_array_index(stream->models, handle);
+         vkdf_scene_remove_object(stream->scene, m->set_id, obj);
+      }
+      add_pending_free(stream, t->scene_objs, NULL, NULL);
+      t->scene_objs = NULL;
+   }
+
+   for (uint32_t i = 0; i < t->models->len; i++) {
+      uint32_t handle = g_array_index(t->models, uint32_t, i);
+      release_model(stream,
+                    (VkdfStreamModel *) g_ptr_array_index(stream->models,
+                                                          handle));
+   }
+
+   t->state = VKDF_STREAM_TILE_UNLOADED;
+}
+
+static void
+start_tile_load(VkdfStream *stream, VkdfStreamTile *t)
+{
+   assert(t->state == VKDF_STREAM_TILE_UNLOADED);
+
+   for (uint32_t i = 0; i < t->models->len; i++) {
+      uint32_t handle = g_array_index(t->models, uint32_t, i);
+      acquire_model(stream,
+                    (VkdfStreamModel *) g_ptr_array_index(stream->models,
+                                                          handle));
+   }
+
+   t->state = VKDF_STREAM_TILE_LOADING;
+}
+
+/* Adds the objects of a loading tile that are not in the scene yet to the
+ * scene if all its models are resident.
+ */
+static void
+finish_tile_load(VkdfStream *stream, VkdfStreamTile *t)
+{
+   assert(t->state == VKDF_STREAM_TILE_LOADING);
+
+   for (uint32_t i = 0; i < t->models->len; i++) {
+      uint32_t handle = g_array_index(t->models, uint32_t, i);
+      if (!vkdf_stream_get_model(stream, handle))
+         return;
+   }
+
+   // Objects go into the scene in the order of t->objs
+   if (!t->scene_objs)
+      t->scene_objs = g_ptr_array_sized_new(t->objs->len);
+   for (uint32_t i = t->scene_objs->len; i < t->objs->len; i++) {
+      VkdfStreamObject *spec = &g_array_index(t->objs, VkdfStreamObject, i);
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, spec->model);
+
+      VkdfObject *obj = vkdf_object_new_from_model(spec->pos, m->model);
+      vkdf_object_set_rotation(obj, spec->rot);
+      vkdf_object_set_scale(obj, spec->scale);
+      vkdf_object_set_material_idx_base(obj, spec->material_idx_base);
+      vkdf_object_set_lighting_behavior(obj, spec->casts_shadows,
+                                        spec->receives_shadows);
+      vkdf_scene_add_object(stream->scene, m->set_id, obj);
+
+      g_ptr_array_add(t->scene_objs, obj);
+   }
+
+   t->state = VKDF_STREAM_TILE_RESIDENT;
+}
+
+/**
+ * Adds a static object to the streamed content of the tile that contains
+ * its position. The object goes into the scene when the tile is loaded, or
+ * right away if the tile is resident and the object's model is too.
+ */
+void
+vkdf_stream_add_object(VkdfStream *stream, const VkdfStreamObject *obj)
+{
+   assert(obj->model < stream->models->len);
+
+   uint32_t index = vkdf_scene_get_tile_index(stream->scene, obj->pos);
+   assert(index < vkdf_scene_get_num_tiles(stream->scene));
+
+   VkdfStreamTile *t = stream->tiles[index];
+   if (!t) {
+      t = g_new0(VkdfStreamTile, 1);
+      t->index = index;
+      t->state = VKDF_STREAM_TILE_UNLOADED;
+      t->objs = g_array_new(FALSE, FALSE, sizeof(VkdfStreamObject));
+      t->models = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+      stream->tiles[index] = t;
+      g_ptr_array_add(stream->used_tiles, t);
+   }
+
+   g_array_append_val(t->objs, *obj);
+
+   bool new_model = true;
+   for (uint32_t i = 0; i < t->models->len; i++) {
+      if (g_array_index(t->models, uint32_t, i) == obj->model) {
+         new_model = false;
+         break;
+      }
+   }
+
+   if (new_model)
+      g_array_append_val(t->models, obj->model);
+
+   if (t->state == VKDF_STREAM_TILE_UNLOADED)
+      return;
+
+   // Loading and resident tiles hold their models
+   if (new_model) {
+      acquire_model(stream,
+                    (VkdfStreamModel *) g_ptr_array_index(stream->models,
+                                                          obj->model));
+   }
+
+   // If the model isn't resident yet the tile keeps loading until it is,
+   // and the object goes into the scene then
+   if (t->state == VKDF_STREAM_TILE_RESIDENT) {
+      t->state = VKDF_STREAM_TILE_LOADING;
+      finish_tile_load(stream, t);
+   }
+}
+
+static VkDeviceSize
+compute_model_size(VkdfModel *model)
+{
+   VkDeviceSize size = 0;
+   for (uint32_t i = 0; i < model->meshes.size(); i++) {
+      VkdfMesh *mesh = model->meshes[i];
+      size += mesh->vertex_buf.mem_reqs.size;
+      size += mesh->index_buf.mem_reqs.size;
+   }
+   return size;
+}
+
+/**
+ * Makes models that finished loading in the background resident. Their
+ * vertex data is in GPU memory already, but texture uploads use the command
+ * pool and wait for the queue, which stalls the update for as long as the
+ * copies take. We only upload up to upload_budget bytes of texture data
+ * each time, or a single model if it is larger than that.
+ */
+static void
+check_loaded_models(VkdfStream *stream)
+{
+   VkDeviceSize uploaded = 0;
+   for (uint32_t i = 0; i < stream->models->len; i++) {
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, i);
+
+      if (m->state == VKDF_STREAM_MODEL_LOADING &&
+          vkdf_thread_job_group_is_done(&m->load_group)) {
+         m->state = VKDF_STREAM_MODEL_LOADED;
+      }
+
+      if (m->state != VKDF_STREAM_MODEL_LOADED)
+         continue;
+
+      // Tiles may have been unloaded while we were loading
+      if (m->users == 0) {
+         free_model_data(stream, m);
+         m->state = VKDF_STREAM_MODEL_UNLOADED;
+         continue;
+      }
+
+      VkDeviceSize tex_size =
+         m->tex_data ? vkdf_model_get_texture_data_size(m->tex_data) : 0;
+      if (uploaded > 0 && uploaded + tex_size > stream->upload_budget)
+         continue;
+
+      // The update reads the sizes of models that are loading, so we set
+      // it here instead of in the background job
+      m->size = compute_model_size(m->model);
+      if (m->tex_data) {
+         m->size += tex_size;
+         vkdf_model_create_textures(stream->ctx, stream->pool,
+                                    m->model, m->tex_data);
+         m->tex_data = NULL;
+         uploaded += tex_size;
+      }
+
+      m->state = VKDF_STREAM_MODEL_RESIDENT;
+      stream->resident_size += m->size;
+
+      // If the model was resident before, the scene has a set for it
+      // already, which needs to point to the new model
+      update_scene_model(stream, m, m->model);
+
+      if (stream->callbacks.model_loaded) {
+         stream->callbacks.model_loaded(stream->ctx, m->set_id, m->model,
+                                        stream->callbacks.data);
+      }
+   }
+}
+
+static void
+check_pending_free(VkdfStream *stream)
+{
+   GList *iter = stream->pending_free;
+   while (iter) {
+      struct _PendingFree *pf = (struct _PendingFree *) iter->data;
+      GList *link = iter;
+      iter = g_list_next(iter);
+
+      if (--pf->frames > 0)
+         continue;
+
+      free_pending(stream, pf);
+      stream->pending_free = g_list_delete_link(stream->pending_free, link);
+   }
+}
+
+/* Distance from a position to the area covered by a top-level tile */
+static float
+compute_tile_distance(VkdfScene *s, uint32_t index, glm::vec3 pos)
+{
+   VkdfSceneTile *t = vkdf_scene_get_tile(s, index);
+   glm::vec3 min = t->offset;
+   glm::vec3 max = t->offset + glm::vec3(s->tile_size[0].w,
+                                         s->tile_size[0].h,
+                                         s->tile_size[0].d);
+   glm::vec3 d = glm::max(glm::max(min - pos, pos - max), glm::vec3(0.0f));
+   return glm::length(d);
+}
+
+static gint
+compare_tile_distance(gconstpointer a, gconstpointer b)
+{
+   const VkdfStreamTile *ta = *((const VkdfStreamTile **) a);
+   const VkdfStreamTile *tb = *((const VkdfStreamTile **) b);
+   if (ta->dist < tb->dist)
+      return -1;
+   if (ta->dist > tb->dist)
+      return 1;
+   return 0;
+}
+
+/* GPU memory we need for a tile on top of what we use already. Models
+ * that were never loaded count with their estimated size.
+ */
+static VkDeviceSize
+compute_tile_load_size(VkdfStream *stream, VkdfStreamTile *t)
+{
+   VkDeviceSize size = 0;
+   for (uint32_t i = 0; i < t->models->len; i++) {
+      uint32_t handle = g_array_index(t->models, uint32_t, i);
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, handle);
+      if (m->users == 0)
+         size += m->size;
+   }
+   return size;
+}
+
+/* GPU memory used or about to be used by the models of loaded and loading
+ * tiles.
+ */
+static VkDeviceSize
+compute_committed_size(VkdfStream *stream)
+{
+   VkDeviceSize size = 0;
+   for (uint32_t i = 0; i < stream->models->len; i++) {
+      VkdfStreamModel *m =
+         (VkdfStreamModel *) g_ptr_array_index(stream->models, i);
+      if (m->users > 0)
+         size += m->size;
+   }
+   return size;
+}
+
+/**
+ * Updates tile residency for the current camera position. Call this once
+ * per frame from the scene's update_state callback.
+ */
+void
+vkdf_stream_update(VkdfStream *stream)
+{
+   check_pending_free(stream);
+   check_loaded_models(stream);
+
+   if (stream->used_tiles->len == 0)
+      return;
+
+   VkdfCamera *cam = vkdf_scene_get_camera(stream->scene);
+   glm::vec3 cam_pos = vkdf_camera_get_position(cam);
+
+   // Tiles are sorted nearest first, so we load the nearest tiles first and
+   // evict the farthest tiles first
+   for (uint32_t i = 0; i < stream->used_tiles->len; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      t->dist = compute_tile_distance(stream->scene, t->index, cam_pos);
+   }
+   g_ptr_array_sort(stream->used_tiles, compare_tile_distance);
+
+   int32_t last = stream->used_tiles->len - 1;
+   while (last >= 0) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, last);
+      if (t->dist <= stream->unload_dist)
+         break;
+      unload_tile(stream, t);
+      last--;
+   }
+
+   // Models that finished loading may be larger than we estimated, so
+   // evict the farthest tiles until we are back under the budget
+   VkDeviceSize committed = compute_committed_size(stream);
+   while (committed > stream->budget && last >= 0) {
+      VkdfStreamTile *far =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, last);
+      if (far->state != VKDF_STREAM_TILE_UNLOADED) {
+         unload_tile(stream, far);
+         committed = compute_committed_size(stream);
+      }
+      last--;
+   }
+
+   for (int32_t i = 0; i <= last; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      if (t->dist > stream->load_dist)
+         break;
+
+      if (t->state != VKDF_STREAM_TILE_UNLOADED)
+         continue;
+
+      // Evict tiles farther than this one until it fits in the budget
+      VkDeviceSize size = compute_tile_load_size(stream, t);
+      while (committed + size > stream->budget && last > i) {
+         VkdfStreamTile *far =
+            (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, last);
+         unload_tile(stream, far);
+         committed = compute_committed_size(stream);
+         size = compute_tile_load_size(stream, t);
+         last--;
+      }
+
+      if (committed + size > stream->budget)
+         break;
+
+      start_tile_load(stream, t);
+      committed += size;
+   }
+
+   // Make room in the scene for the objects of all the tiles that are
+   // loading, so the scene grows its static buffers once instead of every
+   // time one of them is done
+   uint32_t pending_objs = 0;
+   for (int32_t i = 0; i <= last; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      if (t->state == VKDF_STREAM_TILE_LOADING) {
+         pending_objs += t->objs->len;
+         if (t->scene_objs)
+            pending_objs -= t->scene_objs->len;
+      }
+   }
+
+   if (pending_objs > 0) {
+      vkdf_scene_reserve_static_objects(stream->scene,
+         vkdf_scene_get_static_object_count(stream->scene) + pending_objs);
+   }
+
+   for (int32_t i = 0; i <= last; i++) {
+      VkdfStreamTile *t =
+         (VkdfStreamTile *) g_ptr_array_index(stream->used_tiles, i);
+      if (t->state == VKDF_STREAM_TILE_LOADING)
+         finish_tile_load(stream, t);
+   }
+}
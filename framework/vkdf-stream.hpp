@@ -0,0 +1,224 @@
+#ifndef __VKDF_STREAM_H__
+#define __VKDF_STREAM_H__
+
+#include "vkdf-deps.hpp"
+#include "vkdf-init.hpp"
+#include "vkdf-thread-pool.hpp"
+#include "vkdf-model.hpp"
+#include "vkdf-object.hpp"
+#include "vkdf-scene.hpp"
+
+/* Frames we wait before freeing unloaded content, so the GPU is done with it */
+#define VKDF_STREAM_FREE_DELAY 3
+
+#define VKDF_STREAM_INVALID_MODEL ((uint32_t) -1)
+
+/* Texture data we upload per update by default */
+#define VKDF_STREAM_DEFAULT_UPLOAD_BUDGET (16 * 1024 * 1024)
+
+typedef enum {
+   VKDF_STREAM_MODEL_UNLOADED = 0,
+   VKDF_STREAM_MODEL_LOADING,          // Loading files in the thread pool
+   VKDF_STREAM_MODEL_LOADED,           // Files loaded, waiting for upload
+   VKDF_STREAM_MODEL_RESIDENT,         // GPU resources ready
+} VkdfStreamModelState;
+
+typedef enum {
+   VKDF_STREAM_TILE_UNLOADED = 0,
+   VKDF_STREAM_TILE_LOADING,           // Waiting for its models, some of
+                                       // its objects may be in the scene
+   VKDF_STREAM_TILE_RESIDENT,          // Its objects are in the scene
+} VkdfStreamTileState;
+
+typedef struct {
+   VkdfContext *ctx;
+   char *set_id;
+   char *path;
+   bool load_textures;
+   bool color_is_srgb;
+
+   VkdfStreamModelState state;
+   VkdfThreadJobGroup load_group;
+   VkdfModel *model;
+   VkdfModelTextureData *tex_data;
+
+   VkDeviceSize size;                  // GPU memory used, estimated until
+                                       // the first load
+   uint32_t users;                     // Loading or resident tiles using it
+} VkdfStreamModel;
+
+/* Description of a streamed object. Objects are created when their tile
+ * becomes resident and freed when it is unloaded.
+ */
+typedef struct {
+   uint32_t model;                     // Handle from vkdf_stream_add_model()
+   glm::vec3 pos;
+   glm::vec3 rot;
+   glm::vec3 scale;
+   uint32_t material_idx_base;
+   bool casts_shadows;
+   bool receives_shadows;
+} VkdfStreamObject;
+
+/* Streamed content of a top-level scene tile */
+typedef struct {
+   uint32_t index;                     // Scene tile index
+   VkdfStreamTileState state;
+   GArray *objs;                       // VkdfStreamObject
+   GArray *models;                     // Model handles used by objs
+   GPtrArray *scene_objs;              // Objects in the scene, same order
+                                       // as objs
+   float dist;                         // Distance to the camera
+} VkdfStreamTile;
+
+typedef void (*VkdfStreamModelCB)(VkdfContext *, const char *, VkdfModel *, void *);
+
+/* Loads and unloads the content of top-level scene tiles depending on their
+ * distance to the camera. Tiles within the load distance are loaded nearest
+ * first as long as the GPU memory used by their models stays under the
+ * budget, evicting farther tiles to make room if needed. Models that were
+ * never loaded count with an estimate of their size, and if they turn out
+ * to be larger the farthest tiles are evicted until we are under the budget
+ * again. Tiles beyond the unload distance are unloaded.
+ *
+ * Model and texture files are loaded in the background in the thread pool,
+ * where vertex and index data also go into their (host visible) buffers.
+ * Only texture uploads happen in the update, since they need the command
+ * pool and wait for the queue to finish the copies, so we upload at most
+ * 'upload_budget' bytes of texture data per call. Tile objects go into the
+ * scene (as static objects) once all their models are resident.
+ *
+ * Models are shared by all the tiles that use them. The application gets
+ * notified when a model becomes resident and right before it is freed, so
+ * it can manage its own resources for it (like texture descriptors).
+ *
+ * Streamed objects go into the scene's static object buffers and the
+ * materials of their models into its static material buffer. The stream
+ * reserves room in the scene for the objects of the tiles it is loading,
+ * and the scene replaces its buffers with larger ones when they fill up, so
+ * the scene must have a buffers changed callback (see
+ * vkdf_scene_set_buffers_changed_callback()) when the stream is created.
+ *
+ * vkdf_stream_update() is meant to be called from the scene's update_state
+ * callback, after the scene has been prepared. The stream must be freed
+ * before the scene.
+ */
+typedef struct {
+   VkdfContext *ctx;
+   VkdfScene *scene;
+   VkCommandPool pool;                 // For texture uploads
+
+   VkDeviceSize budget;
+   float load_dist;
+   float unload_dist;
+   VkDeviceSize upload_budget;         // Texture bytes uploaded per update
+
+   GPtrArray *models;                  // VkdfStreamModel, by handle
+   GHashTable *model_handles;          // Model handles by set id
+   VkdfStreamTile **tiles;             // By scene tile index, NULL if empty
+   GPtrArray *used_tiles;              // Tiles with content
+
+   VkDeviceSize resident_size;         // GPU memory used by resident models
+
+   GList *pending_free;                // Unloaded content waiting for the GPU
+
+   struct {
+      VkdfStreamModelCB model_loaded;
+      VkdfStreamModelCB model_unloaded;
+      void *data;
+   } callbacks;
+} VkdfStream;
+
+VkdfStream *
+vkdf_stream_new(VkdfContext *ctx,
+                VkdfScene *scene,
+                VkCommandPool pool,
+                VkDeviceSize budget,
+                float load_dist,
+                float unload_dist);
+
+void
+vkdf_stream_free(VkdfStream *stream);
+
+inline void
+vkdf_stream_set_callbacks(VkdfStream *stream,
+                          VkdfStreamModelCB loaded_cb,
+                          VkdfStreamModelCB unloaded_cb,
+                          void *data)
+{
+   stream->callbacks.model_loaded = loaded_cb;
+   stream->callbacks.model_unloaded = unloaded_cb;
+   stream->callbacks.data = data;
+}
+
+inline void
+vkdf_stream_set_budget(VkdfStream *stream, VkDeviceSize budget)
+{
+   stream->budget = budget;
+}
+
+/**
+ * Sets how many bytes of texture data we upload per update. Models with
+ * more texture data than this are uploaded on their own.
+ */
+inline void
+vkdf_stream_set_upload_budget(VkdfStream *stream, VkDeviceSize budget)
+{
+   stream->upload_budget = budget;
+}
+
+inline VkDeviceSize
+vkdf_stream_get_resident_size(VkdfStream *stream)
+{
+   return stream->resident_size;
+}
+
+uint32_t
+vkdf_stream_add_model(VkdfStream *stream,
+                      const char *set_id,
+                      const char *path,
+                      bool load_textures,
+                      bool color_is_srgb);
+
+/**
+ * Sets the estimated GPU memory used by a model. The estimate is used until
+ * the model is loaded and then replaced with its actual size.
+ */
+inline void
+vkdf_stream_set_model_size(VkdfStream *stream,
+                           uint32_t handle,
+                           VkDeviceSize size)
+{
+   assert(handle < stream->models->len);
+   VkdfStreamModel *m =
+      (VkdfStreamModel *) g_ptr_array_index(stream->models, handle);
+   if (m->state != VKDF_STREAM_MODEL_RESIDENT)
+      m->size = size;
+}
+
+void
+vkdf_stream_add_object(VkdfStream *stream, const VkdfStreamObject *obj);
+
+inline uint32_t
+vkdf_stream_get_model_handle(VkdfStream *stream, const char *set_id)
+{
+   return GPOINTER_TO_UINT(g_hash_table_lookup(stream->model_handles,
+                                               set_id)) - 1;
+}
+
+/**
+ * Returns the model for a model handle, or NULL if it is not resident
+ */
+inline VkdfModel *
+vkdf_stream_get_model(VkdfStream *stream, uint32_t handle)
+{
+   assert(handle < stream->models->len);
+   VkdfStreamModel *m =
+      (VkdfStreamModel *) g_ptr_array_index(stream->models, handle);
+   return m->state == VKDF_STREAM_MODEL_RESIDENT ? m->model : NULL;
+}
+
+void
+vkdf_stream_update(VkdfStream *stream);
+
+#endif
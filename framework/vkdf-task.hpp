@@ -0,0 +1,204 @@
+#ifndef __VKDF_TASK_H__
+#define __VKDF_TASK_H__
+
+#include "vkdf-thread-pool.hpp"
+
+/* Coroutine tasks on top of VkdfThreadPool. These require C++20, the rest of
+ * the framework doesn't, so this is only available to code built with
+ * coroutine support.
+ *
+ * A VkdfTask<T> is a coroutine that returns a T. Tasks are lazy: they start
+ * running when they are awaited from another task or when they are passed to
+ * vkdf_task_run(). Inside a task:
+ *
+ *  - co_await vkdf_task_schedule() suspends the task and resumes it in a job
+ *    in the thread pool, so the current thread can do other work.
+ *  - co_await other_task runs other_task in the current thread and resumes
+ *    the awaiting task when it completes, without blocking any thread.
+ *
+ * For example:
+ *
+ *    VkdfTask<SDL_Surface *> decode(const char *path) {
+ *       co_await vkdf_task_schedule();
+ *       co_return vkdf_load_image_data_from_file(path);
+ *    }
+ *
+ *    VkdfTask<> load(const char *path, VkdfImage *image) {
+ *       SDL_Surface *surf = co_await decode(path);
+ *       ...
+ *    }
+ *
+ *    vkdf_task_run(pool, load(path, &image));
+ *
+ * All the jobs used to run a task go into a job group created by
+ * vkdf_task_run(), so waiting on the task doesn't wait on unrelated work in
+ * the pool, and the waiting thread helps running jobs in the meantime.
+ */
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+template<typename T> class VkdfTask;
+
+inline void
+vkdf_task_resume_job(uint32_t thread_id, void *arg)
+{
+   std::coroutine_handle<>::from_address(arg).resume();
+}
+
+struct VkdfTaskPromiseBase {
+   // Pool and group the task runs in, inherited from the awaiting task
+   VkdfThreadPool *pool = NULL;
+   VkdfThreadJobGroup *group = NULL;
+
+   // Coroutine to resume when the task completes
+   std::coroutine_handle<> continuation;
+
+   struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+
+      template<typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+      {
+         std::coroutine_handle<> c = h.promise().continuation;
+         return c ? c : std::noop_coroutine();
+      }
+
+      void await_resume() noexcept { }
+   };
+
+   std::suspend_always initial_suspend() noexcept { return {}; }
+   FinalAwaiter final_suspend() noexcept { return {}; }
+
+   // The framework doesn't use exceptions
+   void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct VkdfTaskPromise : VkdfTaskPromiseBase {
+   std::optional<T> value;
+
+   VkdfTask<T> get_return_object();
+   void return_value(T v) { value = std::move(v); }
+};
+
+template<>
+struct VkdfTaskPromise<void> : VkdfTaskPromiseBase {
+   VkdfTask<void> get_return_object();
+   void return_void() { }
+};
+
+template<typename T = void>
+class VkdfTask {
+public:
+   typedef VkdfTaskPromise<T> promise_type;
+   typedef std::coroutine_handle<promise_type> handle_type;
+
+   explicit VkdfTask(handle_type h) : handle(h) { }
+   VkdfTask(VkdfTask &&other) noexcept : handle(std::exchange(other.handle, {})) { }
+   VkdfTask(const VkdfTask &) = delete;
+   VkdfTask &operator=(const VkdfTask &) = delete;
+
+   ~VkdfTask()
+   {
+      if (handle)
+         handle.destroy();
+   }
+
+   bool await_ready() const noexcept { return false; }
+
+   template<typename P>
+   std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiting) noexcept
+   {
+      handle.promise().pool = awaiting.promise().pool;
+      handle.promise().group = awaiting.promise().group;
+      handle.promise().continuation = awaiting;
+      return handle;
+   }
+
+   T await_resume()
+   {
+      assert(handle.done());
+      if constexpr (!std::is_void_v<T>)
+         return std::move(*handle.promise().value);
+   }
+
+   handle_type handle;
+};
+
+template<typename T>
+inline VkdfTask<T>
+VkdfTaskPromise<T>::get_return_object()
+{
+   return VkdfTask<T>(VkdfTask<T>::handle_type::from_promise(*this));
+}
+
+inline VkdfTask<void>
+VkdfTaskPromise<void>::get_return_object()
+{
+   return VkdfTask<void>(VkdfTask<void>::handle_type::from_promise(*this));
+}
+
+struct VkdfTaskSchedule {
+   bool await_ready() const noexcept { return false; }
+
+   template<typename P>
+   bool await_suspend(std::coroutine_handle<P> h) noexcept
+   {
+      // Without a pool we just keep running in the current thread
+      P &promise = h.promise();
+      if (!promise.pool)
+         return false;
+
+      // The job may resume (and even complete) the task right away in another
+      // thread, so we can't touch the coroutine after this
+      vkdf_thread_pool_add_group_job(promise.pool, promise.group,
+                                     vkdf_task_resume_job, h.address());
+      return true;
+   }
+
+   void await_resume() noexcept { }
+};
+
+/**
+ * Awaitable that resumes the calling task in a job in the thread pool.
+ */
+inline VkdfTaskSchedule
+vkdf_task_schedule()
+{
+   return VkdfTaskSchedule();
+}
+
+/**
+ * Runs a task in the thread pool and waits for it to complete, helping with
+ * jobs in the pool in the meantime. If pool is NULL the task runs in the
+ * calling thread. Returns the value returned by the task.
+ */
+template<typename T>
+T
+vkdf_task_run(VkdfThreadPool *pool,
+              VkdfTask<T> task,
+              VkdfThreadJobPriority priority = VKDF_THREAD_JOB_PRIORITY_CRITICAL)
+{
+   VkdfThreadJobGroup group;
+   vkdf_thread_job_group_init(&group, NULL, NULL);
+   vkdf_thread_job_group_set_priority(&group, priority);
+
+   task.handle.promise().pool = pool;
+   task.handle.promise().group = &group;
+   vkdf_thread_pool_add_group_job(pool, &group,
+                                  vkdf_task_resume_job,
+                                  task.handle.address());
+   vkdf_thread_pool_wait_group(pool, &group);
+
+   return task.await_resume();
+}
+
+#endif
+
+#endif
@@ -1,69 +1,251 @@
 #include "vkdf-thread-pool.hpp"
+#include "vkdf-util.hpp"
+#include "vkdf-error.hpp"
 
-static void
-binary_sem_set(VkdfBinarySemaphore *sem, uint32_t value)
+#include <sched.h>
+#include <unistd.h>
+
+static const uint32_t QUEUE_MASK = VKDF_THREAD_QUEUE_SIZE - 1;
+static const uint32_t OVERFLOW_INITIAL_SIZE = 64;
+
+/* The worker thread running the current code, if any. Jobs added from inside
+ * a job go to the worker's own queue instead of being distributed round-robin.
+ */
+static __thread VkdfThread *current_thread = NULL;
+
+static inline uint64_t
+get_time_ns()
 {
-   assert(value == 0 || value == 1);
-   pthread_mutex_init(&sem->mutex, NULL);
-   pthread_cond_init(&sem->cond, NULL);
-   sem->value = value;
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return ((uint64_t) t.tv_sec) * 1000000000ull + t.tv_nsec;
 }
 
 static void
-binary_sem_wait(VkdfBinarySemaphore *sem)
+queue_init(VkdfThreadQueue *queue)
+{
+   memset(queue, 0, sizeof(VkdfThreadQueue));
+   for (uint32_t i = 0; i < VKDF_THREAD_QUEUE_SIZE; i++)
+      queue->slots[i].seq = i;
+}
+
+/* A slot is free for position 'pos' when its sequence number is 'pos' and
+ * it holds the job for position 'pos' when its sequence number is 'pos + 1'.
+ * Positions only ever increase (modulo 2^32) so we compare them by their
+ * signed difference.
+ */
+static bool
+queue_push(VkdfThreadQueue *queue, const VkdfThreadJob *job)
 {
-   pthread_mutex_lock(&sem->mutex);
-   while (sem->value != 1)
-      pthread_cond_wait(&sem->cond, &sem->mutex);
-   sem->value = 0;
-   pthread_mutex_unlock(&sem->mutex);
+   VkdfThreadJobSlot *slot;
+   uint32_t pos = (uint32_t) g_atomic_int_get(&queue->enqueue_pos);
+   while (true) {
+      slot = &queue->slots[pos & QUEUE_MASK];
+      uint32_t seq = (uint32_t) g_atomic_int_get(&slot->seq);
+      int32_t diff = (int32_t) (seq - pos);
+      if (diff == 0) {
+         if (g_atomic_int_compare_and_exchange(&queue->enqueue_pos,
+                                               (gint) pos, (gint) (pos + 1)))
+            break;
+      } else if (diff < 0) {
+         return false; // Full
+      }
+      pos = (uint32_t) g_atomic_int_get(&queue->enqueue_pos);
+   }
+
+   slot->job = *job;
+   g_atomic_int_set(&slot->seq, (gint) (pos + 1));
+   return true;
+}
+
+static bool
+queue_pop(VkdfThreadQueue *queue, VkdfThreadJob *job)
+{
+   VkdfThreadJobSlot *slot;
+   uint32_t pos = (uint32_t) g_atomic_int_get(&queue->dequeue_pos);
+   while (true) {
+      slot = &queue->slots[pos & QUEUE_MASK];
+      uint32_t seq = (uint32_t) g_atomic_int_get(&slot->seq);
+      int32_t diff = (int32_t) (seq - (pos + 1));
+      if (diff == 0) {
+         if (g_atomic_int_compare_and_exchange(&queue->dequeue_pos,
+                                               (gint) pos, (gint) (pos + 1)))
+            break;
+      } else if (diff < 0) {
+         return false; // Empty
+      }
+      pos = (uint32_t) g_atomic_int_get(&queue->dequeue_pos);
+   }
+
+   *job = slot->job;
+   g_atomic_int_set(&slot->seq, (gint) (pos + VKDF_THREAD_QUEUE_SIZE));
+   return true;
 }
 
 static void
-binary_sem_post(VkdfBinarySemaphore *sem)
+overflow_push(VkdfThreadOverflow *overflow, const VkdfThreadJob *job)
 {
-   pthread_mutex_lock(&sem->mutex);
-   sem->value = 1;
-   pthread_cond_signal(&sem->cond);
-   pthread_mutex_unlock(&sem->mutex);
+   pthread_mutex_lock(&overflow->mutex);
+   if (overflow->count == overflow->size) {
+      overflow->size = MAX2(2 * overflow->size, OVERFLOW_INITIAL_SIZE);
+      overflow->jobs = g_renew(VkdfThreadJob, overflow->jobs, overflow->size);
+   }
+   overflow->jobs[overflow->count++] = *job;
+   g_atomic_int_inc(&overflow->num_jobs);
+   pthread_mutex_unlock(&overflow->mutex);
+}
+
+static bool
+overflow_pop(VkdfThreadOverflow *overflow, VkdfThreadJob *job)
+{
+   if (g_atomic_int_get(&overflow->num_jobs) <= 0)
+      return false;
+
+   bool found = false;
+   pthread_mutex_lock(&overflow->mutex);
+   if (overflow->count > 0) {
+      *job = overflow->jobs[--overflow->count];
+      g_atomic_int_add(&overflow->num_jobs, -1);
+      found = true;
+   }
+   pthread_mutex_unlock(&overflow->mutex);
+
+   return found;
+}
+
+static bool
+find_job_with_priority(VkdfThreadPool *pool,
+                       VkdfThread *thread,
+                       VkdfThreadJobPriority priority,
+                       VkdfThreadJob *job)
+{
+   if (g_atomic_int_get(&pool->num_queued[priority]) <= 0)
+      return false;
+
+   bool found = queue_pop(&thread->queues[priority], job);
+
+   // Our queue is empty, try to steal work from the others
+   for (uint32_t i = 1; !found && i <= pool->num_threads; i++) {
+      uint32_t victim = (thread->id + i) % pool->num_threads;
+      if (victim != thread->id)
+         found = queue_pop(&pool->threads[victim].queues[priority], job);
+      if (found)
+         thread->stats.steals++;
+   }
+
+   if (!found)
+      found = overflow_pop(&pool->overflow[priority], job);
+
+   if (found)
+      g_atomic_int_add(&pool->num_queued[priority], -1);
+
+   return found;
+}
+
+/* Finds a job with priority 'lowest' or higher, higher priorities first */
+static bool
+find_job(VkdfThreadPool *pool,
+         VkdfThread *thread,
+         VkdfThreadJobPriority lowest,
+         VkdfThreadJob *job)
+{
+   for (uint32_t p = 0; p <= lowest; p++) {
+      if (find_job_with_priority(pool, thread, (VkdfThreadJobPriority) p, job))
+         return true;
+   }
+   return false;
+}
+
+static inline bool
+has_queued_jobs(VkdfThreadPool *pool)
+{
+   for (uint32_t p = 0; p < VKDF_THREAD_JOB_PRIORITY_COUNT; p++) {
+      if (g_atomic_int_get(&pool->num_queued[p]) > 0)
+         return true;
+   }
+   return false;
 }
 
 static void
-binary_sem_post_all(VkdfBinarySemaphore *sem)
+job_done(VkdfThreadPool *pool)
 {
-   pthread_mutex_lock(&sem->mutex);
-   sem->value = 1;
-   pthread_cond_broadcast(&sem->cond);
-   pthread_mutex_unlock(&sem->mutex);
+   if (g_atomic_int_dec_and_test(&pool->num_pending)) {
+      pthread_mutex_lock(&pool->idle_mutex);
+      pthread_cond_broadcast(&pool->all_idle);
+      pthread_mutex_unlock(&pool->idle_mutex);
+   }
 }
 
-static VkdfThreadJob *
-queue_pull(VkdfThreadQueue *queue)
+static void
+group_complete(VkdfThreadPool *pool, VkdfThreadJobGroup *group)
 {
-   VkdfThreadJob *job = NULL;
+   if (!pool) {
+      g_atomic_int_set(&group->completed, 1);
+      return;
+   }
 
-   pthread_mutex_lock(&queue->mutex);
+   /* Waiters check the flag with idle_mutex held, so once we release it
+    * the group may be gone.
+    */
+   pthread_mutex_lock(&pool->idle_mutex);
+   g_atomic_int_set(&group->completed, 1);
+   pthread_cond_broadcast(&pool->all_idle);
+   pthread_mutex_unlock(&pool->idle_mutex);
+}
 
-   if (queue->jobs != NULL) {
-      GList *head = queue->jobs;
-      job = (VkdfThreadJob *) head->data;
-      queue->jobs = g_list_delete_link(queue->jobs, head);
-      if (queue->jobs != NULL)
-         binary_sem_post(&queue->has_jobs);
+static void
+group_release(VkdfThreadPool *pool, VkdfThreadJobGroup *group)
+{
+   if (!g_atomic_int_dec_and_test(&group->pending))
+      return;
+
+   /* Whoever drops the last reference owns the group now, so there is no
+    * race on the continuation.
+    */
+   if (group->continuation) {
+      VkdfThreadJobFunction func = group->continuation;
+      group->continuation = NULL;
+      vkdf_thread_pool_add_group_job(pool, group,
+                                     func, group->continuation_arg);
+      return;
    }
 
-   pthread_mutex_unlock(&queue->mutex);
+   group_complete(pool, group);
+}
+
+static void
+run_job(VkdfThreadPool *pool, VkdfThread *thread, VkdfThreadJob *job)
+{
+   uint64_t start = get_time_ns();
+   uint64_t wait_time = start - job->queue_time;
+
+   job->function(thread->id, job->arg);
+
+   thread->stats.jobs++;
+   thread->stats.busy_time += get_time_ns() - start;
+   thread->stats.wait_time += wait_time;
+   thread->stats.max_wait_time = MAX2(thread->stats.max_wait_time, wait_time);
 
-   return job;
+   if (job->group)
+      group_release(pool, job->group);
+
+   job_done(pool);
 }
 
 static void
-queue_push(VkdfThreadQueue *queue, VkdfThreadJob *job)
+thread_sleep(VkdfThreadPool *pool)
 {
-   pthread_mutex_lock(&queue->mutex);
-   queue->jobs = g_list_prepend(queue->jobs, job);
-   binary_sem_post(&queue->has_jobs);
-   pthread_mutex_unlock(&queue->mutex);
+   pthread_mutex_lock(&pool->sleep_mutex);
+
+   /* Register as sleeper before checking for jobs so that a concurrent
+    * vkdf_thread_pool_add_job() either sees us sleeping or we see its job.
+    */
+   g_atomic_int_inc(&pool->num_sleeping);
+   while (g_atomic_int_get(&pool->active) && !has_queued_jobs(pool))
+      pthread_cond_wait(&pool->has_jobs, &pool->sleep_mutex);
+   g_atomic_int_add(&pool->num_sleeping, -1);
+
+   pthread_mutex_unlock(&pool->sleep_mutex);
 }
 
 static void *
@@ -73,57 +255,33 @@ thread_run(void *data)
 
    VkdfThreadPool *pool = (VkdfThreadPool *) thread->pool;
 
-   pthread_mutex_lock(&pool->thread_count_mutex);
-   pool->num_alive++;
-   pthread_mutex_unlock(&pool->thread_count_mutex);
+   current_thread = thread;
 
-   while (pool->active) {
-      binary_sem_wait(&pool->queue.has_jobs);
-
-      if (!pool->active)
+   uint64_t idle_start = get_time_ns();
+   while (g_atomic_int_get(&pool->active)) {
+      VkdfThreadJob job;
+      if (!find_job(pool, thread,
+                    VKDF_THREAD_JOB_PRIORITY_BACKGROUND, &job)) {
+         thread_sleep(pool);
          continue;
-
-      pthread_mutex_lock(&pool->thread_count_mutex);
-      pool->num_working++;
-      pthread_mutex_unlock(&pool->thread_count_mutex);
-
-      VkdfThreadJob *job = queue_pull(&pool->queue);
-      if (job) {
-         job->function(thread->id, job->arg);
-         free(job);
       }
 
-      pthread_mutex_lock(&pool->thread_count_mutex);
-      pool->num_working--;
-      if (pool->num_working == 0)
-         pthread_cond_signal(&pool->all_idle);
-      pthread_mutex_unlock(&pool->thread_count_mutex);
+      thread->stats.idle_time += get_time_ns() - idle_start;
+      run_job(pool, thread, &job);
+      idle_start = get_time_ns();
    }
 
-   pthread_mutex_lock(&pool->thread_count_mutex);
-   pool->num_alive--;
-   pthread_mutex_unlock(&pool->thread_count_mutex);
+   current_thread = NULL;
 
    return NULL;
 }
 
 static void
-queue_init(VkdfThreadQueue *queue)
+thread_set_name(VkdfThread *thread, const char *name)
 {
-   memset(queue, 0, sizeof(VkdfThreadQueue));
-   pthread_mutex_init(&queue->mutex, NULL);
-   binary_sem_set(&queue->has_jobs, 0);
-}
-
-static void
-queue_free(VkdfThreadQueue *queue)
-{
-   while (queue->jobs) {
-      VkdfThreadJob *job = queue_pull(queue);
-      g_free(job);
-   }
-
-   binary_sem_set(&queue->has_jobs, 0);
+   // Thread names are limited to 15 characters plus the terminator
+   snprintf(thread->name, sizeof(thread->name), "%.11s-%u", name, thread->id);
+   pthread_setname_np(thread->pthread, thread->name);
 }
 
 static void
@@ -131,9 +289,10 @@ thread_init(VkdfThreadPool *pool, VkdfThread *thread, uint32_t id)
 {
    thread->pool = (struct _VkdfThreadPool *) pool;
    thread->id = id;
+   thread->cpu = -1;
 
    pthread_create(&thread->pthread, NULL, thread_run, thread);
-   pthread_detach(thread->pthread);
+   thread_set_name(thread, "vkdf-pool");
 }
 
 static void
@@ -142,12 +301,16 @@ threads_init(VkdfThreadPool *pool, uint32_t num_threads)
    pool->num_threads = num_threads;
    pool->threads = g_new0(VkdfThread, pool->num_threads);
 
+   /* Workers steal from each other's queues as soon as they start, so all
+    * queues must exist before we launch any thread.
+    */
+   for (uint32_t i = 0; i < num_threads; i++) {
+      for (uint32_t p = 0; p < VKDF_THREAD_JOB_PRIORITY_COUNT; p++)
+         queue_init(&pool->threads[i].queues[p]);
+   }
+
    for (uint32_t i = 0; i < num_threads; i++)
       thread_init(pool, &pool->threads[i], i);
-
-   struct timespec wait_time = { 0, 1000 };
-   while (pool->num_alive != pool->num_threads)
-      nanosleep(&wait_time, NULL);
 }
 
 VkdfThreadPool *
@@ -155,48 +318,468 @@ vkdf_thread_pool_new(uint32_t num_threads)
 {
    VkdfThreadPool *pool = g_new0(VkdfThreadPool, 1);
 
-   pool->active = true;
+   pool->active = 1;
+
+   for (uint32_t p = 0; p < VKDF_THREAD_JOB_PRIORITY_COUNT; p++)
+      pthread_mutex_init(&pool->overflow[p].mutex, NULL);
+   pthread_mutex_init(&pool->sleep_mutex, NULL);
+   pthread_cond_init(&pool->has_jobs, NULL);
+   pthread_mutex_init(&pool->idle_mutex, NULL);
+   pthread_cond_init(&pool->all_idle, NULL);
+   pthread_mutex_init(&pool->caller_mutex, NULL);
+
+   pool->caller.pool = (struct _VkdfThreadPool *) pool;
+   pool->caller.id = num_threads;
+   pool->caller.cpu = -1;
+   for (uint32_t p = 0; p < VKDF_THREAD_JOB_PRIORITY_COUNT; p++)
+      queue_init(&pool->caller.queues[p]);
 
-   queue_init(&pool->queue);
    threads_init(pool, num_threads);
 
    return pool;
 }
 
+static void
+queue_job(VkdfThreadPool *pool,
+          VkdfThreadJobFunction func, void *arg,
+          VkdfThreadJobGroup *group,
+          VkdfThreadJobPriority priority)
+{
+   VkdfThreadJob job;
+   job.function = func;
+   job.arg = arg;
+   job.group = group;
+   job.queue_time = get_time_ns();
+
+   /* Jobs spawned by a worker stay local (and can be stolen by idle workers),
+    * jobs from other threads are spread across all the workers. Workers
+    * don't steal from the caller's queues, so jobs spawned by jobs that
+    * the caller runs are spread too.
+    */
+   VkdfThreadQueue *queue;
+   if (current_thread && current_thread->pool == pool &&
+       current_thread != &pool->caller) {
+      queue = &current_thread->queues[priority];
+   } else {
+      uint32_t idx = (uint32_t) g_atomic_int_add(&pool->next_queue, 1);
+      queue = &pool->threads[idx % pool->num_threads].queues[priority];
+   }
+
+   g_atomic_int_inc(&pool->num_pending);
+   if (!queue_push(queue, &job))
+      overflow_push(&pool->overflow[priority], &job);
+   g_atomic_int_inc(&pool->num_queued[priority]);
+
+   if (g_atomic_int_get(&pool->num_sleeping) > 0) {
+      pthread_mutex_lock(&pool->sleep_mutex);
+      pthread_cond_signal(&pool->has_jobs);
+      pthread_mutex_unlock(&pool->sleep_mutex);
+   }
+}
+
 void
 vkdf_thread_pool_add_job(VkdfThreadPool *pool,
                          VkdfThreadJobFunction func,
                          void *arg)
 {
-   VkdfThreadJob *job = g_new(VkdfThreadJob, 1);
-   job->function = func;
-   job->arg = arg;
-   queue_push(&pool->queue, job);
+   queue_job(pool, func, arg, NULL, VKDF_THREAD_JOB_PRIORITY_CRITICAL);
+}
+
+void
+vkdf_thread_pool_add_background_job(VkdfThreadPool *pool,
+                                    VkdfThreadJobFunction func,
+                                    void *arg)
+{
+   queue_job(pool, func, arg, NULL, VKDF_THREAD_JOB_PRIORITY_BACKGROUND);
+}
+
+/* Runs one queued job in the calling thread, if there is any. Returns true if
+ * a job was executed.
+ *
+ * A thread outside the pool runs the job as the pool's caller thread, so
+ * jobs it runs that wait on the same pool keep helping as the caller too
+ * instead of sleeping.
+ */
+static bool
+help(VkdfThreadPool *pool, VkdfThreadJobPriority lowest)
+{
+   VkdfThread *thread;
+   bool is_caller = false;
+   if (current_thread && current_thread->pool == pool) {
+      thread = current_thread;
+   } else {
+      if (pthread_mutex_trylock(&pool->caller_mutex) != 0)
+         return false;
+      thread = &pool->caller;
+      is_caller = true;
+   }
+
+   VkdfThreadJob job;
+   bool found = find_job(pool, thread, lowest, &job);
+   if (found) {
+      VkdfThread *prev_thread = current_thread;
+      current_thread = thread;
+      run_job(pool, thread, &job);
+      current_thread = prev_thread;
+   }
+
+   if (is_caller)
+      pthread_mutex_unlock(&pool->caller_mutex);
+
+   return found;
+}
+
+static bool
+pool_is_idle(void *data)
+{
+   VkdfThreadPool *pool = (VkdfThreadPool *) data;
+   return g_atomic_int_get(&pool->num_pending) <= 0;
+}
+
+static bool
+group_is_done(void *data)
+{
+   return vkdf_thread_job_group_is_done((VkdfThreadJobGroup *) data);
+}
+
+/* Runs queued jobs with priority 'lowest' or higher until is_done(data) is
+ * true. If there is nothing left to run we sleep until something completes
+ * and check again.
+ */
+static void
+help_until(VkdfThreadPool *pool,
+           VkdfThreadJobPriority lowest,
+           bool (*is_done)(void *), void *data)
+{
+   while (!is_done(data)) {
+      if (help(pool, lowest))
+         continue;
+
+      pthread_mutex_lock(&pool->idle_mutex);
+      if (!is_done(data))
+         pthread_cond_wait(&pool->all_idle, &pool->idle_mutex);
+      pthread_mutex_unlock(&pool->idle_mutex);
+   }
 }
 
 void
 vkdf_thread_pool_wait(VkdfThreadPool *pool)
 {
-   pthread_mutex_lock(&pool->thread_count_mutex);
-   while (pool->queue.jobs || pool->num_working)
-      pthread_cond_wait(&pool->all_idle, &pool->thread_count_mutex);
-   pthread_mutex_unlock(&pool->thread_count_mutex);
+   help_until(pool, VKDF_THREAD_JOB_PRIORITY_BACKGROUND, pool_is_idle, pool);
+}
+
+/**
+ * Runs all the frame-critical jobs queued in the pool in the calling thread.
+ * Meant to be called periodically from long running background jobs.
+ * Returns true if any job was executed.
+ */
+bool
+vkdf_thread_pool_yield(VkdfThreadPool *pool)
+{
+   bool found = false;
+   while (vkdf_thread_pool_should_yield(pool) &&
+          help(pool, VKDF_THREAD_JOB_PRIORITY_CRITICAL)) {
+      found = true;
+   }
+   return found;
 }
 
 void
-vkdf_thread_pool_free(VkdfThreadPool *pool)
+vkdf_thread_job_group_init(VkdfThreadJobGroup *group,
+                           VkdfThreadJobFunction continuation,
+                           void *continuation_arg)
 {
-   pool->active = false;
+   group->pending = 1;
+   group->completed = 0;
+   group->closed = false;
+   group->priority = VKDF_THREAD_JOB_PRIORITY_CRITICAL;
+   group->continuation = continuation;
+   group->continuation_arg = continuation_arg;
+}
+
+/**
+ * Adds a job to a group. If pool is NULL the job runs immediately in the
+ * calling thread.
+ */
+void
+vkdf_thread_pool_add_group_job(VkdfThreadPool *pool,
+                               VkdfThreadJobGroup *group,
+                               VkdfThreadJobFunction func, void *arg)
+{
+   assert(!vkdf_thread_job_group_is_done(group));
+
+   g_atomic_int_inc(&group->pending);
 
-   const struct timespec wait_time = { 0, 1000};
-   while (pool->num_alive) {
-      binary_sem_post_all(&pool->queue.has_jobs);
-      nanosleep(&wait_time, NULL);
+   if (!pool) {
+      func(0, arg);
+      group_release(pool, group);
+      return;
    }
 
-   queue_free(&pool->queue);
+   queue_job(pool, func, arg, group, group->priority);
+}
+
+/**
+ * Tells the pool that no more jobs will be added to the group by its owner
+ * (continuations and jobs running in the group can still add more). The
+ * group completes once all its jobs have finished.
+ */
+void
+vkdf_thread_pool_close_group(VkdfThreadPool *pool, VkdfThreadJobGroup *group)
+{
+   if (group->closed)
+      return;
+
+   group->closed = true;
+   group_release(pool, group);
+}
+
+/**
+ * Closes the group if needed and waits for it to complete, running queued
+ * jobs in the calling thread in the meantime. Other jobs in the pool may
+ * still be running when this returns.
+ */
+void
+vkdf_thread_pool_wait_group(VkdfThreadPool *pool, VkdfThreadJobGroup *group)
+{
+   vkdf_thread_pool_close_group(pool, group);
+
+   if (!pool) {
+      assert(vkdf_thread_job_group_is_done(group));
+      return;
+   }
+
+   // Don't pick up background work while waiting on frame-critical jobs
+   help_until(pool, group->priority, group_is_done, group);
+}
+
+typedef struct {
+   VkdfThreadRangeFunction func;
+   void *arg;
+   uint32_t end;
+   uint32_t grain;
+   uint32_t num_jobs;
+   gint next;
+} ParallelForData;
+
+static void
+parallel_for_job(uint32_t thread_id, void *arg)
+{
+   ParallelForData *data = (ParallelForData *) arg;
+
+   /* Jobs grab chunks from the shared range until it is exhausted. Chunks
+    * start large and shrink as the range runs out (but never below the grain
+    * size) so threads that get expensive items don't hold everyone back.
+    */
+   while (true) {
+      uint32_t begin = (uint32_t) g_atomic_int_get(&data->next);
+      if (begin >= data->end)
+         break;
+
+      uint32_t remaining = data->end - begin;
+      uint32_t chunk = MAX2(data->grain, remaining / (2 * data->num_jobs));
+      chunk = MIN2(chunk, remaining);
+      if (!g_atomic_int_compare_and_exchange(&data->next,
+                                             (gint) begin,
+                                             (gint) (begin + chunk)))
+         continue;
+
+      data->func(thread_id, begin, begin + chunk, data->arg);
+   }
+}
+
+/**
+ * Runs func on the range [begin, end) split in chunks of at least 'grain'
+ * items and waits for it to complete. The calling thread processes chunks
+ * too. The thread_id passed to func identifies the thread running the chunk
+ * (num_threads for the calling thread) and can be used to index per-thread
+ * data. If pool is NULL, or if this is called from a job running in the
+ * same pool (in a worker or in a thread helping as the caller), the whole
+ * range is processed in the calling thread.
+ */
+void
+vkdf_thread_pool_parallel_for(VkdfThreadPool *pool,
+                              uint32_t begin, uint32_t end, uint32_t grain,
+                              VkdfThreadRangeFunction func, void *arg)
+{
+   if (begin >= end)
+      return;
+
+   if (!pool) {
+      func(0, begin, end, arg);
+      return;
+   }
+
+   // Jobs run by workers and by the caller thread (see help()) process the
+   // range inline, with their own thread id
+   if (current_thread && current_thread->pool == pool) {
+      func(current_thread->id, begin, end, arg);
+      return;
+   }
+
+   grain = MAX2(grain, 1);
+   uint32_t num_chunks = (end - begin + grain - 1) / grain;
+
+   ParallelForData data;
+   data.func = func;
+   data.arg = arg;
+   data.end = end;
+   data.grain = grain;
+   data.num_jobs = MIN2(num_chunks, pool->num_threads + 1);
+   data.next = (gint) begin;
+
+   VkdfThreadJobGroup group;
+   vkdf_thread_job_group_init(&group, NULL, NULL);
+   for (uint32_t i = 0; i < data.num_jobs; i++)
+      vkdf_thread_pool_add_group_job(pool, &group, parallel_for_job, &data);
+   vkdf_thread_pool_wait_group(pool, &group);
+}
+
+/**
+ * Returns at least 'size' bytes of scratch memory owned by the given worker
+ * thread. The memory is kept around across jobs, so jobs can use it for
+ * temporary per-thread storage without allocating every time. Its contents
+ * are only valid until the job returns.
+ */
+void *
+vkdf_thread_pool_get_scratch(VkdfThreadPool *pool,
+                             uint32_t thread_id, size_t size)
+{
+   assert(thread_id <= pool->num_threads);
+
+   VkdfThread *thread = thread_id < pool->num_threads ?
+      &pool->threads[thread_id] : &pool->caller;
+   if (thread->scratch_size < size) {
+      thread->scratch_size = MAX2(size, 2 * thread->scratch_size);
+      g_free(thread->scratch);
+      thread->scratch = g_malloc(thread->scratch_size);
+   }
+
+   return thread->scratch;
+}
+
+/**
+ * Names the worker threads "<name>-<thread id>" so they can be told apart in
+ * debuggers and profilers. Names are truncated to fit the system limit.
+ */
+void
+vkdf_thread_pool_set_name(VkdfThreadPool *pool, const char *name)
+{
+   for (uint32_t i = 0; i < pool->num_threads; i++)
+      thread_set_name(&pool->threads[i], name);
+}
+
+/**
+ * Pins a worker thread to a CPU. A negative cpu allows the thread to run on
+ * any CPU again. Returns false if the affinity could not be changed.
+ */
+bool
+vkdf_thread_pool_set_thread_affinity(VkdfThreadPool *pool,
+                                     uint32_t thread_id,
+                                     int32_t cpu)
+{
+   assert(thread_id < pool->num_threads);
+   VkdfThread *thread = &pool->threads[thread_id];
+
+   cpu_set_t cpu_set;
+   CPU_ZERO(&cpu_set);
+   if (cpu >= 0) {
+      if (cpu >= CPU_SETSIZE)
+         return false;
+      CPU_SET(cpu, &cpu_set);
+   } else {
+      long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+      for (long i = 0; i < num_cpus && i < CPU_SETSIZE; i++)
+         CPU_SET(i, &cpu_set);
+   }
+
+   if (pthread_setaffinity_np(thread->pthread, sizeof(cpu_set), &cpu_set))
+      return false;
+
+   thread->cpu = cpu >= 0 ? cpu : -1;
+   return true;
+}
+
+/**
+ * Returns the counters for a thread. thread_id can be num_threads to query
+ * the jobs executed by external threads while they waited on the pool.
+ * Counters are updated by the threads as they run, so they are only exact
+ * when the pool is idle.
+ */
+void
+vkdf_thread_pool_get_stats(VkdfThreadPool *pool,
+                           uint32_t thread_id,
+                           VkdfThreadStats *stats)
+{
+   assert(thread_id <= pool->num_threads);
+   VkdfThread *thread = thread_id < pool->num_threads ?
+      &pool->threads[thread_id] : &pool->caller;
+   *stats = thread->stats;
+}
+
+/**
+ * Resets the counters of all threads. Should only be called when the pool
+ * is idle.
+ */
+void
+vkdf_thread_pool_reset_stats(VkdfThreadPool *pool)
+{
+   for (uint32_t i = 0; i < pool->num_threads; i++)
+      memset(&pool->threads[i].stats, 0, sizeof(VkdfThreadStats));
+   memset(&pool->caller.stats, 0, sizeof(VkdfThreadStats));
+}
+
+void
+vkdf_thread_pool_print_stats(VkdfThreadPool *pool)
+{
+   for (uint32_t i = 0; i <= pool->num_threads; i++) {
+      VkdfThreadStats stats;
+      vkdf_thread_pool_get_stats(pool, i, &stats);
+
+      const char *name =
+         i < pool->num_threads ? pool->threads[i].name : "caller";
+      double avg_wait_us =
+         stats.jobs > 0 ? stats.wait_time / (stats.jobs * 1000.0) : 0.0;
+
+      vkdf_info("thread pool: %s: jobs %lu, steals %lu, "
+                "busy %.3f ms, idle %.3f ms, "
+                "queue wait avg %.3f us / max %.3f us\n",
+                name,
+                (unsigned long) stats.jobs,
+                (unsigned long) stats.steals,
+                stats.busy_time / 1000000.0,
+                stats.idle_time / 1000000.0,
+                avg_wait_us,
+                stats.max_wait_time / 1000.0);
+   }
+}
+
+void
+vkdf_thread_pool_free(VkdfThreadPool *pool)
+{
+   pthread_mutex_lock(&pool->sleep_mutex);
+   g_atomic_int_set(&pool->active, 0);
+   pthread_cond_broadcast(&pool->has_jobs);
+   pthread_mutex_unlock(&pool->sleep_mutex);
+
+   for (uint32_t i = 0; i < pool->num_threads; i++)
+      pthread_join(pool->threads[i].pthread, NULL);
+
+   for (uint32_t i = 0; i < pool->num_threads; i++)
+      g_free(pool->threads[i].scratch);
+   g_free(pool->caller.scratch);
 
    g_free(pool->threads);
+   for (uint32_t p = 0; p < VKDF_THREAD_JOB_PRIORITY_COUNT; p++) {
+      g_free(pool->overflow[p].jobs);
+      pthread_mutex_destroy(&pool->overflow[p].mutex);
+   }
+
+   pthread_mutex_destroy(&pool->sleep_mutex);
+   pthread_cond_destroy(&pool->has_jobs);
+   pthread_mutex_destroy(&pool->idle_mutex);
+   pthread_cond_destroy(&pool->all_idle);
+   pthread_mutex_destroy(&pool->caller_mutex);
 
    g_free(pool);
 }
@@ -10,39 +10,126 @@ struct _VkdfThreadJob;
 
 typedef void (*VkdfThreadJobFunction)(uint32_t, void *);
 
+/* Processes items [begin, end) of a parallel-for range */
+typedef void (*VkdfThreadRangeFunction)(uint32_t thread_id,
+                                        uint32_t begin, uint32_t end,
+                                        void *arg);
+
+/* Frame-critical jobs always run before background jobs. Long running
+ * background jobs should call vkdf_thread_pool_yield() every now and then so
+ * frame-critical jobs don't have to wait for them to finish.
+ */
+typedef enum {
+   VKDF_THREAD_JOB_PRIORITY_CRITICAL = 0,
+   VKDF_THREAD_JOB_PRIORITY_BACKGROUND,
+   VKDF_THREAD_JOB_PRIORITY_COUNT
+} VkdfThreadJobPriority;
+
+/* A group of jobs that can be waited on independently of any other work in
+ * the pool. The continuation, if any, is queued as one more job in the group
+ * once all the other jobs in the group have finished.
+ */
 typedef struct {
-   pthread_mutex_t mutex;
-   pthread_cond_t cond;
-   uint32_t value;
-} VkdfBinarySemaphore;
+   gint pending;       // Unfinished jobs (+1 while the group is open)
+   gint completed;
+   bool closed;
+   VkdfThreadJobPriority priority;
+   VkdfThreadJobFunction continuation;
+   void *continuation_arg;
+} VkdfThreadJobGroup;
 
 typedef struct {
    VkdfThreadJobFunction function;
    void *arg;
+   VkdfThreadJobGroup *group;
+   uint64_t queue_time;    // When the job was queued (ns)
 } VkdfThreadJob;
 
+/* Capacity of each per-thread job ring (must be a power of two) */
+#define VKDF_THREAD_QUEUE_SIZE 256
+
 typedef struct {
-   pthread_mutex_t mutex;
-   GList *jobs;
-   VkdfBinarySemaphore has_jobs;
-   uint32_t len;
+   gint seq;
+   VkdfThreadJob job;
+} VkdfThreadJobSlot;
+
+/* Per-thread bounded lock-free job ring (multi-producer, multi-consumer).
+ * Jobs are stored inline in the slots, so pushing and popping never
+ * allocates. The owner thread pops from its own ring and idle threads
+ * steal from the rings of the other threads. Each slot's sequence number
+ * tells producers and consumers whether the slot is free or holds a job
+ * for the current lap around the ring.
+ */
+typedef struct {
+   VkdfThreadJobSlot slots[VKDF_THREAD_QUEUE_SIZE];
+   gint enqueue_pos;
+   char pad0[60];
+   gint dequeue_pos;
+   char pad1[60];
 } VkdfThreadQueue;
 
+/* Per-thread counters. Times are in nanoseconds. */
+typedef struct {
+   uint64_t jobs;          // Jobs executed
+   uint64_t steals;        // Jobs taken from other threads' queues
+   uint64_t busy_time;     // Time spent running jobs
+   uint64_t idle_time;     // Time spent looking for jobs or sleeping
+   uint64_t wait_time;     // Time executed jobs spent queued
+   uint64_t max_wait_time; // Longest time a job spent queued
+} VkdfThreadStats;
+
 typedef struct {
    uint32_t id;
    pthread_t pthread;
+   char name[16];
+   int32_t cpu;            // CPU the thread is pinned to or -1
    struct _VkdfThreadPool *pool;
+   VkdfThreadQueue queues[VKDF_THREAD_JOB_PRIORITY_COUNT];
+   VkdfThreadStats stats;
+
+   // Scratch memory for jobs running on this thread
+   void *scratch;
+   size_t scratch_size;
 } VkdfThread;
 
+/* Jobs that didn't fit in a ring. The array only grows, so once it is big
+ * enough for the peak load it doesn't allocate anymore.
+ */
 typedef struct {
-   volatile bool active;
+   pthread_mutex_t mutex;
+   VkdfThreadJob *jobs;
+   uint32_t size;
+   uint32_t count;
+   gint num_jobs;
+} VkdfThreadOverflow;
+
+typedef struct _VkdfThreadPool {
+   gint active;
    VkdfThread *threads;
    uint32_t num_threads;
-   uint32_t num_alive;
-   uint32_t num_working;
-   pthread_mutex_t thread_count_mutex;
+
+   // Round-robin index for jobs submitted from outside the pool
+   gint next_queue;
+
+   // Jobs sitting in a queue / jobs that have not finished executing yet
+   gint num_queued[VKDF_THREAD_JOB_PRIORITY_COUNT];
+   gint num_pending;
+
+   VkdfThreadOverflow overflow[VKDF_THREAD_JOB_PRIORITY_COUNT];
+
+   // Idle workers sleep here until new jobs are queued
+   pthread_mutex_t sleep_mutex;
+   pthread_cond_t has_jobs;
+   gint num_sleeping;
+
+   // Signaled when num_pending drops to 0 and when a job group completes
+   pthread_mutex_t idle_mutex;
    pthread_cond_t all_idle;
-   VkdfThreadQueue queue;
+
+   // A thread outside the pool that waits on it runs queued jobs while it
+   // waits. It takes the id num_threads, so only one can do that at a time.
+   VkdfThread caller;
+   pthread_mutex_t caller_mutex;
 } VkdfThreadPool;
 
 VkdfThreadPool *
@@ -58,9 +145,87 @@ void
 vkdf_thread_pool_add_job(VkdfThreadPool *pool,
                          VkdfThreadJobFunction func, void *arg);
 
+void
+vkdf_thread_pool_add_background_job(VkdfThreadPool *pool,
+                                    VkdfThreadJobFunction func, void *arg);
+
 void
 vkdf_thread_pool_wait(VkdfThreadPool *pool);
 
+inline bool
+vkdf_thread_pool_should_yield(VkdfThreadPool *pool)
+{
+   return g_atomic_int_get(
+      &pool->num_queued[VKDF_THREAD_JOB_PRIORITY_CRITICAL]) > 0;
+}
+
+bool
+vkdf_thread_pool_yield(VkdfThreadPool *pool);
+
+void
+vkdf_thread_job_group_init(VkdfThreadJobGroup *group,
+                           VkdfThreadJobFunction continuation,
+                           void *continuation_arg);
+
+inline void
+vkdf_thread_job_group_set_priority(VkdfThreadJobGroup *group,
+                                   VkdfThreadJobPriority priority)
+{
+   group->priority = priority;
+}
+
+inline bool
+vkdf_thread_job_group_is_done(VkdfThreadJobGroup *group)
+{
+   return g_atomic_int_get(&group->completed) != 0;
+}
+
+void
+vkdf_thread_pool_add_group_job(VkdfThreadPool *pool,
+                               VkdfThreadJobGroup *group,
+                               VkdfThreadJobFunction func, void *arg);
+
+void
+vkdf_thread_pool_close_group(VkdfThreadPool *pool, VkdfThreadJobGroup *group);
+
+void
+vkdf_thread_pool_wait_group(VkdfThreadPool *pool, VkdfThreadJobGroup *group);
+
+void
+vkdf_thread_pool_parallel_for(VkdfThreadPool *pool,
+                              uint32_t begin, uint32_t end, uint32_t grain,
+                              VkdfThreadRangeFunction func, void *arg);
+
+void *
+vkdf_thread_pool_get_scratch(VkdfThreadPool *pool,
+                             uint32_t thread_id, size_t size);
+
+void
+vkdf_thread_pool_set_name(VkdfThreadPool *pool, const char *name);
+
+inline const char *
+vkdf_thread_pool_get_thread_name(VkdfThreadPool *pool, uint32_t thread_id)
+{
+   assert(thread_id < pool->num_threads);
+   return pool->threads[thread_id].name;
+}
+
+bool
+vkdf_thread_pool_set_thread_affinity(VkdfThreadPool *pool,
+                                     uint32_t thread_id,
+                                     int32_t cpu);
+
+void
+vkdf_thread_pool_get_stats(VkdfThreadPool *pool,
+                           uint32_t thread_id,
+                           VkdfThreadStats *stats);
+
+void
+vkdf_thread_pool_reset_stats(VkdfThreadPool *pool);
+
+void
+vkdf_thread_pool_print_stats(VkdfThreadPool *pool);
+
 void
 vkdf_thread_pool_free(VkdfThreadPool *pool);
 
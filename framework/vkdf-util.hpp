@@ -25,11 +25,14 @@ rand_float(float min, float max)
    return  r * range + min;
 }
 
+// C++20 has its own lerp(), which math.h brings into the global namespace
+#if !defined(__cpp_lib_interpolate)
 inline float
 lerp(float a, float b, float f)
 {
     return a + f * (b - a);
 }
+#endif
 
 inline glm::vec3
 vec3(glm::vec4 v)
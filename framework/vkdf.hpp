@@ -5,8 +5,10 @@
 #include "vkdf-util.hpp"
 #include "vkdf-plane.hpp"
 #include "vkdf-box.hpp"
+#include "vkdf-bvh.hpp"
 #include "vkdf-frustum.hpp"
 #include "vkdf-thread-pool.hpp"
+#include "vkdf-task.hpp"
 #include "vkdf-error.hpp"
 #include "vkdf-init.hpp"
 #include "vkdf-event-loop.hpp"
@@ -28,6 +30,8 @@
 #include "vkdf-light.hpp"
 #include "vkdf-camera.hpp"
 #include "vkdf-ssao.hpp"
+#include "vkdf-occlusion.hpp"
 #include "vkdf-scene.hpp"
+#include "vkdf-stream.hpp"
 
 #endif